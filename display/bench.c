@@ -0,0 +1,427 @@
+#include "bench.h"
+
+#include "abort.h"
+#include "rendering/canvas.h"
+#include "rendering/copy.h"
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Each case is timed in batches of at least this long, and reports the median
+// batch. The iteration count is picked per case to fill a batch.
+#define BATCH_NS 10000000
+#define BATCHES 7
+
+// Most cases draw on a canvas about the size of a small screen.
+#define W 1024
+#define H 768
+
+static const struct color FG = { .r = 0xFF, .g = 0xFF, .b = 0xFF };
+
+enum op {
+	OP_FILL,
+	OP_RECT,
+	OP_CIRCLE,
+	OP_LINE,
+	OP_RECT_COPY,
+	OP_BEZIER2,
+	OP_TRIANGLE,
+	OP_READ_RGBA,
+	OP_DUMP,
+	OP_COPY_TO_WC,
+	OP_MEMCPY,
+};
+
+static const char *const op_names[] = {
+	[OP_FILL] = "fill",
+	[OP_RECT] = "rect",
+	[OP_CIRCLE] = "circle",
+	[OP_LINE] = "line",
+	[OP_RECT_COPY] = "rect_copy",
+	[OP_BEZIER2] = "bezier2",
+	[OP_TRIANGLE] = "triangle",
+	[OP_READ_RGBA] = "read_rgba",
+	[OP_DUMP] = "dump",
+	[OP_COPY_TO_WC] = "copy_to_wc",
+	[OP_MEMCPY] = "memcpy",
+};
+
+struct bench {
+	enum op op;
+	const char *name;
+	uint16_t width, height;
+	enum pixel_format format;
+	union {
+		struct rect rect;
+		struct circle circle;
+		struct line line;
+		struct rect_copy rect_copy;
+		struct bezier2 bezier2;
+		struct triangle triangle;
+
+		// For copies, how far past a cache line the destination starts.
+		size_t dst_offset;
+	};
+};
+
+// Where the read_rgba and dump cases put their output. Copies go from `rgba`
+// to `frame`, which is ordinary memory: there's no write-combined mapping to
+// be had here, so this only shows what skipping the cache costs or saves.
+struct sink {
+	uint8_t *rgba;
+	uint8_t *frame;
+	DIR *dir;
+	char dir_path[64];
+};
+
+static void run_case(const struct bench *, struct sink *);
+static void setup(struct canvas *);
+static void run_op(struct canvas *, const struct bench *, struct sink *);
+static size_t count_pixels(
+    struct canvas *, const struct bench *, struct sink *);
+static double time_batch(
+    struct canvas *, const struct bench *, struct sink *, uint64_t iters);
+static uint64_t now_ns(void);
+static int cmp_double(const void *, const void *);
+
+void run_bench(void)
+{
+	const struct bench benches[] = {
+		{ .op = OP_FILL, .name = "64x64", .width = 64, .height = 64 },
+		{ .op = OP_FILL,
+		    .name = "640x480",
+		    .width = 640,
+		    .height = 480 },
+		{ .op = OP_FILL,
+		    .name = "1920x1080",
+		    .width = 1920,
+		    .height = 1080 },
+
+		{ OP_RECT, "8x8", W, H, .rect = { 100, 100, 8, 8, FG } },
+		{ OP_RECT, "64x64 aligned", W, H,
+		    .rect = { 128, 128, 64, 64, FG } },
+		{ OP_RECT, "64x64 unaligned", W, H,
+		    .rect = { 100, 100, 64, 64, FG } },
+		{ OP_RECT, "512x512", W, H,
+		    .rect = { 100, 100, 512, 512, FG } },
+		{ OP_RECT, "full", W, H, .rect = { 0, 0, W, H, FG } },
+		{ OP_RECT, "clipped", W, H,
+		    .rect = { 900, 700, 300, 300, FG } },
+		{ OP_RECT, "256x256 rgb565", W, H, PIXEL_FORMAT_RGB565,
+		    .rect = { 100, 100, 256, 256, FG } },
+		{ OP_RECT, "256x256 p8", W, H, PIXEL_FORMAT_P8,
+		    .rect = { 100, 100, 256, 256, FG } },
+
+		{ OP_CIRCLE, "r4", W, H, .circle = { 512, 384, 4, FG } },
+		{ OP_CIRCLE, "r32", W, H, .circle = { 512, 384, 32, FG } },
+		{ OP_CIRCLE, "r300", W, H, .circle = { 512, 384, 300, FG } },
+		{ OP_CIRCLE, "clipped", W, H,
+		    .circle = { 1000, 20, 300, FG } },
+
+		{ OP_LINE, "short", W, H, .line = { 100, 100, 110, 104, FG } },
+		{ OP_LINE, "horizontal", W, H,
+		    .line = { 10, 384, 1013, 384, FG } },
+		{ OP_LINE, "vertical", W, H,
+		    .line = { 512, 10, 512, 757, FG } },
+		{ OP_LINE, "diagonal", W, H, .line = { 0, 0, 767, 767, FG } },
+		{ OP_LINE, "shallow", W, H,
+		    .line = { 0, 100, 1023, 400, FG } },
+		{ OP_LINE, "steep", W, H, .line = { 300, 0, 400, 767, FG } },
+		{ OP_LINE, "reversed", W, H,
+		    .line = { 1023, 400, 0, 100, FG } },
+		{ OP_LINE, "clipped", W, H,
+		    .line = { 900, 300, 1900, 1300, FG } },
+
+		{ OP_RECT_COPY, "64x64 aligned", W, H,
+		    .rect_copy = { 128, 128, 0, 0, 64, 64 } },
+		{ OP_RECT_COPY, "100x100 unaligned", W, H,
+		    .rect_copy = { 300, 200, 10, 10, 100, 100 } },
+		{ OP_RECT_COPY, "scroll up", W, H,
+		    .rect_copy = { 0, 0, 0, 1, W, H - 1 } },
+		{ OP_RECT_COPY, "scroll down", W, H,
+		    .rect_copy = { 0, 1, 0, 0, W, H - 1 } },
+		{ OP_RECT_COPY, "overlapping", W, H,
+		    .rect_copy = { 101, 101, 100, 100, 400, 400 } },
+		{ OP_RECT_COPY, "clipped", W, H,
+		    .rect_copy = { 900, 700, 0, 0, 300, 300 } },
+
+		{ OP_BEZIER2, "small", W, H,
+		    .bezier2 = { 100, 100, 120, 80, 140, 100, FG } },
+		{ OP_BEZIER2, "large", W, H,
+		    .bezier2 = { 0, 767, 512, -700, 1023, 767, FG } },
+		{ OP_BEZIER2, "clipped", W, H,
+		    .bezier2 = { -500, 100, 512, 1500, 1500, 100, FG } },
+
+		{ OP_TRIANGLE, "small", W, H,
+		    .triangle = { 100, 100, 110, 100, 105, 108, FG } },
+		{ OP_TRIANGLE, "large", W, H,
+		    .triangle = { 0, 0, 1023, 100, 300, 767, FG } },
+		{ OP_TRIANGLE, "flat", W, H,
+		    .triangle = { 10, 10, 1000, 10, 500, 700, FG } },
+		{ OP_TRIANGLE, "sliver", W, H,
+		    .triangle = { 0, 0, 1023, 767, 0, 4, FG } },
+		{ OP_TRIANGLE, "clipped", W, H,
+		    .triangle = { 800, 500, 1400, 600, 900, 1000, FG } },
+
+		{ .op = OP_READ_RGBA,
+		    .name = "640x480",
+		    .width = 640,
+		    .height = 480 },
+		{ .op = OP_READ_RGBA,
+		    .name = "1920x1080",
+		    .width = 1920,
+		    .height = 1080 },
+		{ .op = OP_READ_RGBA,
+		    .name = "1920x1080 rgb565",
+		    .width = 1920,
+		    .height = 1080,
+		    .format = PIXEL_FORMAT_RGB565 },
+
+		{ .op = OP_DUMP,
+		    .name = "640x480",
+		    .width = 640,
+		    .height = 480 },
+		{ .op = OP_DUMP,
+		    .name = "1920x1080",
+		    .width = 1920,
+		    .height = 1080 },
+
+		{ OP_COPY_TO_WC, "1920x1080 aligned", 1920, 1080,
+		    .dst_offset = 0 },
+		{ OP_COPY_TO_WC, "1920x1080 unaligned", 1920, 1080,
+		    .dst_offset = 4 },
+		{ OP_MEMCPY, "1920x1080 aligned", 1920, 1080, .dst_offset = 0 },
+		{ OP_MEMCPY, "1920x1080 unaligned", 1920, 1080,
+		    .dst_offset = 4 },
+		{ OP_COPY_TO_WC, "3840x2160 aligned", 3840, 2160,
+		    .dst_offset = 0 },
+		{ OP_MEMCPY, "3840x2160 aligned", 3840, 2160, .dst_offset = 0 },
+	};
+	const size_t num_benches = sizeof(benches) / sizeof(*benches);
+
+	// Dumps go to a scratch directory, which is removed afterward.
+	struct sink sink = { 0 };
+	const char *tmp = getenv("TMPDIR");
+	snprintf(sink.dir_path, sizeof(sink.dir_path), "%s/ttds-bench-XXXXXX",
+	    tmp ? tmp : "/tmp");
+	if (mkdtemp(sink.dir_path) == NULL)
+		FATAL_ERR("bench: couldn't create '%s': %s", sink.dir_path,
+		    STR_ERR);
+	sink.dir = opendir(sink.dir_path);
+	if (sink.dir == NULL)
+		FATAL_ERR("bench: couldn't open '%s': %s", sink.dir_path,
+		    STR_ERR);
+
+	printf("{\n  \"batch_ns\": %d,\n  \"batches\": %d,\n", BATCH_NS,
+	    BATCHES);
+	printf("  \"benchmarks\": [\n");
+	for (size_t i = 0; i < num_benches; i++) {
+		run_case(&benches[i], &sink);
+		printf("%s\n", i + 1 < num_benches ? "," : "");
+	}
+	printf("  ]\n}\n");
+
+	if (unlinkat(dirfd(sink.dir), "bench.data", 0) != 0)
+		FATAL_ERR("bench: couldn't remove dump: %s", STR_ERR);
+	if (closedir(sink.dir) != 0)
+		FATAL_ERR("bench: couldn't close dir: %s", STR_ERR);
+	if (rmdir(sink.dir_path) != 0)
+		FATAL_ERR("bench: couldn't remove '%s': %s", sink.dir_path,
+		    STR_ERR);
+}
+
+/* Time one case and print it as a JSON object, without a trailing newline. */
+static void run_case(const struct bench *b, struct sink *sink)
+{
+	struct canvas *c = canvas_init(b->width, b->height, b->format);
+	if (c == NULL)
+		FATAL_ERR("out of memory");
+
+	const size_t frame_bytes = (size_t)b->width * b->height * 4;
+	sink->rgba = malloc(frame_bytes);
+	sink->frame = aligned_alloc(64, frame_bytes + 64);
+	if (sink->rgba == NULL || sink->frame == NULL)
+		FATAL_ERR("out of memory");
+
+	// This doubles as a warm-up, so tiles are already split and faulted in
+	// by the time anything is timed.
+	setup(c);
+	const size_t pixels = count_pixels(c, b, sink);
+
+	uint64_t iters = 1;
+	while (time_batch(c, b, sink, iters) * iters < BATCH_NS &&
+	    iters < (UINT64_C(1) << 32))
+		iters *= 2;
+
+	double ns[BATCHES];
+	for (size_t i = 0; i < BATCHES; i++)
+		ns[i] = time_batch(c, b, sink, iters);
+	qsort(ns, BATCHES, sizeof(*ns), cmp_double);
+	const double median = ns[BATCHES / 2];
+
+	// Bytes of pixels moved per call: draws write theirs, copies read them
+	// too, and readers convert to 4-byte RGBA. A fill replaces the tiles
+	// rather than writing pixels, so its figure is only nominal.
+	const size_t px_bytes = pixel_format_size(b->format);
+	size_t bytes = pixels * px_bytes;
+	if (b->op == OP_RECT_COPY || b->op == OP_COPY_TO_WC ||
+	    b->op == OP_MEMCPY)
+		bytes = pixels * px_bytes * 2;
+	else if (b->op == OP_READ_RGBA || b->op == OP_DUMP)
+		bytes = pixels * (px_bytes + 4);
+
+	printf("    {\"primitive\": \"%s\", \"case\": \"%s\", "
+	       "\"format\": \"%s\", \"width\": %u, \"height\": %u, "
+	       "\"iterations\": %" PRIu64 ", \"ns_per_call\": %.1f, "
+	       "\"ns_per_call_min\": %.1f, \"pixels_per_call\": %zu, "
+	       "\"pixels_per_sec\": %.0f, \"gb_per_sec\": %.3f}",
+	    op_names[b->op], b->name, pixel_format_str(b->format), b->width,
+	    b->height, iters, median, ns[0], pixels,
+	    pixels * 1e9 / median, bytes / median);
+
+	free(sink->rgba);
+	free(sink->frame);
+	canvas_deinit(c);
+}
+
+/* Fill the canvas with a gradient, so that every tile has pixels of its own
+ * and any copy moves pixels to where they differ. No pixel is FG. */
+static void setup(struct canvas *c)
+{
+	const size_t stride = (size_t)c->width * 4;
+	uint8_t *src = malloc(stride * c->height);
+	if (src == NULL)
+		FATAL_ERR("out of memory");
+
+	for (size_t y = 0; y < c->height; y++) {
+		for (size_t x = 0; x < c->width; x++) {
+			uint8_t *px = &src[y * stride + x * 4];
+			px[0] = x ^ y;
+			px[1] = y;
+			px[2] = x;
+			px[3] = 0xff;
+		}
+	}
+
+	rendering_draw_blit(c,
+	    &(struct blit) {
+		.x = 0,
+		.y = 0,
+		.w = c->width,
+		.h = c->height,
+		.order = PIXEL_BGRA,
+		.stride = stride,
+		.src = src,
+	    });
+	free(src);
+}
+
+static void run_op(struct canvas *c, const struct bench *b, struct sink *sink)
+{
+	switch (b->op) {
+	case OP_FILL:
+		rendering_fill(c, FG);
+		break;
+	case OP_RECT:
+		rendering_draw_rect(c, &b->rect);
+		break;
+	case OP_CIRCLE:
+		rendering_draw_circle(c, &b->circle);
+		break;
+	case OP_LINE:
+		rendering_draw_line(c, &b->line);
+		break;
+	case OP_RECT_COPY:
+		rendering_draw_rect_copy(c, &b->rect_copy);
+		break;
+	case OP_BEZIER2:
+		rendering_draw_bezier2(c, &b->bezier2);
+		break;
+	case OP_TRIANGLE:
+		rendering_draw_triangle(c, &b->triangle);
+		break;
+	case OP_READ_RGBA:
+		canvas_read_rgba(c, 0, c->height, sink->rgba);
+		break;
+	case OP_DUMP:
+		rendering_dump_bgra_to_rgba(
+		    c, sink->dir, sink->dir_path, "bench.data");
+		break;
+	case OP_COPY_TO_WC:
+		copy_to_wc(&sink->frame[b->dst_offset], sink->rgba,
+		    (size_t)c->width * c->height * 4);
+		break;
+	case OP_MEMCPY:
+		memcpy(&sink->frame[b->dst_offset], sink->rgba,
+		    (size_t)c->width * c->height * 4);
+		break;
+	}
+}
+
+/* Run the case once, returning how many pixels it covered. Readers and copies
+ * cover the whole canvas; everything else is measured by what changed. */
+static size_t count_pixels(
+    struct canvas *c, const struct bench *b, struct sink *sink)
+{
+	const size_t n = (size_t)c->width * c->height;
+	if (b->op == OP_COPY_TO_WC || b->op == OP_MEMCPY) {
+		// The source is a frame as the canvas would compose it.
+		for (uint16_t y = 0; y < c->height; y++)
+			canvas_read_span(c, 0, y, c->width,
+			    (uint32_t *)&sink->rgba[(size_t)y * c->width * 4]);
+		run_op(c, b, sink);
+		return n;
+	} else if (b->op == OP_READ_RGBA || b->op == OP_DUMP) {
+		run_op(c, b, sink);
+		return n;
+	}
+
+	uint32_t *before = malloc(n * sizeof(uint32_t));
+	uint32_t *after = malloc(n * sizeof(uint32_t));
+	if (before == NULL || after == NULL)
+		FATAL_ERR("out of memory");
+
+	for (uint16_t y = 0; y < c->height; y++)
+		canvas_read_span(c, 0, y, c->width, &before[y * c->width]);
+	run_op(c, b, sink);
+	for (uint16_t y = 0; y < c->height; y++)
+		canvas_read_span(c, 0, y, c->width, &after[y * c->width]);
+
+	size_t changed = 0;
+	for (size_t i = 0; i < n; i++)
+		changed += before[i] != after[i];
+
+	free(before);
+	free(after);
+	return changed;
+}
+
+/* Run the case `iters` times, returning the average time per call. */
+static double time_batch(
+    struct canvas *c, const struct bench *b, struct sink *sink, uint64_t iters)
+{
+	const uint64_t start = now_ns();
+	for (uint64_t i = 0; i < iters; i++)
+		run_op(c, b, sink);
+	return (double)(now_ns() - start) / iters;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	const double x = *(const double *)a;
+	const double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
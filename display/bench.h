@@ -0,0 +1,4 @@
+#pragma once
+
+/* Time every rasterizer and print the results to stdout as JSON. */
+void run_bench(void);
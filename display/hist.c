@@ -0,0 +1,81 @@
+#include "hist.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+
+static unsigned bucket_of(uint64_t v);
+
+void hist_record(struct hist *h, uint64_t value)
+{
+	h->count++;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+	h->buckets[bucket_of(value)]++;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	for (unsigned i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+uint64_t hist_quantile(const struct hist *h, double q)
+{
+	if (h->count == 0)
+		return 0;
+
+	uint64_t rank = ceil(q * h->count);
+	if (rank < 1)
+		rank = 1;
+
+	uint64_t seen = 0;
+	unsigned i = 0;
+	for (; i < HIST_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	// Small values get a bucket each. Past that, report the middle of the
+	// bucket, though never more than was actually seen.
+	if (i < HIST_SUB)
+		return i;
+
+	const unsigned shift = i / HIST_SUB - 1;
+	const uint64_t lo = (uint64_t)(HIST_SUB + i % HIST_SUB) << shift;
+	const uint64_t mid = lo + ((UINT64_C(1) << shift) >> 1);
+	return mid < h->max ? mid : h->max;
+}
+
+uint64_t hist_mean(const struct hist *h)
+{
+	return h->count ? h->sum / h->count : 0;
+}
+
+int hist_format(char *out, size_t size, const struct hist *h)
+{
+	return snprintf(out, size,
+	    "%" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64
+	    "/%" PRIu64,
+	    h->count,
+	    hist_quantile(h, 0.5), hist_quantile(h, 0.9),
+	    hist_quantile(h, 0.99), hist_quantile(h, 0.999), h->max);
+}
+
+/* Values below HIST_SUB map to themselves. After that, each power of two gets
+ * HIST_SUB buckets, picked by the bits just below the leading one. */
+static unsigned bucket_of(uint64_t v)
+{
+	if (v < HIST_SUB)
+		return v;
+
+	const unsigned msb = 63 - __builtin_clzll(v);
+	const unsigned shift = msb - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (unsigned)(v >> shift) % HIST_SUB;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A log-linear histogram, after HdrHistogram: every power of two is split into
+ * HIST_SUB buckets, so any quantile read back is within about 6% of the real
+ * one, over the whole range of uint64_t. Recording is a few instructions and
+ * never allocates. Values are usually nanoseconds. */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_record(struct hist *, uint64_t value);
+
+/* Add everything recorded in `src` to `dst`. */
+void hist_merge(struct hist *dst, const struct hist *src);
+
+/* The value below which a fraction `q` (in [0, 1]) of the recorded ones fall,
+ * or zero if there are none. */
+uint64_t hist_quantile(const struct hist *, double q);
+
+uint64_t hist_mean(const struct hist *);
+
+/* Summarize as `<count>/<p50>/<p90>/<p99>/<p99.9>/<max>`, like snprintf. */
+int hist_format(char *out, size_t size, const struct hist *);
@@ -0,0 +1,466 @@
+#include "load.h"
+
+#include "abort.h"
+#include "hist.h"
+#include "rendering/mem/mem.h"
+#include "rendering/rendering.h"
+#include "threads/commands.h"
+#include "threads/termination.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Panes made by the "panes" scenario, and kept alive at once by "churn".
+#define MANY_PANES 512
+#define CHURN_PANES 64
+
+// Most shapes fit in a box this big; one in LARGE_ODDS spans the whole pane.
+#define SMALL_EXTENT 32
+#define LARGE_ODDS 16
+
+// Unexpected replies logged per scenario, past which they're only counted.
+#define MAX_LOGGED_ERRORS 8
+
+/* Where synthetic commands come from. Everything is seeded the same way on
+ * every run, so runs can be compared. */
+struct gen {
+	uint64_t rng;
+	uint16_t width, height; // of the screen
+
+	// Pane names in "churn" only ever count up. Zero marks an empty slot.
+	uint64_t churn_next;
+	uint64_t churn_ids[CHURN_PANES];
+	size_t churn_step;
+};
+
+struct scenario {
+	const char *name;
+
+	// Lines to run untimed before and after the scenario, e.g., to make
+	// and remove panes. `i` counts up from zero, and false means there
+	// are no more. An empty line is skipped.
+	bool (*setup)(struct gen *, size_t i, char *line);
+	bool (*teardown)(struct gen *, size_t i, char *line);
+
+	// Write the next timed line, returning how many commands are in it.
+	size_t (*next)(struct gen *, char *line);
+};
+
+/* The client end of the pipes standing in for stdin and stdout. */
+struct driver {
+	int to_cmd;
+	int from_cmd;
+
+	// Replies read so far, the first `taken` bytes of which were returned
+	// already.
+	char buf[4096];
+	size_t len, taken;
+};
+
+static bool one_pane_setup(struct gen *, size_t i, char *line);
+static bool one_pane_teardown(struct gen *, size_t i, char *line);
+static size_t mixed_next(struct gen *, char *line);
+static bool panes_setup(struct gen *, size_t i, char *line);
+static bool panes_teardown(struct gen *, size_t i, char *line);
+static size_t panes_next(struct gen *, char *line);
+static size_t chains_next(struct gen *, char *line);
+static bool churn_teardown(struct gen *, size_t i, char *line);
+static size_t churn_next(struct gen *, char *line);
+static bool no_lines(struct gen *, size_t i, char *line);
+
+static void run_scenario(const struct scenario *, struct driver *,
+    struct gen *, unsigned duration_ms, FILE *report);
+static bool exec_line(struct driver *, const char *line, char **reply);
+static int primitive(struct gen *, uint16_t w, uint16_t h, char *out, size_t);
+static uint64_t rnd(struct gen *);
+static uint32_t below(struct gen *, uint32_t n);
+static uint32_t extent(struct gen *, uint32_t max);
+static uint64_t now_ns(void);
+
+static const struct scenario scenarios[] = {
+	// Every kind of shape, at every size, on one full-screen pane.
+	{ "mixed", one_pane_setup, one_pane_teardown, mixed_next },
+
+	// The same, spread over hundreds of small panes.
+	{ "panes", panes_setup, panes_teardown, panes_next },
+
+	// As many shapes as fit on a line, chained with ';'.
+	{ "chains", one_pane_setup, one_pane_teardown, chains_next },
+
+	// Panes made, drawn to once, and removed again, round robin.
+	{ "churn", no_lines, churn_teardown, churn_next },
+};
+
+bool load_scenario_valid(const char *name)
+{
+	if (strcmp(name, "all") == 0)
+		return true;
+
+	for (size_t i = 0; i < sizeof(scenarios) / sizeof(*scenarios); i++) {
+		if (strcmp(name, scenarios[i].name) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+void run_load(
+    const char *scenario, unsigned duration_ms, const struct ui_opts *opts)
+{
+	// cmd_thread only talks through stdin and stdout, so stand pipes in for
+	// them, and keep the real stdout for the report.
+	int to_cmd[2], from_cmd[2];
+	if (pipe(to_cmd) != 0 || pipe(from_cmd) != 0)
+		FATAL_ERR("load: couldn't create pipes: %s", STR_ERR);
+
+	fflush(stdout);
+	const int report_fd = dup(STDOUT_FILENO);
+	if (report_fd < 0 || dup2(to_cmd[0], STDIN_FILENO) < 0 ||
+	    dup2(from_cmd[1], STDOUT_FILENO) < 0)
+		FATAL_ERR("load: couldn't redirect stdio: %s", STR_ERR);
+	close(to_cmd[0]);
+	close(from_cmd[1]);
+
+	FILE *report = fdopen(report_fd, "w");
+	if (!report)
+		FATAL_ERR("load: fdopen failed: %s", STR_ERR);
+
+	const struct rendering_vtable vt = supported_backends[BACKEND_MEM];
+	struct ui_ctx *ctx = ui_ctx_new(vt, opts);
+
+	struct cmd_thread_args cmd_args = { .ui_ctx = ctx };
+	pthread_t ui_handle, cmd_handle;
+	if (pthread_create(&ui_handle, NULL, ui_thread, ctx) != 0 ||
+	    pthread_create(&cmd_handle, NULL, cmd_thread, &cmd_args) != 0)
+		FATAL_ERR("load: couldn't spawn threads: %s", STR_ERR);
+
+	struct driver driver = {
+		.to_cmd = to_cmd[1],
+		.from_cmd = from_cmd[0],
+	};
+	struct gen gen = {
+		.rng = 0x9E3779B97F4A7C15,
+		.width = opts->rendering.width ? opts->rendering.width
+					       : MEM_BACKEND_WIDTH,
+		.height = opts->rendering.height ? opts->rendering.height
+						 : MEM_BACKEND_HEIGHT,
+	};
+
+	fprintf(report,
+	    "{\n  \"backend\": \"MEM\",\n  \"width\": %u,\n  \"height\": %u,\n"
+	    "  \"duration_ms\": %u,\n  \"scenarios\": [\n",
+	    gen.width, gen.height, duration_ms);
+
+	bool first = true;
+	for (size_t i = 0; i < sizeof(scenarios) / sizeof(*scenarios); i++) {
+		if (strcmp(scenario, "all") != 0 &&
+		    strcmp(scenario, scenarios[i].name) != 0)
+			continue;
+
+		if (!first)
+			fprintf(report, ",\n");
+		first = false;
+
+		run_scenario(&scenarios[i], &driver, &gen, duration_ms, report);
+	}
+	fprintf(report, "\n  ]\n}\n");
+
+	term();
+	pthread_join(cmd_handle, NULL);
+	pthread_join(ui_handle, NULL);
+	ui_ctx_free(ctx);
+
+	if (fclose(report) != 0)
+		FATAL_ERR("load: couldn't write report: %s", STR_ERR);
+	close(driver.to_cmd);
+	close(driver.from_cmd);
+}
+
+/* Run a scenario for `duration_ms`, one line at a time, and report on it. A
+ * line's latency is from just before it's written to just after its reply is
+ * read, so it includes both trips through a pipe. */
+static void run_scenario(const struct scenario *s, struct driver *d,
+    struct gen *g, unsigned duration_ms, FILE *report)
+{
+	char line[MAX_CMD_LEN];
+	char *reply;
+
+	for (size_t i = 0; s->setup(g, i, line); i++) {
+		if (line[0] != '\0' && !exec_line(d, line, &reply))
+			FATAL_ERR("load: %s: setup failed: %s", s->name, reply);
+	}
+
+	struct hist latency = { 0 };
+	uint64_t lines = 0, commands = 0, errors = 0;
+
+	const uint64_t start = now_ns();
+	const uint64_t deadline = start + (uint64_t)duration_ms * 1000000;
+	uint64_t end = start;
+	while (end < deadline) {
+		const size_t n = s->next(g, line);
+
+		const uint64_t t0 = now_ns();
+		const bool ok = exec_line(d, line, &reply);
+		end = now_ns();
+
+		hist_record(&latency, end - t0);
+		lines++;
+		commands += n;
+
+		if (!ok && errors++ < MAX_LOGGED_ERRORS)
+			fprintf(stderr, "load: %s: '%.*s' failed: %s\n",
+			    s->name, (int)strcspn(line, "\n"), line, reply);
+	}
+
+	for (size_t i = 0; s->teardown(g, i, line); i++) {
+		if (line[0] != '\0' && !exec_line(d, line, &reply))
+			FATAL_ERR(
+			    "load: %s: teardown failed: %s", s->name, reply);
+	}
+
+	const double secs = (end - start) / 1e9;
+	fprintf(report,
+	    "    {\"scenario\": \"%s\", \"seconds\": %.3f, "
+	    "\"lines\": %" PRIu64 ", \"commands\": %" PRIu64
+	    ", \"errors\": %" PRIu64 ", "
+	    "\"lines_per_sec\": %.0f, \"commands_per_sec\": %.0f, "
+	    "\"latency_ns\": {\"mean\": %" PRIu64 ", \"p50\": %" PRIu64
+	    ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64
+	    ", \"max\": %" PRIu64 "}}",
+	    s->name, secs, lines, commands, errors, lines / secs,
+	    commands / secs, hist_mean(&latency),
+	    hist_quantile(&latency, 0.5), hist_quantile(&latency, 0.99),
+	    hist_quantile(&latency, 0.999), latency.max);
+	fflush(report);
+}
+
+/* Send a line and wait for its reply, which `reply` is pointed at until the
+ * next call. Returns whether the reply was OK. Every line sent is well-formed,
+ * so a reply is always a single line. */
+static bool exec_line(struct driver *d, const char *line, char **reply)
+{
+	const size_t len = strlen(line);
+	for (size_t off = 0; off < len;) {
+		const ssize_t n = write(d->to_cmd, &line[off], len - off);
+		if (n < 0)
+			FATAL_ERR("load: couldn't write command: %s", STR_ERR);
+		off += n;
+	}
+
+	// The last reply has been used by now.
+	memmove(d->buf, &d->buf[d->taken], d->len - d->taken);
+	d->len -= d->taken;
+
+	char *nl;
+	while (!(nl = memchr(d->buf, '\n', d->len))) {
+		if (d->len == sizeof(d->buf))
+			FATAL_ERR("load: reply too long");
+
+		const ssize_t n = read(
+		    d->from_cmd, &d->buf[d->len], sizeof(d->buf) - d->len);
+		if (n <= 0)
+			FATAL_ERR("load: couldn't read reply: %s",
+			    n < 0 ? STR_ERR : "EOF");
+		d->len += n;
+	}
+
+	*nl = '\0';
+	d->taken = nl - d->buf + 1;
+
+	*reply = d->buf;
+	return strcmp(d->buf, "OK") == 0;
+}
+
+static bool one_pane_setup(struct gen *, size_t i, char *line)
+{
+	snprintf(line, MAX_CMD_LEN, "load: CREATE #000000\n");
+	return i == 0;
+}
+
+static bool one_pane_teardown(struct gen *, size_t i, char *line)
+{
+	snprintf(line, MAX_CMD_LEN, "load: REMOVE\n");
+	return i == 0;
+}
+
+static size_t mixed_next(struct gen *g, char *line)
+{
+	int n = snprintf(line, MAX_CMD_LEN, "load: ");
+	n += primitive(g, g->width, g->height, &line[n], MAX_CMD_LEN - n);
+	snprintf(&line[n], MAX_CMD_LEN - n, "\n");
+	return 1;
+}
+
+static uint16_t small_pane_width(const struct gen *g)
+{
+	return g->width < 128 ? g->width : 128;
+}
+
+static uint16_t small_pane_height(const struct gen *g)
+{
+	return g->height < 96 ? g->height : 96;
+}
+
+static bool panes_setup(struct gen *g, size_t i, char *line)
+{
+	const uint16_t w = small_pane_width(g), h = small_pane_height(g);
+	snprintf(line, MAX_CMD_LEN, "load-%zu: CREATE #%06x %u %u %u %u\n", i,
+	    (unsigned)(rnd(g) & 0xffffff), w, h, below(g, g->width - w + 1),
+	    below(g, g->height - h + 1));
+	return i < MANY_PANES;
+}
+
+static bool panes_teardown(struct gen *, size_t i, char *line)
+{
+	snprintf(line, MAX_CMD_LEN, "load-%zu: REMOVE\n", i);
+	return i < MANY_PANES;
+}
+
+static size_t panes_next(struct gen *g, char *line)
+{
+	int n = snprintf(line, MAX_CMD_LEN, "load-%u: ", below(g, MANY_PANES));
+	n += primitive(g, small_pane_width(g), small_pane_height(g), &line[n],
+	    MAX_CMD_LEN - n);
+	snprintf(&line[n], MAX_CMD_LEN - n, "\n");
+	return 1;
+}
+
+static size_t chains_next(struct gen *g, char *line)
+{
+	size_t n = snprintf(line, MAX_CMD_LEN, "load:");
+	size_t commands = 0;
+
+	// Stop before a shape could overflow the line, with room for the
+	// separator and the newline.
+	char shape[128];
+	for (;;) {
+		const int len = primitive(g, g->width, g->height, shape,
+		    sizeof(shape));
+		if (n + len + 3 >= MAX_CMD_LEN)
+			break;
+
+		n += snprintf(&line[n], MAX_CMD_LEN - n, "%s %s",
+		    commands ? ";" : "", shape);
+		commands++;
+	}
+	snprintf(&line[n], MAX_CMD_LEN - n, "\n");
+	return commands;
+}
+
+static bool churn_teardown(struct gen *g, size_t i, char *line)
+{
+	if (i >= CHURN_PANES)
+		return false;
+
+	line[0] = '\0';
+	if (g->churn_ids[i]) {
+		snprintf(line, MAX_CMD_LEN, "churn-%" PRIu64 ": REMOVE\n",
+		    g->churn_ids[i]);
+		g->churn_ids[i] = 0;
+	}
+	return true;
+}
+
+static size_t churn_next(struct gen *g, char *line)
+{
+	const size_t slot = g->churn_step++ % CHURN_PANES;
+	if (g->churn_ids[slot]) {
+		snprintf(line, MAX_CMD_LEN, "churn-%" PRIu64 ": REMOVE\n",
+		    g->churn_ids[slot]);
+		g->churn_ids[slot] = 0;
+		return 1;
+	}
+
+	const uint16_t w = extent(g, g->width), h = extent(g, g->height);
+	g->churn_ids[slot] = ++g->churn_next;
+
+	int n = snprintf(line, MAX_CMD_LEN,
+	    "churn-%" PRIu64 ": CREATE #%06x %u %u %u %u; ",
+	    g->churn_ids[slot],
+	    (unsigned)(rnd(g) & 0xffffff), w, h, below(g, g->width - w + 1),
+	    below(g, g->height - h + 1));
+	n += primitive(g, w, h, &line[n], MAX_CMD_LEN - n);
+	snprintf(&line[n], MAX_CMD_LEN - n, "\n");
+	return 2;
+}
+
+static bool no_lines(struct gen *, size_t, char *)
+{
+	return false;
+}
+
+/* Write a random shape that fits in a `w` x `h` pane, as a command without its
+ * target. Returns its length. */
+static int primitive(
+    struct gen *g, uint16_t w, uint16_t h, char *out, size_t size)
+{
+	// Points are picked in a box, which is usually small.
+	const uint32_t bw = extent(g, w), bh = extent(g, h);
+	const uint32_t bx = below(g, w - bw + 1), by = below(g, h - bh + 1);
+	uint32_t x[3], y[3];
+	for (size_t i = 0; i < 3; i++) {
+		x[i] = bx + below(g, bw);
+		y[i] = by + below(g, bh);
+	}
+	const unsigned c = rnd(g) & 0xffffff;
+
+	switch (below(g, 6)) {
+	case 0:
+		return snprintf(out, size, "RECT #%06x %u %u %u %u", c, bx, by,
+		    bw, bh);
+	case 1: {
+		const uint32_t r = (bw < bh ? bw : bh) / 2;
+		return snprintf(out, size, "CIRCLE #%06x %u %u %u", c,
+		    bx + r, by + r, r);
+	}
+	case 2:
+		return snprintf(out, size, "LINE #%06x %u %u %u %u", c, x[0],
+		    y[0], x[1], y[1]);
+	case 3:
+		return snprintf(out, size, "COPY_RECT %u %u %u %u %u %u",
+		    below(g, w - bw + 1), below(g, h - bh + 1), bx, by, bw, bh);
+	case 4:
+		return snprintf(out, size, "BEZIER2 #%06x %u %u %u %u %u %u", c,
+		    x[0], y[0], x[1], y[1], x[2], y[2]);
+	default:
+		return snprintf(out, size, "TRIANGLE #%06x %u %u %u %u %u %u",
+		    c, x[0], y[0], x[1], y[1], x[2], y[2]);
+	}
+}
+
+/* xorshift64* */
+static uint64_t rnd(struct gen *g)
+{
+	g->rng ^= g->rng >> 12;
+	g->rng ^= g->rng << 25;
+	g->rng ^= g->rng >> 27;
+	return g->rng * 0x2545F4914F6CDD1D;
+}
+
+/* A number in [0, n). */
+static uint32_t below(struct gen *g, uint32_t n)
+{
+	return rnd(g) % n;
+}
+
+/* A size in [1, max], which is usually small. */
+static uint32_t extent(struct gen *g, uint32_t max)
+{
+	if (max > SMALL_EXTENT && below(g, LARGE_ODDS) != 0)
+		max = SMALL_EXTENT;
+	return 1 + below(g, max);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
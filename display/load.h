@@ -0,0 +1,15 @@
+#pragma once
+
+#include "threads/ui.h"
+
+#include <stdbool.h>
+
+/* Whether `name` is a scenario run_load knows, or "all". */
+bool load_scenario_valid(const char *name);
+
+/* Feed synthetic traffic through cmd_thread and the UI thread, in-process and
+ * on the MEM backend, for `duration_ms` per scenario. Commands go in through
+ * stdin and replies come back through stdout, both redirected to pipes for the
+ * duration. Throughput and latency go to the real stdout as JSON. */
+void run_load(
+    const char *scenario, unsigned duration_ms, const struct ui_opts *);
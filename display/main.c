@@ -1,17 +1,27 @@
 #include "abort.h"
+#include "bench.h"
+#include "load.h"
+#include "replay.h"
+#include "rendering/pool.h"
 #include "rendering/rendering.h"
 #include "testing.h"
+#include "threads/capture.h"
 #include "threads/commands.h"
+#include "threads/eloop.h"
 #include "threads/termination.h"
 #include "threads/ui.h"
+#include "trace.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
@@ -38,15 +48,70 @@ struct args {
 
 	// If non-null, run the tests and dump pixel buffers here.
 	char *tests_dump_dir;
+
+	// Time the rasterizers and print the results as JSON.
+	bool bench;
+
+	// If non-null, run this load scenario for `load_duration` milliseconds
+	// each and print the results as JSON.
+	char *load_scenario;
+	unsigned load_duration;
+
+	// If non-null, journal every line clients send to this file.
+	char *capture_path;
+
+	// If non-null, send the traffic in this capture to `replay_to` at
+	// `replay_speed`; see run_replay.
+	char *replay_path;
+	char *replay_to;
+	double replay_speed;
+
+	// If non-null, write a timeline of what every thread did here.
+	char *trace_path;
+
+	// Run everything from a single epoll loop rather than a thread each.
+	bool event_loop;
+
+	// If non-null, accept clients on a Unix socket here. Implies
+	// event_loop.
+	char *listen_path;
+
+	// See ui_opts. Zero means no limit.
+	size_t pane_memory_budget;
+
+	// Fault in this much tile memory at startup; see pool_reserve.
+	size_t tile_pool;
+
+	// See rendering_opts. Zero means the backend's default.
+	uint16_t width, height;
+	char *stream_path;
+	enum stream_format stream_format;
+	unsigned stream_fps;
+	char *rfb_listen;
+	char *shm_path;
+
+	// See ui_opts.
+	char *state_dir;
+	char *checkpoint_path;
+	unsigned checkpoint_interval;
+	char *restore_path;
 };
 
 static void print_usage(const char *);
 static struct args parse_args(int argc, char **argv);
+static bool parse_size(const char *in, size_t *out);
+static bool parse_dimensions(const char *in, uint16_t *w, uint16_t *h);
+static bool parse_ms(const char *in, unsigned *out);
+static bool parse_fps(const char *in, unsigned *out);
+static bool parse_speed(const char *in, double *out);
 
 const struct backend_opt backend_strings[] = {
 	// The first backend is treated as the default.
 	{ BACKEND_DRM, "DRM", "directly use the Linux DRM subsystem" },
 	{ BACKEND_MEM, "MEM", "drawing uses zero I/O, only happens in-memory" },
+	{ BACKEND_STREAM, "STREAM", "write frames to a pipe (see below)" },
+	{ BACKEND_RFB, "RFB", "serve the screen to VNC viewers (see below)" },
+	{ BACKEND_SHM, "SHM", "share frames with local readers (see below)" },
 };
 
 int main(int argc, char *argv[])
@@ -73,22 +138,94 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	if (args.bench) {
+		run_bench();
+		return 0;
+	}
+
+	// Replays are only a client to some other instance.
+	if (args.replay_path != NULL) {
+		run_replay(args.replay_path, args.replay_to, args.replay_speed);
+		return 0;
+	}
+
 	term_init(4);
 
-	// Prepare to block for SIGINT.
+	// Prepare to block for SIGINT, and for SIGUSR1, which asks for a report
+	// on the panes lock.
 	sigset_t f, b;
 	sigemptyset(&f);
 	sigaddset(&f, SIGINT);
+	sigaddset(&f, SIGUSR1);
 	sigprocmask(SIG_BLOCK, &f, &b);
 
+	if (args.tile_pool > 0)
+		pool_reserve(args.tile_pool);
+
+	if (args.trace_path != NULL)
+		trace_open(args.trace_path);
+
+	const struct ui_opts ui_opts = {
+		.pane_memory_budget = args.pane_memory_budget,
+		.rendering = {
+			.width = args.width,
+			.height = args.height,
+			.stream_path = args.stream_path,
+			.stream_format = args.stream_format,
+			.stream_fps = args.stream_fps,
+			.rfb_listen = args.rfb_listen,
+			.shm_path = args.shm_path,
+		},
+		.state_dir = args.state_dir,
+		.checkpoint_path = args.checkpoint_path,
+		.checkpoint_interval = args.checkpoint_interval,
+		.restore_path = args.restore_path,
+	};
+
+	// Load runs drive the same threads as below, but with a ui_ctx of their
+	// own on the MEM backend.
+	if (args.load_scenario != NULL) {
+		run_load(args.load_scenario, args.load_duration, &ui_opts);
+		trace_close();
+		return 0;
+	}
+
+	struct ui_ctx *ui_ctx = ui_ctx_new(vt, &ui_opts);
+
+	struct capture *capture = NULL;
+	if (args.capture_path != NULL)
+		capture = capture_open(args.capture_path);
+
+	if (args.event_loop) {
+		const struct eloop_opts opts = {
+			.listen_path = args.listen_path,
+			.capture = capture,
+		};
+
+		eloop_run(ui_ctx, vt, &opts);
+		ui_ctx_free(ui_ctx);
+		if (capture)
+			capture_close(capture);
+		trace_close();
+		return 0;
+	}
+
 	// Spawn child threads.
-	struct ui_ctx *ui_ctx = ui_ctx_new(vt);
+	struct cmd_thread_args cmd_args = {
+		.ui_ctx = ui_ctx,
+		.capture = capture,
+	};
 	SPAWN_THREAD(ui_thread, ui_handle, ui_ctx);
 	SPAWN_THREAD(vt.input_thread, input_handle, NULL);
-	SPAWN_THREAD(cmd_thread, cmd_handle, ui_ctx);
+	SPAWN_THREAD(cmd_thread, cmd_handle, &cmd_args);
 
 	// Block for SIGINT.
 	for (int s = 0; s != SIGINT; sigwait(&f, &s)) {
+		if (s == SIGUSR1) {
+			char *report = ui_lock_report(ui_ctx);
+			fprintf(stderr, "locks: %s\n", report);
+			free(report);
+		}
 	}
 
 	fprintf(stderr, "SIGINT received; cleaning up.\n");
@@ -98,6 +235,11 @@ int main(int argc, char *argv[])
 	pthread_join(ui_handle, NULL);
 	pthread_join(cmd_handle, NULL);
 
+	ui_ctx_free(ui_ctx);
+	if (capture)
+		capture_close(capture);
+	trace_close();
+
 	return 0;
 }
 
@@ -120,6 +262,134 @@ static void print_usage(const char *self)
 	fprintf(stderr,
 	    "  \tThese can be manually diffed to verify the rendering code.\n");
 
+	fprintf(stderr, "      --bench\n");
+	fprintf(stderr,
+	    "  \tTime each rasterizer across sizes, orientations and clipping\n");
+	fprintf(stderr,
+	    "  \tcases, and print ns/call, pixels/s and GB/s as JSON.\n");
+
+	fprintf(stderr, "      --load <SCENARIO>\n");
+	fprintf(stderr,
+	    "  \tFeed synthetic commands through the command and UI threads\n");
+	fprintf(stderr,
+	    "  \ton the MEM backend. Print commands/s and latency as JSON.\n");
+	fprintf(stderr, "  \t<SCENARIO> is one of:\n");
+	fprintf(stderr, "  \t  - \"mixed\": shapes of every kind and size\n");
+	fprintf(stderr, "  \t  - \"panes\": the same over hundreds of panes\n");
+	fprintf(stderr, "  \t  - \"chains\": long ';'-chains of shapes\n");
+	fprintf(stderr, "  \t  - \"churn\": panes made and removed\n");
+	fprintf(stderr, "  \t  - \"all\": each of the above in turn\n");
+
+	fprintf(stderr, "      --load-duration <MS>\n");
+	fprintf(stderr,
+	    "  \tHow long to run each load scenario (2000 ms by default).\n");
+
+	fprintf(stderr, "      --capture <FILE>\n");
+	fprintf(stderr,
+	    "  \tJournal every line clients send, when and from whom, to\n");
+	fprintf(stderr, "  \t<FILE> for --replay.\n");
+
+	fprintf(stderr, "      --replay <FILE>\n");
+	fprintf(stderr,
+	    "  \tSend the traffic captured in <FILE> to the instance at\n");
+	fprintf(stderr,
+	    "  \t--replay-to, a connection per client, and print how it\n");
+	fprintf(stderr, "  \twent as JSON.\n");
+
+	fprintf(stderr, "      --replay-to <PATH>\n");
+	fprintf(stderr,
+	    "  \tThe Unix socket a fresh instance is listening on (see\n");
+	fprintf(stderr, "  \t--listen).\n");
+
+	fprintf(stderr, "      --replay-speed <X>\n");
+	fprintf(stderr,
+	    "  \tReplay at <X> times the original pace, or with 0 (the\n");
+	fprintf(stderr, "  \tdefault), as fast as possible.\n");
+
+	fprintf(stderr, "      --trace <FILE>\n");
+	fprintf(stderr,
+	    "  \tRecord what every thread spends its time on (reads,\n");
+	fprintf(stderr,
+	    "  \tparsing, the panes lock, drawing, presents, flips and\n");
+	fprintf(stderr,
+	    "  \tsaves) and write it to <FILE> on exit, as Chrome\n");
+	fprintf(stderr, "  \ttrace-event JSON.\n");
+
+	fprintf(stderr, "      --event-loop\n");
+	fprintf(stderr,
+	    "  \tServe commands, pane rotation and input from one epoll loop\n");
+	fprintf(stderr,
+	    "  \tinstead of a thread each. Heavy commands go to a worker pool.\n");
+
+	fprintf(stderr, "      --listen <PATH>\n");
+	fprintf(stderr,
+	    "  \tAlso accept clients on a Unix socket at <PATH>, each with its\n");
+	fprintf(stderr, "  \town command stream. Implies --event-loop.\n");
+
+	fprintf(stderr, "      --pane-memory-budget <BYTES>\n");
+	fprintf(stderr,
+	    "  \tCompress the least recently used panes whenever canvases take\n");
+	fprintf(stderr,
+	    "  \tup more than <BYTES> (with an optional K, M or G suffix).\n");
+
+	fprintf(stderr, "      --tile-pool <BYTES>\n");
+	fprintf(stderr,
+	    "  \tFault in <BYTES> of tile memory up front, and keep at least\n");
+	fprintf(stderr,
+	    "  \tthat much around for reuse as panes come and go.\n");
+
+	fprintf(stderr, "      --size <WIDTH>x<HEIGHT>\n");
+	fprintf(stderr,
+	    "  \tSet the screen size of every backend but DRM (640x480 by\n");
+	fprintf(stderr, "  \tdefault), which goes by the display's mode.\n");
+
+	fprintf(stderr, "      --stream-output <PATH>\n");
+	fprintf(stderr,
+	    "  \tWhere the STREAM backend writes frames: a file, a FIFO, or\n");
+	fprintf(stderr,
+	    "  \t/dev/fd/N for a pipe to an encoder. Stdout is taken by\n");
+	fprintf(stderr, "  \tcommand replies, so use e.g. /dev/fd/3 3>&1.\n");
+
+	fprintf(stderr, "      --stream-format <y4m|bgra>\n");
+	fprintf(stderr,
+	    "  \tWrite YUV4MPEG2 (4:2:0, the default) or bare BGRA frames.\n");
+
+	fprintf(stderr, "      --stream-fps <FPS>\n");
+	fprintf(stderr,
+	    "  \tHow many frames to write a second (30 by default). The\n");
+	fprintf(stderr, "  \tlast frame repeats while nothing new is shown.\n");
+
+	fprintf(stderr, "      --rfb-listen <PORT|PATH>\n");
+	fprintf(stderr,
+	    "  \tWhere the RFB backend takes viewers: a TCP port, on\n");
+	fprintf(stderr,
+	    "  \tloopback only (5900 by default), or a Unix socket. There's no\n");
+	fprintf(stderr, "  \tauthentication, and viewers can't send input.\n");
+
+	fprintf(stderr, "      --shm-path <PATH>\n");
+	fprintf(stderr,
+	    "  \tWhere the SHM backend keeps its frames, for other processes\n");
+	fprintf(stderr,
+	    "  \tto map (see rendering/shm/shm.h for the layout). Without\n");
+	fprintf(stderr, "  \tthis, it's a memfd, found through /proc.\n");
+
+	fprintf(stderr, "      --state-dir <DIR>\n");
+	fprintf(stderr,
+	    "  \tKeep every pane in a file under <DIR>, and bring them back\n");
+	fprintf(stderr, "  \tfrom there on the next start.\n");
+
+	fprintf(stderr, "      --checkpoint <FILE>\n");
+	fprintf(stderr,
+	    "  \tPeriodically write the tiles that changed to a checkpoint\n");
+	fprintf(stderr, "  \tfile, which --restore can start from.\n");
+
+	fprintf(stderr, "      --checkpoint-interval <MS>\n");
+	fprintf(stderr,
+	    "  \tHow often to checkpoint, in milliseconds (1000 by default).\n");
+
+	fprintf(stderr, "      --restore <FILE>\n");
+	fprintf(stderr, "  \tStart with the panes in a checkpoint file.\n");
+
 	fprintf(stderr, "  -h, --help\n");
 	fprintf(stderr, "  \tPrint help.\n");
 }
@@ -132,6 +402,29 @@ static struct args parse_args(int argc, char **argv)
 	struct args args = {
 		.backend = backend_strings[0].backend,
 		.tests_dump_dir = NULL,
+		.bench = false,
+		.load_scenario = NULL,
+		.load_duration = 2000,
+		.capture_path = NULL,
+		.replay_path = NULL,
+		.replay_to = NULL,
+		.replay_speed = 0,
+		.trace_path = NULL,
+		.event_loop = false,
+		.listen_path = NULL,
+		.pane_memory_budget = 0,
+		.tile_pool = 0,
+		.width = 0,
+		.height = 0,
+		.stream_path = NULL,
+		.stream_format = STREAM_FORMAT_Y4M,
+		.stream_fps = 0,
+		.rfb_listen = NULL,
+		.shm_path = NULL,
+		.state_dir = NULL,
+		.checkpoint_path = NULL,
+		.checkpoint_interval = 1000,
+		.restore_path = NULL,
 	};
 
 	// i miss https://github.com/clap-rs/clap 💔
@@ -142,6 +435,28 @@ static struct args parse_args(int argc, char **argv)
 			{ "help", 0, NULL, 'h' },
 			{ "backend", required_argument, NULL, 'b' },
 			{ "test", required_argument, NULL, 't' },
+			{ "bench", 0, NULL, 'n' },
+			{ "load", required_argument, NULL, 'a' },
+			{ "load-duration", required_argument, NULL, 'u' },
+			{ "capture", required_argument, NULL, 'w' },
+			{ "replay", required_argument, NULL, 'x' },
+			{ "replay-to", required_argument, NULL, 'y' },
+			{ "replay-speed", required_argument, NULL, 'z' },
+			{ "trace", required_argument, NULL, 'j' },
+			{ "event-loop", 0, NULL, 'e' },
+			{ "listen", required_argument, NULL, 'l' },
+			{ "pane-memory-budget", required_argument, NULL, 'm' },
+			{ "tile-pool", required_argument, NULL, 'p' },
+			{ "size", required_argument, NULL, 's' },
+			{ "stream-output", required_argument, NULL, 'o' },
+			{ "stream-format", required_argument, NULL, 'f' },
+			{ "stream-fps", required_argument, NULL, 'q' },
+			{ "rfb-listen", required_argument, NULL, 'v' },
+			{ "shm-path", required_argument, NULL, 'g' },
+			{ "state-dir", required_argument, NULL, 'd' },
+			{ "checkpoint", required_argument, NULL, 'c' },
+			{ "checkpoint-interval", required_argument, NULL, 'i' },
+			{ "restore", required_argument, NULL, 'r' },
 			{ 0 }, // this must be terminated with some end
 			       // indicator since getopt does not accept a
 			       // length
@@ -173,6 +488,117 @@ static struct args parse_args(int argc, char **argv)
 		case 't':
 			args.tests_dump_dir = optarg;
 			break;
+		case 'n':
+			args.bench = true;
+			break;
+		case 'a':
+			if (!load_scenario_valid(optarg)) {
+				fprintf(stderr,
+				    "%s: unknown load scenario '%s'\n", self,
+				    optarg);
+				exit(1);
+			}
+			args.load_scenario = optarg;
+			break;
+		case 'u':
+			if (!parse_ms(optarg, &args.load_duration)) {
+				fprintf(stderr, "%s: bad load duration '%s'\n",
+				    self, optarg);
+				exit(1);
+			}
+			break;
+		case 'w':
+			args.capture_path = optarg;
+			break;
+		case 'x':
+			args.replay_path = optarg;
+			break;
+		case 'y':
+			args.replay_to = optarg;
+			break;
+		case 'j':
+			args.trace_path = optarg;
+			break;
+		case 'z':
+			if (!parse_speed(optarg, &args.replay_speed)) {
+				fprintf(stderr, "%s: bad replay speed '%s'\n",
+				    self, optarg);
+				exit(1);
+			}
+			break;
+		case 'e':
+			args.event_loop = true;
+			break;
+		case 'l':
+			args.listen_path = optarg;
+			args.event_loop = true;
+			break;
+		case 'm':
+			if (!parse_size(optarg, &args.pane_memory_budget)) {
+				fprintf(stderr, "%s: bad memory budget '%s'\n",
+				    self, optarg);
+				exit(1);
+			}
+			break;
+		case 'p':
+			if (!parse_size(optarg, &args.tile_pool)) {
+				fprintf(stderr, "%s: bad tile pool size '%s'\n",
+				    self, optarg);
+				exit(1);
+			}
+			break;
+		case 's':
+			if (!parse_dimensions(
+				optarg, &args.width, &args.height)) {
+				fprintf(stderr, "%s: bad screen size '%s'\n",
+				    self, optarg);
+				exit(1);
+			}
+			break;
+		case 'o':
+			args.stream_path = optarg;
+			break;
+		case 'f':
+			if (strcasecmp(optarg, "y4m") == 0) {
+				args.stream_format = STREAM_FORMAT_Y4M;
+			} else if (strcasecmp(optarg, "bgra") == 0) {
+				args.stream_format = STREAM_FORMAT_BGRA;
+			} else {
+				fprintf(stderr, "%s: bad stream format '%s'\n",
+				    self, optarg);
+				exit(1);
+			}
+			break;
+		case 'q':
+			if (!parse_fps(optarg, &args.stream_fps)) {
+				fprintf(stderr, "%s: bad frame rate '%s'\n",
+				    self, optarg);
+				exit(1);
+			}
+			break;
+		case 'v':
+			args.rfb_listen = optarg;
+			break;
+		case 'g':
+			args.shm_path = optarg;
+			break;
+		case 'd':
+			args.state_dir = optarg;
+			break;
+		case 'c':
+			args.checkpoint_path = optarg;
+			break;
+		case 'i':
+			if (!parse_ms(optarg, &args.checkpoint_interval)) {
+				fprintf(stderr,
+				    "%s: bad checkpoint interval '%s'\n", self,
+				    optarg);
+				exit(1);
+			}
+			break;
+		case 'r':
+			args.restore_path = optarg;
+			break;
 		case '?':
 			exit(1);
 		default:
@@ -186,5 +612,116 @@ static struct args parse_args(int argc, char **argv)
 		exit(1);
 	}
 
+	if (args.backend == BACKEND_STREAM && args.stream_path == NULL &&
+	    args.tests_dump_dir == NULL && !args.bench &&
+	    args.load_scenario == NULL) {
+		fprintf(stderr,
+		    "%s: the STREAM backend needs --stream-output\n", self);
+		exit(1);
+	}
+
+	if (args.replay_path != NULL && args.replay_to == NULL) {
+		fprintf(stderr, "%s: --replay needs --replay-to\n", self);
+		exit(1);
+	}
+
 	return args;
 }
+
+static bool parse_size(const char *in, size_t *out)
+{
+	char *end = NULL;
+	errno = 0;
+	unsigned long long n = strtoull(in, &end, 10);
+	if (errno != 0 || end == in || *in == '-')
+		return false;
+
+	unsigned shift = 0;
+	switch (*end) {
+	case '\0':
+		break;
+	case 'k':
+	case 'K':
+		shift = 10;
+		break;
+	case 'm':
+	case 'M':
+		shift = 20;
+		break;
+	case 'g':
+	case 'G':
+		shift = 30;
+		break;
+	default:
+		return false;
+	}
+
+	if (*end != '\0' && end[1] != '\0')
+		return false;
+
+	if (n > (SIZE_MAX >> shift))
+		return false;
+
+	*out = (size_t)n << shift;
+	return true;
+}
+
+static bool parse_dimensions(const char *in, uint16_t *w, uint16_t *h)
+{
+	char *end = NULL;
+	unsigned long width = strtoul(in, &end, 10);
+	if (end == in || *end != 'x' || *in == '-')
+		return false;
+
+	in = end + 1;
+	unsigned long height = strtoul(in, &end, 10);
+	if (end == in || *end != '\0' || *in == '-')
+		return false;
+
+	if (width < 1 || height < 1 || width > UINT16_MAX ||
+	    height > UINT16_MAX)
+		return false;
+
+	*w = width;
+	*h = height;
+	return true;
+}
+
+static bool parse_ms(const char *in, unsigned *out)
+{
+	char *end = NULL;
+	errno = 0;
+	unsigned long ms = strtoul(in, &end, 10);
+	if (errno != 0 || end == in || *end != '\0' || *in == '-' || ms < 1 ||
+	    ms > UINT_MAX)
+		return false;
+
+	*out = ms;
+	return true;
+}
+
+static bool parse_fps(const char *in, unsigned *out)
+{
+	char *end = NULL;
+	errno = 0;
+	unsigned long fps = strtoul(in, &end, 10);
+	if (errno != 0 || end == in || *end != '\0' || *in == '-' || fps < 1 ||
+	    fps > 1000)
+		return false;
+
+	*out = fps;
+	return true;
+}
+
+static bool parse_speed(const char *in, double *out)
+{
+	char *end = NULL;
+	errno = 0;
+	double speed = strtod(in, &end);
+	if (errno != 0 || end == in || *end != '\0' || !(speed >= 0) ||
+	    speed > 1e6)
+		return false;
+
+	*out = speed;
+	return true;
+}
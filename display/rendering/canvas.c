@@ -1,77 +1,587 @@
+#define _GNU_SOURCE // mincore
+
 #include "canvas.h"
 
 #include "abort.h"
+#include "pool.h"
+#include "store.h"
 
 #include <dirent.h>
 #include <fcntl.h>
 #include <math.h>
+#include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
-// The function body goes after macro invocation.
-#define DEFN_RENDER(type)                         \
-	void rendering_draw_##type##_type_erased( \
-	    struct canvas *c, const void *v)      \
-	{                                         \
-		rendering_draw_##type(c, v);      \
-	}                                         \
-	void rendering_draw_##type(struct canvas *c, const struct type *type)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+// The function body goes after macro invocation. It's compiled once for each
+// pixel format, with `fmt` fixed, so that the pixel accesses within turn into
+// plain loads and stores of the right width.
+#define DEFN_RENDER(type)                                                    \
+	static ALWAYS_INLINE void draw_##type(struct canvas *c,              \
+	    const struct type *type, const enum pixel_format fmt);             \
+	void rendering_draw_##type(struct canvas *c, const struct type *type) \
+	{                                                                    \
+		switch (c->format) {                                         \
+		case PIXEL_FORMAT_BGRA8888:                                  \
+			draw_##type(c, type, PIXEL_FORMAT_BGRA8888);         \
+			break;                                               \
+		case PIXEL_FORMAT_RGB565:                                    \
+			draw_##type(c, type, PIXEL_FORMAT_RGB565);           \
+			break;                                               \
+		case PIXEL_FORMAT_P8:                                        \
+			draw_##type(c, type, PIXEL_FORMAT_P8);               \
+			break;                                               \
+		}                                                            \
+	}                                                                    \
+	void rendering_draw_##type##_type_erased(                            \
+	    struct canvas *c, const void *v)                                 \
+	{                                                                    \
+		rendering_draw_##type(c, v);                                 \
+	}                                                                    \
+	static ALWAYS_INLINE void draw_##type(struct canvas *c,              \
+	    const struct type *type, const enum pixel_format fmt)
+
+#define TILE_AREA (TILE_SIZE * TILE_SIZE)
+#define PALETTE_SIZE 256
+
+static_assert(TILE_AREA * sizeof(uint32_t) == POOL_BLOCK_SIZE,
+    "tiles must fit pool blocks exactly");
+static_assert(TILE_AREA == POOL_BLOCK_SIZE >> (POOL_CLASSES - 1),
+    "the smallest pool blocks must fit P8 tiles");
+static_assert(PALETTE_SIZE == STORE_PALETTE_SIZE, "stored palettes differ");
+
+/* A tile holds one of: its own pixels, packed pixels (see tile_pack), or
+ * neither, in which case every pixel is `solid`. Pixels come from the pool,
+ * and canvases made with canvas_clone share them until one of them draws to
+ * the tile. */
+struct tile {
+	uint8_t *pixels;
+	uint8_t *packed;
+	uint32_t packed_len;
+	uint32_t solid;
+};
+
+// Packed tiles are a series of packets, each starting with a 16-bit header.
+// With the top bit set, the next pixel repeats (header & 0x7fff) + 1 times.
+// Otherwise, header + 1 literal pixels follow. Pixels are in the canvas'
+// format.
+#define PACK_RUN 0x8000
+#define PACK_MAX_PACKET 0x8000
+
+// Leave anything that shrinks less than this alone; unpacking it later
+// isn't free.
+#define PACK_MIN_SAVINGS 1024
 
 static inline intmax_t min(intmax_t, intmax_t);
 static inline intmax_t max(intmax_t, intmax_t);
 static inline float lerp(float start, float end, float t);
 static void bezier2_compute(struct bezier2 b, float t, float *x, float *y);
 static float bezier2_arclen_approx(struct bezier2 b, size_t n);
-static void draw_point(struct canvas *, int32_t x, int32_t y, struct color);
+static ALWAYS_INLINE size_t px_size(enum pixel_format);
+static ALWAYS_INLINE uint32_t px_load(
+    enum pixel_format, const uint8_t *px, size_t i);
+static ALWAYS_INLINE void px_store(
+    enum pixel_format, uint8_t *px, size_t i, uint32_t v);
+static ALWAYS_INLINE void px_fill(
+    enum pixel_format, uint8_t *px, size_t n, uint32_t v);
+static ALWAYS_INLINE void draw_point(struct canvas *, enum pixel_format,
+    int32_t x, int32_t y, uint32_t px);
+static ALWAYS_INLINE void fill_area(struct canvas *, enum pixel_format,
+    uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, uint32_t px);
+static ALWAYS_INLINE void read_native(const struct canvas *,
+    enum pixel_format, uint32_t x, uint32_t y, uint32_t w, uint8_t *out);
+static ALWAYS_INLINE void read_span(const struct canvas *, enum pixel_format,
+    uint32_t x, uint32_t y, uint32_t w, uint32_t *out);
+static ALWAYS_INLINE void write_span(struct canvas *, enum pixel_format,
+    uint32_t x, uint32_t y, uint32_t w, const uint8_t *in);
+static ALWAYS_INLINE uint32_t expand_px(
+    const struct canvas *, enum pixel_format, uint32_t px);
+static ALWAYS_INLINE void expand(const struct canvas *, enum pixel_format,
+    const uint8_t *in, size_t n, uint32_t *out);
+static void convert(
+    struct canvas *, const uint32_t *in, size_t n, uint8_t *out);
+static inline uint32_t pack_color(struct color);
+static uint32_t canvas_px(struct canvas *, struct color);
+static inline uint32_t bgra_to_rgb565(uint32_t);
+static inline uint32_t rgb565_to_bgra(uint32_t);
+static uint32_t palette_index(struct canvas *, uint32_t bgra);
+static inline size_t tile_bytes(const struct canvas *);
+static struct tile *tile_at(struct canvas *, uint32_t x, uint32_t y);
+static uint8_t *tile_px_mut(struct canvas *, struct tile *);
+static void tile_set_solid(struct canvas *, struct tile *, uint32_t px);
+static void tile_pack(struct canvas *, struct tile *);
+static void tile_unpack(struct canvas *, struct tile *);
+static void packed_read(const struct tile *, size_t px_size, uint32_t off,
+    uint32_t n, uint8_t *out);
+static void tiles_release(struct canvas *);
+static inline struct stored_tile *stored_tile(
+    const struct canvas *, const struct tile *);
+static inline uint8_t *stored_slot(const struct canvas *, const struct tile *);
+static void stored_sync(struct canvas *);
+static inline void tile_dirty(struct canvas *, const struct tile *);
+static inline size_t dirty_words(const struct canvas *);
+static size_t resident_bytes(const uint8_t *p, size_t len);
+
+static const char *const format_names[] = {
+	[PIXEL_FORMAT_BGRA8888] = "BGRA8888",
+	[PIXEL_FORMAT_RGB565] = "RGB565",
+	[PIXEL_FORMAT_P8] = "P8",
+};
+
+struct canvas *canvas_init(
+    uint16_t width, uint16_t height, enum pixel_format format)
+{
+	struct canvas *ret = malloc(sizeof(struct canvas));
+	if (ret == NULL)
+		return NULL;
+
+	ret->width = width;
+	ret->height = height;
+	ret->tiles_x = ((uint32_t)width + TILE_SIZE - 1) / TILE_SIZE;
+	ret->tiles_y = ((uint32_t)height + TILE_SIZE - 1) / TILE_SIZE;
+	ret->format = format;
+
+	// Tiles are only split out on the first draw.
+	ret->tiles = NULL;
+	ret->fill = 0;
+	ret->bytes = 0;
+	ret->pixel_tiles = 0;
+	ret->packed_tiles = 0;
+	ret->packed_bytes = 0;
+
+	ret->stored = NULL;
+	ret->all_dirty = true;
+	ret->dirty = calloc(dirty_words(ret), sizeof(uint64_t));
+	if (ret->dirty == NULL) {
+		free(ret);
+		return NULL;
+	}
+
+	ret->palette = NULL;
+	ret->palette_len = 0;
+	if (format == PIXEL_FORMAT_P8) {
+		ret->palette = malloc(PALETTE_SIZE * sizeof(uint32_t));
+		if (ret->palette == NULL) {
+			free(ret->dirty);
+			free(ret);
+			return NULL;
+		}
+
+		// Give the initial fill the same meaning it has in BGRA.
+		ret->palette[0] = 0;
+		ret->palette_len = 1;
+	}
+
+	return ret;
+}
 
 struct canvas *canvas_init_bgra(uint16_t width, uint16_t height)
 {
-	// These Linux sources were helpful in understanding the intended
-	// memory layout & alignment of these pixel buffers
-	// (as of commit ffd294d346d185b70e28b1a28abe367bbfe53c04):
-	// - linux/drivers/gpu/drm/drm_dumb_buffers.c:60
-	// - linux/drivers/gpu/drm/amd/amdgpu/amdgpu_gem.c:942
-	// - linux/drivers/gpu/drm/amd/amdgpu/amdgpu_gem.c:916
+	return canvas_init(width, height, PIXEL_FORMAT_BGRA8888);
+}
+
+struct canvas *canvas_init_stored(struct stored_canvas *s)
+{
+	struct canvas *ret = canvas_init(s->width, s->height, s->format);
+	if (ret == NULL)
+		return NULL;
+
+	// Whatever is in the file, it mustn't index past the palette.
+	const uint32_t mask =
+	    (uint32_t)-1 >> (32 - 8 * pixel_format_size(ret->format));
+
+	free(ret->palette);
+	ret->stored = s;
+	ret->palette = ret->format == PIXEL_FORMAT_P8 ? s->palette : NULL;
+	ret->palette_len = ret->palette ? s->palette_len : 0;
+	ret->fill = s->fill & mask;
+	if (!s->split)
+		return ret;
+
+	const size_t n = (size_t)ret->tiles_x * ret->tiles_y;
+	ret->tiles = malloc(n * sizeof(struct tile));
+	if (ret->tiles == NULL) {
+		ret->stored = NULL;
+		ret->palette = NULL;
+		canvas_deinit(ret);
+		return NULL;
+	}
+
+	ret->bytes = n * sizeof(struct tile);
+	for (size_t i = 0; i < n; i++) {
+		struct tile *t = &ret->tiles[i];
+		const struct stored_tile *st = stored_tile(ret, t);
+
+		*t = (struct tile) { .solid = st->solid & mask };
+		if (st->has_pixels) {
+			t->pixels = stored_slot(ret, t);
+			ret->bytes += tile_bytes(ret);
+			ret->pixel_tiles++;
+		}
+	}
+
+	return ret;
+}
+
+bool pixel_format_parse(const char *in, enum pixel_format *out)
+{
+	for (size_t i = 0; i < sizeof(format_names) / sizeof(*format_names);
+	    i++) {
+		if (strcmp(in, format_names[i]) == 0) {
+			*out = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+const char *pixel_format_str(enum pixel_format format)
+{
+	return format_names[format];
+}
+
+size_t pixel_format_size(enum pixel_format format)
+{
+	return px_size(format);
+}
 
+struct canvas *canvas_clone(const struct canvas *c)
+{
 	struct canvas *ret = malloc(sizeof(struct canvas));
 	if (ret == NULL)
 		return NULL;
 
-	ret->width = width;
-	ret->height = height;
-	ret->stride = width * 4;
+	*ret = *c;
+	ret->stored = NULL;
+	ret->dirty = malloc(dirty_words(c) * sizeof(uint64_t));
+	if (ret->dirty == NULL) {
+		free(ret);
+		return NULL;
+	}
 
-	ret->buffer = calloc(ret->height, ret->stride);
-	if (ret->buffer == NULL)
+	memcpy(ret->dirty, c->dirty, dirty_words(c) * sizeof(uint64_t));
+	if (c->palette) {
+		ret->palette = malloc(PALETTE_SIZE * sizeof(uint32_t));
+		if (ret->palette == NULL) {
+			free(ret->dirty);
+			free(ret);
+			return NULL;
+		}
+
+		memcpy(ret->palette, c->palette,
+		    c->palette_len * sizeof(uint32_t));
+	}
+
+	if (!c->tiles)
+		return ret;
+
+	const size_t n = (size_t)c->tiles_x * c->tiles_y;
+	ret->tiles = malloc(n * sizeof(struct tile));
+	if (ret->tiles == NULL) {
+		free(ret->palette);
+		free(ret->dirty);
+		free(ret);
 		return NULL;
+	}
+
+	memcpy(ret->tiles, c->tiles, n * sizeof(struct tile));
+	for (size_t i = 0; i < n; i++) {
+		struct tile *t = &ret->tiles[i];
+
+		// Stored pixels keep changing in place, so they can't be
+		// shared.
+		if (t->pixels && c->stored) {
+			uint8_t *p = pool_get(tile_bytes(c));
+			memcpy(p, t->pixels, tile_bytes(c));
+			t->pixels = p;
+		} else if (t->pixels) {
+			pool_ref(t->pixels);
+		}
+
+		// Packed pixels are small, so they aren't worth sharing.
+		if (t->packed) {
+			uint8_t *packed = malloc(t->packed_len);
+			if (!packed)
+				FATAL_ERR("canvas: clone: OOM");
+
+			memcpy(packed, t->packed, t->packed_len);
+			t->packed = packed;
+		}
+	}
 
 	return ret;
 }
 
 void canvas_deinit(struct canvas *c)
 {
-	free(c->buffer);
+	if (c->stored) {
+		// Leave the file as it is for next time.
+		free(c->tiles);
+		free(c->dirty);
+		store_unmap(c->stored);
+		free(c);
+		return;
+	}
+
+	tiles_release(c);
+	free(c->palette);
+	free(c->dirty);
 	free(c);
 }
 
+struct canvas_delta *canvas_take_dirty(struct canvas *c, bool full)
+{
+	full |= c->all_dirty;
+
+	const size_t n = (size_t)c->tiles_x * c->tiles_y;
+	size_t num_tiles = 0;
+	if (full && c->tiles)
+		num_tiles = n;
+	else if (c->tiles)
+		for (size_t w = 0; w < dirty_words(c); w++)
+			num_tiles += __builtin_popcountll(c->dirty[w]);
+
+	struct canvas_delta *d =
+	    malloc(sizeof(*d) + num_tiles * sizeof(struct delta_tile));
+	if (!d)
+		FATAL_ERR("canvas: take_dirty: OOM");
+
+	*d = (struct canvas_delta) {
+		.width = c->width,
+		.height = c->height,
+		.format = c->format,
+		.full = full,
+		.fill = c->fill,
+		.split = c->tiles != NULL,
+		.palette_len = c->palette_len,
+		.num_tiles = num_tiles,
+	};
+
+	if (c->palette) {
+		d->palette = malloc(PALETTE_SIZE * sizeof(uint32_t));
+		if (!d->palette)
+			FATAL_ERR("canvas: take_dirty: OOM");
+
+		memcpy(d->palette, c->palette,
+		    c->palette_len * sizeof(uint32_t));
+	}
+
+	size_t k = 0;
+	for (size_t i = 0; i < n && k < num_tiles; i++) {
+		if (!full && !(c->dirty[i / 64] >> (i % 64) & 1)) {
+			// Skip clean stretches a word at a time.
+			if (c->dirty[i / 64] >> (i % 64) == 0)
+				i |= 63;
+			continue;
+		}
+
+		const struct tile *t = &c->tiles[i];
+		struct delta_tile *dt = &d->tiles[k++];
+		*dt = (struct delta_tile) { .index = i, .solid = t->solid };
+
+		// Stored pixels change in place, and packed ones would have to
+		// be unpacked anyway, so take a copy of either.
+		if (t->pixels && !c->stored) {
+			pool_ref(t->pixels);
+			dt->pixels = t->pixels;
+		} else if (t->pixels || t->packed) {
+			dt->pixels = pool_get(tile_bytes(c));
+			if (t->pixels)
+				memcpy(dt->pixels, t->pixels, tile_bytes(c));
+			else
+				packed_read(t, px_size(c->format), 0,
+				    TILE_AREA, dt->pixels);
+		}
+	}
+
+	memset(c->dirty, 0, dirty_words(c) * sizeof(uint64_t));
+	c->all_dirty = false;
+	return d;
+}
+
+void canvas_apply_delta(struct canvas *c, const struct canvas_delta *d)
+{
+	assert(d->width == c->width && d->height == c->height &&
+	    d->format == c->format);
+
+	const uint32_t mask =
+	    (uint32_t)-1 >> (32 - 8 * pixel_format_size(c->format));
+
+	if (c->palette && d->palette) {
+		c->palette_len = min(d->palette_len, PALETTE_SIZE);
+		memcpy(c->palette, d->palette,
+		    c->palette_len * sizeof(uint32_t));
+	}
+
+	if (d->full) {
+		tiles_release(c);
+		c->fill = d->fill & mask;
+		c->all_dirty = true;
+	}
+	stored_sync(c);
+
+	const size_t n = (size_t)c->tiles_x * c->tiles_y;
+	for (size_t i = 0; i < d->num_tiles; i++) {
+		const struct delta_tile *dt = &d->tiles[i];
+		if (dt->index >= n)
+			continue;
+
+		struct tile *t = tile_at(c, dt->index % c->tiles_x * TILE_SIZE,
+		    dt->index / c->tiles_x * TILE_SIZE);
+		tile_dirty(c, t);
+		if (dt->pixels)
+			memcpy(tile_px_mut(c, t), dt->pixels, tile_bytes(c));
+		else
+			tile_set_solid(c, t, dt->solid & mask);
+	}
+}
+
+void canvas_delta_free(struct canvas_delta *d)
+{
+	for (size_t i = 0; i < d->num_tiles; i++)
+		if (d->tiles[i].pixels)
+			pool_unref(d->tiles[i].pixels);
+
+	free(d->palette);
+	free(d);
+}
+
+void canvas_read_span(const struct canvas *c, uint16_t x, uint16_t y,
+    uint16_t w, uint32_t *out)
+{
+	switch (c->format) {
+	case PIXEL_FORMAT_BGRA8888:
+		read_span(c, PIXEL_FORMAT_BGRA8888, x, y, w, out);
+		break;
+	case PIXEL_FORMAT_RGB565:
+		read_span(c, PIXEL_FORMAT_RGB565, x, y, w, out);
+		break;
+	case PIXEL_FORMAT_P8:
+		read_span(c, PIXEL_FORMAT_P8, x, y, w, out);
+		break;
+	}
+}
+
+void canvas_read_rgba(
+    const struct canvas *c, uint16_t y, uint16_t rows, uint8_t *out)
+{
+	const size_t stride = (size_t)c->width * 4;
+	for (uint16_t i = 0; i < rows; i++) {
+		uint32_t *row = (uint32_t *)&out[stride * i];
+		canvas_read_span(c, 0, y + i, c->width, row);
+
+		// BGRA to RGBA in place, i.e., swap R and B.
+		for (uint16_t x = 0; x < c->width; x++) {
+			const uint32_t px = row[x];
+			row[x] = (px & 0xff00ff00) | (px >> 16 & 0xff) |
+			    (px & 0xff) << 16;
+		}
+	}
+}
+
+void canvas_compose_span(const struct canvas *c, const struct placement *pl,
+    uint16_t y, uint16_t frame_width, uint32_t *out)
+{
+	const uint32_t bg = pack_color(pl->background);
+
+	// The part of the row the canvas covers, in frame coordinates.
+	uint32_t x0 = 0;
+	uint32_t x1 = 0;
+	if (y >= pl->y && y - pl->y < c->height) {
+		x0 = min(pl->x, frame_width);
+		x1 = min((uint32_t)pl->x + c->width, frame_width);
+	}
+
+	for (uint32_t x = 0; x < x0; x++)
+		out[x] = bg;
+
+	if (x0 < x1)
+		canvas_read_span(c, 0, y - pl->y, x1 - x0, &out[x0]);
+
+	for (uint32_t x = x1; x < frame_width; x++)
+		out[x] = bg;
+}
+
+void canvas_materialize(const struct canvas *c, const struct placement *pl,
+    uint16_t frame_width, uint16_t frame_height, uint8_t *dst, size_t stride)
+{
+	for (uint16_t y = 0; y < frame_height; y++)
+		canvas_compose_span(
+		    c, pl, y, frame_width, (uint32_t *)&dst[stride * y]);
+}
+
+void canvas_pack(struct canvas *c)
+{
+	// The kernel can write stored canvases back and drop their pages on
+	// its own.
+	if (!c->tiles || c->stored)
+		return;
+
+	const size_t n = (size_t)c->tiles_x * c->tiles_y;
+	for (size_t i = 0; i < n && c->pixel_tiles > 0; i++)
+		if (c->tiles[i].pixels)
+			tile_pack(c, &c->tiles[i]);
+}
+
+void canvas_unpack(struct canvas *c)
+{
+	if (!c->tiles)
+		return;
+
+	const size_t n = (size_t)c->tiles_x * c->tiles_y;
+	for (size_t i = 0; i < n && c->packed_tiles > 0; i++)
+		if (c->tiles[i].packed)
+			tile_unpack(c, &c->tiles[i]);
+}
+
+size_t canvas_resident(const struct canvas *c)
+{
+	if (!c->tiles)
+		return c->bytes;
+
+	size_t out = c->bytes;
+	const size_t len = tile_bytes(c);
+	const size_t n = (size_t)c->tiles_x * c->tiles_y;
+	for (size_t i = 0; i < n; i++)
+		if (c->tiles[i].pixels)
+			out -= len - resident_bytes(c->tiles[i].pixels, len);
+
+	return out;
+}
+
 void rendering_fill(struct canvas *c, struct color color)
 {
-	// Color space is little endian, thus the BGRA format used below:
-	for (uint16_t x = 0; x < c->width; x++)
-		for (uint16_t y = 0; y < c->height; y++)
-			draw_point(c, x, y, color);
+	// Every pixel is overwritten, so drop the tiles rather than touch
+	// them. This is O(1) whatever the canvas size. The palette is free to
+	// start over, too.
+	tiles_release(c);
+	c->palette_len = 0;
+	c->fill = canvas_px(c, color);
+	c->all_dirty = true;
+	stored_sync(c);
 }
 
 DEFN_RENDER(rect)
 {
-	uint16_t right_edge = rect->x + rect->w;
-	uint16_t bottom_edge = rect->y + rect->h;
-	for (uint16_t y = rect->y; y < bottom_edge && y < c->height; y++)
-		for (uint16_t x = rect->x; x < right_edge && x < c->width; x++)
-			draw_point(c, x, y, rect->c);
+	// The edges wrap like the old per-pixel loop's did.
+	const uint16_t right_edge = rect->x + rect->w;
+	const uint16_t bottom_edge = rect->y + rect->h;
+	const uint32_t x1 = min(right_edge, c->width);
+	const uint32_t y1 = min(bottom_edge, c->height);
+	if (rect->x >= x1 || rect->y >= y1)
+		return;
+
+	fill_area(c, fmt, rect->x, rect->y, x1, y1, canvas_px(c, rect->c));
 }
 
 DEFN_RENDER(circle)
@@ -80,40 +590,40 @@ DEFN_RENDER(circle)
 	uint16_t y = 0;
 	int32_t t1 = circle->r / 16;
 
-	const struct color color = circle->c;
+	const uint32_t px = canvas_px(c, circle->c);
 
 	while (x > 0 && x >= y) {
 		int32_t eff_y = circle->y + y;
 		for (int32_t eff_x = circle->x + x; eff_x >= circle->x; eff_x--)
-			draw_point(c, eff_x, eff_y, color);
+			draw_point(c, fmt, eff_x, eff_y, px);
 
 		eff_y = circle->y - y;
 		for (int32_t eff_x = circle->x + x; eff_x >= circle->x; eff_x--)
-			draw_point(c, eff_x, eff_y, color);
+			draw_point(c, fmt, eff_x, eff_y, px);
 
 		eff_y = circle->y - y;
 		for (int32_t eff_x = circle->x - x; eff_x < circle->x; eff_x++)
-			draw_point(c, eff_x, eff_y, color);
+			draw_point(c, fmt, eff_x, eff_y, px);
 
 		eff_y = circle->y + y;
 		for (int32_t eff_x = circle->x - x; eff_x < circle->x; eff_x++)
-			draw_point(c, eff_x, eff_y, color);
+			draw_point(c, fmt, eff_x, eff_y, px);
 
 		eff_y = circle->y + x;
 		for (int32_t eff_x = circle->x + y; eff_x >= circle->x; eff_x--)
-			draw_point(c, eff_x, eff_y, color);
+			draw_point(c, fmt, eff_x, eff_y, px);
 
 		eff_y = circle->y - x;
 		for (int32_t eff_x = circle->x + y; eff_x >= circle->x; eff_x--)
-			draw_point(c, eff_x, eff_y, color);
+			draw_point(c, fmt, eff_x, eff_y, px);
 
 		eff_y = circle->y - x;
 		for (int32_t eff_x = circle->x - y; eff_x < circle->x; eff_x++)
-			draw_point(c, eff_x, eff_y, color);
+			draw_point(c, fmt, eff_x, eff_y, px);
 
 		eff_y = circle->y + x;
 		for (int32_t eff_x = circle->x - y; eff_x < circle->x; eff_x++)
-			draw_point(c, eff_x, eff_y, color);
+			draw_point(c, fmt, eff_x, eff_y, px);
 
 		y++;
 		t1 = t1 + y;
@@ -160,8 +670,9 @@ DEFN_RENDER(line)
 	// in the mathy state and accounted for by `sx` and `sy`.
 	int32_t e = dx - dy;
 
+	const uint32_t px = canvas_px(c, line->c);
 	while (true) {
-		draw_point(c, x, y, line->c);
+		draw_point(c, fmt, x, y, px);
 
 		// Check if we reached the other end.
 		if (x == line->x1 && y == line->y1)
@@ -208,15 +719,106 @@ DEFN_RENDER(rect_copy)
 	if (safe_width <= 0)
 		return;
 
+	// Going through a row buffer takes care of horizontal overlap. Pixels
+	// stay in the canvas' format, so nothing is lost on the way.
+	uint8_t *row = malloc((size_t)safe_width * px_size(fmt));
+	if (!row)
+		FATAL_ERR("canvas: rect_copy: OOM");
+
 	for (int32_t dy = y_inc ? 0 : safe_height - 1;
 	    dy < safe_height && dy >= 0; y_inc ? dy++ : dy--) {
 		uint16_t src_row_y = rc.src_y + dy;
 		uint16_t dst_row_y = rc.dst_y + dy;
-		size_t src_idx = (size_t)c->stride * src_row_y + (rc.src_x * 4);
-		size_t dst_idx = (size_t)c->stride * dst_row_y + (rc.dst_x * 4);
-		memmove(&c->buffer[dst_idx], &c->buffer[src_idx],
-		    (size_t)safe_width * 4);
+		read_native(c, fmt, rc.src_x, src_row_y, safe_width, row);
+		write_span(c, fmt, rc.dst_x, dst_row_y, safe_width, row);
+	}
+
+	free(row);
+}
+
+// Swap red and blue, forcing alpha to 0xff. This is its own inverse (up to
+// alpha), so it serves both directions.
+static inline uint32_t swizzle_rb(uint32_t px)
+{
+	return (px & 0x0000ff00) | (px >> 16 & 0xff) | (px & 0xff) << 16 |
+	    0xff000000;
+}
+
+DEFN_RENDER(blit)
+{
+	const struct blit b = *blit;
+	const int32_t w = min(b.w, (int32_t)c->width - b.x);
+	const int32_t h = min(b.h, (int32_t)c->height - b.y);
+	if (w <= 0 || h <= 0)
+		return;
+
+	uint32_t *row = malloc((size_t)w * sizeof(uint32_t));
+	if (!row)
+		FATAL_ERR("canvas: blit: OOM");
+
+	uint8_t *native = (uint8_t *)row;
+	if (fmt != PIXEL_FORMAT_BGRA8888) {
+		native = malloc((size_t)w * px_size(fmt));
+		if (!native)
+			FATAL_ERR("canvas: blit: OOM");
+	}
+
+	for (int32_t dy = 0; dy < h; dy++) {
+		const uint8_t *src = &b.src[b.stride * dy];
+
+		// The staging area belongs to the client and need not be
+		// aligned, so go through memcpy for each source pixel. The
+		// compiler turns these loops into plain vector moves.
+		if (b.order == PIXEL_BGRA) {
+			for (int32_t x = 0; x < w; x++) {
+				uint32_t px;
+				memcpy(&px, &src[x * 4], 4);
+				row[x] = px | 0xff000000;
+			}
+		} else {
+			for (int32_t x = 0; x < w; x++) {
+				uint32_t px;
+				memcpy(&px, &src[x * 4], 4);
+				row[x] = swizzle_rb(px);
+			}
+		}
+
+		if (fmt != PIXEL_FORMAT_BGRA8888)
+			convert(c, row, w, native);
+
+		write_span(c, fmt, b.x, b.y + dy, w, native);
+	}
+
+	if (native != (uint8_t *)row)
+		free(native);
+	free(row);
+}
+
+DEFN_RENDER(readback)
+{
+	const struct readback rb = *readback;
+	const int32_t w = min(rb.w, (int32_t)c->width - rb.x);
+	const int32_t h = min(rb.h, (int32_t)c->height - rb.y);
+	if (w <= 0 || h <= 0)
+		return;
+
+	uint32_t *row = malloc((size_t)w * sizeof(uint32_t));
+	if (!row)
+		FATAL_ERR("canvas: readback: OOM");
+
+	for (int32_t dy = 0; dy < h; dy++) {
+		uint8_t *dst = &rb.dst[rb.stride * dy];
+		read_span(c, fmt, rb.x, rb.y + dy, w, row);
+
+		if (rb.order == PIXEL_RGBA) {
+			for (int32_t x = 0; x < w; x++)
+				row[x] = swizzle_rb(row[x]);
+		}
+
+		memcpy(dst, row, (size_t)w * 4);
 	}
+
+	free(row);
 }
 
 static void bezier2_compute(struct bezier2 b, float t, float *x, float *y)
@@ -256,10 +858,11 @@ DEFN_RENDER(bezier2)
 	size_t arclen_precision = 13;
 	float density = 2.0;
 	float dt = 1.0 / (bezier2_arclen_approx(b, arclen_precision) * density);
+	const uint32_t color = canvas_px(c, b.c);
 	for (float t = 0.0; t <= 1.0; t += dt) {
 		float px, py;
 		bezier2_compute(b, t, &px, &py);
-		draw_point(c, roundf(px), roundf(py), b.c);
+		draw_point(c, fmt, roundf(px), roundf(py), color);
 	}
 }
 
@@ -313,6 +916,8 @@ DEFN_RENDER(triangle)
 	const int64_t lo = min(0, det);
 	const int64_t hi = max(0, det);
 
+	const uint32_t px = canvas_px(c, tri.c);
+
 	for (int32_t y = bound_up; y <= bound_down; y++) {
 		for (int32_t x = bound_left; x <= bound_right; x++) {
 			// looks like lisp lmao
@@ -328,7 +933,7 @@ DEFN_RENDER(triangle)
 
 			if (lo <= b1 && b1 <= hi && lo <= b2 && b2 <= hi &&
 			    lo <= b3 && b3 <= hi)
-				draw_point(c, x, y, tri.c);
+				draw_point(c, fmt, x, y, px);
 		}
 	}
 }
@@ -342,7 +947,8 @@ void rendering_dump_bgra_to_rgba(
 		FATAL_ERR("Failed to open file for writing: %s/%s: %s", dirpath,
 		    path, STR_ERR);
 
-	const size_t buffer_size = (size_t)c->height * (size_t)c->stride;
+	const size_t stride = (size_t)c->width * 4;
+	const size_t buffer_size = (size_t)c->height * stride;
 	if (ftruncate(fd, buffer_size) < 0)
 		FATAL_ERR("Failed to grow file to %zu bytes: %s/%s: %s",
 		    buffer_size, dirpath, path, STR_ERR);
@@ -353,20 +959,28 @@ void rendering_dump_bgra_to_rgba(
 		FATAL_ERR("Failed to mmap file for writing: %s/%s: %s", dirpath,
 		    path, STR_ERR);
 
+	uint32_t *row = malloc((size_t)c->width * sizeof(uint32_t));
+	if (!row)
+		FATAL_ERR("Failed to allocate row for %s/%s", dirpath, path);
+
 	for (uint16_t y = 0; y < c->height; y++) {
+		canvas_read_span(c, 0, y, c->width, row);
 		for (uint16_t x = 0; x < c->width; x++) {
-			const size_t idx = (c->stride * y) + (x * 4);
+			const size_t idx = (stride * y) + (x * 4);
+			const uint8_t *bgra = (const uint8_t *)&row[x];
 			const uint8_t rgba_pixel[4] = {
-				c->buffer[idx + 2], // R
-				c->buffer[idx + 1], // G
-				c->buffer[idx + 0], // B
-				c->buffer[idx + 3], // A
+				bgra[2], // R
+				bgra[1], // G
+				bgra[0], // B
+				bgra[3], // A
 			};
 
 			memcpy(&dst[idx], rgba_pixel, sizeof(rgba_pixel));
 		}
 	}
 
+	free(row);
+
 	if (munmap(dst, buffer_size) < 0)
 		FATAL_ERR("Failed to unmap file contents: %s/%s: %s", dirpath,
 		    path, STR_ERR);
@@ -391,8 +1005,74 @@ static inline float lerp(float start, float end, float t)
 	return t * end + (1 - t) * start;
 }
 
-static void draw_point(
-    struct canvas *c, int32_t x, int32_t y, struct color color)
+static ALWAYS_INLINE size_t px_size(enum pixel_format fmt)
+{
+	switch (fmt) {
+	case PIXEL_FORMAT_RGB565:
+		return 2;
+	case PIXEL_FORMAT_P8:
+		return 1;
+	default:
+		return 4;
+	}
+}
+
+// Pixel blocks come from the pool aligned, so these are safe to access as
+// whole pixels.
+static ALWAYS_INLINE uint32_t px_load(
+    enum pixel_format fmt, const uint8_t *px, size_t i)
+{
+	switch (fmt) {
+	case PIXEL_FORMAT_RGB565:
+		return ((const uint16_t *)px)[i];
+	case PIXEL_FORMAT_P8:
+		return px[i];
+	default:
+		return ((const uint32_t *)px)[i];
+	}
+}
+
+static ALWAYS_INLINE void px_store(
+    enum pixel_format fmt, uint8_t *px, size_t i, uint32_t v)
+{
+	switch (fmt) {
+	case PIXEL_FORMAT_RGB565:
+		((uint16_t *)px)[i] = v;
+		break;
+	case PIXEL_FORMAT_P8:
+		px[i] = v;
+		break;
+	default:
+		((uint32_t *)px)[i] = v;
+		break;
+	}
+}
+
+static ALWAYS_INLINE void px_fill(
+    enum pixel_format fmt, uint8_t *px, size_t n, uint32_t v)
+{
+	if (fmt == PIXEL_FORMAT_P8) {
+		memset(px, v, n);
+		return;
+	}
+
+	// Store eight bytes at a time, so that narrower pixels take fewer
+	// stores rather than just as many.
+	uint64_t pattern = v;
+	for (size_t bits = px_size(fmt) * 8; bits < 64; bits *= 2)
+		pattern |= pattern << bits;
+
+	const size_t bytes = n * px_size(fmt);
+	size_t i = 0;
+	for (; i + sizeof(pattern) <= bytes; i += sizeof(pattern))
+		memcpy(&px[i], &pattern, sizeof(pattern));
+
+	for (i /= px_size(fmt); i < n; i++)
+		px_store(fmt, px, i, v);
+}
+
+static ALWAYS_INLINE void draw_point(struct canvas *c,
+    const enum pixel_format fmt, int32_t x, int32_t y, uint32_t px)
 {
 	// Drawing a point out of bounds is a no-op. This is
 	// especially important given that we're receiving
@@ -401,9 +1081,626 @@ static void draw_point(
 	    x > UINT16_MAX || y > UINT16_MAX)
 		return;
 
+	// Leave solid tiles alone if the point wouldn't change them.
+	if (!c->tiles && c->fill == px)
+		return;
+
+	struct tile *t = tile_at(c, x, y);
+	if (!t->pixels && !t->packed && t->solid == px)
+		return;
+
+	px_store(fmt, tile_px_mut(c, t),
+	    (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE, px);
+}
+
+static ALWAYS_INLINE void fill_area(struct canvas *c,
+    const enum pixel_format fmt, uint32_t x0, uint32_t y0, uint32_t x1,
+    uint32_t y1, uint32_t px)
+{
+	for (uint32_t ty = y0 / TILE_SIZE; ty * TILE_SIZE < y1; ty++) {
+		for (uint32_t tx = x0 / TILE_SIZE; tx * TILE_SIZE < x1; tx++) {
+			// The part of the area within this tile, in tile
+			// coordinates.
+			const uint32_t ax0 = max(x0, tx * TILE_SIZE) % TILE_SIZE;
+			const uint32_t ay0 = max(y0, ty * TILE_SIZE) % TILE_SIZE;
+			const uint32_t ax1 = min(x1 - tx * TILE_SIZE, TILE_SIZE);
+			const uint32_t ay1 = min(y1 - ty * TILE_SIZE, TILE_SIZE);
+
+			// Tiles on the right and bottom edges may hang off the
+			// canvas. Covering what's on the canvas is enough.
+			const uint32_t tw = min(c->width - tx * TILE_SIZE, TILE_SIZE);
+			const uint32_t th =
+			    min(c->height - ty * TILE_SIZE, TILE_SIZE);
+
+			struct tile *t = tile_at(c, tx * TILE_SIZE, ty * TILE_SIZE);
+			if (ax0 == 0 && ay0 == 0 && ax1 == tw && ay1 == th) {
+				tile_set_solid(c, t, px);
+				tile_dirty(c, t);
+				continue;
+			}
+
+			if (!t->pixels && !t->packed && t->solid == px)
+				continue;
+
+			uint8_t *dst = tile_px_mut(c, t);
+			const size_t size = px_size(fmt);
+			for (uint32_t y = ay0; y < ay1; y++)
+				px_fill(fmt, &dst[(y * TILE_SIZE + ax0) * size],
+				    ax1 - ax0, px);
+		}
+	}
+}
+
+/* Read `w` pixels starting at (x, y) as they're stored. */
+static ALWAYS_INLINE void read_native(const struct canvas *c,
+    const enum pixel_format fmt, uint32_t x, uint32_t y, uint32_t w,
+    uint8_t *out)
+{
+	const size_t size = px_size(fmt);
+
+	if (!c->tiles) {
+		px_fill(fmt, out, w, c->fill);
+		return;
+	}
+
+	const struct tile *row = &c->tiles[(size_t)(y / TILE_SIZE) * c->tiles_x];
+	const uint32_t row_off = (y % TILE_SIZE) * TILE_SIZE;
+
+	while (w > 0) {
+		const struct tile *t = &row[x / TILE_SIZE];
+		const uint32_t n = min(w, TILE_SIZE - x % TILE_SIZE);
+		const uint32_t off = row_off + x % TILE_SIZE;
+
+		if (t->pixels)
+			memcpy(out, &t->pixels[off * size], n * size);
+		else if (t->packed)
+			packed_read(t, size, off, n, out);
+		else
+			px_fill(fmt, out, n, t->solid);
+
+		out += n * size;
+		x += n;
+		w -= n;
+	}
+}
+
+/* Read `w` pixels starting at (x, y) as BGRA. */
+static ALWAYS_INLINE void read_span(const struct canvas *c,
+    const enum pixel_format fmt, uint32_t x, uint32_t y, uint32_t w,
+    uint32_t *out)
+{
+	if (fmt == PIXEL_FORMAT_BGRA8888) {
+		read_native(c, fmt, x, y, w, (uint8_t *)out);
+		return;
+	}
+
+	if (!c->tiles) {
+		const uint32_t px = expand_px(c, fmt, c->fill);
+		for (uint32_t i = 0; i < w; i++)
+			out[i] = px;
+		return;
+	}
+
+	const struct tile *row = &c->tiles[(size_t)(y / TILE_SIZE) * c->tiles_x];
+	const uint32_t row_off = (y % TILE_SIZE) * TILE_SIZE;
+
+	while (w > 0) {
+		const struct tile *t = &row[x / TILE_SIZE];
+		const uint32_t n = min(w, TILE_SIZE - x % TILE_SIZE);
+		const uint32_t off = row_off + x % TILE_SIZE;
+
+		if (t->pixels) {
+			expand(c, fmt, &t->pixels[off * px_size(fmt)], n, out);
+		} else if (t->packed) {
+			uint8_t buf[TILE_SIZE * sizeof(uint32_t)];
+			packed_read(t, px_size(fmt), off, n, buf);
+			expand(c, fmt, buf, n, out);
+		} else {
+			const uint32_t px = expand_px(c, fmt, t->solid);
+			for (uint32_t i = 0; i < n; i++)
+				out[i] = px;
+		}
+
+		out += n;
+		x += n;
+		w -= n;
+	}
+}
+
+static ALWAYS_INLINE void write_span(struct canvas *c,
+    const enum pixel_format fmt, uint32_t x, uint32_t y, uint32_t w,
+    const uint8_t *in)
+{
+	const size_t size = px_size(fmt);
+	const uint32_t row_off = (y % TILE_SIZE) * TILE_SIZE;
+
+	while (w > 0) {
+		const uint32_t n = min(w, TILE_SIZE - x % TILE_SIZE);
+		uint8_t *dst = tile_px_mut(c, tile_at(c, x, y));
+		memcpy(&dst[(row_off + x % TILE_SIZE) * size], in, n * size);
+
+		in += n * size;
+		x += n;
+		w -= n;
+	}
+}
+
+/* Turn one stored pixel into BGRA. */
+static ALWAYS_INLINE uint32_t expand_px(
+    const struct canvas *c, const enum pixel_format fmt, uint32_t px)
+{
+	switch (fmt) {
+	case PIXEL_FORMAT_RGB565:
+		return rgb565_to_bgra(px);
+	case PIXEL_FORMAT_P8:
+		return c->palette[px];
+	default:
+		return px;
+	}
+}
+
+#ifdef __SSE2__
+/* rgb565_to_bgra, four (zero extended) pixels at a time. */
+static ALWAYS_INLINE __m128i rgb565x4_to_bgra(__m128i px)
+{
+	const __m128i mask5 = _mm_set1_epi32(0x1f);
+	const __m128i mask6 = _mm_set1_epi32(0x3f);
+
+	__m128i r = _mm_and_si128(_mm_srli_epi32(px, 11), mask5);
+	__m128i g = _mm_and_si128(_mm_srli_epi32(px, 5), mask6);
+	__m128i b = _mm_and_si128(px, mask5);
+
+	// Replicate the high bits into the low ones so that full intensity
+	// stays full.
+	r = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+	g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 4));
+	b = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+
+	return _mm_or_si128(_mm_or_si128(b, _mm_slli_epi32(g, 8)),
+	    _mm_or_si128(_mm_slli_epi32(r, 16),
+		_mm_set1_epi32((int)0xff000000)));
+}
+#endif
+
+/* Turn `n` stored pixels into BGRA. This is what showing a compact canvas
+ * costs, so RGB565 goes eight pixels at a time where SSE2 is around. Palette
+ * lookups don't vectorize well without gathers, and are cheap enough as is. */
+static ALWAYS_INLINE void expand(const struct canvas *c,
+    const enum pixel_format fmt, const uint8_t *in, size_t n, uint32_t *out)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	if (fmt == PIXEL_FORMAT_RGB565) {
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 8 <= n; i += 8) {
+			const __m128i v =
+			    _mm_loadu_si128((const __m128i *)&in[i * 2]);
+			_mm_storeu_si128((__m128i *)&out[i],
+			    rgb565x4_to_bgra(_mm_unpacklo_epi16(v, zero)));
+			_mm_storeu_si128((__m128i *)&out[i + 4],
+			    rgb565x4_to_bgra(_mm_unpackhi_epi16(v, zero)));
+		}
+	}
+#endif
+
+	if (fmt == PIXEL_FORMAT_BGRA8888) {
+		memcpy(out, in, n * sizeof(uint32_t));
+		return;
+	}
+
+	for (; i < n; i++)
+		out[i] = expand_px(c, fmt, px_load(fmt, in, i));
+}
+
+/* Turn `n` BGRA pixels into the canvas' format. */
+static void convert(
+    struct canvas *c, const uint32_t *in, size_t n, uint8_t *out)
+{
+	switch (c->format) {
+	case PIXEL_FORMAT_BGRA8888:
+		memcpy(out, in, n * sizeof(uint32_t));
+		break;
+	case PIXEL_FORMAT_RGB565:
+		for (size_t i = 0; i < n; i++)
+			px_store(PIXEL_FORMAT_RGB565, out, i,
+			    bgra_to_rgb565(in[i]));
+		break;
+	case PIXEL_FORMAT_P8:
+		// Images tend to repeat the last color, so skip the palette
+		// search when they do.
+		uint32_t last = 0;
+		uint32_t last_idx = PALETTE_SIZE;
+		for (size_t i = 0; i < n; i++) {
+			if (last_idx == PALETTE_SIZE || in[i] != last) {
+				last = in[i];
+				last_idx = palette_index(c, last);
+			}
+			out[i] = last_idx;
+		}
+		break;
+	}
+}
+
+static inline uint32_t pack_color(struct color color)
+{
 	// Color space is little endian, thus the BGRA format used below:
 	uint8_t mapped[4] = { color.b, color.g, color.r, 0xFF };
 
-	size_t off = (c->stride * y) + (x * sizeof(mapped));
-	memcpy(&c->buffer[off], mapped, sizeof(mapped));
+	uint32_t px;
+	memcpy(&px, mapped, sizeof(px));
+	return px;
+}
+
+/* Encode a color the way the canvas stores it. */
+static uint32_t canvas_px(struct canvas *c, struct color color)
+{
+	const uint32_t bgra = pack_color(color);
+
+	switch (c->format) {
+	case PIXEL_FORMAT_RGB565:
+		return bgra_to_rgb565(bgra);
+	case PIXEL_FORMAT_P8:
+		return palette_index(c, bgra);
+	default:
+		return bgra;
+	}
+}
+
+static inline uint32_t bgra_to_rgb565(uint32_t px)
+{
+	return (px >> 8 & 0xf800) | (px >> 5 & 0x07e0) | (px >> 3 & 0x001f);
+}
+
+static inline uint32_t rgb565_to_bgra(uint32_t px)
+{
+	const uint32_t r = px >> 11 & 0x1f;
+	const uint32_t g = px >> 5 & 0x3f;
+	const uint32_t b = px & 0x1f;
+
+	return (b << 3 | b >> 2) | (g << 2 | g >> 4) << 8 |
+	    (r << 3 | r >> 2) << 16 | 0xff000000;
+}
+
+/* Find a color in a P8 canvas' palette, adding it if there's room. Once the
+ * palette is full, the closest color has to do. */
+static uint32_t palette_index(struct canvas *c, uint32_t bgra)
+{
+	bgra |= 0xff000000;
+	for (uint32_t i = 0; i < c->palette_len; i++)
+		if (c->palette[i] == bgra)
+			return i;
+
+	if (c->palette_len < PALETTE_SIZE) {
+		c->palette[c->palette_len++] = bgra;
+		stored_sync(c);
+		return c->palette_len - 1;
+	}
+
+	uint32_t best = 0;
+	uint32_t best_dist = UINT32_MAX;
+	for (uint32_t i = 0; i < PALETTE_SIZE; i++) {
+		uint32_t dist = 0;
+		for (uint32_t shift = 0; shift < 24; shift += 8) {
+			const int32_t d = (int32_t)(bgra >> shift & 0xff) -
+			    (int32_t)(c->palette[i] >> shift & 0xff);
+			dist += d * d;
+		}
+
+		if (dist < best_dist) {
+			best = i;
+			best_dist = dist;
+		}
+	}
+
+	return best;
+}
+
+/* The part of [p, p + len) on resident pages. `len` is at most a block. */
+static size_t resident_bytes(const uint8_t *p, size_t len)
+{
+	const uintptr_t page = sysconf(_SC_PAGESIZE);
+	const uintptr_t start = (uintptr_t)p;
+	const uintptr_t end = start + len;
+	const uintptr_t first = start & ~(page - 1);
+
+	// Enough for a block on 4 KiB pages, however it's aligned.
+	unsigned char vec[POOL_BLOCK_SIZE / 4096 + 1];
+	if (mincore((void *)first, end - first, vec) != 0)
+		return len;
+
+	size_t out = 0;
+	for (uintptr_t at = first, i = 0; at < end; at += page, i++) {
+		if (!(vec[i] & 1))
+			continue;
+
+		const uintptr_t lo = at < start ? start : at;
+		const uintptr_t hi = at + page > end ? end : at + page;
+		out += hi - lo;
+	}
+
+	return out;
+}
+
+static inline size_t tile_bytes(const struct canvas *c)
+{
+	return TILE_AREA * px_size(c->format);
+}
+
+/* Find the tile holding a pixel, splitting the canvas into tiles first if it
+ * hasn't been yet. */
+static struct tile *tile_at(struct canvas *c, uint32_t x, uint32_t y)
+{
+	if (!c->tiles) {
+		const size_t n = (size_t)c->tiles_x * c->tiles_y;
+		c->tiles = malloc(n * sizeof(struct tile));
+		if (!c->tiles)
+			FATAL_ERR("canvas: failed to allocate %zu tiles", n);
+
+		for (size_t i = 0; i < n; i++) {
+			c->tiles[i] = (struct tile) { .solid = c->fill };
+			if (c->stored)
+				*stored_tile(c, &c->tiles[i]) =
+				    (struct stored_tile) { .solid = c->fill };
+		}
+
+		c->bytes += n * sizeof(struct tile);
+		stored_sync(c);
+	}
+
+	return &c->tiles[(size_t)(y / TILE_SIZE) * c->tiles_x + x / TILE_SIZE];
+}
+
+/* Get pixels for the tile that only it uses, which are safe to write. */
+static uint8_t *tile_px_mut(struct canvas *c, struct tile *t)
+{
+	if (t->packed)
+		tile_unpack(c, t);
+
+	tile_dirty(c, t);
+
+	uint8_t *p = t->pixels;
+	if (c->stored) {
+		if (p)
+			return p;
+
+		p = stored_slot(c, t);
+		px_fill(c->format, p, TILE_AREA, t->solid);
+		stored_tile(c, t)->has_pixels = 1;
+
+		c->bytes += tile_bytes(c);
+		c->pixel_tiles++;
+		t->pixels = p;
+		return p;
+	}
+
+	if (p && pool_refs(p) == 1)
+		return p;
+
+	const size_t bytes = tile_bytes(c);
+	uint8_t *q = pool_get(bytes);
+	if (p) {
+		memcpy(q, p, bytes);
+		pool_unref(p);
+	} else {
+		px_fill(c->format, q, TILE_AREA, t->solid);
+
+		c->bytes += bytes;
+		c->pixel_tiles++;
+	}
+
+	t->pixels = q;
+	return q;
+}
+
+static void tile_set_solid(struct canvas *c, struct tile *t, uint32_t px)
+{
+	if (c->stored)
+		*stored_tile(c, t) = (struct stored_tile) { .solid = px };
+
+	if (t->pixels) {
+		if (c->stored)
+			store_discard(t->pixels, tile_bytes(c));
+		else
+			pool_unref(t->pixels);
+
+		c->bytes -= tile_bytes(c);
+		c->pixel_tiles--;
+	}
+
+	if (t->packed) {
+		free(t->packed);
+		c->bytes -= t->packed_len;
+		c->packed_bytes -= t->packed_len;
+		c->packed_tiles--;
+	}
+
+	*t = (struct tile) { .solid = px };
+}
+
+/* Run-length encode a tile's pixels, which suits the flat colors most panes are
+ * made of. Tiles that turn out to be one color become solid, and ones that
+ * barely shrink are left alone. */
+static void tile_pack(struct canvas *c, struct tile *t)
+{
+	const enum pixel_format fmt = c->format;
+	const size_t size = px_size(fmt);
+	const uint8_t *px = t->pixels;
+	const size_t n = TILE_AREA;
+
+	// Worst case, everything is one big literal.
+	uint8_t buf[(TILE_AREA / PACK_MAX_PACKET + 1) * 2 +
+	    sizeof(uint32_t) * TILE_AREA];
+	size_t len = 0;
+
+	for (size_t i = 0; i < n;) {
+		size_t run = 1;
+		while (i + run < n && run < PACK_MAX_PACKET &&
+		    px_load(fmt, px, i + run) == px_load(fmt, px, i))
+			run++;
+
+		if (run == n) {
+			tile_set_solid(c, t, px_load(fmt, px, 0));
+			return;
+		}
+
+		if (run >= 3) {
+			uint16_t header = PACK_RUN | (run - 1);
+			memcpy(&buf[len], &header, sizeof(header));
+			memcpy(&buf[len + 2], &px[i * size], size);
+			len += 2 + size;
+			i += run;
+			continue;
+		}
+
+		// Collect literals up to the next worthwhile run.
+		size_t lit = 0;
+		while (i + lit < n && lit < PACK_MAX_PACKET) {
+			const uint32_t v = px_load(fmt, px, i + lit);
+			if (i + lit + 2 < n &&
+			    v == px_load(fmt, px, i + lit + 1) &&
+			    v == px_load(fmt, px, i + lit + 2))
+				break;
+			lit++;
+		}
+
+		uint16_t header = lit - 1;
+		memcpy(&buf[len], &header, sizeof(header));
+		memcpy(&buf[len + 2], &px[i * size], lit * size);
+		len += 2 + lit * size;
+		i += lit;
+	}
+
+	if (len + PACK_MIN_SAVINGS > tile_bytes(c))
+		return;
+
+	uint8_t *packed = malloc(len);
+	if (!packed)
+		return; // not worth dying over
+
+	memcpy(packed, buf, len);
+
+	pool_unref(t->pixels);
+	t->pixels = NULL;
+	t->packed = packed;
+	t->packed_len = len;
+
+	c->bytes += len;
+	c->bytes -= tile_bytes(c);
+	c->packed_bytes += len;
+	c->pixel_tiles--;
+	c->packed_tiles++;
+}
+
+static void tile_unpack(struct canvas *c, struct tile *t)
+{
+	uint8_t *p = pool_get(tile_bytes(c));
+	packed_read(t, px_size(c->format), 0, TILE_AREA, p);
+
+	c->bytes -= t->packed_len;
+	c->bytes += tile_bytes(c);
+	c->packed_bytes -= t->packed_len;
+	c->packed_tiles--;
+	c->pixel_tiles++;
+
+	free(t->packed);
+	t->packed = NULL;
+	t->packed_len = 0;
+	t->pixels = p;
+}
+
+/* Decode `n` pixels of `size` bytes each, starting `off` pixels into a packed
+ * tile. */
+static void packed_read(const struct tile *t, size_t size, uint32_t off,
+    uint32_t n, uint8_t *out)
+{
+	const uint8_t *cur = t->packed;
+	uint32_t pos = 0; // pixel index at `cur`
+
+	while (n > 0) {
+		uint16_t header;
+		memcpy(&header, cur, sizeof(header));
+
+		const bool is_run = header & PACK_RUN;
+		const uint32_t count = (header & ~PACK_RUN) + 1;
+		const uint8_t *data = cur + sizeof(header);
+		cur = data + (is_run ? 1 : count) * size;
+
+		if (pos + count <= off) {
+			pos += count;
+			continue;
+		}
+
+		const uint32_t skip = off > pos ? off - pos : 0;
+		const uint32_t take = min(count - skip, n);
+		if (is_run) {
+			for (uint32_t i = 0; i < take; i++)
+				memcpy(&out[i * size], data, size);
+		} else {
+			memcpy(out, &data[skip * size], take * size);
+		}
+
+		out += take * size;
+		n -= take;
+		pos += count;
+		off = pos;
+	}
+}
+
+static void tiles_release(struct canvas *c)
+{
+	if (!c->tiles)
+		return;
+
+	const size_t n = (size_t)c->tiles_x * c->tiles_y;
+	for (size_t i = 0; i < n; i++) {
+		if (c->tiles[i].pixels && c->stored)
+			store_discard(c->tiles[i].pixels, tile_bytes(c));
+		else if (c->tiles[i].pixels)
+			pool_unref(c->tiles[i].pixels);
+		free(c->tiles[i].packed);
+	}
+
+	free(c->tiles);
+	c->tiles = NULL;
+	c->bytes = 0;
+	c->pixel_tiles = 0;
+	c->packed_tiles = 0;
+	c->packed_bytes = 0;
+}
+
+static inline struct stored_tile *stored_tile(
+    const struct canvas *c, const struct tile *t)
+{
+	struct stored_tile *tiles = (struct stored_tile *)((uint8_t *)c->stored +
+	    c->stored->tiles_offset);
+	return &tiles[t - c->tiles];
+}
+
+static inline uint8_t *stored_slot(const struct canvas *c, const struct tile *t)
+{
+	return (uint8_t *)c->stored + c->stored->slots_offset +
+	    (size_t)(t - c->tiles) * tile_bytes(c);
+}
+
+/* Write the canvas-wide state through to its file, if it has one. */
+static void stored_sync(struct canvas *c)
+{
+	if (!c->stored)
+		return;
+
+	c->stored->fill = c->fill;
+	c->stored->split = c->tiles != NULL;
+	c->stored->palette_len = c->palette_len;
+}
+
+static inline void tile_dirty(struct canvas *c, const struct tile *t)
+{
+	const size_t i = t - c->tiles;
+	c->dirty[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static inline size_t dirty_words(const struct canvas *c)
+{
+	return ((size_t)c->tiles_x * c->tiles_y + 63) / 64;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <dirent.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -47,16 +48,181 @@ struct triangle {
 	struct color c;
 };
 
+/* How a canvas stores its pixels. Whatever the format, pixels go in and out of
+ * the canvas (through canvas_read_span, blits and so on) as BGRA.
+ *
+ * RGB565 drops the low bits of each channel. P8 keeps a palette of the first
+ * 256 colors drawn, and maps any color after that to the nearest one in it. */
+enum pixel_format {
+	PIXEL_FORMAT_BGRA8888,
+	PIXEL_FORMAT_RGB565,
+	PIXEL_FORMAT_P8,
+};
+
+/* Byte order of raw pixels moved in or out of a canvas. */
+enum pixel_order {
+	PIXEL_BGRA,
+	PIXEL_RGBA,
+};
+
+/* Copy raw pixels at `src` onto the canvas. Rows are `stride` bytes apart and
+ * the alpha channel is ignored. */
+struct blit {
+	uint16_t x, y, w, h;
+	enum pixel_order order;
+	size_t stride;
+	const uint8_t *src;
+};
+
+/* Copy a region of the canvas out to `dst`, the reverse of a blit. Alpha is
+ * written as 0xff. Clipped rows and columns are left untouched. */
+struct readback {
+	uint16_t x, y, w, h;
+	enum pixel_order order;
+	size_t stride;
+	uint8_t *dst;
+};
+
+/* Canvases are stored as square tiles this many pixels on a side. A tile is
+ * either a single color or its own block of pixels in the canvas' format. */
+#define TILE_SIZE 64
+
+struct tile;
+struct stored_canvas;
+
 struct canvas {
 	uint16_t width, height;
-	uint32_t stride;
-	uint8_t *buffer;
+	uint16_t tiles_x, tiles_y;
+	enum pixel_format format;
+
+	// Row-major, or null while every pixel is `fill` (e.g., after
+	// rendering_fill). Like every stored pixel, `fill` is in `format`.
+	struct tile *tiles;
+	uint32_t fill;
+
+	// BGRA colors for P8 pixels, and how many are in use. Null otherwise.
+	uint32_t *palette;
+	uint16_t palette_len;
+
+	// Heap bytes held by the tiles, counting shared pixels in full.
+	size_t bytes;
+
+	// How many tiles have pixels of their own, and how many are packed.
+	size_t pixel_tiles;
+	size_t packed_tiles;
+	size_t packed_bytes;
+
+	// For canvases kept in a file (see store.h), the file's mapping. Tiles
+	// with pixels use their fixed slot in it rather than the pool, and
+	// every change is written through. Null otherwise.
+	struct stored_canvas *stored;
+
+	// One bit per tile drawn to since canvas_take_dirty last ran. If
+	// `all_dirty`, the fill or the whole canvas may have changed too.
+	uint64_t *dirty;
+	bool all_dirty;
 };
 
+struct canvas *canvas_init(
+    uint16_t width, uint16_t height, enum pixel_format);
+
 struct canvas *canvas_init_bgra(uint16_t width, uint16_t height);
 
+/* Make a canvas out of a mapped canvas file, taking ownership of it unless this
+ * fails. Only the tile states are read; the pixels stay where they are. */
+struct canvas *canvas_init_stored(struct stored_canvas *);
+
+/* Parse a format's name (e.g., "RGB565"), returning false if it isn't one. */
+bool pixel_format_parse(const char *, enum pixel_format *out);
+
+const char *pixel_format_str(enum pixel_format);
+
+/* Bytes per pixel. */
+size_t pixel_format_size(enum pixel_format);
+
+/* Make a canvas that shares the pixels of another. Tiles are copied only when
+ * either canvas draws to them, so this is cheap, and the clone can be read
+ * from without any locks while the original is drawn to. */
+struct canvas *canvas_clone(const struct canvas *);
+
 void canvas_deinit(struct canvas *);
 
+struct delta_tile {
+	uint32_t index; // row-major
+	uint32_t solid;
+	uint8_t *pixels; // a pool block, or null if the tile is `solid`
+};
+
+/* The tiles of a canvas that changed between two calls to canvas_take_dirty,
+ * or all of them if `full`. */
+struct canvas_delta {
+	uint16_t width, height;
+	enum pixel_format format;
+	bool full;
+
+	// Only used if `full`. Tiles that aren't listed are `fill`, as are all
+	// of them unless `split`.
+	uint32_t fill;
+	bool split;
+
+	// P8 palettes are always included whole. Null for other formats.
+	uint32_t *palette;
+	uint16_t palette_len;
+
+	size_t num_tiles;
+	struct delta_tile tiles[];
+};
+
+/* Copy out what changed since the last call, or everything if `full`, and
+ * start over. Pixels are shared copy-on-write as with canvas_clone, so this is
+ * cheap, and the delta can be used without any locks. A canvas that was filled
+ * (or is new) since the last call always gives a full delta. */
+struct canvas_delta *canvas_take_dirty(struct canvas *, bool full);
+
+/* Replay a delta onto a canvas of the same size and format. Deltas read back
+ * from files needn't be trusted: anything out of range is masked or skipped. */
+void canvas_apply_delta(struct canvas *, const struct canvas_delta *);
+
+void canvas_delta_free(struct canvas_delta *);
+
+/* Where a canvas goes on a frame, which may be larger than it. Whatever the
+ * canvas doesn't cover shows `background`, and whatever hangs off the frame is
+ * cut off. */
+struct placement {
+	uint16_t x, y;
+	struct color background;
+};
+
+/* Read `w` BGRA pixels starting at (x, y), which must all be on the canvas. */
+void canvas_read_span(const struct canvas *, uint16_t x, uint16_t y,
+    uint16_t w, uint32_t *out);
+
+/* Read `rows` whole rows starting at `y` as RGBA, like SAVE writes them. `out`
+ * needs to be 4-byte aligned. */
+void canvas_read_rgba(
+    const struct canvas *, uint16_t y, uint16_t rows, uint8_t *out);
+
+/* Read row `y` of a frame `frame_width` pixels wide with the canvas placed on
+ * it, as BGRA. */
+void canvas_compose_span(const struct canvas *, const struct placement *,
+    uint16_t y, uint16_t frame_width, uint32_t *out);
+
+/* Write out a whole `frame_width` x `frame_height` frame with the canvas placed
+ * on it, as BGRA rows `stride` bytes apart. */
+void canvas_materialize(const struct canvas *, const struct placement *,
+    uint16_t frame_width, uint16_t frame_height, uint8_t *dst, size_t stride);
+
+/* Compress every tile that has pixels of its own. Packed tiles still read
+ * correctly, only slower, and drawing to one unpacks it. */
+void canvas_pack(struct canvas *);
+
+/* Undo canvas_pack, e.g., ahead of showing the canvas. */
+void canvas_unpack(struct canvas *);
+
+/* How much of `bytes` is actually in memory, going by mincore(2) for pixel
+ * blocks. Everything else is small enough to count as resident. */
+size_t canvas_resident(const struct canvas *);
+
 void rendering_fill(struct canvas *, struct color);
 
 #define DECL_RENDERING_FNS(type)                                          \
@@ -69,6 +235,8 @@ DECL_RENDERING_FNS(line)
 DECL_RENDERING_FNS(rect_copy)
 DECL_RENDERING_FNS(bezier2)
 DECL_RENDERING_FNS(triangle)
+DECL_RENDERING_FNS(blit)
+DECL_RENDERING_FNS(readback)
 
 void rendering_dump_bgra_to_rgba(
     const struct canvas *c, DIR *dir, const char *dirpath, const char *path);
@@ -0,0 +1,70 @@
+#include "copy.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CACHE_LINE 64
+
+void copy_to_wc(void *restrict dst, const void *restrict src, size_t n)
+{
+	copy_to_wc_unfenced(dst, src, n);
+	copy_to_wc_fence();
+}
+
+void copy_to_wc_unfenced(
+    void *restrict dst, const void *restrict src, size_t n)
+{
+#ifdef __SSE2__
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+
+	// Get the destination onto a cache line boundary. Partial lines still
+	// go through the write-combining buffers, they just don't get the
+	// benefit of a full-line burst. Dumb buffers are page aligned, so this
+	// is normally a no-op.
+	size_t head = (CACHE_LINE - ((uintptr_t)d & (CACHE_LINE - 1))) &
+	    (CACHE_LINE - 1);
+	if (head > n)
+		head = n;
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+
+	// Fill whole lines at a time. Each group of four 16-byte streaming
+	// stores completes one line, which the CPU can then flush as a single
+	// burst without ever pulling the line into cache.
+	for (; n >= CACHE_LINE; n -= CACHE_LINE) {
+		const __m128i a = _mm_loadu_si128((const __m128i *)(s + 0));
+		const __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+		const __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+		const __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+
+		_mm_stream_si128((__m128i *)(d + 0), a);
+		_mm_stream_si128((__m128i *)(d + 16), b);
+		_mm_stream_si128((__m128i *)(d + 32), c);
+		_mm_stream_si128((__m128i *)(d + 48), e);
+
+		d += CACHE_LINE;
+		s += CACHE_LINE;
+	}
+
+	memcpy(d, s, n);
+#else
+	memcpy(dst, src, n);
+#endif
+}
+
+void copy_to_wc_fence(void)
+{
+#ifdef __SSE2__
+	// Streaming stores are weakly ordered; make sure they're all visible
+	// before anyone (e.g., the display engine after a page flip) looks.
+	_mm_sfence();
+#endif
+}
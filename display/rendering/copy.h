@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Copy `n` bytes into memory that is mapped write-combined or uncached, such
+ * as a DRM dumb buffer. The destination is never read, and whole cache lines
+ * are written with non-temporal stores where the target supports them. The
+ * regions must not overlap. */
+void copy_to_wc(void *restrict dst, const void *restrict src, size_t n);
+
+/* The same, without making the stores visible to other agents yet, for copying
+ * a frame a piece at a time. Call copy_to_wc_fence after the last piece. */
+void copy_to_wc_unfenced(
+    void *restrict dst, const void *restrict src, size_t n);
+
+/* Order every copy_to_wc_unfenced so far before any later store. */
+void copy_to_wc_fence(void);
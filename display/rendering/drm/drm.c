@@ -1,5 +1,8 @@
 #include "../../abort.h"
+#include "../../trace.h"
 #include "../canvas.h"
+#include "../copy.h"
+#include "../rendering.h"
 
 #include <assert.h>
 #include <dirent.h>
@@ -8,12 +11,15 @@
 #include <drm_mode.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -23,6 +29,13 @@ typedef uint32_t crtc_id_t;
 typedef uint32_t plane_id_t;
 typedef uint32_t buf_id_t;
 
+/* The number of dumb buffers owned by the present thread. One is on screen,
+one may be waiting on a page flip, and one sits in the mailbox, so a producer
+always finds a buffer it can write to without waiting on the display. */
+#define NUM_BUFS 3
+
+static_assert(NUM_BUFS >= 3, "the mailbox needs at least three buffers");
+
 struct rendering_ctx;
 
 /* A series of functions called by rendering_init that fatally error on failure,
@@ -34,17 +47,34 @@ static void init_crtc(struct rendering_ctx *);
 static void init_mode(struct rendering_ctx *);
 static void init_plane(struct rendering_ctx *);
 static void init_buf(struct rendering_ctx *, size_t);
+static void init_present(struct rendering_ctx *);
+
+static void *present_thread(void *);
+static void wait_for_flip(struct rendering_ctx *);
+static uint64_t now_ns(void);
+static void handle_flip(int fd, unsigned int sequence, unsigned int tv_sec,
+    unsigned int tv_usec, void *user_data);
 
 static card_fd_t find_card(void);
 static void require_dumb_buffers(card_fd_t);
 static void require_universal_planes(card_fd_t);
 static bool is_primary_plane(struct rendering_ctx *, plane_id_t plane_id);
 
+enum buffer_state {
+	BUF_FREE,     // nobody is using it
+	BUF_DRAWING,  // rendering_show is copying a canvas into it
+	BUF_QUEUED,   // sitting in the mailbox, waiting for the present thread
+	BUF_FLIPPING, // handed to the kernel, waiting for the flip to complete
+	BUF_FRONT,    // currently being scanned out
+};
+
 struct buffer {
 	buf_id_t id;
 	uint32_t stride;
 	uint64_t size;
 	uint8_t *data;
+
+	enum buffer_state state;
 };
 
 struct rendering_ctx {
@@ -58,12 +88,35 @@ struct rendering_ctx {
 	drmModePlane *plane;
 
 	size_t front_buf_idx;
-	struct buffer bufs[2];
+	struct buffer bufs[NUM_BUFS];
+
+	// Canvases are tiled, so each row is gathered here before being
+	// streamed into a dumb buffer. Only used by rendering_show.
+	uint32_t *row;
+
+	// The mailbox: at most one finished frame waiting to be flipped. A
+	// newer frame replaces an older one that hasn't been picked up yet.
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	ssize_t queued_buf_idx; // -1 if the mailbox is empty
+	bool stopping;
+	pthread_t present_handle;
+
+	// Set by handle_flip from within drmHandleEvent.
+	bool flip_done;
+
+	// Protected by `lock`.
+	struct present_stats stats;
 };
 
-void *drm_rendering_init(void)
+void *drm_rendering_init(const struct rendering_opts *)
 {
+	// The display mode decides the frame size, so there's nothing to use
+	// from the options.
 	struct rendering_ctx *ctx = malloc(sizeof(struct rendering_ctx));
+	if (!ctx)
+		FATAL_ERR("drm: failed to allocate rendering ctx");
+
 	ctx->front_buf_idx = 0;
 
 	init_card(ctx);
@@ -72,8 +125,19 @@ void *drm_rendering_init(void)
 	init_crtc(ctx);
 	init_mode(ctx);
 	init_plane(ctx);
-	init_buf(ctx, 0);
-	init_buf(ctx, 1);
+	for (size_t i = 0; i < NUM_BUFS; i++)
+		init_buf(ctx, i);
+
+	ctx->row = malloc((size_t)ctx->mode.hdisplay * sizeof(uint32_t));
+	if (!ctx->row)
+		FATAL_ERR("drm: failed to allocate row buffer");
+
+	// Whatever the CRTC shows right now isn't ours, but treat the first
+	// buffer as the front so that it's never written while (eventually)
+	// being scanned out.
+	ctx->bufs[ctx->front_buf_idx].state = BUF_FRONT;
+
+	init_present(ctx);
 
 	return ctx;
 }
@@ -84,6 +148,25 @@ void drm_rendering_cleanup(void *r_ctx)
 
 	int r;
 
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stopping = true;
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	r = pthread_join(ctx->present_handle, NULL);
+	if (r != 0)
+		FATAL_ERR("drm: failed to join present thread: %s", strerror(r));
+
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->lock);
+
+	for (size_t i = 0; i < NUM_BUFS; i++) {
+		if (munmap(ctx->bufs[i].data, ctx->bufs[i].size) != 0)
+			FATAL_ERR("failed to unmap buffer: %s", STR_ERR);
+	}
+
+	free(ctx->row);
+
 	drmModeFreePlane(ctx->plane);
 	drmModeFreeCrtc(ctx->crtc);
 	drmModeFreeConnector(ctx->conn);
@@ -102,42 +185,106 @@ void drm_rendering_ctx_log(const void *r_ctx)
 
 	fprintf(stderr, "CRTC:\t%d\n", ctx->crtc->crtc_id);
 	fprintf(stderr, "Plane:\t%d\n", ctx->plane->plane_id);
-	fprintf(stderr, "Buffer:\t%d (front), %d (back)\n",
-	    ctx->bufs[ctx->front_buf_idx].id,
-	    ctx->bufs[1 ^ ctx->front_buf_idx].id);
+	fprintf(stderr, "Buffers:");
+	for (size_t i = 0; i < NUM_BUFS; i++)
+		fprintf(stderr, "\t%d%s", ctx->bufs[i].id,
+		    i == ctx->front_buf_idx ? " (front)" : "");
+	fprintf(stderr, "\n");
 	fprintf(stderr, "Mode:\t%dx%d @ %dHz\n", ctx->mode.hdisplay,
 	    ctx->mode.vdisplay, ctx->mode.vrefresh);
 }
 
-void drm_rendering_show(void *r_ctx, struct canvas *c)
+void drm_rendering_show(
+    void *r_ctx, struct canvas *c, const struct placement *pl)
 {
+	// This never waits on the display: we copy into a buffer nobody else is
+	// using, drop it in the mailbox, and let the present thread deal with
+	// page flips. Only one thread may call this at a time.
 	struct rendering_ctx *ctx = r_ctx;
 
-	struct buffer back = ctx->bufs[1 ^ ctx->front_buf_idx];
-	memcpy(back.data, c->buffer, back.size);
+	pthread_mutex_lock(&ctx->lock);
 
-	while (drmModePageFlip(ctx->card_fd, ctx->crtc->crtc_id, back.id, 0, NULL) != 0) {
-		if (errno != EBUSY)
-			FATAL_ERR("drmModePageFlip failed: %s", STR_ERR);
+	ssize_t idx = -1;
+	for (size_t i = 0; i < NUM_BUFS; i++) {
+		if (ctx->bufs[i].state == BUF_FREE) {
+			idx = i;
+			break;
+		}
+	}
+
+	// Every other buffer is on screen or about to be, so take back the
+	// frame in the mailbox. We're about to replace it anyway.
+	if (idx < 0 && ctx->queued_buf_idx >= 0) {
+		idx = ctx->queued_buf_idx;
+		ctx->queued_buf_idx = -1;
+		ctx->stats.dropped++;
+	}
+
+	if (idx < 0)
+		FATAL_ERR("drm: no buffer available; is rendering_show being "
+			  "called concurrently?");
+
+	struct buffer *back = &ctx->bufs[idx];
+	back->state = BUF_DRAWING;
+	pthread_mutex_unlock(&ctx->lock);
+
+	const uint64_t span = trace_begin();
+	const uint16_t width = ctx->mode.hdisplay;
+	for (uint16_t y = 0; y < ctx->mode.vdisplay; y++) {
+		canvas_compose_span(c, pl, y, width, ctx->row);
+		copy_to_wc_unfenced(&back->data[(size_t)back->stride * y],
+		    ctx->row, (size_t)width * sizeof(uint32_t));
+	}
+
+	// Once for the whole frame, before the present thread can flip to it.
+	copy_to_wc_fence();
+	trace_end(span, "copy");
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->queued_buf_idx >= 0) {
+		// The newest frame wins.
+		ctx->bufs[ctx->queued_buf_idx].state = BUF_FREE;
+		ctx->stats.dropped++;
 	}
 
-	// We now have a new front buffer.
-	ctx->front_buf_idx ^= 1;
+	back->state = BUF_QUEUED;
+	ctx->queued_buf_idx = idx;
+	ctx->stats.queued++;
+	ctx->stats.copied_bytes +=
+	    (size_t)width * ctx->mode.vdisplay * sizeof(uint32_t);
+
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
 }
 
-struct canvas *drm_canvas_init(void *r_ctx)
+void drm_rendering_stats(void *r_ctx, struct present_stats *out)
 {
 	struct rendering_ctx *ctx = r_ctx;
 
-	struct buffer front = ctx->bufs[ctx->front_buf_idx];
+	pthread_mutex_lock(&ctx->lock);
+	*out = ctx->stats;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+void drm_rendering_size(
+    const void *r_ctx, uint16_t *width, uint16_t *height)
+{
+	const struct rendering_ctx *ctx = r_ctx;
+
+	*width = ctx->mode.hdisplay;
+	*height = ctx->mode.vdisplay;
+}
+
+size_t drm_rendering_memory(const void *r_ctx)
+{
+	const struct rendering_ctx *ctx = r_ctx;
 
-	struct canvas *ret = malloc(sizeof(struct canvas));
-	ret->width = ctx->mode.hdisplay;
-	ret->height = ctx->mode.vdisplay;
-	ret->stride = front.stride;
-	ret->buffer = malloc(front.size);
+	// The dumb buffers, and the row that's composed before copying.
+	size_t out = (size_t)ctx->mode.hdisplay * sizeof(uint32_t);
+	for (size_t i = 0; i < NUM_BUFS; i++)
+		out += ctx->bufs[i].size;
 
-	return ret;
+	return out;
 }
 
 static void init_card(struct rendering_ctx *ctx)
@@ -275,8 +422,127 @@ static void init_buf(struct rendering_ctx *ctx, size_t idx)
 	target->data = mmap(0, fb_create.size, PROT_READ | PROT_WRITE,
 	    MAP_SHARED, ctx->card_fd, offset);
 
-	if (!target->data)
+	if (target->data == MAP_FAILED)
 		FATAL_ERR("Couldn't map frame buffer.");
+
+	target->state = BUF_FREE;
+}
+
+static void init_present(struct rendering_ctx *ctx)
+{
+	int r;
+
+	ctx->queued_buf_idx = -1;
+	ctx->stopping = false;
+	ctx->stats = (struct present_stats) {
+		.refresh_hz = ctx->mode.vrefresh,
+	};
+
+	if ((r = pthread_mutex_init(&ctx->lock, NULL)) != 0)
+		FATAL_ERR("drm: pthread_mutex_init failed: %s", strerror(r));
+
+	if ((r = pthread_cond_init(&ctx->cond, NULL)) != 0)
+		FATAL_ERR("drm: pthread_cond_init failed: %s", strerror(r));
+
+	r = pthread_create(&ctx->present_handle, NULL, present_thread, ctx);
+	if (r != 0)
+		FATAL_ERR("drm: failed to spawn present thread: %s",
+		    strerror(r));
+}
+
+static void *present_thread(void *arg)
+{
+	struct rendering_ctx *ctx = arg;
+
+	trace_thread_name("drm present");
+
+	// A flip that takes more than a frame and a half to come back missed
+	// the vblank it was meant for.
+	const uint64_t late_ns =
+	    ctx->mode.vrefresh ? 1500000000 / ctx->mode.vrefresh : 0;
+
+	for (;;) {
+		pthread_mutex_lock(&ctx->lock);
+		while (!ctx->stopping && ctx->queued_buf_idx < 0)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+
+		if (ctx->stopping) {
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+
+		size_t idx = ctx->queued_buf_idx;
+		ctx->queued_buf_idx = -1;
+		ctx->bufs[idx].state = BUF_FLIPPING;
+		pthread_mutex_unlock(&ctx->lock);
+
+		const uint64_t span = trace_begin();
+		const uint64_t flip_start = now_ns();
+		ctx->flip_done = false;
+		while (drmModePageFlip(ctx->card_fd, ctx->crtc->crtc_id,
+			   ctx->bufs[idx].id, DRM_MODE_PAGE_FLIP_EVENT, ctx) !=
+		    0) {
+			if (errno != EBUSY)
+				FATAL_ERR(
+				    "drmModePageFlip failed: %s", STR_ERR);
+		}
+
+		wait_for_flip(ctx);
+		trace_end(span, "flip");
+		const uint64_t wait = now_ns() - flip_start;
+
+		// We now have a new front buffer, and the old one is free to
+		// be drawn into.
+		pthread_mutex_lock(&ctx->lock);
+		ctx->bufs[ctx->front_buf_idx].state = BUF_FREE;
+		ctx->bufs[idx].state = BUF_FRONT;
+		ctx->front_buf_idx = idx;
+		ctx->stats.presented++;
+		ctx->stats.flip_wait_ns += wait;
+		ctx->stats.late += late_ns && wait > late_ns;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	return NULL;
+}
+
+static void wait_for_flip(struct rendering_ctx *ctx)
+{
+	drmEventContext ev = {
+		.version = 2,
+		.page_flip_handler = handle_flip,
+	};
+
+	struct pollfd fd = {
+		.fd = ctx->card_fd,
+		.events = POLLIN,
+	};
+
+	while (!ctx->flip_done) {
+		if (poll(&fd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			FATAL_ERR("drm: poll failed: %s", STR_ERR);
+		}
+
+		if (drmHandleEvent(ctx->card_fd, &ev) != 0)
+			FATAL_ERR("drmHandleEvent failed: %s", STR_ERR);
+	}
+}
+
+static void handle_flip(int, unsigned int, unsigned int, unsigned int,
+    void *user_data)
+{
+	struct rendering_ctx *ctx = user_data;
+	ctx->flip_done = true;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 static card_fd_t find_card(void)
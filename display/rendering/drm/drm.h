@@ -1,10 +1,15 @@
 #pragma once
 
 #include "../canvas.h"
+#include "../rendering.h"
 #include "input.h"
 
-void *drm_rendering_init(void);
+void *drm_rendering_init(const struct rendering_opts *);
 void drm_rendering_cleanup(void *drm_ctx);
 void drm_rendering_ctx_log(const void *drm_ctx);
-void drm_rendering_show(void *drm_ctx, struct canvas *);
-struct canvas *drm_canvas_init(void *drm_ctx);
+void drm_rendering_show(
+    void *drm_ctx, struct canvas *, const struct placement *);
+void drm_rendering_stats(void *drm_ctx, struct present_stats *);
+void drm_rendering_size(
+    const void *drm_ctx, uint16_t *width, uint16_t *height);
+size_t drm_rendering_memory(const void *drm_ctx);
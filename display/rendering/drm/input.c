@@ -53,8 +53,14 @@ static void switch_to_tty(struct eloop_ctx *, uint32_t id);
 static bool scan_poll(struct eloop_ctx *);
 static void *event_loop(void *arg);
 
+/* Read and act on a single event from an input device. */
+static void handle_event(struct eloop_ctx *, int fd);
+
+/* Connect to logind and grab every input device. */
+static void open_inputs(struct eloop_ctx *);
+
 /* Iterate through /dev/input and put all the requisite fd's (including
- * cancellation) into eloop_ctx. */
+ * cancellation, if there is one) into eloop_ctx. */
 static void gather_fds(struct eloop_ctx *);
 
 static void cleanup(struct eloop_ctx *);
@@ -63,39 +69,15 @@ void *drm_input_thread(void *arg)
 {
 	arg_use = arg; // shut clang up :)
 
-	// make sure we don't grab a key while it's pressed
-	const struct timespec ts = {
-		.tv_sec = 0,
-		.tv_nsec = 1000,
-	};
-
-	nanosleep(&ts, NULL);
-
-	// Assume only 1 seat and that sessions are never created or destroyed.
-	// This latter assumption will break in fun and silly ways.
-
-	int r;
-	sd_bus *bus = NULL;
-
-	r = sd_bus_default_system(&bus);
-	if (r < 0)
-		FATAL_ERR("Couldn't open dbus: %s", strerror(-r));
-
-	char *seat = read_seat(bus);
-	struct sessions sessions = read_sessions(bus, seat);
-
 	int cancellation_pipe[2];
 	if (pipe(cancellation_pipe) != 0)
 		FATAL_ERR("loading pipe failed: %s", STR_ERR);
 
 	struct eloop_ctx ctx = {
-		.sessions = sessions,
-		.bus = bus,
-		.seat = seat,
 		.cancellation_fd = cancellation_pipe[0],
 	};
 
-	gather_fds(&ctx);
+	open_inputs(&ctx);
 
 	pthread_t eloop_thread;
 	pthread_create(&eloop_thread, NULL, event_loop, &ctx);
@@ -114,6 +96,70 @@ void *drm_input_thread(void *arg)
 	return NULL;
 }
 
+void *drm_input_open(int *fds, size_t *numfds, size_t max)
+{
+	struct eloop_ctx *ctx = malloc(sizeof(struct eloop_ctx));
+	if (!ctx)
+		FATAL_ERR("input: failed to allocate ctx");
+
+	ctx->cancellation_fd = -1;
+	open_inputs(ctx);
+
+	if (ctx->numfds > max)
+		FATAL_ERR("Too many inputs.");
+
+	for (size_t i = 0; i < ctx->numfds; i++)
+		fds[i] = ctx->fds[i].fd;
+	*numfds = ctx->numfds;
+
+	return ctx;
+}
+
+void drm_input_dispatch(void *i_ctx, int fd)
+{
+	handle_event(i_ctx, fd);
+}
+
+void drm_input_close(void *i_ctx)
+{
+	struct eloop_ctx *ctx = i_ctx;
+
+	for (size_t i = 0; i < ctx->numfds; i++) {
+		ioctl(ctx->fds[i].fd, EVIOCGRAB, 0);
+	}
+
+	switch_to_tty(ctx, 3);
+	cleanup(ctx);
+	free(ctx);
+}
+
+static void open_inputs(struct eloop_ctx *ctx)
+{
+	// make sure we don't grab a key while it's pressed
+	const struct timespec ts = {
+		.tv_sec = 0,
+		.tv_nsec = 1000,
+	};
+
+	nanosleep(&ts, NULL);
+
+	// Assume only 1 seat and that sessions are never created or destroyed.
+	// This latter assumption will break in fun and silly ways.
+
+	int r;
+	sd_bus *bus = NULL;
+
+	r = sd_bus_default_system(&bus);
+	if (r < 0)
+		FATAL_ERR("Couldn't open dbus: %s", strerror(-r));
+
+	ctx->bus = bus;
+	ctx->seat = read_seat(bus);
+	ctx->sessions = read_sessions(bus, ctx->seat);
+
+	gather_fds(ctx);
+}
+
 static char *read_seat(sd_bus *bus)
 {
 	int r;
@@ -258,37 +304,41 @@ static bool scan_poll(struct eloop_ctx *ctx)
 		if (ctx->fds[i].fd == ctx->cancellation_fd)
 			return true;
 
-		struct input_event event;
-		int r = read(ctx->fds[i].fd, &event, sizeof(event));
-		if (r < 0) {
-			fprintf(stderr, "input: failed to read event: %s\n",
-			    STR_ERR);
-			continue;
-		}
+		handle_event(ctx, ctx->fds[i].fd);
+	}
 
-		if (r != sizeof(event))
-			FATAL_ERR("Couldn't fill event buffer.");
+	return false;
+}
 
-		if (event.type != EV_KEY)
-			continue;
+static void handle_event(struct eloop_ctx *ctx, int fd)
+{
+	struct input_event event;
+	int r = read(fd, &event, sizeof(event));
+	if (r < 0) {
+		fprintf(stderr, "input: failed to read event: %s\n", STR_ERR);
+		return;
+	}
 
-		if (event.value != EV_KEY) // release
-			continue;
+	if (r != sizeof(event))
+		FATAL_ERR("Couldn't fill event buffer.");
 
-		if (event.code == KEY_SPACE) {
-			kill(getpid(), SIGINT);
-			continue;
-		}
+	if (event.type != EV_KEY)
+		return;
 
-		if (event.code >= KEY_1 && event.code <= KEY_0) {
-			uint32_t target =
-			    event.code == KEY_0 ? 0 : event.code - KEY_1 + 1;
+	if (event.value != EV_KEY) // release
+		return;
 
-			switch_to_tty(ctx, target);
-		}
+	if (event.code == KEY_SPACE) {
+		kill(getpid(), SIGINT);
+		return;
 	}
 
-	return false;
+	if (event.code >= KEY_1 && event.code <= KEY_0) {
+		uint32_t target =
+		    event.code == KEY_0 ? 0 : event.code - KEY_1 + 1;
+
+		switch_to_tty(ctx, target);
+	}
 }
 
 static void *event_loop(void *arg)
@@ -325,7 +375,7 @@ static void gather_fds(struct eloop_ctx *ctx)
 	struct dirent *dir;
 
 	for (;;) {
-		if (ctx->numfds >= MAX_INPUT)
+		if (ctx->numfds >= MAX_INPUTS)
 			FATAL_ERR("Too many inputs.");
 
 		errno = 0;
@@ -368,13 +418,16 @@ static void gather_fds(struct eloop_ctx *ctx)
 		target->revents = 0;
 	}
 
+	closedir(inputs);
+
+	if (ctx->cancellation_fd < 0)
+		return;
+
 	ctx->fds[ctx->numfds].fd = ctx->cancellation_fd;
 	ctx->fds[ctx->numfds].events = POLLIN;
 	ctx->fds[ctx->numfds].revents = 0;
 
 	ctx->numfds++;
-
-	closedir(inputs);
 }
 
 static void cleanup(struct eloop_ctx *ctx)
@@ -1,3 +1,9 @@
 #pragma once
 
+#include <stddef.h>
+
 void *drm_input_thread(void *);
+
+void *drm_input_open(int *fds, size_t *numfds, size_t max);
+void drm_input_dispatch(void *i_ctx, int fd);
+void drm_input_close(void *i_ctx);
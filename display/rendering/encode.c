@@ -0,0 +1,783 @@
+#include "encode.h"
+
+#include "../abort.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Rows encoded at a time. PNG strips are also what's handed to each thread.
+#define STRIP_ROWS 32
+
+#define MAX_ENCODERS 8
+
+// Strips that may be encoded but not yet written, per encoder thread.
+#define STRIPS_AHEAD 2
+
+// Deflate's window, and how many recent positions the matcher remembers.
+#define WINDOW (32 * 1024)
+#define HASH_BITS 14
+#define MIN_MATCH 4
+#define MAX_MATCH 258
+
+static const char *const format_names[] = {
+	[IMAGE_FORMAT_RAW] = "raw",
+	[IMAGE_FORMAT_QOI] = "qoi",
+	[IMAGE_FORMAT_PNG] = "png",
+};
+
+static const char *const format_exts[] = {
+	[IMAGE_FORMAT_RAW] = ".data",
+	[IMAGE_FORMAT_QOI] = ".qoi",
+	[IMAGE_FORMAT_PNG] = ".png",
+};
+
+struct qoi_state {
+	uint32_t index[64];
+	uint32_t prev;
+	uint32_t run;
+};
+
+/* A strip of PNG, ready to go out as one IDAT chunk. */
+struct png_strip {
+	uint8_t *out;
+	size_t len;
+	uint32_t adler;
+	size_t raw_len; // how much went into the adler
+	bool done;
+};
+
+/* Memory an encoder thread reuses from strip to strip. */
+struct png_scratch {
+	uint8_t *rows; // the row above the strip, then the strip, as RGBA
+	uint8_t *filtered;
+	uint8_t *sub, *up;
+	int32_t *head; // most recent position with each hash
+};
+
+struct png_job {
+	const struct canvas *c;
+	uint32_t num_strips;
+	size_t strip_cap;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t next;	  // strip for the next thread to claim
+	uint32_t written; // strips handed to the sink so far
+	bool stop;
+	size_t num_slots;
+	struct png_strip *slots; // strip k goes in k % num_slots
+};
+
+struct bits {
+	uint8_t *out;
+	size_t len;
+	uint64_t acc;
+	unsigned n;
+};
+
+static bool encode_raw(const struct canvas *, encode_sink_fn, void *arg);
+static bool encode_qoi(const struct canvas *, encode_sink_fn, void *arg);
+static size_t qoi_rows(struct qoi_state *, const uint32_t *px, size_t n,
+    bool last, uint8_t *out);
+static bool encode_png(const struct canvas *, encode_sink_fn, void *arg);
+static void *png_worker(void *);
+static void png_strip(const struct png_job *, uint32_t index,
+    struct png_scratch *, struct png_strip *);
+static size_t png_filter(const uint8_t *prev, const uint8_t *row,
+    size_t stride, uint8_t *sub, uint8_t *up, uint8_t *out);
+static size_t deflate_fixed(const uint8_t *in, size_t len, int32_t *head,
+    bool final, uint8_t *out);
+static void fixed_tables_init(void);
+static uint32_t adler32(uint32_t adler, const uint8_t *, size_t);
+static uint32_t adler32_combine(uint32_t a, uint32_t b, size_t len_b);
+static uint32_t crc32(uint32_t crc, const uint8_t *, size_t);
+static size_t png_chunk(uint8_t *out, const char type[4], size_t len);
+static inline void put_be32(uint8_t *, uint32_t);
+static bool fd_sink(void *arg, const uint8_t *data, size_t len);
+
+bool image_format_parse(const char *name, enum image_format *out)
+{
+	for (size_t i = 0; i < sizeof(format_names) / sizeof(*format_names);
+	    i++) {
+		if (strcmp(name, format_names[i]) == 0) {
+			*out = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+const char *image_format_ext(enum image_format f)
+{
+	return format_exts[f];
+}
+
+bool canvas_encode(const struct canvas *c, enum image_format f,
+    encode_sink_fn sink, void *arg)
+{
+	switch (f) {
+	case IMAGE_FORMAT_RAW:
+		return encode_raw(c, sink, arg);
+	case IMAGE_FORMAT_QOI:
+		return encode_qoi(c, sink, arg);
+	case IMAGE_FORMAT_PNG:
+		return encode_png(c, sink, arg);
+	}
+
+	return false;
+}
+
+void rendering_dump_encoded(const struct canvas *c, DIR *dir,
+    const char *dirpath, const char *path, enum image_format f)
+{
+	int fd = openat(dirfd(dir), path, O_WRONLY | O_CREAT | O_TRUNC,
+	    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0)
+		FATAL_ERR("Failed to open file for writing: %s/%s: %s", dirpath,
+		    path, STR_ERR);
+
+	if (!canvas_encode(c, f, fd_sink, &fd))
+		FATAL_ERR("Failed to write %s file: %s/%s: %s",
+		    format_names[f], dirpath, path, STR_ERR);
+
+	if (close(fd) < 0)
+		FATAL_ERR(
+		    "Failed to close file: %s/%s: %s", dirpath, path, STR_ERR);
+}
+
+static bool encode_raw(const struct canvas *c, encode_sink_fn sink, void *arg)
+{
+	const size_t stride = (size_t)c->width * 4;
+	uint8_t *buf = malloc(stride * STRIP_ROWS);
+	if (!buf)
+		return false;
+
+	bool ok = true;
+	for (uint32_t y = 0; ok && y < c->height; y += STRIP_ROWS) {
+		const uint16_t rows = c->height - y < STRIP_ROWS ? c->height - y
+								 : STRIP_ROWS;
+
+		canvas_read_rgba(c, y, rows, buf);
+		ok = sink(arg, buf, rows * stride);
+	}
+
+	free(buf);
+	return ok;
+}
+
+/* QOI, per https://qoiformat.org/qoi-specification.pdf. It's one long chain
+ * of pixels, so there's nothing to split between threads, but it's cheap. */
+static bool encode_qoi(const struct canvas *c, encode_sink_fn sink, void *arg)
+{
+	const size_t stride = (size_t)c->width * 4;
+	const size_t strip_px = (size_t)c->width * STRIP_ROWS;
+
+	// At worst five bytes a pixel (QOI_OP_RGBA), plus the end marker.
+	uint32_t *px = malloc(stride * STRIP_ROWS);
+	uint8_t *out = malloc(strip_px * 5 + 8);
+	if (!px || !out) {
+		free(px);
+		free(out);
+		return false;
+	}
+
+	uint8_t head[14] = { 'q', 'o', 'i', 'f' };
+	put_be32(&head[4], c->width);
+	put_be32(&head[8], c->height);
+	head[12] = 4; // RGBA
+	head[13] = 0; // sRGB with linear alpha
+
+	struct qoi_state s = { .prev = 0xff000000 };
+
+	bool ok = sink(arg, head, sizeof(head));
+	for (uint32_t y = 0; ok && y < c->height; y += STRIP_ROWS) {
+		const uint16_t rows = c->height - y < STRIP_ROWS ? c->height - y
+								 : STRIP_ROWS;
+		const bool last = y + rows == c->height;
+
+		canvas_read_rgba(c, y, rows, (uint8_t *)px);
+		size_t len =
+		    qoi_rows(&s, px, (size_t)rows * c->width, last, out);
+
+		if (last) {
+			static const uint8_t end[8] = { [7] = 1 };
+			memcpy(&out[len], end, sizeof(end));
+			len += sizeof(end);
+		}
+
+		ok = sink(arg, out, len);
+	}
+
+	free(px);
+	free(out);
+	return ok;
+}
+
+/* Encode `n` RGBA pixels (as loaded little-endian), carrying on from where
+ * the last call left off. */
+static size_t qoi_rows(struct qoi_state *s, const uint32_t *px, size_t n,
+    bool last, uint8_t *out)
+{
+	size_t len = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		const uint32_t p = px[i];
+
+		if (p == s->prev) {
+			s->run++;
+			if (s->run == 62 || (last && i == n - 1)) {
+				out[len++] = 0xc0 | (s->run - 1); // QOI_OP_RUN
+				s->run = 0;
+			}
+			continue;
+		}
+
+		if (s->run > 0) {
+			out[len++] = 0xc0 | (s->run - 1);
+			s->run = 0;
+		}
+
+		const uint8_t r = p, g = p >> 8, b = p >> 16, a = p >> 24;
+		const uint8_t hash = (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+
+		if (s->index[hash] == p) {
+			out[len++] = hash; // QOI_OP_INDEX
+			s->prev = p;
+			continue;
+		}
+		s->index[hash] = p;
+
+		if (a != s->prev >> 24) {
+			out[len++] = 0xff; // QOI_OP_RGBA
+			out[len++] = r;
+			out[len++] = g;
+			out[len++] = b;
+			out[len++] = a;
+			s->prev = p;
+			continue;
+		}
+
+		const int8_t dr = r - (uint8_t)s->prev;
+		const int8_t dg = g - (uint8_t)(s->prev >> 8);
+		const int8_t db = b - (uint8_t)(s->prev >> 16);
+		const int dr_dg = dr - dg;
+		const int db_dg = db - dg;
+
+		if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 &&
+		    db <= 1) {
+			// QOI_OP_DIFF
+			out[len++] =
+			    0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+		} else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+		    db_dg >= -8 && db_dg <= 7) {
+			// QOI_OP_LUMA
+			out[len++] = 0x80 | (dg + 32);
+			out[len++] = (dr_dg + 8) << 4 | (db_dg + 8);
+		} else {
+			out[len++] = 0xfe; // QOI_OP_RGB
+			out[len++] = r;
+			out[len++] = g;
+			out[len++] = b;
+		}
+
+		s->prev = p;
+	}
+
+	return len;
+}
+
+/* PNG, as RGBA with eight bits a channel. Each strip of rows is filtered and
+ * compressed on its own, as a run of deflate blocks that ends byte-aligned, so
+ * the strips can be compressed on separate threads and simply concatenated.
+ * Compression uses the fixed Huffman codes with a greedy matcher: not as small
+ * as zlib, but a lot faster, and flat colors still shrink to almost nothing. */
+static bool encode_png(const struct canvas *c, encode_sink_fn sink, void *arg)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, fixed_tables_init);
+
+	const size_t raw_len = ((size_t)c->width * 4 + 1) * STRIP_ROWS;
+
+	struct png_job job = {
+		.c = c,
+		.num_strips = (c->height + STRIP_ROWS - 1) / STRIP_ROWS,
+
+		// A 9-bit code for every byte at worst, plus the zlib header,
+		// the block headers and the chunk around it.
+		.strip_cap = raw_len + raw_len / 8 + 64,
+	};
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t num_threads = cpus < 1 ? 1 : cpus;
+	if (num_threads > MAX_ENCODERS)
+		num_threads = MAX_ENCODERS;
+	if (num_threads > job.num_strips)
+		num_threads = job.num_strips;
+
+	job.num_slots = num_threads * STRIPS_AHEAD;
+	job.slots = calloc(job.num_slots, sizeof(*job.slots));
+	if (!job.slots)
+		return false;
+
+	bool ok = true;
+	for (size_t i = 0; i < job.num_slots; i++) {
+		job.slots[i].out = malloc(job.strip_cap);
+		ok = ok && job.slots[i].out;
+	}
+
+	uint8_t head[8 + 25] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	uint8_t *ihdr = &head[8 + 8];
+	put_be32(&ihdr[0], c->width);
+	put_be32(&ihdr[4], c->height);
+	ihdr[8] = 8; // bits per channel
+	ihdr[9] = 6; // RGBA
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+	png_chunk(&head[8], "IHDR", 13);
+
+	ok = ok && sink(arg, head, sizeof(head));
+
+	pthread_t threads[MAX_ENCODERS];
+	size_t started = 0;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+	for (; ok && started < num_threads; started++) {
+		if (pthread_create(&threads[started], NULL, png_worker, &job) !=
+		    0)
+			break;
+	}
+	ok = ok && started > 0;
+
+	// Hand the strips over in order as they're done.
+	uint32_t adler = 1;
+	for (uint32_t i = 0; ok && i < job.num_strips; i++) {
+		struct png_strip *s = &job.slots[i % job.num_slots];
+
+		pthread_mutex_lock(&job.lock);
+		while (!s->done)
+			pthread_cond_wait(&job.cond, &job.lock);
+		pthread_mutex_unlock(&job.lock);
+
+		adler = adler32_combine(adler, s->adler, s->raw_len);
+		ok = sink(arg, s->out, s->len);
+
+		pthread_mutex_lock(&job.lock);
+		s->done = false;
+		job.written++;
+		pthread_cond_broadcast(&job.cond);
+		pthread_mutex_unlock(&job.lock);
+	}
+
+	pthread_mutex_lock(&job.lock);
+	job.stop = true;
+	pthread_cond_broadcast(&job.cond);
+	pthread_mutex_unlock(&job.lock);
+
+	for (size_t i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (ok) {
+		// The zlib checksum goes in an IDAT of its own, so the strips
+		// didn't have to wait on each other for it.
+		uint8_t tail[12 + 4 + 12];
+		put_be32(&tail[8], adler);
+		size_t len = png_chunk(tail, "IDAT", 4);
+		len += png_chunk(&tail[len], "IEND", 0);
+		ok = sink(arg, tail, len);
+	}
+
+	for (size_t i = 0; i < job.num_slots; i++)
+		free(job.slots[i].out);
+	free(job.slots);
+	pthread_cond_destroy(&job.cond);
+	pthread_mutex_destroy(&job.lock);
+
+	return ok;
+}
+
+static void *png_worker(void *arg)
+{
+	struct png_job *job = arg;
+	const size_t stride = (size_t)job->c->width * 4;
+
+	struct png_scratch s = {
+		.rows = malloc(stride * (STRIP_ROWS + 1)),
+		.filtered = malloc((stride + 1) * STRIP_ROWS),
+		.sub = malloc(stride),
+		.up = malloc(stride),
+		.head = malloc(sizeof(int32_t) << HASH_BITS),
+	};
+	if (!s.rows || !s.filtered || !s.sub || !s.up || !s.head)
+		FATAL_ERR("encode: OOM");
+
+	pthread_mutex_lock(&job->lock);
+	for (;;) {
+		while (!job->stop && job->next < job->num_strips &&
+		    job->next >= job->written + job->num_slots)
+			pthread_cond_wait(&job->cond, &job->lock);
+
+		if (job->stop || job->next == job->num_strips)
+			break;
+
+		const uint32_t i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+
+		struct png_strip *strip = &job->slots[i % job->num_slots];
+		png_strip(job, i, &s, strip);
+
+		pthread_mutex_lock(&job->lock);
+		strip->done = true;
+		pthread_cond_broadcast(&job->cond);
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	free(s.rows);
+	free(s.filtered);
+	free(s.sub);
+	free(s.up);
+	free(s.head);
+	return NULL;
+}
+
+static void png_strip(const struct png_job *job, uint32_t index,
+    struct png_scratch *s, struct png_strip *out)
+{
+	const struct canvas *c = job->c;
+	const size_t stride = (size_t)c->width * 4;
+	const uint32_t y = index * STRIP_ROWS;
+	const uint16_t rows =
+	    c->height - y < STRIP_ROWS ? c->height - y : STRIP_ROWS;
+
+	// Filtering looks at the row above, even across strips.
+	if (y > 0)
+		canvas_read_rgba(c, y - 1, rows + 1, s->rows);
+	else {
+		memset(s->rows, 0, stride);
+		canvas_read_rgba(c, y, rows, &s->rows[stride]);
+	}
+
+	size_t raw_len = 0;
+	for (uint16_t i = 0; i < rows; i++) {
+		raw_len += png_filter(&s->rows[stride * i],
+		    &s->rows[stride * (i + 1)], stride, s->sub, s->up,
+		    &s->filtered[raw_len]);
+	}
+
+	// The chunk's length and type, and the zlib header before the first
+	// strip, go in front of the compressed data.
+	size_t len = 8;
+	if (index == 0) {
+		out->out[len++] = 0x78; // deflate, with a 32K window
+		out->out[len++] = 0x01; // no dictionary, fastest
+	}
+
+	const bool final = index == job->num_strips - 1;
+	len += deflate_fixed(
+	    s->filtered, raw_len, s->head, final, &out->out[len]);
+
+	out->len = png_chunk(out->out, "IDAT", len - 8);
+	out->adler = adler32(1, s->filtered, raw_len);
+	out->raw_len = raw_len;
+}
+
+/* Filter one row with either Sub or Up, whichever looks likelier to compress
+ * better, going by the usual sum of absolute differences. */
+static size_t png_filter(const uint8_t *prev, const uint8_t *row,
+    size_t stride, uint8_t *sub, uint8_t *up, uint8_t *out)
+{
+	uint64_t sub_cost = 0, up_cost = 0;
+
+	for (size_t i = 0; i < stride; i++) {
+		sub[i] = row[i] - (i >= 4 ? row[i - 4] : 0);
+		up[i] = row[i] - prev[i];
+		sub_cost += abs((int8_t)sub[i]);
+		up_cost += abs((int8_t)up[i]);
+	}
+
+	out[0] = sub_cost <= up_cost ? 1 : 2;
+	memcpy(&out[1], sub_cost <= up_cost ? sub : up, stride);
+	return stride + 1;
+}
+
+// The fixed Huffman codes, bit-reversed so they can go straight out LSB
+// first, and the length and distance symbols with their extra bits. Also the
+// CRC-32 table for PNG chunks. All set up once by fixed_tables_init.
+static uint16_t lit_code[288];
+static uint8_t lit_bits[288];
+static uint16_t len_sym[MAX_MATCH + 1];
+static uint8_t dist_code[30];
+static uint32_t crc_table[256];
+
+static const uint16_t len_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15,
+	17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195,
+	227, 258 };
+static const uint8_t len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2,
+	2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33,
+	49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+	6145, 8193, 12289, 16385, 24577 };
+static const uint8_t dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5,
+	5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static uint16_t reverse_bits(uint16_t code, unsigned n)
+{
+	uint16_t r = 0;
+	for (unsigned i = 0; i < n; i++)
+		r |= (code >> i & 1) << (n - 1 - i);
+
+	return r;
+}
+
+static void fixed_tables_init(void)
+{
+	for (unsigned i = 0; i < 288; i++) {
+		uint16_t code;
+		if (i < 144) {
+			lit_bits[i] = 8;
+			code = 0x30 + i;
+		} else if (i < 256) {
+			lit_bits[i] = 9;
+			code = 0x190 + (i - 144);
+		} else if (i < 280) {
+			lit_bits[i] = 7;
+			code = i - 256;
+		} else {
+			lit_bits[i] = 8;
+			code = 0xc0 + (i - 280);
+		}
+
+		lit_code[i] = reverse_bits(code, lit_bits[i]);
+	}
+
+	for (unsigned sym = 0; sym < 29; sym++) {
+		const unsigned end = sym == 28 ? MAX_MATCH + 1
+					       : len_base[sym + 1];
+		for (unsigned len = len_base[sym]; len < end; len++)
+			len_sym[len] = sym;
+	}
+
+	for (unsigned i = 0; i < 30; i++)
+		dist_code[i] = reverse_bits(i, 5);
+
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320 ^ c >> 1 : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static inline void put_bits(struct bits *b, uint32_t v, unsigned n)
+{
+	b->acc |= (uint64_t)v << b->n;
+	b->n += n;
+
+	if (b->n >= 32) {
+		memcpy(&b->out[b->len], &b->acc, 4); // little endian
+		b->len += 4;
+		b->acc >>= 32;
+		b->n -= 32;
+	}
+}
+
+static inline unsigned dist_sym(uint32_t d)
+{
+	if (d <= 4)
+		return d - 1;
+
+	const uint32_t v = d - 1;
+	const unsigned msb = 31 - __builtin_clz(v);
+	return 2 * msb + (v >> (msb - 1) & 1);
+}
+
+/* How many bytes match, up to `max`, eight at a time. */
+static inline size_t match_len(const uint8_t *a, const uint8_t *b, size_t max)
+{
+	size_t n = MIN_MATCH;
+	while (n + 8 <= max) {
+		uint64_t x, y;
+		memcpy(&x, &a[n], sizeof(x));
+		memcpy(&y, &b[n], sizeof(y));
+		if (x != y)
+			return n + __builtin_ctzll(x ^ y) / 8; // little endian
+		n += 8;
+	}
+
+	while (n < max && a[n] == b[n])
+		n++;
+
+	return n;
+}
+
+static inline uint32_t hash4(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Compress `in` as a single fixed-Huffman block. Unless it's the final one,
+ * an empty stored block follows, which brings the stream to a byte boundary
+ * (like zlib's Z_SYNC_FLUSH) so the next strip can start fresh. */
+static size_t deflate_fixed(const uint8_t *in, size_t len, int32_t *head,
+    bool final, uint8_t *out)
+{
+	struct bits b = { .out = out };
+	memset(head, 0xff, sizeof(int32_t) << HASH_BITS);
+
+	put_bits(&b, final, 1);
+	put_bits(&b, 1, 2); // fixed Huffman codes
+
+	size_t i = 0;
+	while (i < len) {
+		size_t match = 0;
+		uint32_t dist = 0;
+
+		if (i + MIN_MATCH <= len) {
+			const uint32_t h = hash4(&in[i]);
+			const int32_t cand = head[h];
+			head[h] = i;
+
+			if (cand >= 0 && i - cand <= WINDOW &&
+			    memcmp(&in[cand], &in[i], MIN_MATCH) == 0) {
+				const size_t max = len - i < MAX_MATCH
+						       ? len - i
+						       : MAX_MATCH;
+				match = match_len(&in[cand], &in[i], max);
+				dist = i - cand;
+			}
+		}
+
+		if (match == 0) {
+			put_bits(&b, lit_code[in[i]], lit_bits[in[i]]);
+			i++;
+			continue;
+		}
+
+		const unsigned ls = len_sym[match];
+		put_bits(&b, lit_code[257 + ls], lit_bits[257 + ls]);
+		put_bits(&b, match - len_base[ls], len_extra[ls]);
+
+		const unsigned ds = dist_sym(dist);
+		put_bits(&b, dist_code[ds], 5);
+		put_bits(&b, dist - dist_base[ds], dist_extra[ds]);
+
+		// Remember where the match ended up too, which is what finds
+		// the next stretch of the same.
+		i += match;
+		if (i + MIN_MATCH <= len)
+			head[hash4(&in[i - 1])] = i - 1;
+	}
+
+	put_bits(&b, lit_code[256], lit_bits[256]); // end of block
+
+	if (!final)
+		put_bits(&b, 0, 3); // an empty stored block
+
+	// Byte-align, then write out the rest.
+	put_bits(&b, 0, (8 - b.n % 8) % 8);
+	while (b.n > 0) {
+		b.out[b.len++] = b.acc;
+		b.acc >>= 8;
+		b.n -= 8;
+	}
+
+	if (!final) {
+		static const uint8_t empty[4] = { 0x00, 0x00, 0xff, 0xff };
+		memcpy(&b.out[b.len], empty, sizeof(empty));
+		b.len += sizeof(empty);
+	}
+
+	return b.len;
+}
+
+#define ADLER_MOD 65521
+
+static uint32_t adler32(uint32_t adler, const uint8_t *p, size_t len)
+{
+	uint32_t a = adler & 0xffff, b = adler >> 16;
+
+	while (len > 0) {
+		// The most bytes that can't overflow b before the modulo.
+		size_t n = len < 5552 ? len : 5552;
+		len -= n;
+		while (n--) {
+			a += *p++;
+			b += a;
+		}
+		a %= ADLER_MOD;
+		b %= ADLER_MOD;
+	}
+
+	return b << 16 | a;
+}
+
+/* The Adler-32 of two buffers back to back, given each one's, as in zlib. */
+static uint32_t adler32_combine(uint32_t a, uint32_t b, size_t len_b)
+{
+	const uint32_t rem = len_b % ADLER_MOD;
+	uint32_t sum1 = a & 0xffff;
+	uint32_t sum2 = (uint64_t)rem * sum1 % ADLER_MOD;
+
+	sum1 += (b & 0xffff) + ADLER_MOD - 1;
+	sum2 += (a >> 16) + (b >> 16) + ADLER_MOD - rem;
+	if (sum1 >= ADLER_MOD)
+		sum1 -= ADLER_MOD;
+	if (sum1 >= ADLER_MOD)
+		sum1 -= ADLER_MOD;
+	if (sum2 >= 2 * ADLER_MOD)
+		sum2 -= 2 * ADLER_MOD;
+	if (sum2 >= ADLER_MOD)
+		sum2 -= ADLER_MOD;
+
+	return sum2 << 16 | sum1;
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *p, size_t len)
+{
+	crc = ~crc;
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ crc >> 8;
+
+	return ~crc;
+}
+
+/* Fill in the length, type and CRC around `len` bytes of data already at
+ * out + 8. Returns the whole chunk's size. */
+static size_t png_chunk(uint8_t *out, const char type[4], size_t len)
+{
+	put_be32(out, len);
+	memcpy(&out[4], type, 4);
+	put_be32(&out[8 + len], crc32(0, &out[4], len + 4));
+	return len + 12;
+}
+
+static inline void put_be32(uint8_t *out, uint32_t v)
+{
+	out[0] = v >> 24;
+	out[1] = v >> 16;
+	out[2] = v >> 8;
+	out[3] = v;
+}
+
+static bool fd_sink(void *arg, const uint8_t *data, size_t len)
+{
+	const int fd = *(int *)arg;
+
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+
+		data += n;
+		len -= n;
+	}
+
+	return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "canvas.h"
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* What SAVE can write a canvas out as. Every format keeps the canvas's pixels
+ * as RGBA, alpha included, so they all decode to the same bytes as RAW. */
+enum image_format {
+	IMAGE_FORMAT_RAW, // RGBA rows, as they always were
+	IMAGE_FORMAT_QOI,
+	IMAGE_FORMAT_PNG,
+};
+
+/* Takes each piece of output in order. Returns false to give up. */
+typedef bool (*encode_sink_fn)(void *arg, const uint8_t *data, size_t len);
+
+/* Parse "raw", "qoi" or "png". */
+bool image_format_parse(const char *name, enum image_format *out);
+
+/* The file extension for a format, dot included. RAW is ".data". */
+const char *image_format_ext(enum image_format);
+
+/* Encode a canvas a strip of rows at a time, so that the output is never all
+ * in memory at once. PNG strips are compressed on several threads. Returns
+ * false if the sink did, or if out of memory (with errno set). */
+bool canvas_encode(const struct canvas *, enum image_format, encode_sink_fn,
+    void *arg);
+
+/* Like rendering_dump_bgra_to_rgba, but in any format. */
+void rendering_dump_encoded(const struct canvas *c, DIR *dir,
+    const char *dirpath, const char *path, enum image_format);
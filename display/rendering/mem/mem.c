@@ -1,46 +1,86 @@
 #include "mem.h"
 
+#include "../../abort.h"
 #include "threads/termination.h"
 
-#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-void *mem_rendering_init(void)
+struct mem_ctx {
+	uint16_t width, height;
+
+	// The last frame shown, as BGRA rows with no padding.
+	uint8_t *frame;
+
+	// Presents happen synchronously, so nothing is ever dropped.
+	struct present_stats stats;
+};
+
+void *mem_rendering_init(const struct rendering_opts *opts)
 {
-	// TODO: hardcoded resolution is unfortunate, perhaps pass optional size
-	// hint ignored by DRM backend?
-	return canvas_init_bgra(MEM_BACKEND_WIDTH, MEM_BACKEND_HEIGHT);
+	struct mem_ctx *ctx = malloc(sizeof(struct mem_ctx));
+	if (!ctx)
+		return NULL;
+
+	ctx->width = opts->width ? opts->width : MEM_BACKEND_WIDTH;
+	ctx->height = opts->height ? opts->height : MEM_BACKEND_HEIGHT;
+	ctx->frame = calloc(ctx->height, (size_t)ctx->width * 4);
+	if (!ctx->frame) {
+		free(ctx);
+		return NULL;
+	}
+
+	ctx->stats = (struct present_stats) { 0 };
+
+	return ctx;
 }
 
 void mem_rendering_cleanup(void *mem_ctx)
 {
-	struct canvas *ctx = mem_ctx;
-	canvas_deinit(ctx);
+	struct mem_ctx *ctx = mem_ctx;
+	free(ctx->frame);
+	free(ctx);
 }
 
 void mem_rendering_ctx_log(const void *mem_ctx)
 {
-	const struct canvas *ctx = mem_ctx;
+	const struct mem_ctx *ctx = mem_ctx;
 
 	fprintf(stderr, "Size:\t%dx%d\n", ctx->width, ctx->height);
 }
 
-void mem_rendering_show(void *mem_ctx, struct canvas *c)
+void mem_rendering_show(
+    void *mem_ctx, struct canvas *c, const struct placement *pl)
 {
-	struct canvas *ctx = mem_ctx;
-	assert(ctx->width == c->width && ctx->height == c->height &&
-	    ctx->stride == c->stride);
+	struct mem_ctx *ctx = mem_ctx;
 
-	size_t buffer_size = (size_t)ctx->stride * ctx->height;
-	memcpy(ctx->buffer, c->buffer, buffer_size);
+	canvas_materialize(
+	    c, pl, ctx->width, ctx->height, ctx->frame, (size_t)ctx->width * 4);
+
+	ctx->stats.queued++;
+	ctx->stats.presented++;
+	ctx->stats.copied_bytes += (size_t)ctx->width * ctx->height * 4;
+}
+
+void mem_rendering_stats(void *mem_ctx, struct present_stats *out)
+{
+	const struct mem_ctx *ctx = mem_ctx;
+	*out = ctx->stats;
 }
 
-struct canvas *mem_canvas_init(void *mem_ctx)
+void mem_rendering_size(
+    const void *mem_ctx, uint16_t *width, uint16_t *height)
 {
-	struct canvas *ctx = mem_ctx;
-	return canvas_init_bgra(ctx->width, ctx->height);
+	const struct mem_ctx *ctx = mem_ctx;
+	*width = ctx->width;
+	*height = ctx->height;
+}
+
+size_t mem_rendering_memory(const void *mem_ctx)
+{
+	const struct mem_ctx *ctx = mem_ctx;
+	return (size_t)ctx->width * ctx->height * 4;
 }
 
 void *mem_input_thread(void *)
@@ -48,3 +88,18 @@ void *mem_input_thread(void *)
 	term_block();
 	return NULL;
 }
+
+void *mem_input_open(int *, size_t *numfds, size_t)
+{
+	// There's nothing to listen to.
+	*numfds = 0;
+	return NULL;
+}
+
+void mem_input_dispatch(void *, int)
+{
+}
+
+void mem_input_close(void *)
+{
+}
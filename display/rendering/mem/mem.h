@@ -1,13 +1,21 @@
 #pragma once
 
 #include "../canvas.h"
+#include "../rendering.h"
 
 #define MEM_BACKEND_WIDTH 640
 #define MEM_BACKEND_HEIGHT 480
 
-void *mem_rendering_init(void);
+void *mem_rendering_init(const struct rendering_opts *);
 void mem_rendering_cleanup(void *mem_ctx);
 void mem_rendering_ctx_log(const void *mem_ctx);
-void mem_rendering_show(void *mem_ctx, struct canvas *);
-struct canvas *mem_canvas_init(void *mem_ctx);
+void mem_rendering_show(
+    void *mem_ctx, struct canvas *, const struct placement *);
+void mem_rendering_stats(void *mem_ctx, struct present_stats *);
+void mem_rendering_size(
+    const void *mem_ctx, uint16_t *width, uint16_t *height);
+size_t mem_rendering_memory(const void *mem_ctx);
 void *mem_input_thread(void *);
+void *mem_input_open(int *fds, size_t *numfds, size_t max);
+void mem_input_dispatch(void *i_ctx, int fd);
+void mem_input_close(void *i_ctx);
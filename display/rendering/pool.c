@@ -0,0 +1,249 @@
+#define _GNU_SOURCE // MAP_ANONYMOUS, MADV_HUGEPAGE
+
+#include "pool.h"
+
+#include "../abort.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Slabs are the size (and alignment) of a huge page, so that the kernel can
+// back each with one. The first page holds the slab's bookkeeping, which keeps
+// the blocks themselves page aligned.
+#define SLAB_SIZE (2u << 20)
+#define SLAB_HEADER 4096
+
+// Each slab holds blocks of one size class. Class `k` has blocks of
+// POOL_BLOCK_SIZE >> k bytes.
+#define MIN_BLOCK_SIZE (POOL_BLOCK_SIZE >> (POOL_CLASSES - 1))
+#define MAX_BLOCKS_PER_SLAB ((SLAB_SIZE - SLAB_HEADER) / MIN_BLOCK_SIZE)
+
+// How many bytes of free blocks to hang on to by default.
+#define DEFAULT_RETAIN (16u << 20)
+
+struct slab {
+	size_t block_size;
+	atomic_uint refs[MAX_BLOCKS_PER_SLAB];
+};
+
+static_assert(sizeof(struct slab) <= SLAB_HEADER, "slab header overflows");
+
+struct free_block {
+	struct free_block *next;
+};
+
+struct size_class {
+	// Free blocks that are still backed by memory.
+	struct free_block *warm;
+
+	// Free blocks whose memory was given back. Writing a link into them
+	// would fault a page right back in, so they're listed out of line.
+	void **cold;
+	size_t num_cold;
+	size_t cold_cap;
+
+	// The unused tail of the newest slab of this class.
+	uint8_t *fresh;
+	size_t num_fresh;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	size_t retain;
+
+	struct size_class classes[POOL_CLASSES];
+	struct pool_stats stats;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.retain = DEFAULT_RETAIN,
+};
+
+static struct slab *slab_of(const void *block);
+static atomic_uint *refs_of(const void *block);
+static size_t class_of(size_t size);
+static void new_slab(size_t cls);
+static void *take_thread_unsafe(size_t cls);
+static void put_warm_thread_unsafe(size_t cls, void *block);
+
+void *pool_get(size_t size)
+{
+	const size_t cls = class_of(size);
+
+	pthread_mutex_lock(&pool.lock);
+	void *block = take_thread_unsafe(cls);
+	pthread_mutex_unlock(&pool.lock);
+
+	atomic_store_explicit(refs_of(block), 1, memory_order_relaxed);
+	return block;
+}
+
+void pool_ref(void *block)
+{
+	atomic_fetch_add_explicit(refs_of(block), 1, memory_order_relaxed);
+}
+
+void pool_unref(void *block)
+{
+	if (atomic_fetch_sub_explicit(refs_of(block), 1, memory_order_acq_rel) !=
+	    1)
+		return;
+
+	const size_t size = slab_of(block)->block_size;
+	const size_t cls = class_of(size);
+	struct size_class *k = &pool.classes[cls];
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stats.in_use -= size;
+
+	if (pool.stats.warm < pool.retain) {
+		put_warm_thread_unsafe(cls, block);
+		pthread_mutex_unlock(&pool.lock);
+		return;
+	}
+
+	if (k->num_cold == k->cold_cap) {
+		size_t cap = k->cold_cap ? k->cold_cap * 2 : 64;
+		void **cold = realloc(k->cold, cap * sizeof(*cold));
+		if (!cold)
+			FATAL_ERR("pool: failed to grow cold list");
+
+		k->cold = cold;
+		k->cold_cap = cap;
+	}
+
+	// The address range stays ours, so there's nothing to unmap.
+	madvise(block, size, MADV_DONTNEED);
+	k->cold[k->num_cold++] = block;
+	pool.stats.cold += size;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+unsigned pool_refs(const void *block)
+{
+	return atomic_load_explicit(refs_of(block), memory_order_acquire);
+}
+
+void pool_reserve(size_t bytes)
+{
+	pthread_mutex_lock(&pool.lock);
+
+	if (pool.retain < bytes)
+		pool.retain = bytes;
+
+	while (pool.stats.warm < bytes) {
+		void *block = take_thread_unsafe(0);
+		pool.stats.in_use -= POOL_BLOCK_SIZE;
+
+		// Touch every page now rather than on first draw.
+		memset(block, 0, POOL_BLOCK_SIZE);
+		put_warm_thread_unsafe(0, block);
+	}
+
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void pool_stats(struct pool_stats *out)
+{
+	pthread_mutex_lock(&pool.lock);
+	*out = pool.stats;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static struct slab *slab_of(const void *block)
+{
+	return (struct slab *)((uintptr_t)block & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static atomic_uint *refs_of(const void *block)
+{
+	struct slab *slab = slab_of(block);
+	const size_t idx = ((uintptr_t)block - (uintptr_t)slab - SLAB_HEADER) /
+	    slab->block_size;
+
+	return &slab->refs[idx];
+}
+
+static size_t class_of(size_t size)
+{
+	for (size_t cls = 0; cls < POOL_CLASSES; cls++)
+		if (size == POOL_BLOCK_SIZE >> cls)
+			return cls;
+
+	FATAL_ERR("pool: no size class for %zu bytes", size);
+}
+
+static void new_slab(size_t cls)
+{
+	// Over-allocate so that an aligned slab fits somewhere inside, then
+	// trim the rest.
+	uint8_t *raw = mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED)
+		FATAL_ERR("pool: failed to map slab: %s", STR_ERR);
+
+	const uintptr_t start = ((uintptr_t)raw + SLAB_SIZE - 1) &
+	    ~(uintptr_t)(SLAB_SIZE - 1);
+	uint8_t *slab = (uint8_t *)start;
+
+	const size_t head = slab - raw;
+	const size_t tail = SLAB_SIZE - head;
+	if (head > 0)
+		munmap(raw, head);
+	if (tail > 0)
+		munmap(slab + SLAB_SIZE, tail);
+
+	// Only a hint: without transparent huge pages, this fails and we make
+	// do with small ones.
+	madvise(slab, SLAB_SIZE, MADV_HUGEPAGE);
+
+	const size_t size = POOL_BLOCK_SIZE >> cls;
+	((struct slab *)slab)->block_size = size;
+
+	struct size_class *k = &pool.classes[cls];
+	k->fresh = slab + SLAB_HEADER;
+	k->num_fresh = (SLAB_SIZE - SLAB_HEADER) / size;
+	pool.stats.slabs++;
+}
+
+static void *take_thread_unsafe(size_t cls)
+{
+	struct size_class *k = &pool.classes[cls];
+	const size_t size = POOL_BLOCK_SIZE >> cls;
+	void *block;
+
+	if (k->warm) {
+		block = k->warm;
+		k->warm = k->warm->next;
+		pool.stats.warm -= size;
+		pool.stats.reused++;
+	} else if (k->num_cold > 0) {
+		block = k->cold[--k->num_cold];
+		pool.stats.cold -= size;
+		pool.stats.faulted++;
+	} else {
+		if (k->num_fresh == 0)
+			new_slab(cls);
+
+		block = k->fresh;
+		k->fresh += size;
+		k->num_fresh--;
+		pool.stats.faulted++;
+	}
+
+	pool.stats.in_use += size;
+	return block;
+}
+
+static void put_warm_thread_unsafe(size_t cls, void *block)
+{
+	struct size_class *k = &pool.classes[cls];
+	struct free_block *f = block;
+	f->next = k->warm;
+	k->warm = f;
+	pool.stats.warm += POOL_BLOCK_SIZE >> cls;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A pool for the pixel blocks of canvas tiles. Blocks are carved out of
+ * huge-page-backed slabs, are page aligned (but not necessarily aligned to
+ * their size), and each carries a reference count so that canvases can share
+ * them. Freed blocks are kept around for reuse, up to the retention limit; past
+ * that, their memory goes back to the kernel. */
+
+// Big enough for one TILE_SIZE x TILE_SIZE tile of BGRA pixels. Smaller blocks
+// come in halvings of this, one size class per pixel format.
+#define POOL_BLOCK_SIZE ((size_t)64 * 64 * 4)
+#define POOL_CLASSES 3
+
+// All sizes are in bytes.
+struct pool_stats {
+	size_t slabs;
+	size_t in_use;	  // handed out
+	size_t warm;	  // free and still backed by memory
+	size_t cold;	  // free, with the memory given back
+	uint64_t reused;  // allocations served by a warm block
+	uint64_t faulted; // allocations that had to touch fresh memory
+};
+
+/* Get a block with a reference count of one. Its contents are unspecified.
+ * `size` must be POOL_BLOCK_SIZE halved fewer than POOL_CLASSES times. */
+void *pool_get(size_t size);
+
+void pool_ref(void *block);
+
+/* Drop a reference, returning the block to the pool if it was the last. */
+void pool_unref(void *block);
+
+unsigned pool_refs(const void *block);
+
+/* Fault in enough full-size blocks to hold `bytes` up front, and keep at least
+ * that much around afterward rather than giving it back. */
+void pool_reserve(size_t bytes);
+
+void pool_stats(struct pool_stats *out);
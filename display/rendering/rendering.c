@@ -2,6 +2,9 @@
 
 #include "drm/drm.h"
 #include "mem/mem.h"
+#include "rfb/rfb.h"
+#include "shm/shm.h"
+#include "stream/stream.h"
 
 const struct rendering_vtable
     supported_backends[] = {
@@ -10,17 +13,68 @@ const struct rendering_vtable
 		.rendering_cleanup = drm_rendering_cleanup,
 		.rendering_ctx_log = drm_rendering_ctx_log,
 		.rendering_show = drm_rendering_show,
-		.canvas_init = drm_canvas_init,
+		.rendering_stats = drm_rendering_stats,
+		.rendering_size = drm_rendering_size,
+		.rendering_memory = drm_rendering_memory,
 		.input_thread = drm_input_thread,
+		.input_open = drm_input_open,
+		.input_dispatch = drm_input_dispatch,
+		.input_close = drm_input_close,
 	},
 	[BACKEND_MEM] = {
 		.rendering_init = mem_rendering_init,
 		.rendering_cleanup = mem_rendering_cleanup,
 		.rendering_ctx_log = mem_rendering_ctx_log,
 		.rendering_show = mem_rendering_show,
-		.canvas_init = mem_canvas_init,
+		.rendering_stats = mem_rendering_stats,
+		.rendering_size = mem_rendering_size,
+		.rendering_memory = mem_rendering_memory,
 		.input_thread = mem_input_thread,
-	}
+		.input_open = mem_input_open,
+		.input_dispatch = mem_input_dispatch,
+		.input_close = mem_input_close,
+	},
+	[BACKEND_STREAM] = {
+		.rendering_init = stream_rendering_init,
+		.rendering_cleanup = stream_rendering_cleanup,
+		.rendering_ctx_log = stream_rendering_ctx_log,
+		.rendering_show = stream_rendering_show,
+		.rendering_stats = stream_rendering_stats,
+		.rendering_size = stream_rendering_size,
+		.rendering_memory = stream_rendering_memory,
+		// There's no more input to a stream than to memory.
+		.input_thread = mem_input_thread,
+		.input_open = mem_input_open,
+		.input_dispatch = mem_input_dispatch,
+		.input_close = mem_input_close,
+	},
+	[BACKEND_RFB] = {
+		.rendering_init = rfb_rendering_init,
+		.rendering_cleanup = rfb_rendering_cleanup,
+		.rendering_ctx_log = rfb_rendering_ctx_log,
+		.rendering_show = rfb_rendering_show,
+		.rendering_stats = rfb_rendering_stats,
+		.rendering_size = rfb_rendering_size,
+		.rendering_memory = rfb_rendering_memory,
+		// Viewers' key and pointer events are dropped: it's view-only.
+		.input_thread = mem_input_thread,
+		.input_open = mem_input_open,
+		.input_dispatch = mem_input_dispatch,
+		.input_close = mem_input_close,
+	},
+	[BACKEND_SHM] = {
+		.rendering_init = shm_rendering_init,
+		.rendering_cleanup = shm_rendering_cleanup,
+		.rendering_ctx_log = shm_rendering_ctx_log,
+		.rendering_show = shm_rendering_show,
+		.rendering_stats = shm_rendering_stats,
+		.rendering_size = shm_rendering_size,
+		.rendering_memory = shm_rendering_memory,
+		.input_thread = mem_input_thread,
+		.input_open = mem_input_open,
+		.input_dispatch = mem_input_dispatch,
+		.input_close = mem_input_close,
+	},
 };
 
 const size_t backend_count =
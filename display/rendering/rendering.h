@@ -2,10 +2,50 @@
 
 #include "canvas.h"
 
+#include <stdint.h>
+
+/* What happened to the frames handed to `rendering_show`. */
+struct present_stats {
+	uint64_t queued;    // frames handed off by rendering_show
+	uint64_t dropped;   // frames replaced by a newer one before display
+	uint64_t presented; // frames that actually reached the display
+
+	uint64_t copied_bytes; // pixels written into the backend's buffers
+	uint64_t flip_wait_ns; // time spent waiting on page flips, if any
+	uint64_t late;         // flips that missed the vblank they were due at
+	unsigned refresh_hz;   // 0 if the display doesn't have a refresh rate
+};
+
+/* What the STREAM backend writes out. */
+enum stream_format {
+	STREAM_FORMAT_Y4M,  // YUV4MPEG2, as 4:2:0 (what encoders expect)
+	STREAM_FORMAT_BGRA, // bare frames, exactly as shown
+};
+
+struct rendering_opts {
+	// The frame size to use, for backends that get to pick one (i.e., not
+	// DRM, which goes by the display). Zero means the backend's default.
+	uint16_t width, height;
+
+	// Where the STREAM backend writes frames, and how. Zero fps means the
+	// backend's default.
+	const char *stream_path;
+	enum stream_format stream_format;
+	unsigned stream_fps;
+
+	// Where the RFB backend listens: a TCP port (on loopback only), or
+	// otherwise the path of a Unix socket. Null means its default port.
+	const char *rfb_listen;
+
+	// The file the SHM backend shares its frames through (e.g., under
+	// /dev/shm). Null means an anonymous memfd.
+	const char *shm_path;
+};
+
 struct rendering_vtable {
 	/// Initialize the rendering backend, returning an opaque context.
 	/// Returns null if allocation fails.
-	void *(*rendering_init)(void);
+	void *(*rendering_init)(const struct rendering_opts *);
 
 	/// Deinitialize the rendering backend, invalidating the context.
 	void (*rendering_cleanup)(void *r_ctx);
@@ -13,22 +53,46 @@ struct rendering_vtable {
 	/// Log backend-specific parameters.
 	void (*rendering_ctx_log)(const void *r_ctx);
 
-	/// Give the backend a canvas to display.
-	void (*rendering_show)(void *r_ctx, struct canvas *);
+	/// Give the backend a canvas to display, placed on an otherwise blank
+	/// frame.
+	void (*rendering_show)(
+	    void *r_ctx, struct canvas *, const struct placement *);
 
-	/// Construct a canvas with parameters matching the backend.
-	/// Returns null if allocation fails.
-	struct canvas *(*canvas_init)(void *r_ctx);
+	/// Read the backend's present statistics. Not every backend locks
+	/// them, so callers mustn't race with `rendering_show`.
+	void (*rendering_stats)(void *r_ctx, struct present_stats *);
+
+	/// Get the size of the frames the backend shows.
+	void (*rendering_size)(
+	    const void *r_ctx, uint16_t *width, uint16_t *height);
+
+	/// Bytes held by the backend's frame buffers (e.g., DRM's dumb
+	/// buffers).
+	size_t (*rendering_memory)(const void *r_ctx);
 
 	/// This thread handles input, whatever that means for the specific
 	/// backend. For implementors, the thread must call `term_block` before
 	/// it returns. The return value is unused.
 	void *(*input_thread)(void *unused);
+
+	/// An alternative to `input_thread` for callers with their own event
+	/// loop. Open the backend's input devices and write (at most `max`) fds
+	/// to watch for readability into `fds`. Returns an opaque context.
+	void *(*input_open)(int *fds, size_t *numfds, size_t max);
+
+	/// Handle readability on one of the fds given by `input_open`.
+	void (*input_dispatch)(void *i_ctx, int fd);
+
+	/// Release everything acquired by `input_open`.
+	void (*input_close)(void *i_ctx);
 };
 
 enum backend {
 	BACKEND_DRM,
 	BACKEND_MEM,
+	BACKEND_STREAM,
+	BACKEND_RFB,
+	BACKEND_SHM,
 };
 
 extern const struct rendering_vtable supported_backends[];
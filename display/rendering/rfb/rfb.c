@@ -0,0 +1,1407 @@
+#define _GNU_SOURCE // accept4
+
+#include "rfb.h"
+
+#include "../../abort.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Change detection works on square tiles of the screen, the same size as a
+ * canvas' (though a pane's tiles only line up with the screen's when it's
+ * placed on a multiple of them). Each changed tile goes out as a rectangle. */
+#define RFB_TILE TILE_SIZE
+
+// The most a client may send in one message, save for cut text, which is
+// skipped over rather than kept.
+#define CLIENT_INBUF 4096
+
+#define MAX_EVENTS 64
+
+enum {
+	ENCODING_RAW = 0,
+	ENCODING_RRE = 2,
+	ENCODING_HEXTILE = 5,
+};
+
+enum {
+	HEXTILE_RAW = 1,
+	HEXTILE_BACKGROUND = 2,
+	HEXTILE_FOREGROUND = 4,
+	HEXTILE_ANY_SUBRECTS = 8,
+	HEXTILE_SUBRECTS_COLOURED = 16,
+};
+
+enum source_type {
+	SRC_LISTEN,
+	SRC_WAKE,
+	SRC_CLIENT,
+};
+
+struct source {
+	enum source_type type;
+	int fd;
+};
+
+struct buf {
+	uint8_t *data;
+	size_t off; // everything before this has been written
+	size_t len;
+	size_t cap;
+};
+
+/* How a client wants its pixels. Only true color is supported. */
+struct client_format {
+	uint8_t bpp; // 8, 16 or 32
+	bool big_endian;
+
+	// The client's value for each level of each channel, already shifted.
+	uint32_t r[256], g[256], b[256];
+
+	// Matches ours, so that pixels need no translating.
+	bool native;
+};
+
+enum client_state {
+	CLIENT_VERSION,  // waiting for the client's ProtocolVersion
+	CLIENT_SECURITY, // waiting for it to pick a security type
+	CLIENT_INIT,	 // waiting for ClientInit
+	CLIENT_NORMAL,
+};
+
+struct rfb_client {
+	struct source src; // must be first
+
+	enum client_state state;
+	unsigned minor; // the protocol version is 3.minor
+
+	uint8_t in[CLIENT_INBUF];
+	size_t in_len;
+	size_t skip; // cut text still to be thrown away
+
+	struct buf out;
+	uint32_t events; // what we last asked epoll for
+
+	struct client_format pf;
+	int32_t encoding;
+
+	// Hung up, or sent something we can't make sense of. Freed once the
+	// current batch of events is through, since later ones might refer to
+	// it.
+	bool dead;
+
+	// Tiles that changed since this client last got them.
+	uint64_t *dirty;
+
+	// The client has asked for an update of this region (in tiles, end
+	// exclusive), and is waiting for one.
+	bool wants_update;
+	uint16_t req_x0, req_y0, req_x1, req_y1;
+
+	struct rfb_client *prev;
+	struct rfb_client *next;
+};
+
+struct subrect {
+	uint32_t px;
+	uint8_t x, y, w, h;
+};
+
+struct rfb_ctx {
+	uint16_t width, height;
+	uint16_t tiles_x, tiles_y;
+	size_t dirty_words;
+
+	const char *listen_addr;
+	bool is_unix;
+
+	int epoll_fd;
+	struct source listen;
+	struct source wake; // an eventfd, for new frames and stopping
+
+	// Frames as BGRA rows with no padding. rendering_show draws into
+	// `back` and swaps it into the mailbox (`pending`), and the server
+	// thread swaps that with `front` to send from it.
+	uint8_t *back, *pending, *front;
+
+	// A hash of each tile of `front`, to tell which ones a frame changed.
+	uint64_t *hashes;
+
+	pthread_mutex_t lock;
+	bool fresh; // `pending` has yet to be picked up
+	bool stopping;
+	pthread_t server_handle;
+
+	// Protected by `lock`.
+	struct present_stats stats;
+
+	// Only touched by the server thread.
+	struct rfb_client *clients;
+	size_t num_clients;
+	uint32_t tile[RFB_TILE * RFB_TILE]; // in the client's format
+	struct subrect subrects[RFB_TILE * RFB_TILE];
+};
+
+static void init_listener(struct rfb_ctx *);
+static void init_server(struct rfb_ctx *);
+static void *server_thread(void *);
+
+static void watch(struct rfb_ctx *, struct source *, uint32_t events);
+static void handle_frame(struct rfb_ctx *);
+static void handle_listen(struct rfb_ctx *);
+static void handle_client(struct rfb_ctx *, struct rfb_client *, uint32_t);
+static void client_free(struct rfb_ctx *, struct rfb_client *);
+static void reap_clients(struct rfb_ctx *);
+static bool client_parse(struct rfb_ctx *, struct rfb_client *);
+static bool client_flush(struct rfb_client *);
+static void client_update(struct rfb_ctx *, struct rfb_client *);
+static void send_update(struct rfb_ctx *, struct rfb_client *);
+
+static void client_format_native(struct client_format *);
+static bool client_format_set(struct client_format *, const uint8_t *msg);
+static uint64_t hash_tile(const uint8_t *frame, size_t stride, unsigned w,
+    unsigned h);
+
+void *rfb_rendering_init(const struct rendering_opts *opts)
+{
+	struct rfb_ctx *ctx = malloc(sizeof(struct rfb_ctx));
+	if (!ctx)
+		FATAL_ERR("rfb: failed to allocate rendering ctx");
+
+	ctx->width = opts->width ? opts->width : RFB_BACKEND_WIDTH;
+	ctx->height = opts->height ? opts->height : RFB_BACKEND_HEIGHT;
+	ctx->tiles_x = (ctx->width + RFB_TILE - 1) / RFB_TILE;
+	ctx->tiles_y = (ctx->height + RFB_TILE - 1) / RFB_TILE;
+	ctx->dirty_words = ((size_t)ctx->tiles_x * ctx->tiles_y + 63) / 64;
+
+	ctx->listen_addr =
+	    opts->rfb_listen ? opts->rfb_listen : RFB_BACKEND_PORT;
+
+	// Nothing's been shown yet, so the first frame is black.
+	const size_t size = (size_t)ctx->width * ctx->height * 4;
+	ctx->back = calloc(1, size);
+	ctx->pending = calloc(1, size);
+	ctx->front = calloc(1, size);
+	ctx->hashes = calloc((size_t)ctx->tiles_x * ctx->tiles_y, 8);
+	if (!ctx->back || !ctx->pending || !ctx->front || !ctx->hashes)
+		FATAL_ERR("rfb: failed to allocate frames");
+
+	init_listener(ctx);
+	init_server(ctx);
+
+	return ctx;
+}
+
+void rfb_rendering_cleanup(void *rfb_ctx)
+{
+	struct rfb_ctx *ctx = rfb_ctx;
+
+	int r;
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stopping = true;
+	pthread_mutex_unlock(&ctx->lock);
+
+	const uint64_t one = 1;
+	if (write(ctx->wake.fd, &one, sizeof(one)) != sizeof(one))
+		FATAL_ERR("rfb: failed to wake server thread: %s", STR_ERR);
+
+	r = pthread_join(ctx->server_handle, NULL);
+	if (r != 0)
+		FATAL_ERR("rfb: failed to join server thread: %s", strerror(r));
+
+	while (ctx->clients)
+		client_free(ctx, ctx->clients);
+
+	pthread_mutex_destroy(&ctx->lock);
+
+	close(ctx->listen.fd);
+	close(ctx->wake.fd);
+	close(ctx->epoll_fd);
+	if (ctx->is_unix)
+		unlink(ctx->listen_addr);
+
+	free(ctx->back);
+	free(ctx->pending);
+	free(ctx->front);
+	free(ctx->hashes);
+	free(ctx);
+}
+
+void rfb_rendering_ctx_log(const void *rfb_ctx)
+{
+	const struct rfb_ctx *ctx = rfb_ctx;
+
+	fprintf(stderr, "Size:\t%dx%d\n", ctx->width, ctx->height);
+	fprintf(stderr, "Listen:\t%s%s\n", ctx->is_unix ? "" : "127.0.0.1:",
+	    ctx->listen_addr);
+}
+
+void rfb_rendering_show(
+    void *rfb_ctx, struct canvas *c, const struct placement *pl)
+{
+	// Like DRM, this never waits on clients. Only one thread may call this
+	// at a time, since `back` is ours alone.
+	struct rfb_ctx *ctx = rfb_ctx;
+
+	canvas_materialize(
+	    c, pl, ctx->width, ctx->height, ctx->back, (size_t)ctx->width * 4);
+
+	pthread_mutex_lock(&ctx->lock);
+	uint8_t *const tmp = ctx->pending;
+	ctx->pending = ctx->back;
+	ctx->back = tmp;
+
+	// The newest frame wins.
+	if (ctx->fresh)
+		ctx->stats.dropped++;
+
+	ctx->fresh = true;
+	ctx->stats.queued++;
+	ctx->stats.copied_bytes += (size_t)ctx->width * ctx->height * 4;
+	pthread_mutex_unlock(&ctx->lock);
+
+	const uint64_t one = 1;
+	if (write(ctx->wake.fd, &one, sizeof(one)) != sizeof(one))
+		FATAL_ERR("rfb: failed to wake server thread: %s", STR_ERR);
+}
+
+void rfb_rendering_stats(void *rfb_ctx, struct present_stats *out)
+{
+	struct rfb_ctx *ctx = rfb_ctx;
+
+	pthread_mutex_lock(&ctx->lock);
+	*out = ctx->stats;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+void rfb_rendering_size(const void *rfb_ctx, uint16_t *width, uint16_t *height)
+{
+	const struct rfb_ctx *ctx = rfb_ctx;
+	*width = ctx->width;
+	*height = ctx->height;
+}
+
+size_t rfb_rendering_memory(const void *rfb_ctx)
+{
+	const struct rfb_ctx *ctx = rfb_ctx;
+
+	// Viewers' send buffers come and go, and aren't counted.
+	return (size_t)ctx->width * ctx->height * 4 * 3 +
+	    (size_t)ctx->tiles_x * ctx->tiles_y * sizeof(*ctx->hashes);
+}
+
+static void init_listener(struct rfb_ctx *ctx)
+{
+	const char *addr = ctx->listen_addr;
+
+	// A bare number is a port, which only ever goes on loopback: RFB
+	// without authentication has no business on a real network.
+	ctx->is_unix = addr[strspn(addr, "0123456789")] != '\0';
+
+	int fd;
+	if (ctx->is_unix) {
+		struct sockaddr_un sa = { .sun_family = AF_UNIX };
+		if (strlen(addr) >= sizeof(sa.sun_path))
+			FATAL_ERR("rfb: socket path too long: %s", addr);
+		strcpy(sa.sun_path, addr);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    0);
+		if (fd < 0)
+			FATAL_ERR("rfb: socket failed: %s", STR_ERR);
+
+		// Clear out whatever a previous instance left behind.
+		if (unlink(addr) != 0 && errno != ENOENT)
+			FATAL_ERR("rfb: couldn't remove stale socket: %s: %s",
+			    addr, STR_ERR);
+
+		if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+			FATAL_ERR("rfb: couldn't bind to %s: %s", addr,
+			    STR_ERR);
+	} else {
+		const unsigned long port = strtoul(addr, NULL, 10);
+		if (port < 1 || port > UINT16_MAX)
+			FATAL_ERR("rfb: bad port: %s", addr);
+
+		struct sockaddr_in sa = {
+			.sin_family = AF_INET,
+			.sin_port = htons(port),
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		};
+
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    0);
+		if (fd < 0)
+			FATAL_ERR("rfb: socket failed: %s", STR_ERR);
+
+		const int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+			FATAL_ERR("rfb: couldn't bind to port %s: %s", addr,
+			    STR_ERR);
+	}
+
+	if (listen(fd, SOMAXCONN) != 0)
+		FATAL_ERR("rfb: couldn't listen on %s: %s", addr, STR_ERR);
+
+	ctx->listen = (struct source) { SRC_LISTEN, fd };
+}
+
+static void init_server(struct rfb_ctx *ctx)
+{
+	int r;
+
+	ctx->fresh = false;
+	ctx->stopping = false;
+	ctx->stats = (struct present_stats) { 0 };
+	ctx->clients = NULL;
+	ctx->num_clients = 0;
+
+	if ((r = pthread_mutex_init(&ctx->lock, NULL)) != 0)
+		FATAL_ERR("rfb: pthread_mutex_init failed: %s", strerror(r));
+
+	ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx->epoll_fd < 0)
+		FATAL_ERR("rfb: epoll_create1 failed: %s", STR_ERR);
+
+	const int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fd < 0)
+		FATAL_ERR("rfb: couldn't create eventfd: %s", STR_ERR);
+	ctx->wake = (struct source) { SRC_WAKE, fd };
+
+	watch(ctx, &ctx->listen, EPOLLIN);
+	watch(ctx, &ctx->wake, EPOLLIN);
+
+	r = pthread_create(&ctx->server_handle, NULL, server_thread, ctx);
+	if (r != 0)
+		FATAL_ERR("rfb: failed to spawn server thread: %s",
+		    strerror(r));
+}
+
+static void watch(struct rfb_ctx *ctx, struct source *src, uint32_t events)
+{
+	struct epoll_event ev = {
+		.events = events,
+		.data.ptr = src,
+	};
+
+	if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, src->fd, &ev) != 0)
+		FATAL_ERR("rfb: can't watch fd %d: %s", src->fd, STR_ERR);
+}
+
+static void *server_thread(void *arg)
+{
+	struct rfb_ctx *ctx = arg;
+
+	for (;;) {
+		struct epoll_event events[MAX_EVENTS];
+		int n = epoll_wait(ctx->epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			FATAL_ERR("rfb: epoll_wait failed: %s", STR_ERR);
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct source *src = events[i].data.ptr;
+
+			switch (src->type) {
+			case SRC_LISTEN:
+				handle_listen(ctx);
+				break;
+			case SRC_WAKE:
+				uint64_t count;
+				if (read(src->fd, &count, sizeof(count)) < 0 &&
+				    errno != EAGAIN)
+					FATAL_ERR("rfb: couldn't read eventfd: "
+						  "%s",
+					    STR_ERR);
+
+				pthread_mutex_lock(&ctx->lock);
+				const bool stopping = ctx->stopping;
+				pthread_mutex_unlock(&ctx->lock);
+				if (stopping)
+					return NULL;
+
+				handle_frame(ctx);
+				break;
+			case SRC_CLIENT:
+				handle_client(ctx, (struct rfb_client *)src,
+				    events[i].events);
+				break;
+			}
+		}
+
+		reap_clients(ctx);
+	}
+}
+
+static void handle_frame(struct rfb_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+	const bool fresh = ctx->fresh;
+	if (fresh) {
+		uint8_t *const tmp = ctx->front;
+		ctx->front = ctx->pending;
+		ctx->pending = tmp;
+		ctx->fresh = false;
+		ctx->stats.presented++;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (!fresh)
+		return;
+
+	// Hashing the whole frame is the one cost that goes with its size
+	// rather than with how much of it changed, and it runs at about the
+	// speed of memory. Everything past here only touches changed tiles.
+	const size_t stride = (size_t)ctx->width * 4;
+	for (uint16_t ty = 0; ty < ctx->tiles_y; ty++) {
+		for (uint16_t tx = 0; tx < ctx->tiles_x; tx++) {
+			const size_t x = (size_t)tx * RFB_TILE;
+			const size_t y = (size_t)ty * RFB_TILE;
+			const unsigned w = ctx->width - x < RFB_TILE
+			    ? ctx->width - x
+			    : RFB_TILE;
+			const unsigned h = ctx->height - y < RFB_TILE
+			    ? ctx->height - y
+			    : RFB_TILE;
+
+			const uint64_t hash = hash_tile(
+			    &ctx->front[y * stride + x * 4], stride, w, h);
+
+			const size_t i = (size_t)ty * ctx->tiles_x + tx;
+			if (hash == ctx->hashes[i])
+				continue;
+
+			ctx->hashes[i] = hash;
+			for (struct rfb_client *c = ctx->clients; c;
+			    c = c->next)
+				c->dirty[i / 64] |= 1ull << (i % 64);
+		}
+	}
+
+	for (struct rfb_client *c = ctx->clients; c; c = c->next)
+		client_update(ctx, c);
+}
+
+static void handle_listen(struct rfb_ctx *ctx)
+{
+	for (;;) {
+		int fd = accept4(ctx->listen.fd, NULL, NULL,
+		    SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				fprintf(stderr, "rfb: accept failed: %s\n",
+				    STR_ERR);
+			return;
+		}
+
+		// Updates go out in one burst per request; don't hold the tail
+		// of one back waiting for an ACK.
+		if (!ctx->is_unix) {
+			const int on = 1;
+			setsockopt(
+			    fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		}
+
+		struct rfb_client *c = calloc(1, sizeof(struct rfb_client));
+		if (c)
+			c->dirty = calloc(ctx->dirty_words, sizeof(uint64_t));
+		if (!c || !c->dirty)
+			FATAL_ERR("rfb: failed to allocate client");
+
+		c->src = (struct source) { SRC_CLIENT, fd };
+		c->state = CLIENT_VERSION;
+		c->encoding = ENCODING_RAW;
+		client_format_native(&c->pf);
+
+		c->next = ctx->clients;
+		if (ctx->clients)
+			ctx->clients->prev = c;
+		ctx->clients = c;
+		ctx->num_clients++;
+
+		// Everything's new to a new client.
+		memset(c->dirty, 0xff, ctx->dirty_words * sizeof(uint64_t));
+
+		static const char version[] = "RFB 003.008\n";
+		size_t len = strlen(version);
+		c->out.data = malloc(len);
+		if (!c->out.data)
+			FATAL_ERR("rfb: failed to allocate client");
+		memcpy(c->out.data, version, len);
+		c->out.len = c->out.cap = len;
+
+		watch(ctx, &c->src, EPOLLIN);
+		c->events = EPOLLIN;
+		client_update(ctx, c);
+	}
+}
+
+static void reap_clients(struct rfb_ctx *ctx)
+{
+	for (struct rfb_client *c = ctx->clients; c;) {
+		struct rfb_client *next = c->next;
+		if (c->dead)
+			client_free(ctx, c);
+		c = next;
+	}
+}
+
+static void client_free(struct rfb_ctx *ctx, struct rfb_client *c)
+{
+	epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, c->src.fd, NULL);
+	close(c->src.fd);
+
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		ctx->clients = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	ctx->num_clients--;
+
+	free(c->out.data);
+	free(c->dirty);
+	free(c);
+}
+
+static void handle_client(
+    struct rfb_ctx *ctx, struct rfb_client *c, uint32_t events)
+{
+	if (c->dead)
+		return;
+
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		for (;;) {
+			const ssize_t n = recv(c->src.fd, &c->in[c->in_len],
+			    sizeof(c->in) - c->in_len, 0);
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+
+			if (n <= 0) {
+				c->dead = true;
+				return;
+			}
+
+			c->in_len += n;
+			if (!client_parse(ctx, c)) {
+				c->dead = true;
+				return;
+			}
+		}
+	}
+
+	client_update(ctx, c);
+}
+
+static uint8_t *buf_grow(struct buf *b, size_t n)
+{
+	if (b->len + n > b->cap) {
+		size_t cap = b->cap ? b->cap : 4096;
+		while (cap < b->len + n)
+			cap *= 2;
+
+		uint8_t *data = realloc(b->data, cap);
+		if (!data)
+			FATAL_ERR("rfb: failed to grow output buffer");
+
+		b->data = data;
+		b->cap = cap;
+	}
+
+	uint8_t *p = &b->data[b->len];
+	b->len += n;
+	return p;
+}
+
+static void put_u8(struct buf *b, uint8_t v)
+{
+	*buf_grow(b, 1) = v;
+}
+
+static void put_u16(struct buf *b, uint16_t v)
+{
+	uint8_t *p = buf_grow(b, 2);
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put_u32(struct buf *b, uint32_t v)
+{
+	uint8_t *p = buf_grow(b, 4);
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void store_pixel(uint8_t *p, const struct client_format *pf, uint32_t v)
+{
+	const size_t n = pf->bpp / 8;
+	for (size_t i = 0; i < n; i++) {
+		const size_t shift = pf->big_endian ? (n - 1 - i) * 8 : i * 8;
+		p[i] = v >> shift;
+	}
+}
+
+static void put_pixel(struct buf *b, const struct client_format *pf, uint32_t v)
+{
+	store_pixel(buf_grow(b, pf->bpp / 8), pf, v);
+}
+
+static uint16_t get_u16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | p[3];
+}
+
+/* The length of the complete message at the start of `in`, or 0 if more is
+ * needed. Returns -1 for garbage. */
+static ssize_t message_len(const uint8_t *in, size_t len)
+{
+	if (len < 1)
+		return 0;
+
+	size_t need;
+	switch (in[0]) {
+	case 0: // SetPixelFormat
+		need = 20;
+		break;
+	case 2: // SetEncodings
+		if (len < 4)
+			return 0;
+		need = 4 + (size_t)get_u16(&in[2]) * 4;
+		break;
+	case 3: // FramebufferUpdateRequest
+		need = 10;
+		break;
+	case 4: // KeyEvent
+		need = 8;
+		break;
+	case 5: // PointerEvent
+		need = 6;
+		break;
+	case 6: // ClientCutText, without the text
+		need = 8;
+		break;
+	default:
+		return -1;
+	}
+
+	if (need > CLIENT_INBUF)
+		return -1;
+
+	return len < need ? 0 : (ssize_t)need;
+}
+
+static void send_server_init(struct rfb_ctx *ctx, struct rfb_client *c)
+{
+	static const char name[] = "ttds";
+
+	put_u16(&c->out, ctx->width);
+	put_u16(&c->out, ctx->height);
+
+	// Our frames as they are: 32-bit little-endian BGRX.
+	static const uint8_t pf[16] = {
+		32, 24, 0, 1, 0, 255, 0, 255, 0, 255, 16, 8, 0,
+	};
+	memcpy(buf_grow(&c->out, sizeof(pf)), pf, sizeof(pf));
+
+	put_u32(&c->out, strlen(name));
+	memcpy(buf_grow(&c->out, strlen(name)), name, strlen(name));
+}
+
+static void handle_update_request(
+    struct rfb_ctx *ctx, struct rfb_client *c, const uint8_t *msg)
+{
+	const bool incremental = msg[1];
+	const uint32_t x = get_u16(&msg[2]);
+	const uint32_t y = get_u16(&msg[4]);
+	const uint32_t w = get_u16(&msg[6]);
+	const uint32_t h = get_u16(&msg[8]);
+
+	if (w == 0 || h == 0 || x >= ctx->width || y >= ctx->height)
+		return;
+
+	const uint16_t x0 = x / RFB_TILE;
+	const uint16_t y0 = y / RFB_TILE;
+	uint16_t x1 = (x + w + RFB_TILE - 1) / RFB_TILE;
+	uint16_t y1 = (y + h + RFB_TILE - 1) / RFB_TILE;
+	if (x1 > ctx->tiles_x)
+		x1 = ctx->tiles_x;
+	if (y1 > ctx->tiles_y)
+		y1 = ctx->tiles_y;
+
+	if (!incremental) {
+		for (uint16_t ty = y0; ty < y1; ty++) {
+			for (uint16_t tx = x0; tx < x1; tx++) {
+				const size_t i = (size_t)ty * ctx->tiles_x + tx;
+				c->dirty[i / 64] |= 1ull << (i % 64);
+			}
+		}
+	}
+
+	// Requests made before the last one was answered just widen it.
+	if (!c->wants_update) {
+		c->req_x0 = x0;
+		c->req_y0 = y0;
+		c->req_x1 = x1;
+		c->req_y1 = y1;
+	} else {
+		c->req_x0 = x0 < c->req_x0 ? x0 : c->req_x0;
+		c->req_y0 = y0 < c->req_y0 ? y0 : c->req_y0;
+		c->req_x1 = x1 > c->req_x1 ? x1 : c->req_x1;
+		c->req_y1 = y1 > c->req_y1 ? y1 : c->req_y1;
+	}
+	c->wants_update = true;
+}
+
+static void handle_set_encodings(struct rfb_client *c, const uint8_t *msg)
+{
+	// Take the first encoding the client lists that we have. Raw always
+	// works, whether it's listed or not.
+	const uint16_t n = get_u16(&msg[2]);
+	c->encoding = ENCODING_RAW;
+	for (uint16_t i = 0; i < n; i++) {
+		const int32_t enc = (int32_t)get_u32(&msg[4 + i * 4]);
+		if (enc == ENCODING_RAW || enc == ENCODING_RRE ||
+		    enc == ENCODING_HEXTILE) {
+			c->encoding = enc;
+			return;
+		}
+	}
+}
+
+/* Act on whatever complete messages are in the client's input. Returns false
+ * if the client should be dropped. */
+static bool client_parse(struct rfb_ctx *ctx, struct rfb_client *c)
+{
+	size_t off = 0;
+
+	for (;;) {
+		const uint8_t *in = &c->in[off];
+		const size_t len = c->in_len - off;
+
+		if (c->skip > 0) {
+			const size_t n = c->skip < len ? c->skip : len;
+			c->skip -= n;
+			off += n;
+			if (c->skip > 0)
+				break;
+			continue;
+		}
+
+		if (c->state == CLIENT_VERSION) {
+			if (len < 12)
+				break;
+
+			unsigned major, minor;
+			if (memcmp(in, "RFB ", 4) != 0 || in[11] != '\n' ||
+			    sscanf((const char *)&in[4], "%3u.%3u", &major,
+				&minor) != 2 ||
+			    major != 3)
+				return false;
+
+			// Anything between the versions we know behaves like
+			// the one before it.
+			c->minor = minor >= 8 ? 8 : minor >= 7 ? 7 : 3;
+			off += 12;
+
+			if (c->minor == 3) {
+				// The server picks, and there's only None.
+				put_u32(&c->out, 1);
+				c->state = CLIENT_INIT;
+			} else {
+				put_u8(&c->out, 1);
+				put_u8(&c->out, 1); // None
+				c->state = CLIENT_SECURITY;
+			}
+			continue;
+		}
+
+		if (c->state == CLIENT_SECURITY) {
+			if (len < 1)
+				break;
+
+			if (in[0] != 1)
+				return false;
+
+			off += 1;
+			if (c->minor >= 8)
+				put_u32(&c->out, 0); // SecurityResult: OK
+			c->state = CLIENT_INIT;
+			continue;
+		}
+
+		if (c->state == CLIENT_INIT) {
+			if (len < 1)
+				break;
+
+			// Every client shares the screen, whatever it asks.
+			off += 1;
+			send_server_init(ctx, c);
+			c->state = CLIENT_NORMAL;
+			continue;
+		}
+
+		const ssize_t n = message_len(in, len);
+		if (n < 0)
+			return false;
+		if (n == 0)
+			break;
+
+		switch (in[0]) {
+		case 0:
+			if (!client_format_set(&c->pf, in)) {
+				fprintf(stderr, "rfb: client wants a pixel "
+						"format we can't do\n");
+				return false;
+			}
+			break;
+		case 2:
+			handle_set_encodings(c, in);
+			break;
+		case 3:
+			handle_update_request(ctx, c, in);
+			break;
+		case 6:
+			c->skip = get_u32(&in[4]);
+			break;
+		default:
+			// This is a view-only server, so key and pointer events
+			// go nowhere.
+			break;
+		}
+		off += n;
+	}
+
+	memmove(c->in, &c->in[off], c->in_len - off);
+	c->in_len -= off;
+	return true;
+}
+
+/* Write out as much as the socket takes. Returns false if the client is
+ * gone. */
+static bool client_flush(struct rfb_client *c)
+{
+	while (c->out.off < c->out.len) {
+		const ssize_t n = send(c->src.fd, &c->out.data[c->out.off],
+		    c->out.len - c->out.off, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			return false;
+		}
+		c->out.off += n;
+	}
+
+	c->out.off = 0;
+	c->out.len = 0;
+	return true;
+}
+
+/* Send the client an update if it's ready for one, write out what we can,
+ * and watch for whatever's needed next. */
+static void client_update(struct rfb_ctx *ctx, struct rfb_client *c)
+{
+	if (c->dead)
+		return;
+
+	// An update only goes out once the last one is fully written, so a
+	// slow client gets fewer, bigger updates rather than a backlog.
+	if (c->out.len == 0 && c->state == CLIENT_NORMAL && c->wants_update)
+		send_update(ctx, c);
+
+	if (!client_flush(c)) {
+		c->dead = true;
+		return;
+	}
+
+	// Once that's written, there may well be another update to send.
+	uint32_t events = EPOLLIN;
+	if (c->out.len > 0)
+		events |= EPOLLOUT;
+
+	if (events != c->events) {
+		struct epoll_event ev = {
+			.events = events,
+			.data.ptr = &c->src,
+		};
+		if (epoll_ctl(
+			ctx->epoll_fd, EPOLL_CTL_MOD, c->src.fd, &ev) != 0)
+			FATAL_ERR("rfb: can't watch client: %s", STR_ERR);
+		c->events = events;
+	}
+}
+
+static void client_format_native(struct client_format *pf)
+{
+	pf->bpp = 32;
+	pf->big_endian = false;
+	pf->native = true;
+	for (unsigned i = 0; i < 256; i++) {
+		pf->r[i] = i << 16;
+		pf->g[i] = i << 8;
+		pf->b[i] = i;
+	}
+}
+
+static bool client_format_set(struct client_format *pf, const uint8_t *msg)
+{
+	const uint8_t *in = &msg[4];
+	const uint8_t bpp = in[0];
+	const bool big_endian = in[2];
+	const bool true_color = in[3];
+	const uint16_t max[] = { get_u16(&in[4]), get_u16(&in[6]),
+		get_u16(&in[8]) };
+	const uint8_t shift[] = { in[10], in[11], in[12] };
+
+	// Color maps would need a palette sent along, and nobody uses them.
+	if (!true_color || (bpp != 8 && bpp != 16 && bpp != 32))
+		return false;
+
+	for (size_t i = 0; i < 3; i++) {
+		if (max[i] == 0 || shift[i] >= bpp ||
+		    (uint32_t)max[i] << shift[i] >> shift[i] != max[i])
+			return false;
+	}
+
+	pf->bpp = bpp;
+	pf->big_endian = big_endian;
+	pf->native = bpp == 32 && !big_endian && max[0] == 255 &&
+	    max[1] == 255 && max[2] == 255 && shift[0] == 16 &&
+	    shift[1] == 8 && shift[2] == 0;
+
+	uint32_t *const tables[] = { pf->r, pf->g, pf->b };
+	for (size_t i = 0; i < 3; i++) {
+		for (uint32_t v = 0; v < 256; v++)
+			tables[i][v] = (v * max[i] + 127) / 255 << shift[i];
+	}
+
+	return true;
+}
+
+/* Pull a tile of the frame into ctx->tile, as the client's pixel values. */
+static void load_tile(struct rfb_ctx *ctx, const struct client_format *pf,
+    size_t x, size_t y, unsigned w, unsigned h)
+{
+	const size_t stride = (size_t)ctx->width * 4;
+	for (unsigned row = 0; row < h; row++) {
+		const uint8_t *in = &ctx->front[(y + row) * stride + x * 4];
+		uint32_t *out = &ctx->tile[row * RFB_TILE];
+
+		if (pf->native) {
+			for (unsigned i = 0; i < w; i++) {
+				uint32_t px;
+				memcpy(&px, &in[i * 4], 4);
+				out[i] = px & 0xffffff;
+			}
+			continue;
+		}
+
+		for (unsigned i = 0; i < w; i++) {
+			out[i] = pf->b[in[i * 4]] | pf->g[in[i * 4 + 1]] |
+			    pf->r[in[i * 4 + 2]];
+		}
+	}
+}
+
+/* The most common color of a block, going by the first two colors found. Sets
+ * `colors` to how many different ones there are, stopping at 3. */
+static uint32_t pick_background(
+    const uint32_t *px, unsigned w, unsigned h, unsigned *colors)
+{
+	uint32_t c[2] = { px[0], 0 };
+	size_t n[2] = { 0, 0 };
+	*colors = 1;
+
+	for (unsigned y = 0; y < h; y++) {
+		for (unsigned x = 0; x < w; x++) {
+			const uint32_t v = px[y * RFB_TILE + x];
+			if (v == c[0]) {
+				n[0]++;
+			} else if (*colors == 1) {
+				c[1] = v;
+				n[1]++;
+				*colors = 2;
+			} else if (v == c[1]) {
+				n[1]++;
+			} else {
+				*colors = 3;
+			}
+		}
+	}
+
+	return n[1] > n[0] ? c[1] : c[0];
+}
+
+/* Cover every pixel of a block that isn't `bg` with rectangles of one color,
+ * greedily: take the run at the first pixel left uncovered, then grow it down
+ * for as long as the rows below match. Returns how many it took, or -1 if that
+ * would be more than `max`. */
+static int find_subrects(const uint32_t *px, unsigned w, unsigned h,
+    uint32_t bg, struct subrect *out, int max)
+{
+	uint64_t covered[RFB_TILE] = { 0 };
+	int n = 0;
+
+	for (unsigned y = 0; y < h; y++) {
+		for (unsigned x = 0; x < w; x++) {
+			const uint32_t v = px[y * RFB_TILE + x];
+			if (v == bg || (covered[y] >> x & 1))
+				continue;
+
+			unsigned len = 1;
+			while (x + len < w && px[y * RFB_TILE + x + len] == v &&
+			    !(covered[y] >> (x + len) & 1))
+				len++;
+
+			const uint64_t mask =
+			    (len == 64 ? ~0ull : (1ull << len) - 1) << x;
+
+			unsigned y1 = y + 1;
+			for (; y1 < h; y1++) {
+				if (covered[y1] & mask)
+					break;
+
+				const uint32_t *row = &px[y1 * RFB_TILE + x];
+				unsigned i = 0;
+				while (i < len && row[i] == v)
+					i++;
+				if (i < len)
+					break;
+			}
+
+			if (n == max)
+				return -1;
+
+			for (unsigned i = y; i < y1; i++)
+				covered[i] |= mask;
+
+			out[n++] = (struct subrect) {
+				.px = v,
+				.x = x,
+				.y = y,
+				.w = len,
+				.h = y1 - y,
+			};
+			x += len - 1;
+		}
+	}
+
+	return n;
+}
+
+static void put_rect_header(struct buf *b, size_t x, size_t y, unsigned w,
+    unsigned h, int32_t encoding)
+{
+	put_u16(b, x);
+	put_u16(b, y);
+	put_u16(b, w);
+	put_u16(b, h);
+	put_u32(b, (uint32_t)encoding);
+}
+
+static void put_raw(struct buf *b, const struct client_format *pf,
+    const uint32_t *px, unsigned w, unsigned h)
+{
+	const size_t bpp = pf->bpp / 8;
+	for (unsigned y = 0; y < h; y++) {
+		uint8_t *out = buf_grow(b, w * bpp);
+		const uint32_t *row = &px[y * RFB_TILE];
+
+		if (pf->native) {
+			memcpy(out, row, w * 4);
+			continue;
+		}
+
+		for (unsigned x = 0; x < w; x++)
+			store_pixel(&out[x * bpp], pf, row[x]);
+	}
+}
+
+static void encode_rre(struct rfb_ctx *ctx, struct rfb_client *c, size_t x,
+    size_t y, unsigned w, unsigned h)
+{
+	const size_t bpp = c->pf.bpp / 8;
+
+	// Give up on RRE as soon as it's no smaller than raw.
+	unsigned colors;
+	const uint32_t bg = pick_background(ctx->tile, w, h, &colors);
+	const long max =
+	    ((long)(w * h * bpp) - 4 - (long)bpp) / (long)(bpp + 8);
+	const int n = max < 0
+	    ? -1
+	    : find_subrects(ctx->tile, w, h, bg, ctx->subrects, max);
+
+	if (n < 0) {
+		put_rect_header(&c->out, x, y, w, h, ENCODING_RAW);
+		put_raw(&c->out, &c->pf, ctx->tile, w, h);
+		return;
+	}
+
+	put_rect_header(&c->out, x, y, w, h, ENCODING_RRE);
+	put_u32(&c->out, n);
+	put_pixel(&c->out, &c->pf, bg);
+	for (int i = 0; i < n; i++) {
+		const struct subrect *r = &ctx->subrects[i];
+		put_pixel(&c->out, &c->pf, r->px);
+		put_u16(&c->out, r->x);
+		put_u16(&c->out, r->y);
+		put_u16(&c->out, r->w);
+		put_u16(&c->out, r->h);
+	}
+}
+
+static void encode_hextile(struct rfb_ctx *ctx, struct rfb_client *c,
+    size_t x, size_t y, unsigned w, unsigned h)
+{
+	const size_t bpp = c->pf.bpp / 8;
+	struct buf *out = &c->out;
+
+	put_rect_header(out, x, y, w, h, ENCODING_HEXTILE);
+
+	// Colors carry over from one subtile to the next, until a raw one
+	// (or, for the foreground, a coloured one) leaves them undefined.
+	bool have_bg = false, have_fg = false;
+	uint32_t bg = 0, fg = 0;
+
+	for (unsigned sy = 0; sy < h; sy += 16) {
+		for (unsigned sx = 0; sx < w; sx += 16) {
+			const unsigned sw = w - sx < 16 ? w - sx : 16;
+			const unsigned sh = h - sy < 16 ? h - sy : 16;
+			const uint32_t *px = &ctx->tile[sy * RFB_TILE + sx];
+
+			unsigned colors;
+			const uint32_t sbg =
+			    pick_background(px, sw, sh, &colors);
+
+			int n = 0;
+			if (colors > 1)
+				n = find_subrects(
+				    px, sw, sh, sbg, ctx->subrects, 255);
+
+			const bool new_bg = !have_bg || sbg != bg;
+			const bool coloured = colors > 2;
+			const bool new_fg = colors == 2 &&
+			    (!have_fg || ctx->subrects[0].px != fg);
+
+			size_t size = 1 + (new_bg ? bpp : 0);
+			if (colors > 1) {
+				size += 1 + (new_fg ? bpp : 0);
+				size += (size_t)n * (coloured ? bpp + 2 : 2);
+			}
+
+			if (n < 0 || size >= 1 + (size_t)sw * sh * bpp) {
+				put_u8(out, HEXTILE_RAW);
+				put_raw(out, &c->pf, px, sw, sh);
+				have_bg = have_fg = false;
+				continue;
+			}
+
+			uint8_t flags = new_bg ? HEXTILE_BACKGROUND : 0;
+			if (colors > 1)
+				flags |= HEXTILE_ANY_SUBRECTS;
+			if (coloured)
+				flags |= HEXTILE_SUBRECTS_COLOURED;
+			if (new_fg)
+				flags |= HEXTILE_FOREGROUND;
+
+			put_u8(out, flags);
+			if (new_bg)
+				put_pixel(out, &c->pf, sbg);
+			if (new_fg)
+				put_pixel(out, &c->pf, ctx->subrects[0].px);
+
+			have_bg = true;
+			bg = sbg;
+			if (new_fg) {
+				have_fg = true;
+				fg = ctx->subrects[0].px;
+			}
+			if (coloured)
+				have_fg = false;
+
+			if (colors == 1)
+				continue;
+
+			put_u8(out, n);
+			for (int i = 0; i < n; i++) {
+				const struct subrect *r = &ctx->subrects[i];
+				if (coloured)
+					put_pixel(out, &c->pf, r->px);
+				put_u8(out, r->x << 4 | r->y);
+				put_u8(out, (r->w - 1) << 4 | (r->h - 1));
+			}
+		}
+	}
+}
+
+static void send_update(struct rfb_ctx *ctx, struct rfb_client *c)
+{
+	// Changed tiles in the requested region, as many as fit in a message.
+	size_t count = 0;
+	for (uint16_t ty = c->req_y0; ty < c->req_y1; ty++) {
+		for (uint16_t tx = c->req_x0; tx < c->req_x1; tx++) {
+			const size_t i = (size_t)ty * ctx->tiles_x + tx;
+			if (c->dirty[i / 64] >> (i % 64) & 1)
+				count++;
+		}
+	}
+
+	// Nothing's changed, so the request waits for something that does.
+	if (count == 0)
+		return;
+
+	if (count > UINT16_MAX)
+		count = UINT16_MAX;
+
+	put_u8(&c->out, 0); // FramebufferUpdate
+	put_u8(&c->out, 0);
+	put_u16(&c->out, count);
+
+	size_t sent = 0;
+	for (uint16_t ty = c->req_y0; ty < c->req_y1 && sent < count; ty++) {
+		for (uint16_t tx = c->req_x0; tx < c->req_x1 && sent < count;
+		    tx++) {
+			const size_t i = (size_t)ty * ctx->tiles_x + tx;
+			if (!(c->dirty[i / 64] >> (i % 64) & 1))
+				continue;
+
+			c->dirty[i / 64] &= ~(1ull << (i % 64));
+			sent++;
+
+			const size_t x = (size_t)tx * RFB_TILE;
+			const size_t y = (size_t)ty * RFB_TILE;
+			const unsigned w = ctx->width - x < RFB_TILE
+			    ? ctx->width - x
+			    : RFB_TILE;
+			const unsigned h = ctx->height - y < RFB_TILE
+			    ? ctx->height - y
+			    : RFB_TILE;
+
+			load_tile(ctx, &c->pf, x, y, w, h);
+
+			switch (c->encoding) {
+			case ENCODING_HEXTILE:
+				encode_hextile(ctx, c, x, y, w, h);
+				break;
+			case ENCODING_RRE:
+				encode_rre(ctx, c, x, y, w, h);
+				break;
+			default:
+				put_rect_header(
+				    &c->out, x, y, w, h, ENCODING_RAW);
+				put_raw(&c->out, &c->pf, ctx->tile, w, h);
+				break;
+			}
+		}
+	}
+
+	c->wants_update = false;
+}
+
+#define HASH_PRIME 0x9e3779b97f4a7c15ull
+
+static uint64_t hash_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+/* Hash a tile's pixels. Each 16 bytes of a row is keyed by its position and
+ * folded in with a 32x32-bit multiply, two lanes at a time with SSE2, the same
+ * as xxHash's long-input loop. Only equality within one run matters, so the
+ * scalar version needn't agree with it. */
+static uint64_t hash_tile(
+    const uint8_t *frame, size_t stride, unsigned w, unsigned h)
+{
+	const size_t bytes = (size_t)w * 4;
+	uint64_t tail = HASH_PRIME;
+
+#ifdef __SSE2__
+	__m128i acc = _mm_set_epi64x(HASH_PRIME, ~HASH_PRIME);
+	const __m128i step = _mm_set1_epi32(0x61c88647);
+
+	for (unsigned y = 0; y < h; y++) {
+		const uint8_t *row = &frame[y * stride];
+		__m128i key = _mm_set_epi32(y, ~y, y * 3 + 1, y * 5 + 7);
+
+		size_t i = 0;
+		for (; i + 16 <= bytes; i += 16) {
+			const __m128i v =
+			    _mm_loadu_si128((const __m128i *)&row[i]);
+			key = _mm_add_epi32(key, step);
+			const __m128i k = _mm_xor_si128(v, key);
+			const __m128i prod =
+			    _mm_mul_epu32(k, _mm_srli_epi64(k, 32));
+			acc = _mm_add_epi64(acc, _mm_shuffle_epi32(v, 0x4e));
+			acc = _mm_add_epi64(acc, prod);
+		}
+
+		for (; i < bytes; i += 4) {
+			uint32_t px;
+			memcpy(&px, &row[i], 4);
+			tail ^= px ^ ((uint64_t)i << 32 | y);
+			tail *= HASH_PRIME;
+		}
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	return hash_mix(lanes[0] ^ hash_mix(lanes[1] ^ tail));
+#else
+	for (unsigned y = 0; y < h; y++) {
+		const uint8_t *row = &frame[y * stride];
+		for (size_t i = 0; i < bytes; i += 8) {
+			uint64_t v = 0;
+			memcpy(&v, &row[i], bytes - i < 8 ? bytes - i : 8);
+			tail ^= v ^ ((uint64_t)i << 32 | y);
+			tail *= HASH_PRIME;
+			tail ^= tail >> 29;
+		}
+	}
+
+	return hash_mix(tail);
+#endif
+}
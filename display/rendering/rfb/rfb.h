@@ -0,0 +1,18 @@
+#pragma once
+
+#include "../canvas.h"
+#include "../rendering.h"
+
+#define RFB_BACKEND_WIDTH 640
+#define RFB_BACKEND_HEIGHT 480
+#define RFB_BACKEND_PORT "5900"
+
+void *rfb_rendering_init(const struct rendering_opts *);
+void rfb_rendering_cleanup(void *rfb_ctx);
+void rfb_rendering_ctx_log(const void *rfb_ctx);
+void rfb_rendering_show(
+    void *rfb_ctx, struct canvas *, const struct placement *);
+void rfb_rendering_stats(void *rfb_ctx, struct present_stats *);
+void rfb_rendering_size(
+    const void *rfb_ctx, uint16_t *width, uint16_t *height);
+size_t rfb_rendering_memory(const void *rfb_ctx);
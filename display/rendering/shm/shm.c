@@ -0,0 +1,250 @@
+#define _GNU_SOURCE // memfd_create
+
+#include "shm.h"
+
+#include "../../abort.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+struct shm_ctx {
+	uint16_t width, height;
+	uint32_t stride;
+
+	// Null for a memfd, which readers find through /proc instead.
+	const char *path;
+	int fd;
+
+	uint8_t *map;
+	size_t map_size;
+	struct shm_header *header;
+
+	// Presents happen synchronously, so nothing is ever dropped.
+	struct present_stats stats;
+};
+
+static void seq_begin(_Atomic uint64_t *seq);
+static void seq_end(_Atomic uint64_t *seq);
+static bool find_damage(const struct shm_ctx *, const uint8_t *prev,
+    const uint8_t *cur, uint16_t out[4]);
+
+void *shm_rendering_init(const struct rendering_opts *opts)
+{
+	struct shm_ctx *ctx = malloc(sizeof(struct shm_ctx));
+	if (!ctx)
+		FATAL_ERR("shm: failed to allocate rendering ctx");
+
+	ctx->width = opts->width ? opts->width : SHM_BACKEND_WIDTH;
+	ctx->height = opts->height ? opts->height : SHM_BACKEND_HEIGHT;
+	ctx->path = opts->shm_path;
+
+	// Rows start on cache lines, and frames on pages, so that readers can
+	// map or copy either without straddling.
+	ctx->stride = ((uint32_t)ctx->width * 4 + 63) & ~63u;
+	const size_t page = sysconf(_SC_PAGESIZE);
+	const size_t frame = ((size_t)ctx->stride * ctx->height + page - 1) /
+	    page * page;
+	const size_t header = (sizeof(struct shm_header) + page - 1) / page *
+	    page;
+	ctx->map_size = header + frame * SHM_BUFS;
+
+	if (ctx->path) {
+		// The screen's contents are nobody else's business.
+		ctx->fd = open(ctx->path,
+		    O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (ctx->fd < 0)
+			FATAL_ERR("shm: couldn't open '%s': %s", ctx->path,
+			    STR_ERR);
+	} else {
+		ctx->fd = memfd_create("ttds-frame", MFD_CLOEXEC);
+		if (ctx->fd < 0)
+			FATAL_ERR("shm: memfd_create failed: %s", STR_ERR);
+	}
+
+	if (ftruncate(ctx->fd, ctx->map_size) != 0)
+		FATAL_ERR("shm: couldn't size frame buffers: %s", STR_ERR);
+
+	ctx->map = mmap(NULL, ctx->map_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, ctx->fd, 0);
+	if (ctx->map == MAP_FAILED)
+		FATAL_ERR("shm: couldn't map frame buffers: %s", STR_ERR);
+
+	// A fresh file is all zeroes, which already makes for black frames
+	// and even sequence numbers.
+	struct shm_header *h = (struct shm_header *)ctx->map;
+	memcpy(h->magic, SHM_MAGIC, sizeof(h->magic));
+	h->header_size = sizeof(struct shm_header);
+	h->num_bufs = SHM_BUFS;
+	h->width = ctx->width;
+	h->height = ctx->height;
+	h->stride = ctx->stride;
+	h->state = SHM_STATE_LIVE;
+	h->latest = 0;
+	h->frame = 0;
+	for (size_t i = 0; i < SHM_BUFS; i++)
+		h->bufs[i].offset = header + frame * i;
+	ctx->header = h;
+
+	ctx->stats = (struct present_stats) { 0 };
+
+	return ctx;
+}
+
+void shm_rendering_cleanup(void *shm_ctx)
+{
+	struct shm_ctx *ctx = shm_ctx;
+
+	// Readers may hang on to the mapping, so tell them it's over. A path
+	// would just show a stale frame to the next one, so it goes too.
+	seq_begin(&ctx->header->seq);
+	ctx->header->state = SHM_STATE_CLOSED;
+	seq_end(&ctx->header->seq);
+
+	if (ctx->path)
+		unlink(ctx->path);
+
+	if (munmap(ctx->map, ctx->map_size) != 0)
+		FATAL_ERR("shm: failed to unmap frame buffers: %s", STR_ERR);
+
+	if (close(ctx->fd) != 0)
+		FATAL_ERR("shm: failed to close frame buffers: %s", STR_ERR);
+
+	free(ctx);
+}
+
+void shm_rendering_ctx_log(const void *shm_ctx)
+{
+	const struct shm_ctx *ctx = shm_ctx;
+
+	fprintf(stderr, "Size:\t%dx%d\n", ctx->width, ctx->height);
+	if (ctx->path)
+		fprintf(stderr, "Frames:\t%s\n", ctx->path);
+	else
+		fprintf(stderr, "Frames:\t/proc/%d/fd/%d\n", getpid(), ctx->fd);
+}
+
+void shm_rendering_show(
+    void *shm_ctx, struct canvas *c, const struct placement *pl)
+{
+	// Readers can't hold this up: the buffer about to be written is the
+	// one they were told about the longest ago, and any still reading it
+	// find out from its sequence number.
+	struct shm_ctx *ctx = shm_ctx;
+	struct shm_header *h = ctx->header;
+
+	const uint32_t prev = h->latest;
+	const uint32_t next = (prev + 1) % SHM_BUFS;
+	struct shm_buffer *buf = &h->bufs[next];
+	uint8_t *pixels = &ctx->map[buf->offset];
+
+	seq_begin(&buf->seq);
+	canvas_materialize(c, pl, ctx->width, ctx->height, pixels, ctx->stride);
+	buf->frame = h->frame + 1;
+	seq_end(&buf->seq);
+
+	uint16_t damage[4] = { 0, 0, ctx->width, ctx->height };
+	if (h->frame > 0 &&
+	    !find_damage(ctx, &ctx->map[h->bufs[prev].offset], pixels, damage))
+		damage[2] = damage[3] = 0;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	seq_begin(&h->seq);
+	h->latest = next;
+	h->frame++;
+	h->present_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	h->damage_x = damage[0];
+	h->damage_y = damage[1];
+	h->damage_w = damage[2];
+	h->damage_h = damage[3];
+	seq_end(&h->seq);
+
+	ctx->stats.queued++;
+	ctx->stats.presented++;
+	ctx->stats.copied_bytes += (size_t)ctx->stride * ctx->height;
+}
+
+void shm_rendering_stats(void *shm_ctx, struct present_stats *out)
+{
+	const struct shm_ctx *ctx = shm_ctx;
+	*out = ctx->stats;
+}
+
+void shm_rendering_size(
+    const void *shm_ctx, uint16_t *width, uint16_t *height)
+{
+	const struct shm_ctx *ctx = shm_ctx;
+	*width = ctx->width;
+	*height = ctx->height;
+}
+
+size_t shm_rendering_memory(const void *shm_ctx)
+{
+	const struct shm_ctx *ctx = shm_ctx;
+	return ctx->map_size;
+}
+
+/* Make `seq` odd, before anything it guards is touched. */
+static void seq_begin(_Atomic uint64_t *seq)
+{
+	const uint64_t s = atomic_load_explicit(seq, memory_order_relaxed);
+	atomic_store_explicit(seq, s + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+/* Make `seq` even again, after everything it guards is written. */
+static void seq_end(_Atomic uint64_t *seq)
+{
+	const uint64_t s = atomic_load_explicit(seq, memory_order_relaxed);
+	atomic_store_explicit(seq, s + 1, memory_order_release);
+}
+
+/* The bounding box of the pixels that differ between two frames, as x, y, w
+ * and h. Returns false if none do. */
+static bool find_damage(const struct shm_ctx *ctx, const uint8_t *prev,
+    const uint8_t *cur, uint16_t out[4])
+{
+	const size_t row_bytes = (size_t)ctx->width * 4;
+	size_t x0 = ctx->width, x1 = 0;
+	size_t y0 = ctx->height, y1 = 0;
+
+	for (size_t y = 0; y < ctx->height; y++) {
+		const uint32_t *a = (const uint32_t *)&prev[y * ctx->stride];
+		const uint32_t *b = (const uint32_t *)&cur[y * ctx->stride];
+		if (memcmp(a, b, row_bytes) == 0)
+			continue;
+
+		size_t l = 0;
+		while (a[l] == b[l])
+			l++;
+
+		size_t r = ctx->width;
+		while (a[r - 1] == b[r - 1])
+			r--;
+
+		x0 = l < x0 ? l : x0;
+		x1 = r > x1 ? r : x1;
+		if (y0 == ctx->height)
+			y0 = y;
+		y1 = y + 1;
+	}
+
+	if (y0 == ctx->height)
+		return false;
+
+	out[0] = x0;
+	out[1] = y0;
+	out[2] = x1 - x0;
+	out[3] = y1 - y0;
+	return true;
+}
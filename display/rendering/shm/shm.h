@@ -0,0 +1,76 @@
+#pragma once
+
+#include "../canvas.h"
+#include "../rendering.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define SHM_BACKEND_WIDTH 640
+#define SHM_BACKEND_HEIGHT 480
+
+/* The SHM backend presents straight into a shared mapping that other local
+ * processes can read the latest frame from, in place. This is its layout, which
+ * is all a reader needs: a header, then SHM_BUFS frames of pixels (BGRX, i.e.
+ * little-endian XRGB8888) at the offsets it gives.
+ *
+ * The writer never waits on readers. Each present goes into the buffer after
+ * `latest`, then publishes it, so a reader has two presents' time to finish
+ * with a frame before it's reused. To read one:
+ *
+ *   1. Load `seq`; retry while it's odd. Read `latest`, `frame` and `damage`,
+ *      then load `seq` again, and start over if it changed.
+ *   2. Load the buffer's `seq` (again, even), read the pixels, and check that
+ *      its `seq` and `frame` are still what they were. If not, the writer
+ *      lapped the reader, and the pixels may be torn.
+ *
+ * All integers are native-endian. Once `state` is SHM_STATE_CLOSED, nothing
+ * will be written again. */
+
+#define SHM_MAGIC "TTDSSHM1"
+#define SHM_BUFS 3
+
+enum shm_state {
+	SHM_STATE_LIVE = 1,
+	SHM_STATE_CLOSED = 2,
+};
+
+struct shm_buffer {
+	_Atomic uint64_t seq; // odd while being written
+	uint64_t frame;	      // the frame it holds, or 0 for none yet
+	uint64_t offset;      // of its pixels, from the start of the mapping
+};
+
+struct shm_header {
+	char magic[8];
+	uint32_t header_size; // sizeof(struct shm_header)
+	uint32_t num_bufs;    // SHM_BUFS
+	uint16_t width, height;
+	uint32_t stride; // bytes from one row to the next
+
+	// Guarded by `seq`, which is odd while they're being changed.
+	_Atomic uint64_t seq;
+	uint32_t state;
+	uint32_t latest;     // the buffer holding `frame`
+	uint64_t frame;	     // counts presents, from 1
+	uint64_t present_ns; // CLOCK_MONOTONIC, when `frame` was published
+
+	// What differs from frame - 1, or the whole screen for the first. A
+	// reader that skipped frames has to assume everything changed.
+	uint16_t damage_x, damage_y, damage_w, damage_h;
+
+	struct shm_buffer bufs[SHM_BUFS];
+};
+
+static_assert(sizeof(struct shm_header) == 136, "the layout is an ABI");
+
+void *shm_rendering_init(const struct rendering_opts *);
+void shm_rendering_cleanup(void *shm_ctx);
+void shm_rendering_ctx_log(const void *shm_ctx);
+void shm_rendering_show(
+    void *shm_ctx, struct canvas *, const struct placement *);
+void shm_rendering_stats(void *shm_ctx, struct present_stats *);
+void shm_rendering_size(
+    const void *shm_ctx, uint16_t *width, uint16_t *height);
+size_t shm_rendering_memory(const void *shm_ctx);
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE // MADV_REMOVE
+
+#include "store.h"
+
+#include "../abort.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STORE_MAGIC "ttdspane"
+#define STORE_VERSION 1
+#define PAGE 4096
+
+static_assert(sizeof(struct stored_canvas) <= PAGE, "header overflows page");
+
+static struct stored_canvas *map_fd(int fd, size_t size);
+static size_t round_up(size_t n, size_t to);
+
+struct canvas *store_create(int dirfd, const char *file, const char *name,
+    uint16_t width, uint16_t height, uint16_t x, uint16_t y,
+    enum pixel_format format)
+{
+	if (strlen(name) >= STORE_NAME_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	const size_t tiles_x = ((uint32_t)width + TILE_SIZE - 1) / TILE_SIZE;
+	const size_t tiles_y = ((uint32_t)height + TILE_SIZE - 1) / TILE_SIZE;
+	const size_t n = tiles_x * tiles_y;
+	const size_t bpp = pixel_format_size(format);
+
+	const size_t tiles_offset = PAGE;
+	const size_t slots_offset =
+	    tiles_offset + round_up(n * sizeof(struct stored_tile), PAGE);
+	const size_t size = slots_offset + n * TILE_SIZE * TILE_SIZE * bpp;
+
+	const int fd = openat(dirfd, file, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+	    S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		return NULL;
+
+	// The file stays sparse; slots only take up space once drawn to.
+	struct stored_canvas *s = NULL;
+	if (ftruncate(fd, size) == 0)
+		s = map_fd(fd, size);
+
+	const int err = errno;
+	close(fd);
+	if (!s) {
+		unlinkat(dirfd, file, 0);
+		errno = err;
+		return NULL;
+	}
+
+	*s = (struct stored_canvas) {
+		.version = STORE_VERSION,
+		.size = size,
+		.x = x,
+		.y = y,
+		.width = width,
+		.height = height,
+		.format = format,
+		.tiles_offset = tiles_offset,
+		.slots_offset = slots_offset,
+	};
+	strcpy(s->name, name);
+
+	// Match canvas_init: index 0 is what a fresh canvas is filled with.
+	if (format == PIXEL_FORMAT_P8)
+		s->palette_len = 1;
+
+	// The magic goes last, so that a file cut short by a crash is rejected
+	// rather than half read.
+	memcpy(s->magic, STORE_MAGIC, sizeof(s->magic));
+
+	struct canvas *c = canvas_init_stored(s);
+	if (!c) {
+		store_unmap(s);
+		unlinkat(dirfd, file, 0);
+		errno = ENOMEM;
+	}
+
+	return c;
+}
+
+struct canvas *store_attach(int dirfd, const char *file)
+{
+	const int fd = openat(dirfd, file, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		const int err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	if ((size_t)st.st_size < PAGE) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct stored_canvas *s = map_fd(fd, st.st_size);
+	const int err = errno;
+	close(fd);
+	if (!s) {
+		errno = err;
+		return NULL;
+	}
+
+	// Check everything canvas_init_stored will rely on. The offsets come
+	// from the file, so they're checked against the size before anything
+	// is subtracted from it, and nothing is added to them.
+	const size_t tiles_x = ((uint32_t)s->width + TILE_SIZE - 1) / TILE_SIZE;
+	const size_t tiles_y =
+	    ((uint32_t)s->height + TILE_SIZE - 1) / TILE_SIZE;
+	const size_t n = tiles_x * tiles_y;
+	if (memcmp(s->magic, STORE_MAGIC, sizeof(s->magic)) != 0 ||
+	    s->version != STORE_VERSION || s->size != (size_t)st.st_size ||
+	    s->format > PIXEL_FORMAT_P8 ||
+	    s->palette_len > STORE_PALETTE_SIZE ||
+	    s->tiles_offset < PAGE || s->tiles_offset > s->slots_offset ||
+	    s->slots_offset > s->size || s->slots_offset % PAGE != 0 ||
+	    n * sizeof(struct stored_tile) >
+		s->slots_offset - s->tiles_offset ||
+	    n * TILE_SIZE * TILE_SIZE * pixel_format_size(s->format) >
+		s->size - s->slots_offset ||
+	    memchr(s->name, '\0', sizeof(s->name)) == NULL) {
+		munmap(s, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	s->generation++;
+
+	struct canvas *c = canvas_init_stored(s);
+	if (!c) {
+		store_unmap(s);
+		errno = ENOMEM;
+	}
+
+	return c;
+}
+
+void store_discard(void *addr, size_t len)
+{
+	// Punch a hole, which also drops the pages. Filesystems without hole
+	// punching just keep the stale pixels around.
+	madvise(addr, len, MADV_REMOVE);
+}
+
+void store_unmap(struct stored_canvas *s)
+{
+	if (munmap(s, s->size) < 0)
+		FATAL_ERR("store: failed to unmap canvas: %s", STR_ERR);
+}
+
+static struct stored_canvas *map_fd(int fd, size_t size)
+{
+	void *addr =
+	    mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+static size_t round_up(size_t n, size_t to)
+{
+	return (n + to - 1) / to * to;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "canvas.h"
+
+#include <stdint.h>
+
+/* Canvases can be kept in files, so that they outlive the process. Each file is
+ * mapped shared and holds a header, the state of every tile, and a fixed slot
+ * for each tile's pixels. Canvases write every change straight through to the
+ * mapping, so the file is always current, and coming back after a crash or
+ * restart only means mapping it again. Nothing is copied. */
+
+#define STORE_NAME_MAX 256
+#define STORE_PALETTE_SIZE 256
+
+struct stored_tile {
+	uint32_t solid;
+	uint32_t has_pixels; // whether the tile's slot is in use
+};
+
+/* The start of every file, as laid out on disk. */
+struct stored_canvas {
+	char magic[8];
+	uint32_t version;
+
+	// How many times the file has been attached to.
+	uint32_t generation;
+	uint64_t size;
+
+	// What the canvas belongs to, for whoever attaches to it.
+	char name[STORE_NAME_MAX];
+	uint16_t x, y;
+
+	uint16_t width, height;
+	uint32_t format;
+
+	// The same as the canvas fields of the same name. `split` is whether
+	// the tile states are in use, i.e., whether canvas.tiles is non-null.
+	uint32_t fill;
+	uint32_t split;
+	uint32_t palette_len;
+	uint32_t palette[STORE_PALETTE_SIZE];
+
+	// Offsets of the stored_tile array and the first pixel slot.
+	uint64_t tiles_offset;
+	uint64_t slots_offset;
+};
+
+/* Make a new file-backed canvas, failing if `file` already exists. Returns
+ * null and sets errno on failure. */
+struct canvas *store_create(int dirfd, const char *file, const char *name,
+    uint16_t width, uint16_t height, uint16_t x, uint16_t y,
+    enum pixel_format);
+
+/* Map an existing file back in, bumping its generation. Returns null and sets
+ * errno on failure (EINVAL if it isn't a canvas file). */
+struct canvas *store_attach(int dirfd, const char *file);
+
+/* Give back the memory and disk space behind part of a mapping. */
+void store_discard(void *addr, size_t len);
+
+void store_unmap(struct stored_canvas *);
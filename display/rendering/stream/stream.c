@@ -0,0 +1,669 @@
+#define _GNU_SOURCE // vmsplice, F_SETPIPE_SZ
+
+#include "stream.h"
+
+#include "../../abort.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define Y4M_FRAME_HEADER "FRAME\n"
+
+struct stream_ctx {
+	uint16_t width, height;
+	enum stream_format format;
+	unsigned fps;
+	const char *path;
+
+	int fd;
+	int stop_fd; // an eventfd, for waking the writer when stopping
+
+	// With a pipe, frames are vmspliced rather than copied, which hands
+	// the reader references to our own pages.
+	bool splicing;
+
+	// Frames as BGRA rows with no padding. rendering_show draws into
+	// `back` and swaps it into the mailbox (`pending`), and the present
+	// thread swaps that with `front` to encode from it.
+	uint8_t *back, *pending, *front;
+
+	// Encoded frames, as written out. The present thread cycles through
+	// these, and repeats the current one until there's something new.
+	uint8_t **slots;
+	size_t num_slots;
+	size_t slot_size; // mapped, page aligned
+	size_t frame_len; // what's actually written
+	size_t cur_slot;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool fresh; // `pending` has yet to be picked up
+	bool stopping;
+	pthread_t present_handle;
+
+	// Protected by `lock`.
+	struct present_stats stats;
+};
+
+static void init_output(struct stream_ctx *);
+static void init_slots(struct stream_ctx *);
+static void init_present(struct stream_ctx *);
+
+static void *present_thread(void *);
+static bool emit(struct stream_ctx *, const uint8_t *, size_t, bool splice);
+static bool wait_writable(struct stream_ctx *);
+static void encode(struct stream_ctx *, const uint8_t *frame, uint8_t *out);
+static void bgra_to_i420(const uint8_t *frame, uint16_t width,
+    uint16_t height, uint8_t *y, uint8_t *u, uint8_t *v);
+
+void *stream_rendering_init(const struct rendering_opts *opts)
+{
+	if (!opts->stream_path)
+		FATAL_ERR("stream: no output to write to");
+
+	struct stream_ctx *ctx = malloc(sizeof(struct stream_ctx));
+	if (!ctx)
+		FATAL_ERR("stream: failed to allocate rendering ctx");
+
+	ctx->width = opts->width ? opts->width : STREAM_BACKEND_WIDTH;
+	ctx->height = opts->height ? opts->height : STREAM_BACKEND_HEIGHT;
+	ctx->format = opts->stream_format;
+	ctx->fps = opts->stream_fps ? opts->stream_fps : STREAM_BACKEND_FPS;
+	ctx->path = opts->stream_path;
+
+	// Nothing's been shown yet, so the first frames are black.
+	const size_t size = (size_t)ctx->width * ctx->height * 4;
+	ctx->back = calloc(1, size);
+	ctx->pending = calloc(1, size);
+	ctx->front = calloc(1, size);
+	if (!ctx->back || !ctx->pending || !ctx->front)
+		FATAL_ERR("stream: failed to allocate frames");
+
+	if (ctx->format == STREAM_FORMAT_Y4M) {
+		const size_t cw = (ctx->width + 1) / 2;
+		const size_t ch = (ctx->height + 1) / 2;
+		ctx->frame_len = strlen(Y4M_FRAME_HEADER) +
+		    (size_t)ctx->width * ctx->height + cw * ch * 2;
+	} else {
+		ctx->frame_len = size;
+	}
+
+	init_output(ctx);
+	init_slots(ctx);
+	init_present(ctx);
+
+	return ctx;
+}
+
+void stream_rendering_cleanup(void *stream_ctx)
+{
+	struct stream_ctx *ctx = stream_ctx;
+
+	int r;
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stopping = true;
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	// The writer might be waiting on a reader that's gone quiet.
+	const uint64_t one = 1;
+	if (write(ctx->stop_fd, &one, sizeof(one)) != sizeof(one))
+		FATAL_ERR("stream: failed to wake present thread: %s", STR_ERR);
+
+	r = pthread_join(ctx->present_handle, NULL);
+	if (r != 0)
+		FATAL_ERR(
+		    "stream: failed to join present thread: %s", strerror(r));
+
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->lock);
+
+	for (size_t i = 0; i < ctx->num_slots; i++) {
+		if (munmap(ctx->slots[i], ctx->slot_size) != 0)
+			FATAL_ERR("stream: failed to unmap frame: %s", STR_ERR);
+	}
+	free(ctx->slots);
+
+	free(ctx->back);
+	free(ctx->pending);
+	free(ctx->front);
+
+	if (close(ctx->stop_fd) != 0 || close(ctx->fd) != 0)
+		FATAL_ERR("stream: failed to close output: %s", STR_ERR);
+
+	free(ctx);
+}
+
+void stream_rendering_ctx_log(const void *stream_ctx)
+{
+	const struct stream_ctx *ctx = stream_ctx;
+
+	fprintf(stderr, "Size:\t%dx%d\n", ctx->width, ctx->height);
+	fprintf(stderr, "Output:\t%s (%s at %u fps)\n", ctx->path,
+	    ctx->format == STREAM_FORMAT_Y4M ? "Y4M" : "BGRA", ctx->fps);
+	if (ctx->splicing)
+		fprintf(stderr, "Pipe:\tvmsplice, %zu frames\n",
+		    ctx->num_slots);
+}
+
+void stream_rendering_show(
+    void *stream_ctx, struct canvas *c, const struct placement *pl)
+{
+	// Like DRM, this never waits on the output. Only one thread may call
+	// this at a time, since `back` is ours alone.
+	struct stream_ctx *ctx = stream_ctx;
+
+	canvas_materialize(
+	    c, pl, ctx->width, ctx->height, ctx->back, (size_t)ctx->width * 4);
+
+	pthread_mutex_lock(&ctx->lock);
+	uint8_t *const tmp = ctx->pending;
+	ctx->pending = ctx->back;
+	ctx->back = tmp;
+
+	// The newest frame wins.
+	if (ctx->fresh)
+		ctx->stats.dropped++;
+
+	ctx->fresh = true;
+	ctx->stats.queued++;
+	ctx->stats.copied_bytes += (size_t)ctx->width * ctx->height * 4;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+void stream_rendering_stats(void *stream_ctx, struct present_stats *out)
+{
+	struct stream_ctx *ctx = stream_ctx;
+
+	pthread_mutex_lock(&ctx->lock);
+	*out = ctx->stats;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+void stream_rendering_size(
+    const void *stream_ctx, uint16_t *width, uint16_t *height)
+{
+	const struct stream_ctx *ctx = stream_ctx;
+	*width = ctx->width;
+	*height = ctx->height;
+}
+
+size_t stream_rendering_memory(const void *stream_ctx)
+{
+	const struct stream_ctx *ctx = stream_ctx;
+	return (size_t)ctx->width * ctx->height * 4 * 3 +
+	    ctx->num_slots * ctx->slot_size;
+}
+
+static void init_output(struct stream_ctx *ctx)
+{
+	// Opening a FIFO waits here for its reader.
+	ctx->fd =
+	    open(ctx->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (ctx->fd < 0)
+		FATAL_ERR("stream: couldn't open '%s': %s", ctx->path, STR_ERR);
+
+	// Non-blocking, so that a stalled reader can't keep us from stopping.
+	// Opening the path gets us our own file description even for
+	// /dev/fd/N, so this doesn't change the fd anybody else holds.
+	const int flags = fcntl(ctx->fd, F_GETFL);
+	if (flags < 0 || fcntl(ctx->fd, F_SETFL, flags | O_NONBLOCK) != 0)
+		FATAL_ERR("stream: couldn't set '%s' non-blocking: %s",
+		    ctx->path, STR_ERR);
+
+	ctx->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (ctx->stop_fd < 0)
+		FATAL_ERR("stream: couldn't create eventfd: %s", STR_ERR);
+
+	struct stat st;
+	if (fstat(ctx->fd, &st) != 0)
+		FATAL_ERR("stream: couldn't stat '%s': %s", ctx->path, STR_ERR);
+
+	ctx->splicing = S_ISFIFO(st.st_mode);
+	if (ctx->splicing) {
+		// A pipe big enough for a whole frame means one wakeup per
+		// frame for the reader. It's only a hint: the system may cap
+		// it lower, which just costs a few more.
+		fcntl(ctx->fd, F_SETPIPE_SZ, (int)ctx->frame_len);
+	}
+}
+
+static void init_slots(struct stream_ctx *ctx)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	ctx->slot_size = (ctx->frame_len + page - 1) / page * page;
+
+	// With plain writes, the kernel copies each frame as it goes, and two
+	// slots are enough. Spliced pages are still ours until the reader gets
+	// to them, though, so a slot can only be reused once enough frames
+	// have gone after it to push it out of the pipe: each page spliced
+	// takes up one of the pipe's buffers, and they leave in order.
+	//
+	// This assumes the reader consumes what it reads, as encoders do. One
+	// that splices the pipe onward would see frames change underneath it.
+	ctx->num_slots = 2;
+	if (ctx->splicing) {
+		const int pipe_size = fcntl(ctx->fd, F_GETPIPE_SZ);
+		if (pipe_size < 0)
+			FATAL_ERR(
+			    "stream: couldn't get pipe size: %s", STR_ERR);
+
+		const size_t pipe_bufs = (size_t)pipe_size / page;
+		const size_t frame_pages = ctx->slot_size / page;
+		ctx->num_slots =
+		    1 + (pipe_bufs + frame_pages - 1) / frame_pages;
+		if (ctx->num_slots < 2)
+			ctx->num_slots = 2;
+	}
+
+	ctx->slots = calloc(ctx->num_slots, sizeof(uint8_t *));
+	if (!ctx->slots)
+		FATAL_ERR("stream: failed to allocate slots");
+
+	for (size_t i = 0; i < ctx->num_slots; i++) {
+		ctx->slots[i] = mmap(NULL, ctx->slot_size,
+		    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ctx->slots[i] == MAP_FAILED)
+			FATAL_ERR("stream: failed to map frame: %s", STR_ERR);
+	}
+
+	ctx->cur_slot = 0;
+	encode(ctx, ctx->front, ctx->slots[0]);
+}
+
+static void init_present(struct stream_ctx *ctx)
+{
+	int r;
+
+	ctx->fresh = false;
+	ctx->stopping = false;
+	ctx->stats = (struct present_stats) { 0 };
+
+	if ((r = pthread_mutex_init(&ctx->lock, NULL)) != 0)
+		FATAL_ERR("stream: pthread_mutex_init failed: %s", strerror(r));
+
+	// Frames are paced against the monotonic clock, so the condition
+	// variable's timeouts need to be too.
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if ((r = pthread_cond_init(&ctx->cond, &attr)) != 0)
+		FATAL_ERR("stream: pthread_cond_init failed: %s", strerror(r));
+	pthread_condattr_destroy(&attr);
+
+	r = pthread_create(&ctx->present_handle, NULL, present_thread, ctx);
+	if (r != 0)
+		FATAL_ERR("stream: failed to spawn present thread: %s",
+		    strerror(r));
+}
+
+static void timespec_add_ns(struct timespec *t, long ns)
+{
+	t->tv_nsec += ns;
+	while (t->tv_nsec >= 1000000000) {
+		t->tv_nsec -= 1000000000;
+		t->tv_sec++;
+	}
+}
+
+static bool timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+	    (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void *present_thread(void *arg)
+{
+	struct stream_ctx *ctx = arg;
+
+	// A reader going away should end the stream, not the process. Blocking
+	// SIGPIPE here leaves it pending on this thread, and we get EPIPE.
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (ctx->format == STREAM_FORMAT_Y4M) {
+		char header[128];
+		int n = snprintf(header, sizeof(header),
+		    "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg "
+		    "XCOLORRANGE=LIMITED\n",
+		    ctx->width, ctx->height, ctx->fps);
+
+		// Written rather than spliced, since it's on the stack.
+		if (!emit(ctx, (const uint8_t *)header, n, false))
+			return NULL;
+	}
+
+	const long period = 1000000000L / ctx->fps;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (;;) {
+		pthread_mutex_lock(&ctx->lock);
+		while (!ctx->stopping) {
+			int r = pthread_cond_timedwait(
+			    &ctx->cond, &ctx->lock, &next);
+			if (r == ETIMEDOUT)
+				break;
+		}
+
+		if (ctx->stopping) {
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+
+		const bool fresh = ctx->fresh;
+		if (fresh) {
+			uint8_t *const tmp = ctx->front;
+			ctx->front = ctx->pending;
+			ctx->pending = tmp;
+			ctx->fresh = false;
+		}
+		pthread_mutex_unlock(&ctx->lock);
+
+		// Nothing new means showing the last frame again, which is
+		// still sitting in its slot.
+		if (fresh) {
+			ctx->cur_slot = (ctx->cur_slot + 1) % ctx->num_slots;
+			encode(ctx, ctx->front, ctx->slots[ctx->cur_slot]);
+		}
+
+		if (!emit(ctx, ctx->slots[ctx->cur_slot], ctx->frame_len,
+			ctx->splicing))
+			break;
+
+		if (fresh) {
+			pthread_mutex_lock(&ctx->lock);
+			ctx->stats.presented++;
+			pthread_mutex_unlock(&ctx->lock);
+		}
+
+		// A slow reader costs us ticks; they're skipped rather than
+		// made up for with a burst of repeats.
+		timespec_add_ns(&next, period);
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_before(&next, &now))
+			next = now;
+	}
+
+	return NULL;
+}
+
+/* Write out all of `data`, or return false if the output broke or we're
+ * stopping. Spliced data must stay untouched until the reader is done. */
+static bool emit(
+    struct stream_ctx *ctx, const uint8_t *data, size_t len, bool splice)
+{
+	while (len > 0) {
+		ssize_t n;
+		if (splice) {
+			struct iovec iov = {
+				.iov_base = (void *)data,
+				.iov_len = len,
+			};
+			n = vmsplice(ctx->fd, &iov, 1, SPLICE_F_NONBLOCK);
+		} else {
+			n = write(ctx->fd, data, len);
+		}
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN) {
+				if (!wait_writable(ctx))
+					return false;
+				continue;
+			}
+
+			fprintf(stderr, "stream: couldn't write frame: %s\n",
+			    STR_ERR);
+			return false;
+		}
+
+		data += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/* Wait for room in the output. Returns false if we're stopping instead. */
+static bool wait_writable(struct stream_ctx *ctx)
+{
+	struct pollfd fds[] = {
+		{ .fd = ctx->fd, .events = POLLOUT },
+		{ .fd = ctx->stop_fd, .events = POLLIN },
+	};
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			FATAL_ERR("stream: poll failed: %s", STR_ERR);
+		}
+
+		if (fds[1].revents & POLLIN)
+			return false;
+
+		// Errors and hangups are left for the write to report.
+		return true;
+	}
+}
+
+static void encode(struct stream_ctx *ctx, const uint8_t *frame, uint8_t *out)
+{
+	if (ctx->format == STREAM_FORMAT_BGRA) {
+		memcpy(out, frame, ctx->frame_len);
+		return;
+	}
+
+	const size_t header = strlen(Y4M_FRAME_HEADER);
+	memcpy(out, Y4M_FRAME_HEADER, header);
+
+	uint8_t *y = out + header;
+	uint8_t *u = y + (size_t)ctx->width * ctx->height;
+	uint8_t *v =
+	    u + (size_t)((ctx->width + 1) / 2) * ((ctx->height + 1) / 2);
+	bgra_to_i420(frame, ctx->width, ctx->height, y, u, v);
+}
+
+// BT.601, limited range, in 8.8 fixed point. Each chroma sample comes from the
+// sum of a 2x2 block, hence the extra two bits of shift. The offsets fold in
+// rounding along with the usual +16 and +128, and keep every sum positive.
+#define Y_R 66
+#define Y_G 129
+#define Y_B 25
+#define Y_OFFSET ((16 << 8) + 128)
+#define U_R (-38)
+#define U_G (-74)
+#define U_B 112
+#define V_R 112
+#define V_G (-94)
+#define V_B (-18)
+#define UV_OFFSET ((128 << 10) + 512)
+
+static inline uint8_t luma(const uint8_t *px)
+{
+	return (Y_R * px[2] + Y_G * px[1] + Y_B * px[0] + Y_OFFSET) >> 8;
+}
+
+/* Chroma for the 2x2 block at (x, y), clamped to the frame at odd edges. */
+static void chroma(const uint8_t *frame, uint16_t width, uint16_t height,
+    size_t x, size_t y, uint8_t *u, uint8_t *v)
+{
+	const size_t x1 = x + 1 < width ? x + 1 : x;
+	const size_t y1 = y + 1 < height ? y + 1 : y;
+	const size_t stride = (size_t)width * 4;
+
+	const uint8_t *px[] = {
+		&frame[y * stride + x * 4],
+		&frame[y * stride + x1 * 4],
+		&frame[y1 * stride + x * 4],
+		&frame[y1 * stride + x1 * 4],
+	};
+
+	int b = 0, g = 0, r = 0;
+	for (size_t i = 0; i < 4; i++) {
+		b += px[i][0];
+		g += px[i][1];
+		r += px[i][2];
+	}
+
+	*u = (U_R * r + U_G * g + U_B * b + UV_OFFSET) >> 10;
+	*v = (V_R * r + V_G * g + V_B * b + UV_OFFSET) >> 10;
+}
+
+#ifdef __SSE2__
+/* {a0 + a1, a2 + a3, b0 + b1, b2 + b3} */
+static inline __m128i hadd_pairs(__m128i a, __m128i b)
+{
+	const __m128 fa = _mm_castsi128_ps(a);
+	const __m128 fb = _mm_castsi128_ps(b);
+	const __m128i even =
+	    _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0)));
+	const __m128i odd =
+	    _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1)));
+	return _mm_add_epi32(even, odd);
+}
+
+/* Apply the weights in `coeff` to four sets of 16-bit BGRA channels, given
+ * two to a register, then add `offset` and shift. */
+static inline __m128i weigh4(
+    __m128i a, __m128i b, __m128i coeff, __m128i offset, int shift)
+{
+	const __m128i sum =
+	    hadd_pairs(_mm_madd_epi16(a, coeff), _mm_madd_epi16(b, coeff));
+	return _mm_srli_epi32(_mm_add_epi32(sum, offset), shift);
+}
+
+/* Sum each channel of the two pixels in a register into its low half. */
+static inline __m128i sum_pair(__m128i px)
+{
+	return _mm_add_epi16(px, _mm_srli_si128(px, 8));
+}
+
+/* Convert an 8x2 block of pixels, giving 16 luma and 4 of each chroma
+ * samples. */
+static inline void bgra_to_i420_8x2(const uint8_t *row0, const uint8_t *row1,
+    uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i y_coeff =
+	    _mm_setr_epi16(Y_B, Y_G, Y_R, 0, Y_B, Y_G, Y_R, 0);
+	const __m128i u_coeff =
+	    _mm_setr_epi16(U_B, U_G, U_R, 0, U_B, U_G, U_R, 0);
+	const __m128i v_coeff =
+	    _mm_setr_epi16(V_B, V_G, V_R, 0, V_B, V_G, V_R, 0);
+	const __m128i y_offset = _mm_set1_epi32(Y_OFFSET);
+	const __m128i uv_offset = _mm_set1_epi32(UV_OFFSET);
+
+	// Two pixels to a register, with 16-bit channels.
+	__m128i top[4], bottom[4];
+	const uint8_t *rows[] = { row0, row1 };
+	__m128i *wide[] = { top, bottom };
+	for (size_t r = 0; r < 2; r++) {
+		const __m128i a = _mm_loadu_si128((const __m128i *)rows[r]);
+		const __m128i b =
+		    _mm_loadu_si128((const __m128i *)&rows[r][16]);
+		wide[r][0] = _mm_unpacklo_epi8(a, zero);
+		wide[r][1] = _mm_unpackhi_epi8(a, zero);
+		wide[r][2] = _mm_unpacklo_epi8(b, zero);
+		wide[r][3] = _mm_unpackhi_epi8(b, zero);
+	}
+
+	uint8_t *ys[] = { y0, y1 };
+	for (size_t r = 0; r < 2; r++) {
+		const __m128i lo =
+		    weigh4(wide[r][0], wide[r][1], y_coeff, y_offset, 8);
+		const __m128i hi =
+		    weigh4(wide[r][2], wide[r][3], y_coeff, y_offset, 8);
+		const __m128i y16 = _mm_packs_epi32(lo, hi);
+		_mm_storel_epi64(
+		    (__m128i *)ys[r], _mm_packus_epi16(y16, y16));
+	}
+
+	// Each register's worth of pixels, top and bottom, is one 2x2 block.
+	__m128i blocks[4];
+	for (size_t i = 0; i < 4; i++)
+		blocks[i] = sum_pair(_mm_add_epi16(top[i], bottom[i]));
+
+	const __m128i b01 = _mm_unpacklo_epi64(blocks[0], blocks[1]);
+	const __m128i b23 = _mm_unpacklo_epi64(blocks[2], blocks[3]);
+
+	const __m128i u32 = weigh4(b01, b23, u_coeff, uv_offset, 10);
+	const __m128i v32 = weigh4(b01, b23, v_coeff, uv_offset, 10);
+	const __m128i uv16 = _mm_packs_epi32(u32, v32);
+	const __m128i uv8 = _mm_packus_epi16(uv16, uv16);
+
+	uint8_t both[8];
+	_mm_storel_epi64((__m128i *)both, uv8);
+	memcpy(u, both, 4);
+	memcpy(v, &both[4], 4);
+}
+#endif
+
+/* Convert a BGRA frame (with no row padding) into I420 planes. The chroma
+ * planes are half the size each way, rounded up. */
+static void bgra_to_i420(const uint8_t *frame, uint16_t width,
+    uint16_t height, uint8_t *y, uint8_t *u, uint8_t *v)
+{
+	const size_t stride = (size_t)width * 4;
+	const size_t cw = (width + 1) / 2;
+
+	for (size_t row = 0; row < height; row += 2) {
+		const uint8_t *row0 = &frame[row * stride];
+		const bool pair = row + 1 < height;
+		const uint8_t *row1 = pair ? row0 + stride : row0;
+		uint8_t *y0 = &y[row * width];
+		uint8_t *y1 = y0 + width;
+		uint8_t *u_row = &u[row / 2 * cw];
+		uint8_t *v_row = &v[row / 2 * cw];
+
+		size_t x = 0;
+#ifdef __SSE2__
+		// The last row of an odd height has nowhere for its second row
+		// of luma to go.
+		if (pair) {
+			for (; x + 8 <= width; x += 8) {
+				bgra_to_i420_8x2(&row0[x * 4], &row1[x * 4],
+				    &y0[x], &y1[x], &u_row[x / 2],
+				    &v_row[x / 2]);
+			}
+		}
+#endif
+
+		for (size_t i = x; i < width; i++) {
+			y0[i] = luma(&row0[i * 4]);
+			if (pair)
+				y1[i] = luma(&row1[i * 4]);
+		}
+
+		for (; x < width; x += 2) {
+			chroma(frame, width, height, x, row, &u_row[x / 2],
+			    &v_row[x / 2]);
+		}
+	}
+}
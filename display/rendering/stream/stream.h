@@ -0,0 +1,18 @@
+#pragma once
+
+#include "../canvas.h"
+#include "../rendering.h"
+
+#define STREAM_BACKEND_WIDTH 640
+#define STREAM_BACKEND_HEIGHT 480
+#define STREAM_BACKEND_FPS 30
+
+void *stream_rendering_init(const struct rendering_opts *);
+void stream_rendering_cleanup(void *stream_ctx);
+void stream_rendering_ctx_log(const void *stream_ctx);
+void stream_rendering_show(
+    void *stream_ctx, struct canvas *, const struct placement *);
+void stream_rendering_stats(void *stream_ctx, struct present_stats *);
+void stream_rendering_size(
+    const void *stream_ctx, uint16_t *width, uint16_t *height);
+size_t stream_rendering_memory(const void *stream_ctx);
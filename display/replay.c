@@ -0,0 +1,287 @@
+#include "replay.h"
+
+#include "abort.h"
+#include "threads/capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* One client from the capture, and its connection. */
+struct conn {
+	int fd; // -1 until it first sends something, and once it's done
+	bool used;
+
+	// It hung up in the capture, so stop writing once `out` is drained.
+	bool closing;
+	bool shut;
+
+	// Lines waiting to be written.
+	char *out;
+	size_t off, len, cap;
+
+	// The start of the reply line being read: enough to tell "OK" apart.
+	char head[3];
+	size_t head_len;
+};
+
+struct replay {
+	const char *socket_path;
+	struct conn *conns; // by client
+	size_t num_conns;
+
+	uint64_t lines, bytes;
+	uint64_t replies_ok, replies_other;
+	size_t clients;
+};
+
+static void apply(struct replay *, const struct capture_record *);
+static struct conn *conn_get(struct replay *, uint32_t client);
+static void conn_flush(struct conn *);
+static void conn_read(struct replay *, struct conn *);
+static void conn_close(struct conn *);
+static uint64_t now_ns(void);
+
+void run_replay(
+    const char *capture_path, const char *socket_path, double speed)
+{
+	struct capture_reader *reader = capture_reader_open(capture_path);
+	if (!reader)
+		FATAL_ERR("replay: couldn't open '%s': %s", capture_path,
+		    STR_ERR);
+
+	struct replay rp = { .socket_path = socket_path };
+	struct pollfd *fds = NULL;
+	struct conn **polled = NULL;
+
+	struct capture_record rec;
+	bool have = capture_read(reader, &rec);
+	uint64_t capture_ns = 0; // when the next record arrived, originally
+
+	const uint64_t start = now_ns();
+	for (;;) {
+		// Send everything that's due by now.
+		uint64_t now = now_ns() - start;
+		while (have) {
+			const uint64_t at = capture_ns + rec.delta_ns;
+			if (speed > 0 && at / speed > now)
+				break;
+
+			capture_ns = at;
+			apply(&rp, &rec);
+			have = capture_read(reader, &rec);
+		}
+
+		// Whoever's still connected at the end of the capture hangs up.
+		if (!have) {
+			for (size_t i = 0; i < rp.num_conns; i++)
+				rp.conns[i].closing = true;
+		}
+
+		size_t nfds = 0;
+		fds = realloc(fds, rp.num_conns * sizeof(*fds));
+		polled = realloc(polled, rp.num_conns * sizeof(*polled));
+		if (rp.num_conns && (!fds || !polled))
+			FATAL_ERR("replay: out of memory");
+
+		for (size_t i = 0; i < rp.num_conns; i++) {
+			struct conn *c = &rp.conns[i];
+			if (c->fd < 0)
+				continue;
+
+			conn_flush(c);
+			if (c->closing && !c->shut && c->off == c->len) {
+				shutdown(c->fd, SHUT_WR);
+				c->shut = true;
+			}
+
+			// The server closes the connection once it's done
+			// with everything sent, which is what's waited for.
+			short events = POLLIN;
+			if (c->off < c->len)
+				events |= POLLOUT;
+			fds[nfds] = (struct pollfd) { .fd = c->fd, .events = events };
+			polled[nfds++] = c;
+		}
+
+		if (!have && nfds == 0)
+			break;
+
+		int timeout = -1;
+		if (have && speed > 0) {
+			const double wait_ns =
+			    (capture_ns + rec.delta_ns) / speed - now;
+			timeout = wait_ns > 0 ? ceil(wait_ns / 1e6) : 0;
+		} else if (have) {
+			timeout = 0;
+		}
+
+		if (poll(fds, nfds, timeout) < 0 && errno != EINTR)
+			FATAL_ERR("replay: poll failed: %s", STR_ERR);
+
+		for (size_t i = 0; i < nfds; i++) {
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				conn_read(&rp, polled[i]);
+		}
+	}
+	const double secs = (now_ns() - start) / 1e9;
+
+	printf("{\"capture\": \"%s\", \"speed\": %g, \"clients\": %zu, "
+	       "\"lines\": %" PRIu64 ", \"bytes\": %" PRIu64
+	       ", \"replies_ok\": %" PRIu64 ", \"replies_other\": %" PRIu64
+	       ", \"capture_seconds\": %.3f, "
+	       "\"seconds\": %.3f, \"lines_per_sec\": %.0f}\n",
+	    capture_path, speed, rp.clients, rp.lines, rp.bytes,
+	    rp.replies_ok, rp.replies_other, capture_ns / 1e9, secs,
+	    rp.lines / secs);
+
+	for (size_t i = 0; i < rp.num_conns; i++)
+		free(rp.conns[i].out);
+	free(rp.conns);
+	free(fds);
+	free(polled);
+	capture_reader_close(reader);
+}
+
+static void apply(struct replay *rp, const struct capture_record *rec)
+{
+	struct conn *c = conn_get(rp, rec->client);
+	if (rec->hangup) {
+		c->closing = true;
+		return;
+	}
+
+	// The server already hung up on it.
+	if (c->fd < 0)
+		return;
+
+	if (c->len + rec->len > c->cap) {
+		c->cap = (c->len + rec->len) * 2;
+		c->out = realloc(c->out, c->cap);
+		if (!c->out)
+			FATAL_ERR("replay: out of memory");
+	}
+
+	memcpy(&c->out[c->len], rec->line, rec->len);
+	c->len += rec->len;
+	rp->lines++;
+	rp->bytes += rec->len;
+}
+
+/* The connection for a client, connecting it the first time. */
+static struct conn *conn_get(struct replay *rp, uint32_t client)
+{
+	if (client >= rp->num_conns) {
+		const size_t n = (size_t)client + 1;
+		rp->conns = realloc(rp->conns, n * sizeof(struct conn));
+		if (!rp->conns)
+			FATAL_ERR("replay: out of memory");
+
+		for (size_t i = rp->num_conns; i < n; i++)
+			rp->conns[i] = (struct conn) { .fd = -1 };
+		rp->num_conns = n;
+	}
+
+	struct conn *c = &rp->conns[client];
+	if (c->used)
+		return c;
+
+	c->used = true;
+	rp->clients++;
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(rp->socket_path) >= sizeof(addr.sun_path))
+		FATAL_ERR("replay: socket path too long: %s", rp->socket_path);
+	strcpy(addr.sun_path, rp->socket_path);
+
+	c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (c->fd < 0)
+		FATAL_ERR("replay: socket failed: %s", STR_ERR);
+
+	if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		FATAL_ERR("replay: couldn't connect to %s: %s", rp->socket_path,
+		    STR_ERR);
+
+	if (fcntl(c->fd, F_SETFL, O_NONBLOCK) != 0)
+		FATAL_ERR("replay: fcntl failed: %s", STR_ERR);
+
+	return c;
+}
+
+static void conn_flush(struct conn *c)
+{
+	while (c->off < c->len) {
+		const ssize_t n = send(
+		    c->fd, &c->out[c->off], c->len - c->off, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+
+			// The server dropped it, so nothing else can go out.
+			fprintf(stderr, "replay: send failed: %s\n", STR_ERR);
+			c->off = c->len;
+			break;
+		}
+
+		c->off += n;
+	}
+
+	c->off = c->len = 0;
+}
+
+static void conn_read(struct replay *rp, struct conn *c)
+{
+	char buf[64 * 1024];
+	const ssize_t n = read(c->fd, buf, sizeof(buf));
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+
+	if (n <= 0) {
+		if (n < 0)
+			fprintf(stderr, "replay: read failed: %s\n", STR_ERR);
+		conn_close(c);
+		return;
+	}
+
+	for (ssize_t i = 0; i < n; i++) {
+		if (buf[i] != '\n') {
+			if (c->head_len < sizeof(c->head))
+				c->head[c->head_len++] = buf[i];
+			continue;
+		}
+
+		if (c->head_len == 2 && memcmp(c->head, "OK", 2) == 0)
+			rp->replies_ok++;
+		else
+			rp->replies_other++;
+		c->head_len = 0;
+	}
+}
+
+static void conn_close(struct conn *c)
+{
+	close(c->fd);
+	c->fd = -1;
+	c->closing = true;
+	c->off = c->len = 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
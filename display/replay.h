@@ -0,0 +1,11 @@
+#pragma once
+
+/* Send the traffic in a capture (see threads/capture.h) to an instance
+ * listening on the Unix socket at `socket_path`, which should be fresh for the
+ * results to mean anything. Every client in the capture gets a connection of
+ * its own, stdin included. With a `speed` of 1, lines go out with the same
+ * spacing they arrived with; 2 is twice as fast, and 0 as fast as possible.
+ * Replies are read and counted, but otherwise ignored. How it went is printed
+ * to stdout as JSON. */
+void run_replay(
+    const char *capture_path, const char *socket_path, double speed);
@@ -2,15 +2,20 @@
 
 #include "abort.h"
 #include "rendering/canvas.h"
+#include "rendering/encode.h"
+#include "threads/saver.h"
 
 #include <assert.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #define PI 3.141592653589793238462
 #define TAU (2. * PI)
@@ -25,6 +30,14 @@ struct test {
 	void (*draw_fn)(struct canvas *);
 	const char *output_path;
 	uint16_t width, height;
+	enum pixel_format format;
+
+	// What to save the canvas as. The expected output is named .data all
+	// the same.
+	enum image_format image;
+
+	// Save through the saver, like SAVE_ASYNC, rather than directly.
+	bool async;
 };
 
 static void run_these_tests(
@@ -38,6 +51,13 @@ static void test_copy_rect(struct canvas *c);
 static void test_bezier2(struct canvas *c);
 static void test_triangles(struct canvas *c);
 static void test_triangle_array(struct canvas *c);
+static void test_blit(struct canvas *c);
+static void test_pack(struct canvas *c);
+static void test_formats(struct canvas *c);
+static void test_compose(struct canvas *c);
+static void test_delta(struct canvas *c);
+static void test_narrow(struct canvas *c);
+static void save_done(void *arg, const struct save_result *);
 
 void run_tests(const char *dump_dir)
 {
@@ -98,6 +118,83 @@ void run_tests(const char *dump_dir)
 		    .width = 128,
 		    .height = 128,
 		},
+		{
+		    .fill_color = BG,
+		    .draw_fn = test_blit,
+		    .output_path = "blit.data",
+		    .width = 32,
+		    .height = 32,
+		},
+		{
+		    .fill_color = BG,
+		    .draw_fn = test_pack,
+		    .output_path = "pack.data",
+		    .width = 200,
+		    .height = 150,
+		},
+		{
+		    .fill_color = BG,
+		    .draw_fn = test_formats,
+		    .output_path = "formats-bgra8888.data",
+		    .width = 150,
+		    .height = 100,
+		    .format = PIXEL_FORMAT_BGRA8888,
+		},
+		{
+		    .fill_color = BG,
+		    .draw_fn = test_formats,
+		    .output_path = "formats-rgb565.data",
+		    .width = 150,
+		    .height = 100,
+		    .format = PIXEL_FORMAT_RGB565,
+		},
+		{
+		    .fill_color = BG,
+		    .draw_fn = test_formats,
+		    .output_path = "formats-p8.data",
+		    .width = 150,
+		    .height = 100,
+		    .format = PIXEL_FORMAT_P8,
+		},
+		{
+		    .fill_color = BG,
+		    .draw_fn = test_compose,
+		    .output_path = "compose.data",
+		    .width = 64,
+		    .height = 48,
+		},
+		{
+		    .fill_color = BG,
+		    .draw_fn = test_delta,
+		    .output_path = "delta.data",
+		    .width = 200,
+		    .height = 150,
+		    .format = PIXEL_FORMAT_RGB565,
+		},
+		{
+		    .fill_color = BG,
+		    .draw_fn = test_circles,
+		    .output_path = "circles-qoi.data",
+		    .width = 128,
+		    .height = 128,
+		    .image = IMAGE_FORMAT_QOI,
+		},
+		{
+		    .fill_color = BG,
+		    .draw_fn = test_circles,
+		    .output_path = "circles-png.data",
+		    .width = 128,
+		    .height = 128,
+		    .image = IMAGE_FORMAT_PNG,
+		},
+		{
+		    .fill_color = BG,
+		    .draw_fn = test_narrow,
+		    .output_path = "narrow-async.data",
+		    .width = 4,
+		    .height = 40,
+		    .async = true,
+		},
 	};
 
 	run_these_tests(dump_dir, tests, sizeof(tests) / sizeof(*tests));
@@ -126,10 +223,12 @@ static void run_these_tests(
 		FATAL_ERR(
 		    "Failed to open directory: %s: %s", dump_dir_path, STR_ERR);
 
+	struct saver *saver = NULL;
+
 	for (size_t i = 0; i < num_tests; i++) {
 		// Initialize in-memory canvas.
-		struct canvas *canvas =
-		    canvas_init_bgra(tests[i].width, tests[i].height);
+		struct canvas *canvas = canvas_init(
+		    tests[i].width, tests[i].height, tests[i].format);
 		if (canvas == NULL)
 			FATAL_ERR("out of memory");
 
@@ -139,15 +238,43 @@ static void run_these_tests(
 		// Run the test.
 		(tests[i].draw_fn)(canvas);
 
-		// Save canvas as raw RGBA pixel data.
-		rendering_dump_bgra_to_rgba(
-		    canvas, dump_dir, dump_dir_path, tests[i].output_path);
+		// Save canvas as raw RGBA pixel data, or encoded.
+		if (tests[i].async) {
+			if (!saver)
+				saver = saver_new();
+
+			struct save_item *item = malloc(sizeof(*item));
+			char *path = strdup(tests[i].output_path);
+			const int fd = dup(dirfd(dump_dir));
+			if (!item || !path || fd < 0)
+				FATAL_ERR("couldn't set up save: %s", STR_ERR);
+
+			*item = (struct save_item) {
+				.snapshot = canvas,
+				.path = path,
+				.format = tests[i].image,
+			};
+			saver_submit(saver, fd, item, 1, save_done,
+			    (void *)tests[i].output_path);
+
+			// The saver has the canvas now.
+			continue;
+		} else if (tests[i].image == IMAGE_FORMAT_RAW)
+			rendering_dump_bgra_to_rgba(canvas, dump_dir,
+			    dump_dir_path, tests[i].output_path);
+		else
+			rendering_dump_encoded(canvas, dump_dir, dump_dir_path,
+			    tests[i].output_path, tests[i].image);
 		fprintf(stderr, "Wrote RGBA pixel data to file: %s/%s\n",
 		    dump_dir_path, tests[i].output_path);
 
 		canvas_deinit(canvas);
 	}
 
+	// Waits for every save to be written.
+	if (saver)
+		saver_free(saver);
+
 	if (closedir(dump_dir) != 0)
 		FATAL_ERR("couldn't close dir: %s", STR_ERR);
 }
@@ -455,3 +582,249 @@ static void test_triangle_array(struct canvas *c)
 		}
 	}
 }
+
+static void test_blit(struct canvas *c)
+{
+	// A 12x12 gradient with junk in the alpha channel, which should be
+	// ignored.
+	uint8_t img[12][12][4];
+	for (size_t y = 0; y < 12; y++) {
+		for (size_t x = 0; x < 12; x++) {
+			img[y][x][0] = x * 20;
+			img[y][x][1] = y * 20;
+			img[y][x][2] = 0x80;
+			img[y][x][3] = x + y;
+		}
+	}
+
+	const struct blit rgba = {
+		.x = 2,
+		.y = 2,
+		.w = 12,
+		.h = 12,
+		.order = PIXEL_RGBA,
+		.stride = sizeof(*img),
+		.src = &img[0][0][0],
+	};
+	rendering_draw_blit(c, &rgba);
+
+	// The same image with red and blue swapped, hanging off the corner.
+	struct blit bgra = rgba;
+	bgra.x = c->width - 6;
+	bgra.y = c->height - 8;
+	bgra.order = PIXEL_BGRA;
+	rendering_draw_blit(c, &bgra);
+
+	// Round-trip the top left of the first copy to the top right.
+	uint8_t back[6][6][4];
+	const struct readback rb = {
+		.x = 2,
+		.y = 2,
+		.w = 6,
+		.h = 6,
+		.order = PIXEL_RGBA,
+		.stride = sizeof(*back),
+		.dst = &back[0][0][0],
+	};
+	rendering_draw_readback(c, &rb);
+
+	const struct blit again = {
+		.x = c->width - 8,
+		.y = 2,
+		.w = 6,
+		.h = 6,
+		.order = PIXEL_RGBA,
+		.stride = sizeof(*back),
+		.src = &back[0][0][0],
+	};
+	rendering_draw_blit(c, &again);
+}
+
+static void test_pack(struct canvas *c)
+{
+	// Packing must not change what the canvas looks like, whether it's
+	// read packed or drawn to afterward.
+	rendering_draw_circle(
+	    c, &(struct circle) { .x = 60, .y = 60, .r = 40, .c = FG });
+	rendering_draw_rect(c,
+	    &(struct rect) { .x = 64, .y = 0, .w = 64, .h = 64, .c = FG });
+
+	// Noise barely shrinks, so that tile stays unpacked.
+	uint32_t noise[32 * 32];
+	uint32_t seed = 1;
+	for (size_t i = 0; i < 32 * 32; i++) {
+		seed = seed * 1103515245 + 12345;
+		noise[i] = seed;
+	}
+	rendering_draw_blit(c,
+	    &(struct blit) {
+		.x = 140,
+		.y = 70,
+		.w = 32,
+		.h = 32,
+		.order = PIXEL_BGRA,
+		.stride = 32 * 4,
+		.src = (const uint8_t *)noise,
+	    });
+
+	canvas_pack(c);
+
+	rendering_draw_line(c,
+	    &(struct line) { .x0 = 0, .y0 = 149, .x1 = 199, .y1 = 0, .c = FG });
+	rendering_draw_rect_copy(c,
+	    &(struct rect_copy) {
+		.dst_x = 100,
+		.dst_y = 90,
+		.src_x = 20,
+		.src_y = 20,
+		.w = 70,
+		.h = 50,
+	    });
+
+	canvas_pack(c);
+}
+
+static void test_formats(struct canvas *c)
+{
+	// The same scene in each format. RGB565 should only lose the low bits
+	// of each channel, and P8 (with fewer than 256 colors) nothing at all.
+	const struct color teal = { .r = 0x12, .g = 0x9a, .b = 0x8f };
+
+	rendering_draw_rect(c,
+	    &(struct rect) { .x = 10, .y = 10, .w = 100, .h = 70, .c = teal });
+	rendering_draw_circle(
+	    c, &(struct circle) { .x = 100, .y = 50, .r = 30, .c = FG });
+	rendering_draw_triangle(c,
+	    &(struct triangle) {
+		.x0 = 5, .y0 = 95, .x1 = 70, .y1 = 60, .x2 = 140, .y2 = 98,
+		.c = teal,
+	    });
+
+	uint8_t img[12][12][4];
+	for (size_t y = 0; y < 12; y++) {
+		for (size_t x = 0; x < 12; x++) {
+			img[y][x][0] = x * 21;
+			img[y][x][1] = y * 21;
+			img[y][x][2] = 0x40;
+			img[y][x][3] = 0;
+		}
+	}
+	rendering_draw_blit(c,
+	    &(struct blit) {
+		.x = 60,
+		.y = 2,
+		.w = 12,
+		.h = 12,
+		.order = PIXEL_RGBA,
+		.stride = sizeof(*img),
+		.src = &img[0][0][0],
+	    });
+
+	canvas_pack(c);
+
+	rendering_draw_line(c,
+	    &(struct line) { .x0 = 0, .y0 = 0, .x1 = 149, .y1 = 99, .c = FG });
+	rendering_draw_rect_copy(c,
+	    &(struct rect_copy) {
+		.dst_x = 90,
+		.dst_y = 70,
+		.src_x = 55,
+		.src_y = 0,
+		.w = 40,
+		.h = 25,
+	    });
+}
+
+static void test_compose(struct canvas *c)
+{
+	// Compose a small pane, hanging off the bottom right, onto a frame the
+	// size of the test canvas. The frame's background differs from the
+	// canvas fill, so blitting the frame back shows all of it.
+	struct canvas *pane = canvas_init(20, 12, PIXEL_FORMAT_RGB565);
+	if (pane == NULL)
+		FATAL_ERR("out of memory");
+
+	rendering_fill(pane, FG);
+	rendering_draw_line(pane,
+	    &(struct line) { .x0 = 0, .y0 = 0, .x1 = 19, .y1 = 11, .c = BG });
+
+	const struct placement pl = {
+		.x = c->width - 8,
+		.y = c->height - 5,
+		.background = { .r = 0x10, .g = 0x20, .b = 0x30 },
+	};
+
+	uint32_t frame[48][64];
+	assert(c->width == 64 && c->height == 48);
+	canvas_materialize(pane, &pl, c->width, c->height, (uint8_t *)frame,
+	    sizeof(*frame));
+
+	rendering_draw_blit(c,
+	    &(struct blit) {
+		.x = 0,
+		.y = 0,
+		.w = c->width,
+		.h = c->height,
+		.order = PIXEL_BGRA,
+		.stride = sizeof(*frame),
+		.src = (const uint8_t *)frame,
+	    });
+
+	canvas_deinit(pane);
+}
+
+static void test_delta(struct canvas *c)
+{
+	// Replaying every delta taken from a canvas must end up with the same
+	// picture, which is all a checkpoint does.
+	struct canvas *src = canvas_init(c->width, c->height, c->format);
+	if (src == NULL)
+		FATAL_ERR("out of memory");
+
+	struct canvas_delta *d;
+	rendering_fill(src, FG);
+	rendering_draw_circle(
+	    src, &(struct circle) { .x = 80, .y = 70, .r = 60, .c = BG });
+
+	d = canvas_take_dirty(src, false);
+	canvas_apply_delta(c, d);
+	canvas_delta_free(d);
+
+	// Only the tiles drawn to since go in the next delta, packed or not.
+	rendering_draw_rect(src,
+	    &(struct rect) { .x = 130, .y = 0, .w = 64, .h = 64, .c = FG });
+	canvas_pack(src);
+	rendering_draw_line(src,
+	    &(struct line) { .x0 = 0, .y0 = 149, .x1 = 199, .y1 = 60, .c = BG });
+
+	d = canvas_take_dirty(src, false);
+	assert(!d->full && d->num_tiles < (size_t)src->tiles_x * src->tiles_y);
+	canvas_apply_delta(c, d);
+	canvas_delta_free(d);
+
+	// Nothing was drawn, so there's nothing to send.
+	d = canvas_take_dirty(src, false);
+	assert(d->num_tiles == 0);
+	canvas_delta_free(d);
+
+	canvas_deinit(src);
+}
+
+static void test_narrow(struct canvas *c)
+{
+	// Rows this narrow fit more to a write buffer than a uint16_t counts.
+	rendering_draw_rect(c,
+	    &(struct rect) { .x = 1, .y = 5, .w = 2, .h = 20, .c = FG });
+	rendering_draw_line(
+	    c, &(struct line) { .x0 = 0, .y0 = 0, .x1 = 3, .y1 = 39, .c = FG });
+}
+
+static void save_done(void *arg, const struct save_result *r)
+{
+	if (r->failed > 0)
+		FATAL_ERR("couldn't save %s: %s", (const char *)arg,
+		    strerror(r->err));
+
+	fprintf(stderr, "Wrote RGBA pixel data to file: %s\n",
+	    (const char *)arg);
+}
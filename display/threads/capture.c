@@ -0,0 +1,201 @@
+#include "capture.h"
+
+#include "../abort.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Records are small, so let stdio batch them up into far fewer writes.
+#define CAPTURE_BUFFER (256 * 1024)
+
+struct capture {
+	pthread_mutex_t lock;
+	FILE *file;
+	const char *path;
+	char *buf;
+	uint64_t last_ns;
+
+	// Set after a write fails. The capture stops there, but whoever's
+	// sending commands needn't suffer for it.
+	bool failed;
+};
+
+struct capture_reader {
+	FILE *file;
+	const char *path;
+};
+
+static void record(struct capture *, uint32_t client, const char *line,
+    size_t len, bool hangup);
+static void put_varint(FILE *, uint64_t);
+static bool get_varint(struct capture_reader *, uint64_t *out, bool first);
+static uint64_t now_ns(void);
+
+struct capture *capture_open(const char *path)
+{
+	struct capture *cap = malloc(sizeof(struct capture));
+	if (!cap)
+		FATAL_ERR("capture: failed to allocate capture");
+
+	*cap = (struct capture) {
+		.path = path,
+		.last_ns = now_ns(),
+	};
+	pthread_mutex_init(&cap->lock, NULL);
+
+	cap->file = fopen(path, "we");
+	if (!cap->file)
+		FATAL_ERR("capture: couldn't open '%s': %s", path, STR_ERR);
+
+	cap->buf = malloc(CAPTURE_BUFFER);
+	if (!cap->buf)
+		FATAL_ERR("capture: failed to allocate buffer");
+	setvbuf(cap->file, cap->buf, _IOFBF, CAPTURE_BUFFER);
+
+	if (fwrite(CAPTURE_MAGIC, 1, 8, cap->file) != 8)
+		FATAL_ERR("capture: couldn't write '%s': %s", path, STR_ERR);
+
+	return cap;
+}
+
+void capture_close(struct capture *cap)
+{
+	if (fclose(cap->file) != 0 && !cap->failed)
+		fprintf(stderr, "capture: couldn't write '%s': %s\n", cap->path,
+		    STR_ERR);
+
+	pthread_mutex_destroy(&cap->lock);
+	free(cap->buf);
+	free(cap);
+}
+
+void capture_line(
+    struct capture *cap, uint32_t client, const char *line, size_t len)
+{
+	record(cap, client, line, len, false);
+}
+
+void capture_hangup(struct capture *cap, uint32_t client)
+{
+	record(cap, client, NULL, 0, true);
+}
+
+struct capture_reader *capture_reader_open(const char *path)
+{
+	FILE *file = fopen(path, "re");
+	if (!file)
+		return NULL;
+
+	char magic[8];
+	if (fread(magic, 1, 8, file) != 8 ||
+	    memcmp(magic, CAPTURE_MAGIC, 8) != 0)
+		FATAL_ERR("capture: '%s' isn't a capture", path);
+
+	struct capture_reader *r = malloc(sizeof(struct capture_reader));
+	if (!r)
+		FATAL_ERR("capture: failed to allocate reader");
+
+	*r = (struct capture_reader) { .file = file, .path = path };
+	return r;
+}
+
+void capture_reader_close(struct capture_reader *r)
+{
+	fclose(r->file);
+	free(r);
+}
+
+bool capture_read(struct capture_reader *r, struct capture_record *out)
+{
+	uint64_t delta, client, len;
+
+	// A capture cut short (e.g., by a crash) ends cleanly at a record
+	// boundary; anywhere else, it's corrupt.
+	if (!get_varint(r, &delta, true))
+		return false;
+	if (!get_varint(r, &client, false) || !get_varint(r, &len, false))
+		FATAL_ERR("capture: '%s' is truncated", r->path);
+
+	if (client > UINT32_MAX || len > CAPTURE_MAX_LINE)
+		FATAL_ERR("capture: '%s' is corrupt", r->path);
+
+	out->delta_ns = delta;
+	out->client = client;
+	out->hangup = len == 0;
+	out->len = len ? len - 1 : 0;
+
+	if (fread(out->line, 1, out->len, r->file) != out->len)
+		FATAL_ERR("capture: '%s' is truncated", r->path);
+
+	return true;
+}
+
+static void record(struct capture *cap, uint32_t client, const char *line,
+    size_t len, bool hangup)
+{
+	if (len > CAPTURE_MAX_LINE - 1)
+		len = CAPTURE_MAX_LINE - 1;
+
+	pthread_mutex_lock(&cap->lock);
+
+	// Take the time under the lock, so that deltas are never negative.
+	const uint64_t now = now_ns();
+	if (!cap->failed) {
+		put_varint(cap->file, now - cap->last_ns);
+		put_varint(cap->file, client);
+		put_varint(cap->file, hangup ? 0 : len + 1);
+		fwrite(line, 1, len, cap->file);
+
+		if (ferror(cap->file)) {
+			fprintf(stderr, "capture: couldn't write '%s': %s\n",
+			    cap->path, STR_ERR);
+			cap->failed = true;
+		}
+	}
+	cap->last_ns = now;
+
+	pthread_mutex_unlock(&cap->lock);
+}
+
+static void put_varint(FILE *f, uint64_t v)
+{
+	while (v >= 0x80) {
+		putc_unlocked((v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+	putc_unlocked(v, f);
+}
+
+/* Returns false at EOF, which is only fine for the `first` byte of a record. */
+static bool get_varint(struct capture_reader *r, uint64_t *out, bool first)
+{
+	uint64_t v = 0;
+	for (unsigned shift = 0;; shift += 7) {
+		const int c = getc_unlocked(r->file);
+		if (c == EOF) {
+			if (first && shift == 0)
+				return false;
+			FATAL_ERR("capture: '%s' is truncated", r->path);
+		}
+
+		if (shift > 63)
+			FATAL_ERR("capture: '%s' is corrupt", r->path);
+
+		v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			break;
+	}
+
+	*out = v;
+	return true;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
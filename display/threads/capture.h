@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A capture journals every line that clients send, as it's read, so that the
+ * traffic can be replayed later with the same timing (see replay.h).
+ *
+ * The file is CAPTURE_MAGIC followed by records, each made of three unsigned
+ * LEB128 varints and then the line's bytes:
+ *
+ *   1. nanoseconds since the previous record (or since the capture started),
+ *      by CLOCK_MONOTONIC
+ *   2. the client: 0 for stdin, then 1 and up for socket clients, in the order
+ *      they connected
+ *   3. the line's length plus one, or 0 if the client hung up
+ *
+ * Lines are kept exactly as read, newline and all (over-long lines that were
+ * split don't have one). */
+
+#define CAPTURE_MAGIC "TTDSCAP1"
+
+// No line is longer than this; see MAX_CMD_LEN.
+#define CAPTURE_MAX_LINE 1024
+
+struct capture;
+
+/* Start a capture, replacing whatever is at `path`. */
+struct capture *capture_open(const char *path);
+
+/* Write out everything captured, and stop. */
+void capture_close(struct capture *);
+
+/* These may be called from any thread. */
+void capture_line(
+    struct capture *, uint32_t client, const char *line, size_t len);
+void capture_hangup(struct capture *, uint32_t client);
+
+struct capture_record {
+	uint64_t delta_ns;
+	uint32_t client;
+	bool hangup;
+	size_t len;
+	char line[CAPTURE_MAX_LINE];
+};
+
+struct capture_reader;
+
+/* Returns null and sets errno if the file can't be opened. Its contents are
+ * checked as they're read. */
+struct capture_reader *capture_reader_open(const char *path);
+
+void capture_reader_close(struct capture_reader *);
+
+/* Read the next record. Returns false at the end of the capture. */
+bool capture_read(struct capture_reader *, struct capture_record *out);
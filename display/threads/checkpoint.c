@@ -0,0 +1,532 @@
+#include "checkpoint.h"
+
+#include "../abort.h"
+#include "../rendering/pool.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CKPT_MAGIC "ttdsckpt"
+#define CKPT_VERSION 1
+#define FRAME_MAGIC "ckptfram"
+#define FRAME_DONE "ckptdone"
+
+// Everything is written in host byte order: checkpoints aren't meant to move
+// between machines.
+struct file_head {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct frame_head {
+	char magic[8];
+	uint64_t len; // of everything between this and the tail
+	uint64_t seq;
+	uint32_t full;
+	uint32_t num_panes;
+};
+
+// Written and synced only after the rest of the frame.
+struct frame_tail {
+	char magic[8];
+	uint64_t len;
+};
+
+// Followed by the name, the palette (if any) and the tiles.
+struct pane_head {
+	uint16_t name_len;
+	uint16_t x, y;
+	uint16_t width, height;
+	uint16_t format;
+	uint32_t full;
+	uint32_t fill;
+	uint32_t split;
+	uint32_t palette_len;
+	uint32_t num_tiles;
+};
+
+// Followed by the pixels, if it has any.
+struct tile_head {
+	uint32_t index;
+	uint32_t solid;
+	uint32_t has_pixels;
+};
+
+static_assert(sizeof(struct frame_head) == 32, "frame_head has padding");
+static_assert(sizeof(struct pane_head) == 32, "pane_head has padding");
+static_assert(sizeof(struct tile_head) == 12, "tile_head has padding");
+
+struct checkpoint {
+	char *path;
+	char *tmp_path;
+
+	// The current file, or null before the first full frame.
+	FILE *f;
+	uint64_t seq;
+
+	// Size of the last full frame, and of the frames appended since.
+	uint64_t full_len;
+	uint64_t since_full;
+
+	bool need_full;
+};
+
+// A pane being read back.
+struct restored {
+	char *name;
+	uint16_t x, y;
+	struct canvas *canvas;
+	bool is_new; // made by this frame rather than an earlier one
+};
+
+static size_t tile_size(enum pixel_format);
+static uint64_t frame_len(const struct checkpoint_pane *, size_t n);
+static bool write_frame(FILE *, const struct frame_head *,
+    const struct checkpoint_pane *, size_t n);
+static bool write_all(FILE *, const void *, size_t);
+static bool sync_file(FILE *);
+static void sync_dir(const char *path);
+static bool read_frame(FILE *, const struct frame_head *,
+    struct restored **panes, size_t *count, size_t max);
+static bool read_delta(FILE *, const struct pane_head *,
+    struct canvas_delta **out);
+static void restored_abort(struct restored *, size_t n);
+
+struct checkpoint *checkpoint_new(const char *path)
+{
+	struct checkpoint *cp = malloc(sizeof(*cp));
+	if (!cp)
+		FATAL_ERR("checkpoint: OOM");
+
+	*cp = (struct checkpoint) {
+		.path = strdup(path),
+		.tmp_path = malloc(strlen(path) + sizeof(".tmp")),
+		.need_full = true,
+	};
+	if (!cp->path || !cp->tmp_path)
+		FATAL_ERR("checkpoint: OOM");
+
+	sprintf(cp->tmp_path, "%s.tmp", path);
+	return cp;
+}
+
+bool checkpoint_wants_full(const struct checkpoint *cp)
+{
+	return cp->need_full || cp->since_full > cp->full_len;
+}
+
+bool checkpoint_write(struct checkpoint *cp,
+    const struct checkpoint_pane *panes, size_t n, bool full)
+{
+	assert(full || !cp->need_full);
+
+	const struct frame_head head = {
+		.magic = FRAME_MAGIC,
+		.len = frame_len(panes, n),
+		.seq = cp->seq,
+		.full = full,
+		.num_panes = n,
+	};
+	const struct frame_tail tail = {
+		.magic = FRAME_DONE,
+		.len = head.len,
+	};
+
+	// Full frames start a file of their own, which only replaces the old
+	// one once it's complete.
+	FILE *f = cp->f;
+	if (full) {
+		f = fopen(cp->tmp_path, "we");
+		if (!f)
+			goto fail;
+
+		const struct file_head fh = {
+			.magic = CKPT_MAGIC,
+			.version = CKPT_VERSION,
+		};
+		if (!write_all(f, &fh, sizeof(fh)))
+			goto fail;
+	}
+
+	// The tail goes out only after the rest is safely on disk.
+	if (!write_frame(f, &head, panes, n) || !sync_file(f) ||
+	    !write_all(f, &tail, sizeof(tail)) || !sync_file(f))
+		goto fail;
+
+	if (full) {
+		if (rename(cp->tmp_path, cp->path) < 0)
+			goto fail;
+
+		sync_dir(cp->path);
+		if (cp->f)
+			fclose(cp->f);
+
+		cp->f = f;
+		cp->full_len = head.len;
+		cp->since_full = 0;
+	} else {
+		cp->since_full += head.len;
+	}
+
+	cp->seq++;
+	cp->need_full = false;
+	return true;
+
+fail:;
+	const int err = errno;
+	if (full && f) {
+		fclose(f);
+		unlink(cp->tmp_path);
+	}
+
+	// An incremental frame may have been left half written, which is fine:
+	// it has no tail, and the next frame starts a new file.
+	cp->need_full = true;
+	errno = err;
+	return false;
+}
+
+void checkpoint_free(struct checkpoint *cp)
+{
+	if (cp->f)
+		fclose(cp->f);
+
+	free(cp->path);
+	free(cp->tmp_path);
+	free(cp);
+}
+
+ssize_t checkpoint_read(
+    const char *path, struct checkpoint_pane *out, size_t max)
+{
+	FILE *f = fopen(path, "re");
+	if (!f)
+		return -1;
+
+	struct file_head fh;
+	if (fread(&fh, sizeof(fh), 1, f) != 1 ||
+	    memcmp(fh.magic, CKPT_MAGIC, sizeof(fh.magic)) != 0 ||
+	    fh.version != CKPT_VERSION) {
+		fclose(f);
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct restored *panes = NULL;
+	size_t count = 0;
+	for (;;) {
+		const off_t start = ftello(f);
+		struct frame_head head;
+		if (fread(&head, sizeof(head), 1, f) != 1 ||
+		    memcmp(head.magic, FRAME_MAGIC, sizeof(head.magic)) != 0)
+			break;
+
+		// Only frames that were finished count. The first one that
+		// wasn't is the end of the file as far as we're concerned.
+		struct frame_tail tail;
+		const off_t end = start + (off_t)sizeof(head) + (off_t)head.len;
+		if (head.len > INT64_MAX / 2 || fseeko(f, end, SEEK_SET) != 0 ||
+		    fread(&tail, sizeof(tail), 1, f) != 1 ||
+		    memcmp(tail.magic, FRAME_DONE, sizeof(tail.magic)) != 0 ||
+		    tail.len != head.len)
+			break;
+
+		if (fseeko(f, start + (off_t)sizeof(head), SEEK_SET) != 0 ||
+		    !read_frame(f, &head, &panes, &count, max)) {
+			fprintf(stderr,
+			    "checkpoint: %s: frame %" PRIu64
+			    " is corrupt, stopping there\n",
+			    path, head.seq);
+			break;
+		}
+
+		if (fseeko(f, end + (off_t)sizeof(tail), SEEK_SET) != 0)
+			break;
+	}
+
+	fclose(f);
+
+	for (size_t i = 0; i < count; i++) {
+		out[i] = (struct checkpoint_pane) {
+			.name = panes[i].name,
+			.x = panes[i].x,
+			.y = panes[i].y,
+			.delta = canvas_take_dirty(panes[i].canvas, true),
+		};
+		canvas_deinit(panes[i].canvas);
+	}
+
+	free(panes);
+	return count;
+}
+
+static size_t tile_size(enum pixel_format format)
+{
+	return (size_t)TILE_SIZE * TILE_SIZE * pixel_format_size(format);
+}
+
+static uint64_t frame_len(const struct checkpoint_pane *panes, size_t n)
+{
+	uint64_t len = 0;
+	for (size_t i = 0; i < n; i++) {
+		const struct canvas_delta *d = panes[i].delta;
+
+		len += sizeof(struct pane_head) + strlen(panes[i].name);
+		if (d->palette)
+			len += d->palette_len * sizeof(uint32_t);
+
+		len += d->num_tiles * sizeof(struct tile_head);
+		for (size_t j = 0; j < d->num_tiles; j++)
+			if (d->tiles[j].pixels)
+				len += tile_size(d->format);
+	}
+
+	return len;
+}
+
+static bool write_frame(FILE *f, const struct frame_head *head,
+    const struct checkpoint_pane *panes, size_t n)
+{
+	if (!write_all(f, head, sizeof(*head)))
+		return false;
+
+	for (size_t i = 0; i < n; i++) {
+		const struct canvas_delta *d = panes[i].delta;
+		assert(d->full || !head->full);
+
+		const struct pane_head ph = {
+			.name_len = strlen(panes[i].name),
+			.x = panes[i].x,
+			.y = panes[i].y,
+			.width = d->width,
+			.height = d->height,
+			.format = d->format,
+			.full = d->full,
+			.fill = d->fill,
+			.split = d->split,
+			.palette_len = d->palette ? d->palette_len : 0,
+			.num_tiles = d->num_tiles,
+		};
+
+		if (!write_all(f, &ph, sizeof(ph)) ||
+		    !write_all(f, panes[i].name, ph.name_len) ||
+		    !write_all(f, d->palette,
+			ph.palette_len * sizeof(uint32_t)))
+			return false;
+
+		for (size_t j = 0; j < d->num_tiles; j++) {
+			const struct delta_tile *t = &d->tiles[j];
+			const struct tile_head th = {
+				.index = t->index,
+				.solid = t->solid,
+				.has_pixels = t->pixels != NULL,
+			};
+
+			if (!write_all(f, &th, sizeof(th)))
+				return false;
+			if (t->pixels &&
+			    !write_all(f, t->pixels, tile_size(d->format)))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static bool write_all(FILE *f, const void *buf, size_t len)
+{
+	return len == 0 || fwrite(buf, len, 1, f) == 1;
+}
+
+static bool sync_file(FILE *f)
+{
+	return fflush(f) == 0 && fdatasync(fileno(f)) == 0;
+}
+
+/* Make a rename in the directory holding `path` durable. */
+static void sync_dir(const char *path)
+{
+	char *copy = strdup(path);
+	if (!copy)
+		FATAL_ERR("checkpoint: OOM");
+
+	const int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+
+	free(copy);
+}
+
+/* Apply one frame to the panes read so far. Every pane the frame lists is
+ * kept, in its order, and the rest are dropped. */
+static bool read_frame(FILE *f, const struct frame_head *head,
+    struct restored **panes, size_t *count, size_t max)
+{
+	if (head->num_panes > max)
+		return false;
+
+	struct restored *next = calloc(head->num_panes + 1, sizeof(*next));
+	if (!next)
+		FATAL_ERR("checkpoint: OOM");
+
+	size_t i;
+	for (i = 0; i < head->num_panes; i++) {
+		struct pane_head ph;
+		if (fread(&ph, sizeof(ph), 1, f) != 1 || ph.name_len == 0 ||
+		    ph.format > PIXEL_FORMAT_P8 || ph.width == 0 ||
+		    ph.height == 0)
+			break;
+
+		char *name = malloc(ph.name_len + 1);
+		if (!name)
+			FATAL_ERR("checkpoint: OOM");
+
+		if (fread(name, ph.name_len, 1, f) != 1) {
+			free(name);
+			break;
+		}
+		name[ph.name_len] = '\0';
+
+		struct restored *prev = NULL;
+		for (size_t j = 0; j < *count; j++)
+			if (strcmp((*panes)[j].name, name) == 0)
+				prev = &(*panes)[j];
+
+		bool duplicate = false;
+		for (size_t j = 0; j < i; j++)
+			duplicate |= strcmp(next[j].name, name) == 0;
+
+		struct restored *r = &next[i];
+		*r = (struct restored) { .name = name, .x = ph.x, .y = ph.y };
+
+		struct canvas_delta *d;
+		if (duplicate || (!ph.full && !prev) || !read_delta(f, &ph, &d))
+			break;
+
+		if (ph.full) {
+			r->canvas = canvas_init(ph.width, ph.height, ph.format);
+			r->is_new = true;
+			if (!r->canvas)
+				FATAL_ERR("checkpoint: OOM");
+		} else {
+			r->canvas = prev->canvas;
+		}
+
+		if (r->canvas->width != ph.width ||
+		    r->canvas->height != ph.height ||
+		    r->canvas->format != ph.format) {
+			canvas_delta_free(d);
+			break;
+		}
+
+		canvas_apply_delta(r->canvas, d);
+		canvas_delta_free(d);
+	}
+
+	if (i < head->num_panes) {
+		restored_abort(next, i + 1);
+		return false;
+	}
+
+	// Whatever the frame didn't carry over is gone.
+	for (size_t j = 0; j < *count; j++) {
+		struct restored *old = &(*panes)[j];
+		bool kept = false;
+		for (size_t k = 0; k < head->num_panes; k++)
+			kept |= !next[k].is_new && next[k].canvas == old->canvas;
+
+		if (!kept)
+			canvas_deinit(old->canvas);
+		free(old->name);
+	}
+
+	free(*panes);
+	*panes = next;
+	*count = head->num_panes;
+	return true;
+}
+
+static bool read_delta(
+    FILE *f, const struct pane_head *ph, struct canvas_delta **out)
+{
+	const size_t n = (size_t)((ph->width + TILE_SIZE - 1) / TILE_SIZE) *
+	    ((ph->height + TILE_SIZE - 1) / TILE_SIZE);
+	const bool is_p8 = ph->format == PIXEL_FORMAT_P8;
+	if (ph->num_tiles > n || ph->palette_len > 256 ||
+	    (!is_p8 && ph->palette_len > 0))
+		return false;
+
+	struct canvas_delta *d =
+	    malloc(sizeof(*d) + ph->num_tiles * sizeof(struct delta_tile));
+	if (!d)
+		FATAL_ERR("checkpoint: OOM");
+
+	*d = (struct canvas_delta) {
+		.width = ph->width,
+		.height = ph->height,
+		.format = ph->format,
+		.full = ph->full,
+		.fill = ph->fill,
+		.split = ph->split,
+		.palette_len = ph->palette_len,
+	};
+
+	if (is_p8) {
+		d->palette = calloc(256, sizeof(uint32_t));
+		if (!d->palette)
+			FATAL_ERR("checkpoint: OOM");
+
+		if (ph->palette_len > 0 &&
+		    fread(d->palette, ph->palette_len * sizeof(uint32_t), 1,
+			f) != 1) {
+			canvas_delta_free(d);
+			return false;
+		}
+	}
+
+	for (; d->num_tiles < ph->num_tiles; d->num_tiles++) {
+		struct tile_head th;
+		if (fread(&th, sizeof(th), 1, f) != 1) {
+			canvas_delta_free(d);
+			return false;
+		}
+
+		struct delta_tile *t = &d->tiles[d->num_tiles];
+		*t = (struct delta_tile) { .index = th.index, .solid = th.solid };
+		if (!th.has_pixels)
+			continue;
+
+		t->pixels = pool_get(tile_size(ph->format));
+		if (fread(t->pixels, tile_size(ph->format), 1, f) != 1) {
+			d->num_tiles++;
+			canvas_delta_free(d);
+			return false;
+		}
+	}
+
+	*out = d;
+	return true;
+}
+
+/* Throw away the first `n` panes of a frame that couldn't be read. Canvases
+ * from earlier frames are left to them. */
+static void restored_abort(struct restored *panes, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (panes[i].is_new)
+			canvas_deinit(panes[i].canvas);
+		free(panes[i].name);
+	}
+
+	free(panes);
+}
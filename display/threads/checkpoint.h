@@ -0,0 +1,41 @@
+#pragma once
+
+#include "../rendering/canvas.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A checkpoint is one file of frames. Each frame lists every pane, in order,
+ * with the tiles that changed since the frame before. A frame only counts once
+ * all of it is on disk, so a crash mid-write costs at most that frame. Once the
+ * changes add up to more than the last full frame, the next one is written to
+ * a new file that replaces the old, keeping the cost in line with the churn. */
+
+struct checkpoint_pane {
+	char *name;
+	uint16_t x, y;
+	struct canvas_delta *delta;
+};
+
+struct checkpoint;
+
+/* Checkpoint to `path`. Nothing is written until checkpoint_write. */
+struct checkpoint *checkpoint_new(const char *path);
+
+/* Whether the next frame has to be full. */
+bool checkpoint_wants_full(const struct checkpoint *);
+
+/* Write a frame of `n` panes. A full frame needs full deltas. Returns false and
+ * sets errno on failure, after which the next frame has to be full. */
+bool checkpoint_write(struct checkpoint *, const struct checkpoint_pane *,
+    size_t n, bool full);
+
+void checkpoint_free(struct checkpoint *);
+
+/* Read back the panes as of the last complete frame in `path`, with full
+ * deltas. Returns how many there are, or -1 and sets errno if the file isn't a
+ * checkpoint at all. */
+ssize_t checkpoint_read(
+    const char *path, struct checkpoint_pane *out, size_t max);
@@ -1,22 +1,39 @@
+#define _GNU_SOURCE // memfd_create, F_ADD_SEALS
+
+#include "commands.h"
+
 #include "../abort.h"
+#include "../trace.h"
 #include "rendering/canvas.h"
+#include "rendering/encode.h"
+#include "rendering/pool.h"
+#include "stats.h"
 #include "termination.h"
 #include "ui.h"
 
+#include <assert.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
-#define MAX_CMD_LEN 1024
+// Lines estimated to touch at least this many pixels are "heavy"; see
+// cmd_line_is_heavy.
+#define HEAVY_PIXELS (256 * 256)
 
-typedef char *(*act_t)(struct ui_ctx *, char *target, size_t argc, char **argv);
+typedef char *(*act_t)(
+    struct cmd_session *, char *target, size_t argc, char **argv);
 
 struct command {
 	char *target_name;
@@ -35,6 +52,7 @@ struct parse_result {
 
 struct cmd_ctx {
 	struct ui_ctx *ui_ctx;
+	struct capture *capture;
 	int cancellation_fd;
 };
 
@@ -43,40 +61,109 @@ struct action_container {
 	act_t hook;
 };
 
+struct reply {
+	char *buf;
+	size_t len;
+};
+
+struct cmd_notices {
+	pthread_mutex_t lock;
+	int fd; // an eventfd
+	unsigned refs; // the session, plus each save still running
+	struct reply text;
+};
+
+/* A rectangle of pixels in the staging area, as given to BLIT and READBACK. */
+struct staging_region {
+	enum pixel_order order;
+	uint16_t x, y, w, h;
+	size_t offset, stride;
+};
+
 static void *cmd_inner(void *arg);
 static char *find_target(char **);
 static bool parse(char **input_cursor, struct parse_result *result);
 static bool cmd_should_ignore(char *);
+static uint64_t estimate_pixels(const struct command *);
+static uint64_t clamp_u16(long);
+static const char *action_name(size_t action);
+
+/* Sets `index` to the action's place in `candidates`, or to `len` if it isn't
+ * there. */
+static char *call_action(struct cmd_session *s, const struct command *c,
+    const struct action_container *, size_t len, size_t *index);
 
-static char *call_action(struct ui_ctx *ctx, const struct command *c,
-    const struct action_container *, size_t len, bool *found);
+/* Sets `action` to the number the action's stats are kept under. */
+static char *run(struct cmd_session *, const struct command *, size_t *action);
 
-static char *run(struct ui_ctx *, const struct command *);
+static void reply_append(struct reply *, const char *fmt, ...);
+static inline long min(long, long);
+static inline long max(long, long);
 
 static char *eat_whitespace(char *);
 static char **collect_args(char **, size_t *, char **);
 
 static char *act_create(
-    struct ui_ctx *, char *target, size_t argc, char **argv);
+    struct cmd_session *, char *target, size_t argc, char **argv);
 static char *act_remove(
-    struct ui_ctx *, char *target, size_t argc, char **argv);
-static char *act_rect(struct ui_ctx *, char *target, size_t argc, char **argv);
+    struct cmd_session *, char *target, size_t argc, char **argv);
+static char *act_rect(
+    struct cmd_session *, char *target, size_t argc, char **argv);
 static char *act_circle(
-    struct ui_ctx *, char *target, size_t argc, char **argv);
-static char *act_line(struct ui_ctx *, char *target, size_t argc, char **argv);
+    struct cmd_session *, char *target, size_t argc, char **argv);
+static char *act_line(
+    struct cmd_session *, char *target, size_t argc, char **argv);
 static char *act_copy_rect(
-    struct ui_ctx *, char *target, size_t argc, char **argv);
+    struct cmd_session *, char *target, size_t argc, char **argv);
 static char *act_bezier2(
-    struct ui_ctx *, char *target, size_t argc, char **argv);
+    struct cmd_session *, char *target, size_t argc, char **argv);
 static char *act_triangle(
-    struct ui_ctx *, char *target, size_t argc, char **argv);
+    struct cmd_session *, char *target, size_t argc, char **argv);
 
-static char *act_term(struct ui_ctx *, char *target, size_t argc, char **argv);
-static char *act_save(struct ui_ctx *, char *target, size_t argc, char **argv);
-static char *act_count(struct ui_ctx *, char *target, size_t argc, char **argv);
+static char *act_blit(
+    struct cmd_session *, char *target, size_t argc, char **argv);
+static char *act_readback(
+    struct cmd_session *, char *target, size_t argc, char **argv);
+
+static char *act_term(
+    struct cmd_session *, char *target, size_t argc, char **argv);
+static char *act_save(
+    struct cmd_session *, char *target, size_t argc, char **argv);
+static char *act_count(
+    struct cmd_session *, char *target, size_t argc, char **argv);
+static char *act_shm(
+    struct cmd_session *, char *target, size_t argc, char **argv);
+static char *act_memory(
+    struct cmd_session *, char *target, size_t argc, char **argv);
+static char *act_save_async(
+    struct cmd_session *, char *target, size_t argc, char **argv);
+static char *act_save_all(
+    struct cmd_session *, char *target, size_t argc, char **argv);
+static char *act_stats(
+    struct cmd_session *, char *target, size_t argc, char **argv);
+static char *act_locks(
+    struct cmd_session *, char *target, size_t argc, char **argv);
+static char *act_frames(
+    struct cmd_session *, char *target, size_t argc, char **argv);
+static char *act_meminfo(
+    struct cmd_session *, char *target, size_t argc, char **argv);
+
+static struct cmd_notices *notices_ref(struct cmd_session *);
+static void notices_unref(struct cmd_notices *);
+static void notices_destroy(struct cmd_notices *);
+static void notice_save_done(void *arg, const struct save_result *);
+
+static size_t process_rss(void);
 
 static bool parse_color(const char *in, struct color *out);
 static char *parse_args(const char *fmt, size_t argc, char **argv, ...);
+static char *parse_image_format(
+    size_t *argc, char **argv, size_t max_argc, enum image_format *out);
+static char *parse_staging_region(const struct cmd_session *, size_t argc,
+    char **argv, struct staging_region *out);
+
+// See cmd_count_buffer.
+static _Atomic size_t buffer_bytes;
 
 static const struct action_container actions[] = {
 	{ "CREATE", act_create },
@@ -87,12 +174,36 @@ static const struct action_container actions[] = {
 	{ "COPY_RECT", act_copy_rect },
 	{ "BEZIER2", act_bezier2 },
 	{ "TRIANGLE", act_triangle },
+	{ "BLIT", act_blit },
+	{ "READBACK", act_readback },
 };
 
 static const struct action_container root_actions[] = {
 	{ "TERMINATE", act_term },
 	{ "SAVE", act_save },
 	{ "COUNT", act_count },
+	{ "SHM", act_shm },
+	{ "MEMORY", act_memory },
+	{ "SAVE_ASYNC", act_save_async },
+	{ "SAVE_ALL", act_save_all },
+	{ "STATS", act_stats },
+	{ "LOCKS", act_locks },
+	{ "FRAMES", act_frames },
+	{ "MEMINFO", act_meminfo },
+};
+
+#define NUM_ACTIONS (sizeof(actions) / sizeof(*actions))
+#define NUM_ROOT_ACTIONS (sizeof(root_actions) / sizeof(*root_actions))
+
+// Stats for lines that never got as far as an action are kept under this.
+#define UNKNOWN_ACTION (NUM_ACTIONS + NUM_ROOT_ACTIONS)
+static_assert(UNKNOWN_ACTION < STATS_MAX_ACTIONS, "too many actions");
+
+static const char *const phase_names[STATS_PHASES] = {
+	[STATS_PARSE] = "parse",
+	[STATS_LOCK_WAIT] = "lock",
+	[STATS_RASTER] = "raster",
+	[STATS_TOTAL] = "total",
 };
 
 void *cmd_thread(void *arg)
@@ -104,7 +215,9 @@ void *cmd_thread(void *arg)
 		FATAL_ERR("commands: can't create cancellation pipe");
 
 	// TODO: print buffer dimensions to stdout in JSON format
-	ctx.ui_ctx = (struct ui_ctx *)arg;
+	const struct cmd_thread_args *args = arg;
+	ctx.ui_ctx = args->ui_ctx;
+	ctx.capture = args->capture;
 	ctx.cancellation_fd = cancellation_pipe[0];
 
 	pthread_t reader;
@@ -129,7 +242,7 @@ static void *cmd_inner(void *arg)
 	struct cmd_ctx *ctx = (struct cmd_ctx *)arg;
 	int cancellation_fd = ctx->cancellation_fd;
 
-	struct pollfd fds[2];
+	struct pollfd fds[3];
 
 	fds[0].fd = cancellation_fd;
 	fds[0].events = POLLIN;
@@ -139,19 +252,42 @@ static void *cmd_inner(void *arg)
 
 	char line[MAX_CMD_LEN];
 
+	trace_thread_name("commands");
+
+	struct cmd_session session;
+	cmd_session_init(&session, ctx->ui_ctx, false);
+
+	fds[2].events = POLLIN;
+
 	for (;;) {
-		if (poll(fds, 2, -1) < 0)
+		// Ignored until the first SAVE_ASYNC or SAVE_ALL.
+		fds[2].fd = cmd_notices_fd(&session);
+
+		if (poll(fds, 3, -1) < 0)
 			FATAL_ERR("commands: poll failed: %s", STR_ERR);
 
 		if (fds[0].revents &= POLLIN)
 			break;
 
+		if (fds[2].revents & POLLIN) {
+			char *notices = cmd_take_notices(&session);
+			if (notices)
+				fputs(notices, stdout);
+			free(notices);
+		}
+
 		if (!(fds[1].revents & POLLIN))
 			continue;
 
-		if (!fgets(line, MAX_CMD_LEN, stdin)) {
+		const uint64_t span = trace_begin();
+		const bool got_line = fgets(line, MAX_CMD_LEN, stdin);
+		trace_end(span, "read");
+
+		if (!got_line) {
 			// Ignore stdin upon EOF to prevent spinning.
 			if (feof(stdin)) {
+				if (ctx->capture)
+					capture_hangup(ctx->capture, 0);
 				fds[1].fd = -1;
 				continue;
 			}
@@ -162,52 +298,254 @@ static void *cmd_inner(void *arg)
 				    STR_ERR);
 		}
 
-		// Trim newline.
-		size_t len = strlen(line);
-		if (len >= 1)
-			line[len - 1] = '\0';
+		if (ctx->capture)
+			capture_line(ctx->capture, 0, line, strlen(line));
 
-		// Ignore blank lines, comments, etc.
-		if (cmd_should_ignore(line))
+		char *reply = cmd_exec_line(&session, line);
+		if (!reply)
 			continue;
 
-		char *line_cursor = line;
-		char *target = find_target(&line_cursor);
-		if (!target) {
-			printf("target missing in command.\n");
+		fputs(reply, stdout); // write to the client
+		free(reply);
+
+		ui_sync(ctx->ui_ctx);
+	}
+
+	cmd_session_deinit(&session);
+	return NULL;
+}
+
+void cmd_session_init(
+    struct cmd_session *s, struct ui_ctx *ctx, bool can_pass_fds)
+{
+	*s = (struct cmd_session) {
+		.ui_ctx = ctx,
+		.can_pass_fds = can_pass_fds,
+		.reply_fd = -1,
+	};
+}
+
+void cmd_session_deinit(struct cmd_session *s)
+{
+	if (s->staging) {
+		munmap(s->staging, s->staging_size);
+		cmd_count_buffer(-(ptrdiff_t)s->staging_size);
+	}
+
+	if (s->reply_fd >= 0)
+		close(s->reply_fd);
+
+	if (s->notices)
+		notices_unref(s->notices);
+
+	s->staging = NULL;
+	s->reply_fd = -1;
+	s->notices = NULL;
+}
+
+int cmd_notices_fd(const struct cmd_session *s)
+{
+	return s->notices ? s->notices->fd : -1;
+}
+
+bool cmd_saves_pending(const struct cmd_session *s)
+{
+	struct cmd_notices *n = s->notices;
+	if (!n)
+		return false;
+
+	// A finished save still counts until its notice has been taken.
+	pthread_mutex_lock(&n->lock);
+	const bool pending = n->refs > 1 || n->text.len > 0;
+	pthread_mutex_unlock(&n->lock);
+
+	return pending;
+}
+
+char *cmd_take_notices(struct cmd_session *s)
+{
+	struct cmd_notices *n = s->notices;
+	if (!n)
+		return NULL;
+
+	uint64_t count;
+	if (read(n->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		FATAL_ERR("commands: couldn't read notices fd: %s", STR_ERR);
+
+	pthread_mutex_lock(&n->lock);
+	char *text = n->text.buf;
+	n->text = (struct reply) { 0 };
+	pthread_mutex_unlock(&n->lock);
+
+	return text;
+}
+
+void cmd_count_buffer(ptrdiff_t bytes)
+{
+	// Negative counts wrap around to a subtraction.
+	buffer_bytes += (size_t)bytes;
+}
+
+char *cmd_exec_line(struct cmd_session *s, char *line)
+{
+	uint64_t start = stats_now();
+
+	// Trim newline.
+	size_t len = strlen(line);
+	if (len >= 1 && line[len - 1] == '\n')
+		line[len - 1] = '\0';
+
+	// Ignore blank lines, comments, etc.
+	if (cmd_should_ignore(line))
+		return NULL;
+
+	struct reply reply = { 0 };
+
+	// The line's bytes are counted with its first command.
+	struct stats_sample sample = { .bytes_read = len };
+
+	char *line_cursor = line;
+	char *target = find_target(&line_cursor);
+	if (!target) {
+		sample.action = UNKNOWN_ACTION;
+		sample.failed = true;
+		sample.ns[STATS_PARSE] = stats_now() - start;
+		sample.ns[STATS_TOTAL] = sample.ns[STATS_PARSE];
+		stats_record(&sample);
+
+		reply_append(&reply, "target missing in command.\n");
+		return reply.buf;
+	}
+
+	struct parse_result r = { 0 };
+	bool failed = false;
+	uint64_t span = trace_begin();
+	while (parse(&line_cursor, &r)) {
+		sample.ns[STATS_PARSE] = stats_now() - start;
+		trace_end(span, "parse");
+
+		if (!r.ok) {
+			sample.action = UNKNOWN_ACTION;
+			sample.failed = true;
+			sample.ns[STATS_TOTAL] = sample.ns[STATS_PARSE];
+			stats_record(&sample);
+			sample = (struct stats_sample) { 0 };
+			start = stats_now();
+			span = trace_begin();
+
+			failed = true;
+			reply_append(&reply, "parsing failed: %s\n", r.val.err);
+			free(r.val.err);
 			continue;
 		}
 
-		struct parse_result r = { 0 };
-		bool failed = false;
-		while (parse(&line_cursor, &r)) {
-			if (!r.ok) {
-				failed = true;
-				printf("parsing failed: %s\n", r.val.err);
-				free(r.val.err);
-				continue;
-			}
+		r.val.command.target_name = target;
+		const uint64_t pixels = estimate_pixels(&r.val.command);
+		span = trace_begin();
+		char *err = run(s, &r.val.command, &sample.action);
+		trace_end(span, action_name(sample.action));
+
+		// Root actions answer through `err` too, so there's no telling
+		// whether one of those failed.
+		const uint64_t end = stats_now();
+		sample.failed = err &&
+		    (sample.action < NUM_ACTIONS || sample.action == UNKNOWN_ACTION);
+		sample.pixels = sample.failed ? 0 : pixels;
+		sample.ns[STATS_TOTAL] = end - start;
+		stats_record(&sample);
+		sample = (struct stats_sample) { 0 };
+		start = end;
+		span = trace_begin();
+
+		if (err) {
+			failed = true;
+			reply_append(&reply, "%s\n", err); // write to the client
+			fprintf(stderr, "cmd: run: %s\n",
+			    err); // write to the debug log
+
+			free(err);
+			break;
+		}
+	}
 
-			r.val.command.target_name = target;
-			char *err = run(ctx->ui_ctx, &r.val.command);
+	if (!failed)
+		reply_append(&reply, "OK\n");
 
-			if (err) {
-				failed = true;
-				printf("%s\n", err); // write to the client
-				fprintf(stderr, "cmd: run: %s\n",
-				    err); // write to the debug log
+	return reply.buf;
+}
 
-				break;
-			}
+bool cmd_line_is_heavy(const char *line)
+{
+	char *copy = strdup(line);
+	if (!copy)
+		FATAL_ERR("commands: cmd_line_is_heavy: OOM");
+
+	char *line_cursor = copy;
+	if (cmd_should_ignore(copy) || !find_target(&line_cursor)) {
+		free(copy);
+		return false;
+	}
+
+	uint64_t pixels = 0;
+	bool heavy = false;
+
+	struct parse_result r = { 0 };
+	while (!heavy && parse(&line_cursor, &r)) {
+		if (!r.ok) {
+			free(r.val.err);
+			continue;
 		}
 
-		if (!failed)
-			printf("OK\n");
+		const struct command *c = &r.val.command;
 
-		ui_sync(ctx->ui_ctx);
+		// A whole-canvas fill or a pile of I/O.
+		if (strcmp(c->action, "CREATE") == 0 ||
+		    strcmp(c->action, "SAVE") == 0)
+			heavy = true;
+
+		pixels += estimate_pixels(c);
+
+		free(c->argv);
+		r.val.command.argv = NULL;
+
+		heavy |= pixels >= HEAVY_PIXELS;
 	}
 
-	return NULL;
+	free(copy);
+	return heavy;
+}
+
+static void reply_append(struct reply *reply, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	int n = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+
+	if (n < 0)
+		FATAL_ERR("commands: reply_append: bad format: %s", fmt);
+
+	char *buf = realloc(reply->buf, reply->len + n + 1);
+	if (!buf)
+		FATAL_ERR("commands: reply_append: OOM");
+
+	va_start(args, fmt);
+	vsnprintf(&buf[reply->len], n + 1, fmt, args);
+	va_end(args);
+
+	reply->buf = buf;
+	reply->len += n;
+}
+
+static inline long min(long a, long b)
+{
+	return a < b ? a : b;
+}
+
+static inline long max(long a, long b)
+{
+	return a < b ? b : a;
 }
 
 static char *find_target(char **input_cursor)
@@ -249,11 +587,12 @@ static bool parse(char **input_cursor, struct parse_result *result)
 		action_end++;
 
 	result->ok = true;
+	result->val.command.argc = 0;
+	result->val.command.argv = NULL;
 
 	char *arg_start = &action_end[1];
 	if (*action_end != '\0' && *action_end != ';') {
 		*action_end = '\0';
-		result->val.command.argc = 0;
 		result->val.command.argv =
 		    collect_args(&arg_start, &result->val.command.argc, NULL);
 	}
@@ -280,47 +619,99 @@ static bool cmd_should_ignore(char *line)
 	return false;
 }
 
-static char *call_action(struct ui_ctx *ctx, const struct command *c,
-    const struct action_container *candidates, size_t len, bool *found)
+static char *call_action(struct cmd_session *s, const struct command *c,
+    const struct action_container *candidates, size_t len, size_t *index)
 {
 	for (size_t i = 0; i < len; i++) {
 		if (strcmp(c->action, candidates[i].name) == 0) {
-			*found = true;
+			*index = i;
 
-			char *err_buf = candidates[i].hook(
-			    ctx, c->target_name, c->argc, c->argv);
-
-			if (c->argv)
-				free(c->argv);
-
-			return err_buf;
+			return candidates[i].hook(
+			    s, c->target_name, c->argc, c->argv);
 		}
 	}
 
-	*found = false;
+	*index = len;
 
 	char *ret = malloc(512);
 	snprintf(ret, 512, "no such action found: %s", c->action);
 	return ret;
 }
 
-static char *run(struct ui_ctx *ctx, const struct command *c)
+static char *run(
+    struct cmd_session *s, const struct command *c, size_t *action)
 {
 	char *ret = NULL;
-	bool found;
+	size_t i;
 
 	if (strcmp(c->target_name, "root") == 0) {
-		char *root_ret = call_action(ctx, c, root_actions,
-		    sizeof(root_actions) / sizeof(*root_actions), &found);
-		if (found)
+		char *root_ret =
+		    call_action(s, c, root_actions, NUM_ROOT_ACTIONS, &i);
+		if (i < NUM_ROOT_ACTIONS) {
+			*action = NUM_ACTIONS + i;
+			free(c->argv);
 			return root_ret;
+		}
+
+		free(root_ret);
 	}
 
-	ret = call_action(
-	    ctx, c, actions, sizeof(actions) / sizeof(*actions), &found);
+	ret = call_action(s, c, actions, NUM_ACTIONS, &i);
+	*action = i < NUM_ACTIONS ? i : UNKNOWN_ACTION;
+	free(c->argv);
 	return ret;
 }
 
+/* Roughly how many pixels a command touches, going by its arguments. This only
+ * needs to be good enough to tell a dot from a full-screen fill. */
+static uint64_t estimate_pixels(const struct command *c)
+{
+	// Nothing is more than UINT16_MAX wide, and clamping first keeps the
+	// products below from overflowing whatever the client sent.
+	uint64_t v[7] = { 0 };
+	for (size_t i = 0; i < c->argc && i < 7; i++)
+		v[i] = clamp_u16(strtol(c->argv[i], NULL, 0));
+
+	if (strcmp(c->action, "RECT") == 0 && c->argc == 5) {
+		return v[3] * v[4];
+	} else if (strcmp(c->action, "CIRCLE") == 0 && c->argc == 4) {
+		return 4 * v[3] * v[3];
+	} else if (strcmp(c->action, "COPY_RECT") == 0 && c->argc == 6) {
+		return v[4] * v[5];
+	} else if ((strcmp(c->action, "BLIT") == 0 ||
+		       strcmp(c->action, "READBACK") == 0) &&
+	    c->argc == 7) {
+		return v[3] * v[4];
+	} else if (strcmp(c->action, "TRIANGLE") == 0 && c->argc == 7) {
+		// Bounding box, which is what the rasterizer walks.
+		const uint64_t w = max(v[1], max(v[3], v[5])) -
+		    min(v[1], min(v[3], v[5]));
+		const uint64_t h = max(v[2], max(v[4], v[6])) -
+		    min(v[2], min(v[4], v[6]));
+		return w * h;
+	}
+
+	return 0;
+}
+
+static uint64_t clamp_u16(long v)
+{
+	if (v < 0)
+		return 0;
+
+	return v > UINT16_MAX ? UINT16_MAX : v;
+}
+
+static const char *action_name(size_t action)
+{
+	if (action < NUM_ACTIONS)
+		return actions[action].name;
+	else if (action < UNKNOWN_ACTION)
+		return root_actions[action - NUM_ACTIONS].name;
+
+	return "unknown";
+}
+
 static char *eat_whitespace(char *x)
 {
 	while (*x != '\0' && isspace(*x))
@@ -366,14 +757,59 @@ static char **collect_args(char **cursor, size_t *argc, char **argv)
 }
 
 static char *act_create(
-    struct ui_ctx *ctx, char *target, size_t argc, char **argv)
+    struct cmd_session *s, char *target, size_t argc, char **argv)
 {
 	char *err_buf = NULL;
-	struct color fill;
-	if ((err_buf = parse_args("c", argc, argv, &fill)))
+	struct pane_opts opts = { 0 };
+	char *format_name = "BGRA8888";
+	long w = 0, h = 0, x = 0, y = 0;
+
+	// After the fill, the pixel format and then the geometry (width,
+	// height, x and y) are optional, e.g., `CREATE #000000 P8 200 100 0 0`.
+	switch (argc) {
+	case 1:
+		err_buf = parse_args("c", argc, argv, &opts.fill);
+		break;
+	case 2:
+		err_buf =
+		    parse_args("cs", argc, argv, &opts.fill, &format_name);
+		break;
+	case 5:
+		err_buf =
+		    parse_args("ciiii", argc, argv, &opts.fill, &w, &h, &x, &y);
+		break;
+	default:
+		err_buf = parse_args("csiiii", argc, argv, &opts.fill,
+		    &format_name, &w, &h, &x, &y);
+		break;
+	}
+	if (err_buf)
 		return err_buf;
 
-	enum ui_failure r = ui_pane_create(ctx, target, fill);
+	if (!pixel_format_parse(format_name, &opts.format)) {
+		err_buf = malloc(1024);
+		snprintf(err_buf, 1024,
+		    "act_create: expected BGRA8888, RGB565 or P8, got: %s",
+		    format_name);
+		return err_buf;
+	}
+
+	// Without any geometry, the pane covers the whole screen.
+	if (argc > 2) {
+		if (w < 1 || h < 1 || x < 0 || y < 0 || w > UINT16_MAX ||
+		    h > UINT16_MAX || x > UINT16_MAX || y > UINT16_MAX) {
+			err_buf = malloc(1024);
+			snprintf(err_buf, 1024, "act_create: bad geometry");
+			return err_buf;
+		}
+
+		opts.width = w;
+		opts.height = h;
+		opts.x = x;
+		opts.y = y;
+	}
+
+	enum ui_failure r = ui_pane_create(s->ui_ctx, target, &opts);
 	if (r != UI_OK) {
 		err_buf = malloc(1024);
 		snprintf(
@@ -384,13 +820,13 @@ static char *act_create(
 }
 
 static char *act_remove(
-    struct ui_ctx *ctx, char *target, size_t argc, char **argv)
+    struct cmd_session *s, char *target, size_t argc, char **argv)
 {
 	char *err_buf = NULL;
 	if ((err_buf = parse_args("", argc, argv)))
 		return err_buf;
 
-	enum ui_failure r = ui_pane_remove(ctx, target);
+	enum ui_failure r = ui_pane_remove(s->ui_ctx, target);
 	if (r != UI_OK) {
 		err_buf = malloc(1024);
 		snprintf(
@@ -401,7 +837,7 @@ static char *act_remove(
 }
 
 static char *act_rect(
-    struct ui_ctx *ctx, char *target, size_t argc, char **argv)
+    struct cmd_session *s, char *target, size_t argc, char **argv)
 {
 	char *err_buf = NULL;
 	struct rect rect;
@@ -418,7 +854,7 @@ static char *act_rect(
 	rect.h = h;
 
 	enum ui_failure r = ui_pane_draw_shape(
-	    ctx, target, &rect, rendering_draw_rect_type_erased);
+	    s->ui_ctx, target, &rect, rendering_draw_rect_type_erased);
 
 	if (r != UI_OK) {
 		err_buf = malloc(1024);
@@ -430,7 +866,7 @@ static char *act_rect(
 }
 
 static char *act_circle(
-    struct ui_ctx *ctx, char *target, size_t argc, char **argv)
+    struct cmd_session *s, char *target, size_t argc, char **argv)
 {
 	char *err_buf = NULL;
 	struct circle circle;
@@ -445,7 +881,7 @@ static char *act_circle(
 	circle.r = rad;
 
 	enum ui_failure r = ui_pane_draw_shape(
-	    ctx, target, &circle, rendering_draw_circle_type_erased);
+	    s->ui_ctx, target, &circle, rendering_draw_circle_type_erased);
 
 	if (r != UI_OK) {
 		err_buf = malloc(1024);
@@ -457,7 +893,7 @@ static char *act_circle(
 }
 
 static char *act_line(
-    struct ui_ctx *ctx, char *target, size_t argc, char **argv)
+    struct cmd_session *s, char *target, size_t argc, char **argv)
 {
 	char *err_buf = NULL;
 	struct line line;
@@ -474,7 +910,7 @@ static char *act_line(
 	line.y1 = y1;
 
 	enum ui_failure r = ui_pane_draw_shape(
-	    ctx, target, &line, rendering_draw_line_type_erased);
+	    s->ui_ctx, target, &line, rendering_draw_line_type_erased);
 
 	if (r != UI_OK) {
 		err_buf = malloc(1024);
@@ -486,7 +922,7 @@ static char *act_line(
 }
 
 static char *act_copy_rect(
-    struct ui_ctx *ctx, char *target, size_t argc, char **argv)
+    struct cmd_session *s, char *target, size_t argc, char **argv)
 {
 	char *err_buf = NULL;
 	struct rect_copy rc;
@@ -505,7 +941,7 @@ static char *act_copy_rect(
 	rc.h = h;
 
 	enum ui_failure r = ui_pane_draw_shape(
-	    ctx, target, &rc, rendering_draw_rect_copy_type_erased);
+	    s->ui_ctx, target, &rc, rendering_draw_rect_copy_type_erased);
 
 	if (r != UI_OK) {
 		err_buf = malloc(1024);
@@ -517,7 +953,7 @@ static char *act_copy_rect(
 }
 
 static char *act_bezier2(
-    struct ui_ctx *ctx, char *target, size_t argc, char **argv)
+    struct cmd_session *s, char *target, size_t argc, char **argv)
 {
 	char *err_buf = NULL;
 	struct bezier2 b;
@@ -536,7 +972,7 @@ static char *act_bezier2(
 	b.y2 = y2;
 
 	enum ui_failure r = ui_pane_draw_shape(
-	    ctx, target, &b, rendering_draw_bezier2_type_erased);
+	    s->ui_ctx, target, &b, rendering_draw_bezier2_type_erased);
 
 	if (r != UI_OK) {
 		err_buf = malloc(1024);
@@ -548,7 +984,7 @@ static char *act_bezier2(
 }
 
 static char *act_triangle(
-    struct ui_ctx *ctx, char *target, size_t argc, char **argv)
+    struct cmd_session *s, char *target, size_t argc, char **argv)
 {
 	char *err_buf = NULL;
 	struct triangle tri;
@@ -567,7 +1003,7 @@ static char *act_triangle(
 	tri.y2 = y2;
 
 	enum ui_failure r = ui_pane_draw_shape(
-	    ctx, target, &tri, rendering_draw_triangle_type_erased);
+	    s->ui_ctx, target, &tri, rendering_draw_triangle_type_erased);
 
 	if (r != UI_OK) {
 		err_buf = malloc(1024);
@@ -578,7 +1014,70 @@ static char *act_triangle(
 	return err_buf;
 }
 
-static char *act_term(struct ui_ctx *, char *, size_t, char **)
+static char *act_blit(
+    struct cmd_session *s, char *target, size_t argc, char **argv)
+{
+	char *err_buf = NULL;
+	struct staging_region sr;
+
+	if ((err_buf = parse_staging_region(s, argc, argv, &sr)))
+		return err_buf;
+
+	struct blit b = {
+		.x = sr.x,
+		.y = sr.y,
+		.w = sr.w,
+		.h = sr.h,
+		.order = sr.order,
+		.stride = sr.stride,
+		.src = &s->staging[sr.offset],
+	};
+
+	enum ui_failure r = ui_pane_draw_shape(
+	    s->ui_ctx, target, &b, rendering_draw_blit_type_erased);
+
+	if (r != UI_OK) {
+		err_buf = malloc(1024);
+		snprintf(
+		    err_buf, 1024, "act_blit: failed: %s", ui_failure_str(r));
+	}
+
+	return err_buf;
+}
+
+static char *act_readback(
+    struct cmd_session *s, char *target, size_t argc, char **argv)
+{
+	char *err_buf = NULL;
+	struct staging_region sr;
+
+	if ((err_buf = parse_staging_region(s, argc, argv, &sr)))
+		return err_buf;
+
+	struct readback rb = {
+		.x = sr.x,
+		.y = sr.y,
+		.w = sr.w,
+		.h = sr.h,
+		.order = sr.order,
+		.stride = sr.stride,
+		.dst = &s->staging[sr.offset],
+	};
+
+	// Nothing is drawn, but this still needs the pane lock.
+	enum ui_failure r = ui_pane_draw_shape(
+	    s->ui_ctx, target, &rb, rendering_draw_readback_type_erased);
+
+	if (r != UI_OK) {
+		err_buf = malloc(1024);
+		snprintf(err_buf, 1024, "act_readback: failed: %s",
+		    ui_failure_str(r));
+	}
+
+	return err_buf;
+}
+
+static char *act_term(struct cmd_session *, char *, size_t, char **)
 {
 	kill(getpid(), SIGINT);
 
@@ -589,17 +1088,19 @@ static char *act_term(struct ui_ctx *, char *, size_t, char **)
 }
 
 static char *act_save(
-    struct ui_ctx *ctx, char *target, size_t argc, char **argv)
+    struct cmd_session *s, char *target, size_t argc, char **argv)
 {
 	(void)target;
 
 	char *err_buf = NULL;
 	char *name;
 	char *path;
-	if ((err_buf = parse_args("ss", argc, argv, &name, &path)))
+	enum image_format format;
+	if ((err_buf = parse_image_format(&argc, argv, 3, &format)) ||
+	    (err_buf = parse_args("ss", argc, argv, &name, &path)))
 		return err_buf;
 
-	enum ui_failure r = ui_pane_save(ctx, name, path);
+	enum ui_failure r = ui_pane_save(s->ui_ctx, name, path, format);
 
 	if (r != UI_OK) {
 		err_buf = malloc(1024);
@@ -611,7 +1112,96 @@ static char *act_save(
 }
 
 static char *act_count(
-    struct ui_ctx *ctx, char *target, size_t argc, char **argv)
+    struct cmd_session *s, char *target, size_t argc, char **argv)
+{
+	(void)target;
+
+	char *ret_buf = NULL;
+	if ((ret_buf = parse_args("", argc, argv)))
+		return ret_buf;
+
+	ret_buf = malloc(1024);
+	snprintf(ret_buf, 1024, "%zu", ui_pane_count(s->ui_ctx));
+
+	return ret_buf;
+}
+
+static char *act_shm(
+    struct cmd_session *s, char *target, size_t argc, char **argv)
+{
+	(void)target;
+
+	char *err_buf = NULL;
+	long size;
+	if ((err_buf = parse_args("i", argc, argv, &size)))
+		return err_buf;
+
+	err_buf = malloc(1024);
+	if (!err_buf)
+		FATAL_ERR("act_shm: OOM");
+
+	if (!s->can_pass_fds) {
+		snprintf(err_buf, 1024,
+		    "%s: failed: this connection can't carry file descriptors",
+		    __func__);
+		return err_buf;
+	}
+
+	if (s->reply_fd >= 0) {
+		snprintf(err_buf, 1024,
+		    "%s: failed: the last descriptor hasn't been sent yet",
+		    __func__);
+		return err_buf;
+	}
+
+	if (size <= 0 || (unsigned long)size > MAX_STAGING_SIZE) {
+		snprintf(err_buf, 1024, "%s: failed: size must be in 1..%u",
+		    __func__, MAX_STAGING_SIZE);
+		return err_buf;
+	}
+
+	int fd = memfd_create("ttds-staging", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		snprintf(err_buf, 1024, "%s: failed: memfd_create: %s",
+		    __func__, STR_ERR);
+		return err_buf;
+	}
+
+	// Seal the size so the client can't truncate the file out from under
+	// our mapping, which would turn the next BLIT into a SIGBUS.
+	if (ftruncate(fd, size) != 0 ||
+	    fcntl(fd, F_ADD_SEALS,
+		F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+		snprintf(err_buf, 1024, "%s: failed: %s", __func__, STR_ERR);
+		close(fd);
+		return err_buf;
+	}
+
+	uint8_t *staging =
+	    mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (staging == MAP_FAILED) {
+		snprintf(
+		    err_buf, 1024, "%s: failed: mmap: %s", __func__, STR_ERR);
+		close(fd);
+		return err_buf;
+	}
+
+	if (s->staging) {
+		munmap(s->staging, s->staging_size);
+		cmd_count_buffer(-(ptrdiff_t)s->staging_size);
+	}
+
+	s->staging = staging;
+	s->staging_size = size;
+	cmd_count_buffer(size);
+	s->reply_fd = fd;
+
+	free(err_buf);
+	return NULL;
+}
+
+static char *act_memory(
+    struct cmd_session *s, char *target, size_t argc, char **argv)
 {
 	(void)target;
 
@@ -619,12 +1209,277 @@ static char *act_count(
 	if ((ret_buf = parse_args("", argc, argv)))
 		return ret_buf;
 
+	struct ui_memory_stats m;
+	ui_memory_stats(s->ui_ctx, &m);
+
+	struct pool_stats p;
+	pool_stats(&p);
+
 	ret_buf = malloc(1024);
-	snprintf(ret_buf, 1024, "%ld", ui_pane_count(ctx));
+	snprintf(ret_buf, 1024,
+	    "budget=%zu resident=%zu packed_panes=%zu packed_bytes=%zu "
+	    "hits=%" PRIu64 " misses=%" PRIu64 " prefetches=%" PRIu64
+	    " evictions=%" PRIu64 " "
+	    "pool_slabs=%zu pool_in_use=%zu pool_warm=%zu pool_cold=%zu "
+	    "pool_reused=%" PRIu64 " pool_faulted=%" PRIu64,
+	    m.budget, m.resident, m.packed_panes, m.packed_bytes, m.hits,
+	    m.misses, m.prefetches, m.evictions, p.slabs, p.in_use, p.warm,
+	    p.cold, p.reused, p.faulted);
 
 	return ret_buf;
 }
 
+static char *act_save_async(
+    struct cmd_session *s, char *target, size_t argc, char **argv)
+{
+	(void)target;
+
+	char *ret_buf = NULL;
+	char *name;
+	char *path;
+	enum image_format format;
+	if ((ret_buf = parse_image_format(&argc, argv, 3, &format)) ||
+	    (ret_buf = parse_args("ss", argc, argv, &name, &path)))
+		return ret_buf;
+
+	struct cmd_notices *n = notices_ref(s);
+
+	uint64_t id;
+	enum ui_failure r = ui_pane_save_async(
+	    s->ui_ctx, name, path, format, notice_save_done, n, &id);
+
+	ret_buf = malloc(1024);
+	if (r != UI_OK) {
+		notices_unref(n);
+		snprintf(ret_buf, 1024, "%s: failed: %s", __func__,
+		    ui_failure_str(r));
+		return ret_buf;
+	}
+
+	snprintf(ret_buf, 1024, "SAVING %" PRIu64, id);
+	return ret_buf;
+}
+
+static char *act_save_all(
+    struct cmd_session *s, char *target, size_t argc, char **argv)
+{
+	(void)target;
+
+	char *ret_buf = NULL;
+	char *dir;
+	enum image_format format;
+	if ((ret_buf = parse_image_format(&argc, argv, 2, &format)) ||
+	    (ret_buf = parse_args("s", argc, argv, &dir)))
+		return ret_buf;
+
+	struct cmd_notices *n = notices_ref(s);
+
+	uint64_t id;
+	size_t count;
+	enum ui_failure r = ui_save_all(
+	    s->ui_ctx, dir, format, notice_save_done, n, &id, &count);
+
+	ret_buf = malloc(1024);
+	if (r == UI_OPEN_FAILED) {
+		snprintf(ret_buf, 1024, "%s: failed: %s: %s: %s", __func__,
+		    ui_failure_str(r), dir, STR_ERR);
+		notices_unref(n);
+		return ret_buf;
+	} else if (r != UI_OK) {
+		notices_unref(n);
+		snprintf(ret_buf, 1024, "%s: failed: %s", __func__,
+		    ui_failure_str(r));
+		return ret_buf;
+	}
+
+	snprintf(ret_buf, 1024, "SAVING %" PRIu64 " %zu", id, count);
+	return ret_buf;
+}
+
+/* The counters, then for each action and phase with anything recorded,
+ * `<action>.<phase>=<count>/<p50>/<p90>/<p99>/<p99.9>/<max>` in nanoseconds,
+ * all on one line. */
+static char *act_stats(
+    struct cmd_session *s, char *target, size_t argc, char **argv)
+{
+	(void)target;
+
+	char *ret_buf = NULL;
+	if ((ret_buf = parse_args("", argc, argv)))
+		return ret_buf;
+
+	struct stats_snapshot *snap = stats_collect();
+	const struct stats_counters *c = &snap->counters;
+
+	struct reply reply = { 0 };
+	reply_append(&reply,
+	    "commands=%" PRIu64 " errors=%" PRIu64 " pixels=%" PRIu64
+	    " bytes_read=%" PRIu64 " panes=%zu presents=%" PRIu64,
+	    c->commands, c->errors, c->pixels, c->bytes_read,
+	    ui_pane_count(s->ui_ctx), c->presents);
+
+	for (size_t a = 0; a <= UNKNOWN_ACTION; a++) {
+		const char *name = action_name(a);
+
+		for (unsigned p = 0; p < STATS_PHASES; p++) {
+			const struct hist *h = &snap->hists[a][p];
+			if (h->count == 0)
+				continue;
+
+			char summary[128];
+			hist_format(summary, sizeof(summary), h);
+			reply_append(&reply, " %s.%s=%s", name, phase_names[p],
+			    summary);
+		}
+	}
+
+	free(snap);
+	return reply.buf;
+}
+
+static char *act_locks(
+    struct cmd_session *s, char *target, size_t argc, char **argv)
+{
+	(void)target;
+
+	char *ret_buf = NULL;
+	if ((ret_buf = parse_args("", argc, argv)))
+		return ret_buf;
+
+	return ui_lock_report(s->ui_ctx);
+}
+
+static char *act_frames(
+    struct cmd_session *s, char *target, size_t argc, char **argv)
+{
+	(void)target;
+
+	char *ret_buf = NULL;
+	if ((ret_buf = parse_args("", argc, argv)))
+		return ret_buf;
+
+	return ui_present_report(s->ui_ctx);
+}
+
+/* The process' RSS against what it's expected to be: canvas bytes (with shared
+ * pixels counted in full), pool blocks kept warm, command buffers and the
+ * backend's frame buffers. Then every pane's canvas bytes and how many of them
+ * are resident, all on one line. MEMORY breaks the pool down. */
+static char *act_meminfo(
+    struct cmd_session *s, char *target, size_t argc, char **argv)
+{
+	(void)target;
+
+	char *ret_buf = NULL;
+	if ((ret_buf = parse_args("", argc, argv)))
+		return ret_buf;
+
+	struct ui_meminfo m;
+	char *panes = ui_meminfo_report(s->ui_ctx, &m);
+
+	struct pool_stats p;
+	pool_stats(&p);
+
+	const size_t buffers = buffer_bytes;
+	const size_t expected =
+	    m.canvas_bytes + p.warm + buffers + m.backend_bytes;
+
+	struct reply reply = { 0 };
+	reply_append(&reply,
+	    "rss=%zu expected=%zu canvas_bytes=%zu canvas_resident=%zu "
+	    "buffers=%zu backend=%zu%s%s",
+	    process_rss(), expected, m.canvas_bytes, m.canvas_resident,
+	    buffers, m.backend_bytes, *panes ? " " : "", panes);
+
+	free(panes);
+	return reply.buf;
+}
+
+/* Take a reference to the session's notices for a save, creating them if need
+ * be. */
+static struct cmd_notices *notices_ref(struct cmd_session *s)
+{
+	if (!s->notices) {
+		struct cmd_notices *n = calloc(1, sizeof(*n));
+		if (!n)
+			FATAL_ERR("commands: notices: OOM");
+
+		n->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (n->fd < 0)
+			FATAL_ERR("commands: eventfd failed: %s", STR_ERR);
+
+		pthread_mutex_init(&n->lock, NULL);
+		n->refs = 1;
+		s->notices = n;
+	}
+
+	pthread_mutex_lock(&s->notices->lock);
+	s->notices->refs++;
+	pthread_mutex_unlock(&s->notices->lock);
+
+	return s->notices;
+}
+
+static void notices_unref(struct cmd_notices *n)
+{
+	pthread_mutex_lock(&n->lock);
+	const unsigned refs = --n->refs;
+	pthread_mutex_unlock(&n->lock);
+
+	if (refs == 0)
+		notices_destroy(n);
+}
+
+static void notices_destroy(struct cmd_notices *n)
+{
+	close(n->fd);
+	pthread_mutex_destroy(&n->lock);
+	free(n->text.buf);
+	free(n);
+}
+
+/* Runs on the saver's thread. The client may be long gone, in which case
+ * nobody reads the notice. */
+static void notice_save_done(void *arg, const struct save_result *r)
+{
+	struct cmd_notices *n = arg;
+
+	pthread_mutex_lock(&n->lock);
+	if (r->failed == 0)
+		reply_append(&n->text, "SAVED %" PRIu64 " %zu %" PRIu64 "\n",
+		    r->id, r->saved, r->bytes);
+	else
+		reply_append(&n->text,
+		    "SAVE_FAILED %" PRIu64 " %zu %zu: %s\n", r->id, r->saved,
+		    r->failed, strerror(r->err));
+
+	// Drop the reference before waking the client, so it doesn't find the
+	// save still pending. The session's own reference keeps the fd open.
+	const bool last = --n->refs == 0;
+	const uint64_t one = 1;
+	if (!last && write(n->fd, &one, sizeof(one)) != sizeof(one))
+		FATAL_ERR("commands: couldn't write notices fd: %s", STR_ERR);
+	pthread_mutex_unlock(&n->lock);
+
+	if (last)
+		notices_destroy(n);
+}
+
+/* In bytes, or 0 if it can't be read. */
+static size_t process_rss(void)
+{
+	FILE *f = fopen("/proc/self/statm", "re");
+	if (!f)
+		return 0;
+
+	size_t pages = 0;
+	if (fscanf(f, "%*u %zu", &pages) != 1)
+		pages = 0;
+
+	fclose(f);
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
 static bool parse_color(const char *in, struct color *out)
 {
 	if (in[0] != '#')
@@ -701,3 +1556,86 @@ static char *parse_args(const char *fmt, size_t argc, char **argv, ...)
 	free(err_buf);
 	return NULL;
 }
+
+/* Take the image format off the end of the arguments if there are `max_argc`
+ * of them, or else use RAW. */
+static char *parse_image_format(
+    size_t *argc, char **argv, size_t max_argc, enum image_format *out)
+{
+	*out = IMAGE_FORMAT_RAW;
+	if (*argc != max_argc)
+		return NULL;
+
+	(*argc)--;
+	if (image_format_parse(argv[*argc], out))
+		return NULL;
+
+	char *err_buf = malloc(1024);
+	if (!err_buf)
+		FATAL_ERR("parse_image_format: OOM");
+
+	snprintf(err_buf, 1024,
+	    "failure: unknown image format: %s (expected raw, qoi or png)",
+	    argv[*argc]);
+	return err_buf;
+}
+
+static char *parse_staging_region(const struct cmd_session *s, size_t argc,
+    char **argv, struct staging_region *out)
+{
+	char *err_buf = NULL;
+	char *order;
+	long x, y, w, h, offset, stride;
+
+	if ((err_buf = parse_args("siiiiii", argc, argv, &order, &x, &y, &w,
+		 &h, &offset, &stride)))
+		return err_buf;
+
+	err_buf = malloc(1024);
+	if (!err_buf)
+		FATAL_ERR("parse_staging_region: OOM");
+
+	if (strcmp(order, "BGRA") == 0) {
+		out->order = PIXEL_BGRA;
+	} else if (strcmp(order, "RGBA") == 0) {
+		out->order = PIXEL_RGBA;
+	} else {
+		snprintf(err_buf, 1024,
+		    "failure: expected BGRA or RGBA, got: %s", order);
+		return err_buf;
+	}
+
+	if (!s->staging) {
+		snprintf(err_buf, 1024, "failure: no staging area; use SHM");
+		return err_buf;
+	}
+
+	if (x < 0 || y < 0 || w < 0 || h < 0 || x > UINT16_MAX ||
+	    y > UINT16_MAX || w > UINT16_MAX || h > UINT16_MAX) {
+		snprintf(err_buf, 1024, "failure: region out of range");
+		return err_buf;
+	}
+
+	// Every row must fit within the staging area. Sizes are capped well
+	// below the point where this could overflow.
+	if (offset < 0 || stride < w * 4 ||
+	    (size_t)offset > s->staging_size ||
+	    (size_t)stride > s->staging_size ||
+	    (h > 0 && w > 0 &&
+		(uint64_t)offset + (uint64_t)(h - 1) * stride + w * 4 >
+		    s->staging_size)) {
+		snprintf(err_buf, 1024,
+		    "failure: region doesn't fit in the staging area");
+		return err_buf;
+	}
+
+	out->x = x;
+	out->y = y;
+	out->w = w;
+	out->h = h;
+	out->offset = offset;
+	out->stride = stride;
+
+	free(err_buf);
+	return NULL;
+}
@@ -1,3 +1,77 @@
 #pragma once
 
-void *cmd_thread(void *);
+#include "capture.h"
+#include "ui.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_CMD_LEN 1024
+
+/* Upper bound on a client's shared-memory staging area, in bytes. */
+#define MAX_STAGING_SIZE (256u << 20)
+
+/* Lines to send a client outside of any reply, e.g., when a SAVE_ASYNC is
+ * done. */
+struct cmd_notices;
+
+/* Per-client state that outlives a single line. */
+struct cmd_session {
+	struct ui_ctx *ui_ctx;
+
+	// Whether the connection can carry file descriptors (SCM_RIGHTS).
+	bool can_pass_fds;
+
+	// The staging area created by `root: SHM`, if any.
+	uint8_t *staging;
+	size_t staging_size;
+
+	// A descriptor waiting to go out with a reply, or -1. Whoever sends it
+	// closes it and resets this.
+	int reply_fd;
+
+	// Created by the first SAVE_ASYNC or SAVE_ALL, and shared with the
+	// saves still running.
+	struct cmd_notices *notices;
+};
+
+void cmd_session_init(
+    struct cmd_session *s, struct ui_ctx *ctx, bool can_pass_fds);
+
+void cmd_session_deinit(struct cmd_session *s);
+
+/* What cmd_thread runs with. */
+struct cmd_thread_args {
+	struct ui_ctx *ui_ctx;
+
+	// If non-null, journal every line read from stdin here, as client 0.
+	struct capture *capture;
+};
+
+void *cmd_thread(void *args);
+
+/* Run every command on one line of input. The line is modified in place.
+ * Returns the text to send back to the client (to be freed by the caller), or
+ * null if the line was blank or a comment. */
+char *cmd_exec_line(struct cmd_session *s, char *line);
+
+/* An eventfd that's readable whenever there are notices to take, or -1 if no
+ * asynchronous command has run yet. */
+int cmd_notices_fd(const struct cmd_session *s);
+
+/* Whether any SAVE_ASYNC or SAVE_ALL is still running, or has finished
+ * without its notice being taken. */
+bool cmd_saves_pending(const struct cmd_session *s);
+
+/* Every notice so far, to be freed by the caller, or null if there are none.
+ * This also resets the eventfd. */
+char *cmd_take_notices(struct cmd_session *s);
+
+/* Guess whether running the line will take long enough that it should be
+ * moved off of an event loop. This doesn't modify the line. */
+bool cmd_line_is_heavy(const char *line);
+
+/* Keep count of memory held for reading commands and replying to them (e.g.,
+ * an event loop's buffers), for MEMINFO. Staging areas count themselves. */
+void cmd_count_buffer(ptrdiff_t bytes);
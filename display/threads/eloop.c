@@ -0,0 +1,1017 @@
+#define _GNU_SOURCE // accept4
+
+#include "eloop.h"
+
+#include "../abort.h"
+#include "../trace.h"
+#include "commands.h"
+#include "ui.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+#define MAX_INPUT_FDS 32
+#define MAX_WORKERS 8
+
+// Each client may have this much unread input buffered. Past that, we stop
+// reading and let the socket buffers push back on the client.
+#define CLIENT_INBUF (4 * MAX_CMD_LEN)
+
+// Stop reading from a client once this many reply bytes are waiting for it
+// to read them.
+#define CLIENT_MAX_BACKLOG (64 * 1024)
+
+// How many lines one client may run before others get a turn.
+#define LINES_PER_TURN 64
+
+enum source_kind {
+	SRC_SIGNAL,
+	SRC_TIMER,
+	SRC_SYNC,
+	SRC_WORKERS,
+	SRC_INPUT,
+	SRC_LISTEN,
+	SRC_CLIENT,
+	SRC_NOTICES,
+};
+
+/* Everything registered with epoll starts with one of these, and its address
+ * is the event's data pointer. */
+struct source {
+	enum source_kind kind;
+	int fd;
+};
+
+struct outbuf {
+	char *data;
+	size_t off; // everything before this has been written
+	size_t len;
+	size_t cap;
+
+	// The session's reply_fd goes out with the byte at fd_at.
+	bool fd_pending;
+	size_t fd_at;
+};
+
+struct client {
+	struct source src; // must be first
+	int out_fd;
+	bool is_socket;
+	uint32_t id; // for captures: 0 for stdin, then in order of arrival
+
+	// Bytes read but not yet run.
+	char in[CLIENT_INBUF];
+	size_t in_len;
+
+	// Replies not yet written.
+	struct outbuf out;
+
+	struct cmd_session session;
+
+	// The session's notices, once it has any; the fd is -1 until then.
+	struct source notices;
+
+	// A heavy line is running on a worker. Nothing else from this client
+	// runs until it's done, so commands keep their order.
+	bool busy;
+	bool eof;
+	bool dead; // write failed or finished; drop it once it isn't busy
+
+	// epoll refuses some fds (e.g., regular files). Those are read
+	// whenever the loop comes around instead.
+	bool unpollable;
+	uint32_t events; // what we last asked epoll for
+
+	// On the loop's ready list: there's work to do without waiting on
+	// epoll (complete lines left over after a turn, or an unpollable fd).
+	bool ready;
+	struct client *next_ready;
+
+	// On the loop's reap list: it's done or dead, and gets freed once the
+	// events in hand have all been dispatched, since some may be for it.
+	bool reaping;
+	struct client *next_reap;
+
+	// Every socket client, for teardown.
+	struct client *prev;
+	struct client *next;
+};
+
+struct job {
+	struct job *next;
+	struct client *client;
+	char *line;
+	char *reply;
+};
+
+struct job_queue {
+	struct job *head;
+	struct job *tail;
+};
+
+struct eloop {
+	struct ui_ctx *ui_ctx;
+	struct rendering_vtable vt;
+
+	int epoll_fd;
+	bool running;
+
+	struct source signal;
+	struct source timer;
+	struct source sync;
+	struct source workers_done;
+
+	void *i_ctx;
+	size_t num_inputs;
+	struct source inputs[MAX_INPUT_FDS];
+
+	struct client stdin_client;
+
+	const char *listen_path;
+	struct source listen;
+	bool accept_paused; // out of fds
+	struct client *clients;
+	size_t num_clients;
+	uint32_t next_client_id;
+
+	struct capture *capture;
+
+	struct client *ready;
+	struct client *reap;
+
+	// The worker pool, which only ever sees heavy lines.
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct job_queue pending;
+	struct job_queue done;
+	bool stopping;
+	size_t num_workers;
+	pthread_t workers[MAX_WORKERS];
+};
+
+static void watch(struct eloop *, struct source *, uint32_t events);
+static int open_signalfd(void);
+static int open_timerfd(void);
+static int open_listener(const char *path);
+static void raise_fd_limit(void);
+
+static void start_workers(struct eloop *);
+static void stop_workers(struct eloop *);
+static void *worker_main(void *);
+static void job_push(struct job_queue *, struct job *);
+static struct job *job_pop(struct job_queue *);
+
+static void dispatch(struct eloop *, struct source *, uint32_t events);
+static void handle_workers_done(struct eloop *);
+static void handle_listen(struct eloop *);
+static void handle_client(struct eloop *, struct client *, uint32_t events);
+static void run_ready(struct eloop *);
+static void reap_clients(struct eloop *);
+
+static void client_read(struct eloop *, struct client *);
+static void client_run_lines(struct eloop *, struct client *);
+static void client_reply(struct client *, const char *);
+static void client_flush(struct client *);
+static ssize_t send_with_fd(int sock, const char *data, size_t len, int fd);
+static void client_update(struct eloop *, struct client *);
+static void client_watch_notices(struct eloop *, struct client *);
+static void client_free(struct eloop *, struct client *);
+
+static uint64_t drain_counter(int fd);
+
+void eloop_run(struct ui_ctx *ui_ctx, struct rendering_vtable vt,
+    const struct eloop_opts *opts)
+{
+	struct eloop *loop = calloc(1, sizeof(struct eloop));
+	if (!loop)
+		FATAL_ERR("eloop: failed to allocate loop");
+
+	loop->ui_ctx = ui_ctx;
+	loop->vt = vt;
+	loop->running = true;
+	loop->capture = opts->capture;
+	loop->next_client_id = 1;
+
+	trace_thread_name("eloop");
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0)
+		FATAL_ERR("eloop: epoll_create1 failed: %s", STR_ERR);
+
+	loop->signal = (struct source) { SRC_SIGNAL, open_signalfd() };
+	loop->timer = (struct source) { SRC_TIMER, open_timerfd() };
+	loop->sync = (struct source) { SRC_SYNC, ui_sync_fd(ui_ctx) };
+	loop->workers_done = (struct source) {
+		SRC_WORKERS,
+		eventfd(0, EFD_CLOEXEC),
+	};
+	if (loop->workers_done.fd < 0)
+		FATAL_ERR("eloop: eventfd failed: %s", STR_ERR);
+
+	watch(loop, &loop->signal, EPOLLIN);
+	watch(loop, &loop->timer, EPOLLIN);
+	watch(loop, &loop->sync, EPOLLIN);
+	watch(loop, &loop->workers_done, EPOLLIN);
+
+	int input_fds[MAX_INPUT_FDS];
+	loop->i_ctx = vt.input_open(input_fds, &loop->num_inputs, MAX_INPUT_FDS);
+	for (size_t i = 0; i < loop->num_inputs; i++) {
+		loop->inputs[i] = (struct source) { SRC_INPUT, input_fds[i] };
+		watch(loop, &loop->inputs[i], EPOLLIN);
+	}
+
+	struct client *in = &loop->stdin_client;
+	in->src = (struct source) { SRC_CLIENT, 0 };
+	in->out_fd = 1;
+	in->notices = (struct source) { SRC_NOTICES, -1 };
+	cmd_session_init(&in->session, ui_ctx, false);
+	cmd_count_buffer(sizeof(in->in));
+	client_update(loop, in);
+
+	loop->listen_path = opts->listen_path;
+	if (loop->listen_path) {
+		raise_fd_limit();
+
+		loop->listen = (struct source) {
+			SRC_LISTEN,
+			open_listener(loop->listen_path),
+		};
+		watch(loop, &loop->listen, EPOLLIN);
+
+		fprintf(stderr, "eloop: listening on %s\n", loop->listen_path);
+	}
+
+	start_workers(loop);
+
+	// Put something on screen right away, like ui_thread does.
+	ui_present(ui_ctx, true);
+
+	struct epoll_event events[MAX_EVENTS];
+	while (loop->running) {
+		int timeout = loop->ready ? 0 : -1;
+
+		int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			FATAL_ERR("eloop: epoll_wait failed: %s", STR_ERR);
+		}
+
+		for (int i = 0; i < n; i++)
+			dispatch(loop, events[i].data.ptr, events[i].events);
+
+		run_ready(loop);
+		reap_clients(loop);
+	}
+
+	fprintf(stderr, "SIGINT received; cleaning up.\n");
+
+	stop_workers(loop);
+	vt.input_close(loop->i_ctx);
+
+	while (loop->clients)
+		client_free(loop, loop->clients);
+
+	if (loop->listen_path) {
+		close(loop->listen.fd);
+		unlink(loop->listen_path);
+	}
+
+	cmd_session_deinit(&in->session);
+	cmd_count_buffer(-(ptrdiff_t)(sizeof(in->in) + in->out.cap));
+	free(in->out.data);
+
+	close(loop->signal.fd);
+	close(loop->timer.fd);
+	close(loop->workers_done.fd);
+	close(loop->epoll_fd);
+	free(loop);
+}
+
+static void watch(struct eloop *loop, struct source *src, uint32_t events)
+{
+	struct epoll_event ev = {
+		.events = events,
+		.data.ptr = src,
+	};
+
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, src->fd, &ev) != 0)
+		FATAL_ERR("eloop: can't watch fd %d: %s", src->fd, STR_ERR);
+}
+
+static int open_signalfd(void)
+{
+	// main has already blocked these in every thread.
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+
+	int fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (fd < 0)
+		FATAL_ERR("eloop: signalfd failed: %s", STR_ERR);
+
+	return fd;
+}
+
+static int open_timerfd(void)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (fd < 0)
+		FATAL_ERR("eloop: timerfd_create failed: %s", STR_ERR);
+
+	const struct timespec delay = {
+		.tv_sec = PANE_DELAY / 1000,
+		.tv_nsec = (PANE_DELAY % 1000) * 1000 * 1000,
+	};
+	const struct itimerspec spec = {
+		.it_interval = delay,
+		.it_value = delay,
+	};
+
+	if (timerfd_settime(fd, 0, &spec, NULL) != 0)
+		FATAL_ERR("eloop: timerfd_settime failed: %s", STR_ERR);
+
+	return fd;
+}
+
+static int open_listener(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path))
+		FATAL_ERR("eloop: socket path too long: %s", path);
+
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		FATAL_ERR("eloop: socket failed: %s", STR_ERR);
+
+	// Clear out whatever a previous instance left behind.
+	if (unlink(path) != 0 && errno != ENOENT)
+		FATAL_ERR("eloop: couldn't remove stale socket: %s: %s", path,
+		    STR_ERR);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		FATAL_ERR("eloop: couldn't bind to %s: %s", path, STR_ERR);
+
+	if (listen(fd, SOMAXCONN) != 0)
+		FATAL_ERR("eloop: couldn't listen on %s: %s", path, STR_ERR);
+
+	return fd;
+}
+
+static void raise_fd_limit(void)
+{
+	// Every client costs an fd, and the default soft limit is usually a
+	// measly 1024.
+	struct rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim) != 0)
+		return;
+
+	lim.rlim_cur = lim.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &lim) != 0)
+		fprintf(stderr, "eloop: couldn't raise fd limit: %s\n",
+		    STR_ERR);
+}
+
+static void start_workers(struct eloop *loop)
+{
+	int r;
+
+	if ((r = pthread_mutex_init(&loop->lock, NULL)) != 0)
+		FATAL_ERR("eloop: pthread_mutex_init failed: %s", strerror(r));
+
+	if ((r = pthread_cond_init(&loop->cond, NULL)) != 0)
+		FATAL_ERR("eloop: pthread_cond_init failed: %s", strerror(r));
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	loop->num_workers = cpus < 1 ? 1 : (size_t)cpus;
+	if (loop->num_workers > MAX_WORKERS)
+		loop->num_workers = MAX_WORKERS;
+
+	for (size_t i = 0; i < loop->num_workers; i++) {
+		r = pthread_create(&loop->workers[i], NULL, worker_main, loop);
+		if (r != 0)
+			FATAL_ERR("eloop: failed to spawn worker: %s",
+			    strerror(r));
+	}
+}
+
+static void stop_workers(struct eloop *loop)
+{
+	pthread_mutex_lock(&loop->lock);
+	loop->stopping = true;
+	pthread_cond_broadcast(&loop->cond);
+	pthread_mutex_unlock(&loop->lock);
+
+	for (size_t i = 0; i < loop->num_workers; i++)
+		pthread_join(loop->workers[i], NULL);
+
+	// Nobody is going to hear about these anymore.
+	struct job *job;
+	while ((job = job_pop(&loop->pending))) {
+		job->client->busy = false;
+		free(job->line);
+		free(job);
+	}
+	while ((job = job_pop(&loop->done))) {
+		job->client->busy = false;
+		free(job->line);
+		free(job->reply);
+		free(job);
+	}
+
+	pthread_cond_destroy(&loop->cond);
+	pthread_mutex_destroy(&loop->lock);
+}
+
+static void *worker_main(void *arg)
+{
+	struct eloop *loop = arg;
+
+	trace_thread_name("worker");
+
+	for (;;) {
+		pthread_mutex_lock(&loop->lock);
+		while (!loop->stopping && !loop->pending.head)
+			pthread_cond_wait(&loop->cond, &loop->lock);
+
+		if (loop->stopping) {
+			pthread_mutex_unlock(&loop->lock);
+			return NULL;
+		}
+
+		struct job *job = job_pop(&loop->pending);
+		pthread_mutex_unlock(&loop->lock);
+
+		job->reply = cmd_exec_line(&job->client->session, job->line);
+
+		pthread_mutex_lock(&loop->lock);
+		job_push(&loop->done, job);
+		pthread_mutex_unlock(&loop->lock);
+
+		uint64_t one = 1;
+		if (write(loop->workers_done.fd, &one, sizeof(one)) !=
+		    sizeof(one))
+			FATAL_ERR("eloop: failed to signal completion: %s",
+			    STR_ERR);
+	}
+}
+
+static void job_push(struct job_queue *q, struct job *job)
+{
+	job->next = NULL;
+	if (q->tail)
+		q->tail->next = job;
+	else
+		q->head = job;
+	q->tail = job;
+}
+
+static struct job *job_pop(struct job_queue *q)
+{
+	struct job *job = q->head;
+	if (!job)
+		return NULL;
+
+	q->head = job->next;
+	if (!q->head)
+		q->tail = NULL;
+
+	return job;
+}
+
+static void dispatch(struct eloop *loop, struct source *src, uint32_t events)
+{
+	switch (src->kind) {
+	case SRC_SIGNAL:
+		struct signalfd_siginfo info;
+		if (read(src->fd, &info, sizeof(info)) != sizeof(info))
+			FATAL_ERR("eloop: failed to read signalfd: %s",
+			    STR_ERR);
+
+		if (info.ssi_signo == SIGINT) {
+			loop->running = false;
+		} else if (info.ssi_signo == SIGUSR1) {
+			char *report = ui_lock_report(loop->ui_ctx);
+			fprintf(stderr, "locks: %s\n", report);
+			free(report);
+		}
+		break;
+	case SRC_TIMER:
+		drain_counter(src->fd);
+		ui_present(loop->ui_ctx, true);
+		break;
+	case SRC_SYNC:
+		// Any number of syncs since the last present are satisfied by
+		// a single one.
+		drain_counter(src->fd);
+		ui_present(loop->ui_ctx, false);
+		break;
+	case SRC_WORKERS:
+		drain_counter(src->fd);
+		handle_workers_done(loop);
+		break;
+	case SRC_INPUT:
+		loop->vt.input_dispatch(loop->i_ctx, src->fd);
+		break;
+	case SRC_LISTEN:
+		handle_listen(loop);
+		break;
+	case SRC_CLIENT:
+		handle_client(loop, (struct client *)src, events);
+		break;
+	case SRC_NOTICES:
+		struct client *c = (struct client *)((char *)src -
+		    offsetof(struct client, notices));
+
+		char *notices = cmd_take_notices(&c->session);
+		if (notices)
+			client_reply(c, notices);
+		free(notices);
+
+		client_flush(c);
+		client_update(loop, c);
+		break;
+	}
+}
+
+static void handle_workers_done(struct eloop *loop)
+{
+	pthread_mutex_lock(&loop->lock);
+	struct job_queue done = loop->done;
+	loop->done = (struct job_queue) { 0 };
+	pthread_mutex_unlock(&loop->lock);
+
+	struct job *job;
+	while ((job = job_pop(&done))) {
+		struct client *c = job->client;
+
+		if (job->reply) {
+			client_reply(c, job->reply);
+			client_watch_notices(loop, c);
+			ui_sync(loop->ui_ctx);
+		}
+
+		free(job->reply);
+		free(job->line);
+		free(job);
+
+		// Pick up where the client left off.
+		c->busy = false;
+		client_run_lines(loop, c);
+		client_flush(c);
+		client_update(loop, c);
+	}
+}
+
+static void handle_listen(struct eloop *loop)
+{
+	for (;;) {
+		int fd = accept4(loop->listen.fd, NULL, NULL,
+		    SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			if (errno == EMFILE || errno == ENFILE) {
+				// Leave the rest in the backlog until someone
+				// hangs up.
+				fprintf(stderr,
+				    "eloop: out of fds with %zu clients\n",
+				    loop->num_clients);
+
+				struct epoll_event ev = {
+					.events = 0,
+					.data.ptr = &loop->listen,
+				};
+				epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD,
+				    loop->listen.fd, &ev);
+				loop->accept_paused = true;
+				return;
+			}
+
+			FATAL_ERR("eloop: accept failed: %s", STR_ERR);
+		}
+
+		struct client *c = calloc(1, sizeof(struct client));
+		if (!c)
+			FATAL_ERR("eloop: failed to allocate client");
+
+		c->src = (struct source) { SRC_CLIENT, fd };
+		c->out_fd = fd;
+		c->is_socket = true;
+		c->id = loop->next_client_id++;
+		c->notices = (struct source) { SRC_NOTICES, -1 };
+		cmd_session_init(&c->session, loop->ui_ctx, true);
+		cmd_count_buffer(sizeof(c->in));
+
+		c->next = loop->clients;
+		if (loop->clients)
+			loop->clients->prev = c;
+		loop->clients = c;
+		loop->num_clients++;
+
+		client_update(loop, c);
+	}
+}
+
+static void handle_client(struct eloop *loop, struct client *c, uint32_t events)
+{
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		client_read(loop, c);
+
+	if (events & EPOLLOUT)
+		client_flush(c);
+
+	client_update(loop, c);
+}
+
+static void run_ready(struct eloop *loop)
+{
+	struct client *ready = loop->ready;
+	loop->ready = NULL;
+
+	while (ready) {
+		struct client *c = ready;
+		ready = c->next_ready;
+
+		c->ready = false;
+		if (c->unpollable)
+			client_read(loop, c);
+		else
+			client_run_lines(loop, c);
+
+		client_flush(c);
+		client_update(loop, c);
+	}
+}
+
+static void reap_clients(struct eloop *loop)
+{
+	while (loop->reap) {
+		struct client *c = loop->reap;
+		loop->reap = c->next_reap;
+		client_free(loop, c);
+	}
+}
+
+static void client_read(struct eloop *loop, struct client *c)
+{
+	if (!c->eof && !c->dead && c->in_len < sizeof(c->in)) {
+		const uint64_t span = trace_begin();
+		ssize_t n = read(
+		    c->src.fd, &c->in[c->in_len], sizeof(c->in) - c->in_len);
+		trace_end(span, "read");
+
+		if (n < 0 && errno != EINTR && errno != EAGAIN &&
+		    errno != EWOULDBLOCK) {
+			if (!c->is_socket)
+				FATAL_ERR("eloop: couldn't read from stdin: %s",
+				    STR_ERR);
+
+			// Treat e.g. ECONNRESET as a hangup.
+			n = 0;
+			c->dead = true;
+		}
+
+		// Stop reading from clients upon EOF to prevent spinning.
+		// Whatever they already sent still gets run.
+		if (n == 0)
+			c->eof = true;
+		else if (n > 0)
+			c->in_len += n;
+	}
+
+	client_run_lines(loop, c);
+	client_flush(c);
+}
+
+static void client_run_lines(struct eloop *loop, struct client *c)
+{
+	char line[MAX_CMD_LEN + 1];
+
+	for (size_t turn = 0; !c->busy && !c->reaping && c->in_len > 0;
+	    turn++) {
+		if (turn == LINES_PER_TURN) {
+			// Let everyone else have a go first.
+			if (!c->ready) {
+				c->ready = true;
+				c->next_ready = loop->ready;
+				loop->ready = c;
+			}
+			return;
+		}
+
+		size_t max = c->in_len < MAX_CMD_LEN - 1 ? c->in_len
+							 : MAX_CMD_LEN - 1;
+		char *nl = memchr(c->in, '\n', max);
+
+		size_t line_len;
+		if (nl)
+			line_len = nl - c->in + 1;
+		else if (c->in_len >= MAX_CMD_LEN - 1 || c->eof)
+			// Over-long lines get split, like fgets(3) would.
+			line_len = max;
+		else
+			return;
+
+		memcpy(line, c->in, line_len);
+		line[line_len] = '\0';
+
+		if (loop->capture)
+			capture_line(loop->capture, c->id, line, line_len);
+
+		c->in_len -= line_len;
+		memmove(c->in, &c->in[line_len], c->in_len);
+
+		if (cmd_line_is_heavy(line)) {
+			struct job *job = malloc(sizeof(struct job));
+			if (!job || !(job->line = strdup(line)))
+				FATAL_ERR("eloop: failed to allocate job");
+
+			job->client = c;
+			job->reply = NULL;
+			c->busy = true;
+
+			pthread_mutex_lock(&loop->lock);
+			job_push(&loop->pending, job);
+			pthread_cond_signal(&loop->cond);
+			pthread_mutex_unlock(&loop->lock);
+			return;
+		}
+
+		char *reply = cmd_exec_line(&c->session, line);
+		if (!reply)
+			continue;
+
+		client_reply(c, reply);
+		client_watch_notices(loop, c);
+		free(reply);
+
+		// Hand over a new descriptor right away, so a following SHM
+		// doesn't find it still waiting.
+		if (c->out.fd_pending)
+			client_flush(c);
+
+		ui_sync(loop->ui_ctx);
+	}
+}
+
+static void client_reply(struct client *c, const char *reply)
+{
+	if (c->dead)
+		return;
+
+	size_t len = strlen(reply);
+	struct outbuf *out = &c->out;
+
+	// Compact before growing.
+	if (out->off > 0 && out->len + len > out->cap) {
+		memmove(out->data, &out->data[out->off], out->len - out->off);
+		out->len -= out->off;
+		out->fd_at -= out->fd_pending ? out->off : 0;
+		out->off = 0;
+	}
+
+	if (out->len + len > out->cap) {
+		size_t cap = out->cap ? out->cap : 256;
+		while (cap < out->len + len)
+			cap *= 2;
+
+		char *data = realloc(out->data, cap);
+		if (!data)
+			FATAL_ERR("eloop: failed to grow reply buffer");
+
+		cmd_count_buffer(cap - out->cap);
+		out->data = data;
+		out->cap = cap;
+	}
+
+	// A descriptor from this line rides along with the start of its reply.
+	// Later SHMs are refused until it's gone, so there's only ever one.
+	if (c->session.reply_fd >= 0 && !out->fd_pending) {
+		out->fd_pending = true;
+		out->fd_at = out->len;
+	}
+
+	memcpy(&out->data[out->len], reply, len);
+	out->len += len;
+}
+
+static void client_flush(struct client *c)
+{
+	struct outbuf *out = &c->out;
+
+	while (!c->dead && out->off < out->len) {
+		const char *data = &out->data[out->off];
+		size_t len = out->len - out->off;
+
+		ssize_t n;
+		if (out->fd_pending && out->off == out->fd_at) {
+			n = send_with_fd(
+			    c->out_fd, data, len, c->session.reply_fd);
+			if (n > 0) {
+				close(c->session.reply_fd);
+				c->session.reply_fd = -1;
+				out->fd_pending = false;
+			}
+		} else {
+			// Stop short of the descriptor so it can't be
+			// attached to bytes from an earlier reply.
+			if (out->fd_pending)
+				len = out->fd_at - out->off;
+
+			n = c->is_socket ? send(c->out_fd, data, len, MSG_NOSIGNAL)
+					 : write(c->out_fd, data, len);
+		}
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return; // wait for EPOLLOUT
+
+			if (!c->is_socket)
+				FATAL_ERR("eloop: couldn't write to stdout: %s",
+				    STR_ERR);
+
+			c->dead = true;
+			break;
+		}
+
+		out->off += n;
+	}
+
+	out->off = out->len = 0;
+}
+
+static ssize_t send_with_fd(int sock, const char *data, size_t len, int fd)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control = { 0 };
+
+	struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+static void client_update(struct eloop *loop, struct client *c)
+{
+	const size_t backlog = c->out.len - c->out.off;
+
+	// Hang on to clients that are still waiting to hear about a save.
+	const bool done = c->eof && c->in_len == 0 && backlog == 0 &&
+	    !cmd_saves_pending(&c->session);
+	if (c->is_socket && !c->busy && (c->dead || done)) {
+		if (!c->reaping) {
+			c->dead = true;
+			c->reaping = true;
+			c->next_reap = loop->reap;
+			loop->reap = c;
+		}
+		return;
+	}
+
+	uint32_t want = 0;
+	if (!c->busy && !c->eof && c->in_len < sizeof(c->in) &&
+	    backlog < CLIENT_MAX_BACKLOG)
+		want |= EPOLLIN;
+
+	if (c->is_socket && backlog > 0)
+		want |= EPOLLOUT;
+
+	if (c->unpollable) {
+		if (want & EPOLLIN && !c->ready) {
+			c->ready = true;
+			c->next_ready = loop->ready;
+			loop->ready = c;
+		}
+		return;
+	}
+
+	if (want == c->events)
+		return;
+
+	struct epoll_event ev = {
+		.events = want,
+		.data.ptr = &c->src,
+	};
+
+	int op = EPOLL_CTL_MOD;
+	if (c->events == 0)
+		op = EPOLL_CTL_ADD;
+	else if (want == 0)
+		op = EPOLL_CTL_DEL;
+
+	if (epoll_ctl(loop->epoll_fd, op, c->src.fd, &ev) != 0) {
+		if (errno != EPERM)
+			FATAL_ERR("eloop: can't watch client: %s", STR_ERR);
+
+		c->unpollable = true;
+		client_update(loop, c);
+		return;
+	}
+
+	c->events = want;
+}
+
+/* Start watching for notices once the session has them. */
+static void client_watch_notices(struct eloop *loop, struct client *c)
+{
+	if (c->notices.fd >= 0 || cmd_notices_fd(&c->session) < 0)
+		return;
+
+	c->notices.fd = cmd_notices_fd(&c->session);
+	watch(loop, &c->notices, EPOLLIN);
+}
+
+static void client_free(struct eloop *loop, struct client *c)
+{
+	if (c->ready) {
+		struct client **link = &loop->ready;
+		while (*link != c)
+			link = &(*link)->next_ready;
+		*link = c->next_ready;
+	}
+
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		loop->clients = c->next;
+
+	if (c->next)
+		c->next->prev = c->prev;
+
+	loop->num_clients--;
+
+	if (loop->capture)
+		capture_hangup(loop->capture, c->id);
+
+	// The notices may outlive the session, while saves are still going.
+	if (c->notices.fd >= 0)
+		epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, c->notices.fd, NULL);
+
+	// Closing the fd removes it from the epoll set.
+	close(c->src.fd);
+	cmd_session_deinit(&c->session);
+	cmd_count_buffer(-(ptrdiff_t)(sizeof(c->in) + c->out.cap));
+	free(c->out.data);
+	free(c);
+
+	if (loop->accept_paused) {
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = &loop->listen,
+		};
+		epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, loop->listen.fd, &ev);
+		loop->accept_paused = false;
+	}
+}
+
+static uint64_t drain_counter(int fd)
+{
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) != sizeof(count))
+		FATAL_ERR("eloop: failed to read counter fd: %s", STR_ERR);
+
+	return count;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "../rendering/rendering.h"
+#include "capture.h"
+#include "ui.h"
+
+struct eloop_opts {
+	// If non-null, also accept clients on a Unix socket at this path.
+	const char *listen_path;
+
+	// If non-null, journal every line read from any client here.
+	struct capture *capture;
+};
+
+/* Run the whole runtime (commands, pane rotation, input, and termination) on
+ * the calling thread with a single epoll instance, instead of ui_thread,
+ * cmd_thread and the backend's input thread. Every client (stdin included)
+ * gets its own line buffer and reply queue; heavy commands are handed to a
+ * small worker pool. Returns once SIGINT is received, which the caller must
+ * have blocked beforehand. */
+void eloop_run(
+    struct ui_ctx *, struct rendering_vtable, const struct eloop_opts *);
@@ -0,0 +1,517 @@
+#define _GNU_SOURCE // syscall, MAP_POPULATE
+
+#include "saver.h"
+
+#include "../abort.h"
+#include "../trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// How many conversion buffers can be waiting on the disk at once, and how big
+// each is.
+#define NUM_BUFS 16
+#define BUF_SIZE (1u << 20)
+
+struct job {
+	struct job *next;
+	int dirfd;
+
+	struct save_item *items;
+	size_t num_items;
+
+	// Files opened but not yet fully written, and whether every item has
+	// been converted yet.
+	size_t open_files;
+	bool converted;
+
+	struct save_result result;
+	save_done_fn done;
+	void *arg;
+};
+
+struct file {
+	struct job *job;
+	int fd;
+	unsigned inflight; // writes submitted but not completed
+	bool converted;
+	int err;
+	uint64_t bytes;
+};
+
+struct buf {
+	uint8_t *data;
+	struct file *file;
+	size_t len;
+};
+
+/* Where canvas_encode's output goes, a buffer at a time. */
+struct file_sink {
+	struct saver *saver;
+	struct file *file;
+	struct buf *buf; // partly filled, or null
+	uint64_t off;	 // where it goes in the file
+};
+
+/* The parts of an io_uring the saver uses, mapped by hand. */
+struct ring {
+	int fd; // -1 without io_uring
+
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+	unsigned to_submit;
+};
+
+struct saver {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct job *head, *tail;
+	bool stopping;
+	uint64_t next_id;
+
+	// Only touched by the saver's thread.
+	struct ring ring;
+	struct buf bufs[NUM_BUFS];
+	struct buf *free_bufs[NUM_BUFS];
+	size_t num_free;
+};
+
+static void *saver_main(void *);
+static void run_job(struct saver *, struct job *);
+static void save_item(struct saver *, struct job *, struct save_item *);
+static bool file_sink(void *arg, const uint8_t *data, size_t len);
+static void file_sink_flush(struct file_sink *);
+static struct buf *get_buf(struct saver *);
+static void submit_write(struct saver *, struct buf *, uint64_t off);
+static void reap(struct saver *, bool wait);
+static void write_done(struct saver *, struct buf *, int res);
+static void file_done(struct file *);
+static void ring_init(struct ring *);
+static void ring_deinit(struct ring *);
+
+struct saver *saver_new(void)
+{
+	struct saver *s = calloc(1, sizeof(*s));
+	if (!s)
+		FATAL_ERR("saver: OOM");
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->next_id = 1;
+
+	ring_init(&s->ring);
+	if (s->ring.fd < 0)
+		fprintf(stderr,
+		    "saver: no io_uring (%s), falling back to pwrite\n",
+		    STR_ERR);
+
+	for (size_t i = 0; i < NUM_BUFS; i++) {
+		s->bufs[i].data = malloc(BUF_SIZE);
+		if (!s->bufs[i].data)
+			FATAL_ERR("saver: OOM");
+
+		s->free_bufs[s->num_free++] = &s->bufs[i];
+	}
+
+	const int r = pthread_create(&s->thread, NULL, saver_main, s);
+	if (r != 0)
+		FATAL_ERR("saver: failed to spawn thread: %s", strerror(r));
+
+	return s;
+}
+
+void saver_free(struct saver *s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->stopping = true;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_join(s->thread, NULL);
+
+	ring_deinit(&s->ring);
+	for (size_t i = 0; i < NUM_BUFS; i++)
+		free(s->bufs[i].data);
+
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+uint64_t saver_submit(struct saver *s, int dirfd, struct save_item *items,
+    size_t n, save_done_fn done, void *arg)
+{
+	struct job *job = malloc(sizeof(*job));
+	if (!job)
+		FATAL_ERR("saver: OOM");
+
+	*job = (struct job) {
+		.dirfd = dirfd,
+		.items = items,
+		.num_items = n,
+		.done = done,
+		.arg = arg,
+	};
+
+	pthread_mutex_lock(&s->lock);
+	const uint64_t id = job->result.id = s->next_id++;
+	if (s->tail)
+		s->tail->next = job;
+	else
+		s->head = job;
+	s->tail = job;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	// The job may well be done already.
+	return id;
+}
+
+static void *saver_main(void *arg)
+{
+	struct saver *s = arg;
+
+	trace_thread_name("saver");
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		struct job *job = s->head;
+		if (!job && s->stopping)
+			break;
+
+		if (!job) {
+			// Out of work, so finish off the writes before
+			// sleeping.
+			pthread_mutex_unlock(&s->lock);
+			while (s->num_free < NUM_BUFS)
+				reap(s, true);
+			pthread_mutex_lock(&s->lock);
+
+			while (!s->head && !s->stopping)
+				pthread_cond_wait(&s->cond, &s->lock);
+			continue;
+		}
+
+		s->head = job->next;
+		if (!s->head)
+			s->tail = NULL;
+		pthread_mutex_unlock(&s->lock);
+
+		run_job(s, job);
+
+		pthread_mutex_lock(&s->lock);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	while (s->num_free < NUM_BUFS)
+		reap(s, true);
+
+	return NULL;
+}
+
+/* Convert and submit every item. Writes may still be in flight afterward; the
+ * job finishes along with its last file. */
+static void run_job(struct saver *s, struct job *job)
+{
+	// Hold the job open until every item has at least been started.
+	job->open_files++;
+	for (size_t i = 0; i < job->num_items; i++) {
+		const uint64_t span = trace_begin();
+		save_item(s, job, &job->items[i]);
+		trace_end(span, "save");
+	}
+
+	job->converted = true;
+	struct file sentinel = { .job = job, .fd = -1, .converted = true };
+	file_done(&sentinel);
+}
+
+static void save_item(struct saver *s, struct job *job, struct save_item *it)
+{
+	struct canvas *c = it->snapshot;
+
+	struct file *f = malloc(sizeof(*f));
+	if (!f)
+		FATAL_ERR("saver: OOM");
+
+	*f = (struct file) { .job = job };
+	f->fd = openat(job->dirfd, it->path,
+	    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (f->fd < 0)
+		f->err = errno;
+
+	job->open_files++;
+
+	if (it->format != IMAGE_FORMAT_RAW) {
+		struct file_sink sink = { .saver = s, .file = f };
+		if (f->fd >= 0 &&
+		    !canvas_encode(c, it->format, file_sink, &sink) && !f->err)
+			f->err = errno;
+		file_sink_flush(&sink);
+	}
+
+	// Raw rows are converted straight into the buffers.
+	const size_t stride = (size_t)c->width * 4;
+	const size_t rows_per_buf = BUF_SIZE / stride;
+	for (uint32_t y = 0; it->format == IMAGE_FORMAT_RAW && f->fd >= 0 &&
+	    !f->err && y < c->height;
+	    y += rows_per_buf) {
+		const uint16_t rows =
+		    c->height - y < rows_per_buf ? c->height - y : rows_per_buf;
+
+		struct buf *b = get_buf(s);
+		canvas_read_rgba(c, y, rows, b->data);
+		b->file = f;
+		b->len = rows * stride;
+		f->inflight++;
+		submit_write(s, b, y * stride);
+	}
+
+	// Nothing more to convert, so the snapshot can go.
+	canvas_deinit(c);
+	free(it->path);
+
+	f->converted = true;
+	if (f->inflight == 0)
+		file_done(f);
+}
+
+static bool file_sink(void *arg, const uint8_t *data, size_t len)
+{
+	struct file_sink *sink = arg;
+
+	while (len > 0 && !sink->file->err) {
+		if (!sink->buf) {
+			sink->buf = get_buf(sink->saver);
+			sink->buf->file = sink->file;
+			sink->buf->len = 0;
+		}
+
+		struct buf *b = sink->buf;
+		const size_t room = BUF_SIZE - b->len;
+		const size_t n = len < room ? len : room;
+		memcpy(&b->data[b->len], data, n);
+		b->len += n;
+		data += n;
+		len -= n;
+
+		if (b->len == BUF_SIZE)
+			file_sink_flush(sink);
+	}
+
+	return !sink->file->err;
+}
+
+/* Send off the buffer being filled, if any. */
+static void file_sink_flush(struct file_sink *sink)
+{
+	struct buf *b = sink->buf;
+	if (!b)
+		return;
+
+	sink->buf = NULL;
+	if (sink->file->err) {
+		sink->saver->free_bufs[sink->saver->num_free++] = b;
+		return;
+	}
+
+	const uint64_t off = sink->off;
+	sink->off += b->len;
+	sink->file->inflight++;
+	submit_write(sink->saver, b, off);
+}
+
+static struct buf *get_buf(struct saver *s)
+{
+	while (s->num_free == 0)
+		reap(s, true);
+
+	return s->free_bufs[--s->num_free];
+}
+
+static void submit_write(struct saver *s, struct buf *b, uint64_t off)
+{
+	struct ring *r = &s->ring;
+
+	if (r->fd < 0) {
+		size_t done = 0;
+		ssize_t n = 0;
+		while (done < b->len) {
+			n = pwrite(b->file->fd, b->data + done, b->len - done,
+			    off + done);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+
+		write_done(s, b, n < 0 ? -errno : (int)done);
+		return;
+	}
+
+	const unsigned tail = *r->sq_tail;
+	const unsigned idx = tail & *r->sq_mask;
+	r->sqes[idx] = (struct io_uring_sqe) {
+		.opcode = IORING_OP_WRITE,
+		.fd = b->file->fd,
+		.off = off,
+		.addr = (uintptr_t)b->data,
+		.len = b->len,
+		.user_data = (uintptr_t)b,
+	};
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+
+	// Hand writes over in batches of a few buffers, which keeps the disk
+	// busy without a syscall per buffer.
+	if (r->to_submit >= NUM_BUFS / 4)
+		reap(s, false);
+}
+
+/* Submit what's queued and handle every completion so far, waiting for at
+ * least one if `wait`. */
+static void reap(struct saver *s, bool wait)
+{
+	struct ring *r = &s->ring;
+	if (r->fd < 0)
+		return;
+
+	const unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	while (syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait ? 1 : 0,
+		   flags, NULL, 0) < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			FATAL_ERR("saver: io_uring_enter: %s", STR_ERR);
+	}
+	r->to_submit = 0;
+
+	unsigned head = *r->cq_head;
+	const unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		struct buf *b = (struct buf *)(uintptr_t)cqe->user_data;
+		const int res = cqe->res;
+
+		__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+		write_done(s, b, res);
+	}
+}
+
+static void write_done(struct saver *s, struct buf *b, int res)
+{
+	struct file *f = b->file;
+
+	// Regular files only come up short when something went wrong.
+	if (res < 0 && !f->err)
+		f->err = -res;
+	else if ((size_t)res != b->len && !f->err)
+		f->err = EIO;
+	else
+		f->bytes += res;
+
+	s->free_bufs[s->num_free++] = b;
+	if (--f->inflight == 0 && f->converted)
+		file_done(f);
+}
+
+static void file_done(struct file *f)
+{
+	struct job *job = f->job;
+
+	if (f->fd >= 0 && close(f->fd) < 0 && !f->err)
+		f->err = errno;
+
+	// The sentinel from run_job isn't a file.
+	if (f->fd >= 0 || f->err) {
+		job->result.bytes += f->bytes;
+		if (f->err) {
+			job->result.failed++;
+			if (!job->result.err)
+				job->result.err = f->err;
+		} else {
+			job->result.saved++;
+		}
+		free(f);
+	}
+
+	if (--job->open_files > 0 || !job->converted)
+		return;
+
+	if (job->dirfd != AT_FDCWD)
+		close(job->dirfd);
+
+	job->done(job->arg, &job->result);
+	free(job->items);
+	free(job);
+}
+
+static void ring_init(struct ring *r)
+{
+	*r = (struct ring) { .fd = -1 };
+
+	struct io_uring_params p = { 0 };
+	const int fd = syscall(__NR_io_uring_setup, NUM_BUFS, &p);
+	if (fd < 0)
+		return;
+
+	r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_map_len =
+	    p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	// Newer kernels put both rings in one mapping.
+	const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single && r->cq_map_len > r->sq_map_len)
+		r->sq_map_len = r->cq_map_len;
+
+	r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	r->cq_map = single ? r->sq_map
+			   : mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, fd,
+				 IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED ||
+	    r->sqes == MAP_FAILED)
+		FATAL_ERR("saver: failed to map io_uring: %s", STR_ERR);
+
+	uint8_t *sq = r->sq_map;
+	uint8_t *cq = r->cq_map;
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->fd = fd;
+}
+
+static void ring_deinit(struct ring *r)
+{
+	if (r->fd < 0)
+		return;
+
+	munmap(r->sqes, r->sqes_len);
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_len);
+	munmap(r->sq_map, r->sq_map_len);
+	close(r->fd);
+}
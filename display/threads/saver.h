@@ -0,0 +1,42 @@
+#pragma once
+
+#include "../rendering/canvas.h"
+#include "../rendering/encode.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Writes canvases out as files (like SAVE) in the background.
+ * Conversion happens on the saver's own thread, and the writes go through
+ * io_uring with several buffers in flight, so one file is being converted
+ * while the last ones are still being written. Without io_uring, it falls
+ * back to plain pwrite(2). */
+
+struct saver;
+
+struct save_item {
+	struct canvas *snapshot; // taken over by the saver
+	char *path;		 // relative to the job's dirfd; likewise
+	enum image_format format;
+};
+
+struct save_result {
+	uint64_t id;
+	size_t saved;
+	size_t failed;
+	uint64_t bytes;
+	int err; // errno of the first failure
+};
+
+/* Called from the saver's thread once every file in a job is written. */
+typedef void (*save_done_fn)(void *arg, const struct save_result *);
+
+struct saver *saver_new(void);
+
+/* Finish every job submitted so far, then stop. */
+void saver_free(struct saver *);
+
+/* Queue up a job, returning its ID. The saver takes over the items (and the
+ * array), and closes `dirfd` when done unless it's AT_FDCWD. */
+uint64_t saver_submit(struct saver *, int dirfd, struct save_item *items,
+    size_t n, save_done_fn, void *arg);
@@ -0,0 +1,127 @@
+#include "stats.h"
+
+#include "../abort.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+#define CACHE_LINE 64
+
+/* A thread's share of the stats. Slots start on a cache line of their own so
+ * that recording never bounces a line between cores. */
+struct stats_slot {
+	alignas(CACHE_LINE) pthread_mutex_t lock;
+	struct stats_counters counters;
+	struct hist hists[STATS_MAX_ACTIONS][STATS_PHASES];
+
+	struct stats_slot *next;
+};
+
+// Slots outlive their threads, so nothing recorded is ever lost.
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_slot *slots;
+
+static thread_local struct stats_slot *own_slot;
+
+// Lock waits and raster time spent on the command being run, by phase.
+static thread_local uint64_t noted[STATS_PHASES];
+
+static struct stats_slot *slot_get(void);
+
+void stats_record(const struct stats_sample *s)
+{
+	struct stats_slot *slot = slot_get();
+
+	pthread_mutex_lock(&slot->lock);
+
+	struct hist *hists = slot->hists[s->action];
+	for (unsigned i = 0; i < STATS_PHASES; i++) {
+		if (s->ns[i] > 0 || noted[i] > 0)
+			hist_record(&hists[i], s->ns[i] + noted[i]);
+	}
+
+	slot->counters.commands++;
+	slot->counters.errors += s->failed;
+	slot->counters.pixels += s->pixels;
+	slot->counters.bytes_read += s->bytes_read;
+
+	pthread_mutex_unlock(&slot->lock);
+
+	memset(noted, 0, sizeof(noted));
+}
+
+void stats_count_present(void)
+{
+	struct stats_slot *slot = slot_get();
+
+	pthread_mutex_lock(&slot->lock);
+	slot->counters.presents++;
+	pthread_mutex_unlock(&slot->lock);
+}
+
+void stats_note(enum stats_phase phase, uint64_t ns)
+{
+	noted[phase] += ns;
+}
+
+struct stats_snapshot *stats_collect(void)
+{
+	struct stats_snapshot *out = calloc(1, sizeof(struct stats_snapshot));
+	if (!out)
+		FATAL_ERR("stats: failed to allocate snapshot");
+
+	pthread_mutex_lock(&slots_lock);
+	for (struct stats_slot *slot = slots; slot; slot = slot->next) {
+		pthread_mutex_lock(&slot->lock);
+
+		out->counters.commands += slot->counters.commands;
+		out->counters.errors += slot->counters.errors;
+		out->counters.pixels += slot->counters.pixels;
+		out->counters.bytes_read += slot->counters.bytes_read;
+		out->counters.presents += slot->counters.presents;
+
+		for (size_t a = 0; a < STATS_MAX_ACTIONS; a++) {
+			for (unsigned p = 0; p < STATS_PHASES; p++)
+				hist_merge(
+				    &out->hists[a][p], &slot->hists[a][p]);
+		}
+
+		pthread_mutex_unlock(&slot->lock);
+	}
+	pthread_mutex_unlock(&slots_lock);
+
+	return out;
+}
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct stats_slot *slot_get(void)
+{
+	if (own_slot)
+		return own_slot;
+
+	struct stats_slot *slot =
+	    aligned_alloc(CACHE_LINE, sizeof(struct stats_slot));
+	if (!slot)
+		FATAL_ERR("stats: failed to allocate slot");
+
+	memset(slot, 0, sizeof(struct stats_slot));
+	pthread_mutex_init(&slot->lock, NULL);
+
+	pthread_mutex_lock(&slots_lock);
+	slot->next = slots;
+	slots = slot;
+	pthread_mutex_unlock(&slots_lock);
+
+	own_slot = slot;
+	return slot;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "../hist.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Where time goes while running a command. Lock waits and raster time are only
+ * spent by actions that touch panes. */
+enum stats_phase {
+	STATS_PARSE,
+	STATS_LOCK_WAIT,
+	STATS_RASTER,
+	STATS_TOTAL, // from the start of parsing to the end of the action
+	STATS_PHASES,
+};
+
+/* Actions are numbered by whoever runs them (see commands.c). */
+#define STATS_MAX_ACTIONS 24
+
+struct stats_counters {
+	uint64_t commands;
+	uint64_t errors;
+	uint64_t pixels; // estimated from each shape's geometry
+	uint64_t bytes_read;
+	uint64_t presents;
+};
+
+/* What one command cost. Lock waits and raster time noted by the thread since
+ * its last sample are added in when it's recorded. */
+struct stats_sample {
+	size_t action;
+	bool failed;
+	uint64_t pixels;
+	uint64_t bytes_read;
+	uint64_t ns[STATS_PHASES];
+};
+
+/* Everything recorded so far, by every thread. */
+struct stats_snapshot {
+	struct stats_counters counters;
+	struct hist hists[STATS_MAX_ACTIONS][STATS_PHASES];
+};
+
+/* Each thread records into a slot of its own, so these only ever take a lock
+ * nobody else wants, except while a snapshot is being taken. */
+void stats_record(const struct stats_sample *);
+void stats_count_present(void);
+
+/* For whatever the current command is waiting on or drawing. */
+void stats_note(enum stats_phase, uint64_t ns);
+
+/* Returns a snapshot to be freed by the caller. */
+struct stats_snapshot *stats_collect(void);
+
+/* A CLOCK_MONOTONIC timestamp in nanoseconds. */
+uint64_t stats_now(void);
@@ -2,10 +2,20 @@
 
 #include "../abort.h"
 #include "../rendering/rendering.h"
+#include "../trace.h"
+#include "checkpoint.h"
 #include "rendering/canvas.h"
+#include "rendering/encode.h"
+#include "rendering/store.h"
+#include "saver.h"
+#include "stats.h"
 #include "termination.h"
 
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <poll.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -14,33 +24,130 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 #define MAX_PANES 1024
-#define PANE_DELAY 5000
+
+// How often ui_present writes a summary of the presents since the last one.
+#define PRESENT_SUMMARY_NS (10 * (uint64_t)1000000000)
+
+// Panes are kept in files named after a sequence number, as 16 hex digits and
+// ".pane". The root pane is always number zero.
+#define PANE_FILE_LEN (16 + sizeof(".pane"))
 
 struct pane {
 	char *name;
 	struct canvas *canvas;
+
+	// Where the canvas goes on screen.
+	uint16_t x, y;
+
+	// Names the pane's file in the state dir.
+	uint64_t seq;
+
+	// When the pane was last drawn to or shown, by ui_ctx.clock.
+	uint64_t last_used;
+
+	// Packed to fit the budget, and not touched since.
+	bool cold;
+};
+
+/* Where the panes lock gets taken, for ui_lock_report. Sites from SITE_PRESENT
+ * on don't run on behalf of a command. */
+enum lock_site {
+	SITE_DRAW,
+	SITE_CREATE,
+	SITE_REMOVE,
+	SITE_COUNT,
+	SITE_MEMORY,
+	SITE_MEMINFO,
+	SITE_SAVE,
+	SITE_SAVE_ASYNC,
+	SITE_SAVE_ALL,
+	SITE_PRESENT,
+	SITE_CHECKPOINT,
+	NUM_SITES,
+};
+
+struct lock_profile {
+	struct hist wait, hold;
+};
+
+/* Present counts as of some point, so that the summary can show what happened
+ * since then. */
+struct frame_counts {
+	uint64_t at;
+	uint64_t presents, syncs;
+	struct present_stats backend;
 };
 
 struct pane_storage {
 	size_t count;
 	pthread_mutex_t lock;
 	struct pane panes[MAX_PANES];
+
+	// Who has the lock and since when, and how long each site waited for
+	// it and held it. Protected by the lock itself, outside of startup
+	// and shutdown.
+	enum lock_site site;
+	uint64_t locked_at;
+	struct lock_profile profile[NUM_SITES];
 };
 
 struct ui_ctx {
 	struct rendering_vtable vt;
 	void *r_ctx; // type erased rendering context
+	uint16_t screen_width, screen_height;
 
 	struct pane_storage panes;
 
+	// Index of the pane currently on screen. Protected by panes.lock.
+	size_t shown_pane;
+
+	// Memory accounting, also protected by panes.lock. `resident` is the
+	// sum of every canvas's bytes.
+	size_t resident;
+	uint64_t clock;
+	struct ui_memory_stats mem;
+
+	// The state dir, or -1 if panes only live in memory. New panes get
+	// next_seq.
+	int state_dirfd;
+	uint64_t next_seq;
+
+	// Null unless checkpointing. Only the checkpoint thread touches the
+	// file, and the stop flag is protected by checkpoint_lock.
+	struct checkpoint *checkpoint;
+	unsigned checkpoint_interval;
+	pthread_t checkpoint_thread;
+	pthread_mutex_t checkpoint_lock;
+	pthread_cond_t checkpoint_cond;
+	bool checkpoint_stop;
+
+	// Whether a pane was removed since the last checkpoint, which the
+	// tiles alone wouldn't show. Protected by panes.lock.
+	bool panes_removed;
+
+	// Writes out SAVE_ASYNC and SAVE_ALL; started by the first of those.
+	// Protected by panes.lock.
+	struct saver *saver;
+
 	int cancellation_fd;
 
-	int sync_fd_rx;
-	int sync_fd_tx;
+	// An eventfd counting syncs that haven't been presented yet.
+	int sync_fd;
+
+	// Every sync ever asked for, presented on its own or not.
+	_Atomic uint64_t syncs;
+
+	// Presents and how long rendering_show took, overall and since the
+	// last summary. Protected by panes.lock.
+	uint64_t presents;
+	struct hist show_ns, recent_show_ns;
+	struct frame_counts started, last_summary;
 };
 
 enum sleep_result {
@@ -50,6 +157,12 @@ enum sleep_result {
 };
 
 static void *rotate_panes(void *);
+static void present_summary(struct ui_ctx *, uint64_t now);
+
+/* Take and return the panes lock, keeping track of how long that took and
+ * how long it was held for. Commands are charged for the wait. */
+static void lock_panes(struct ui_ctx *, enum lock_site);
+static void unlock_panes(struct ui_ctx *);
 
 /* Search for a pane with the given name, or null if none is found.
  * This does not perform any synchronization, so if there are other threads
@@ -57,12 +170,69 @@ static void *rotate_panes(void *);
 static struct pane *lookup_pane_thread_unsafe(
     struct pane_storage *, const char *);
 
+/* Note that a pane is being drawn to or shown, and unpack it completely if
+ * `unpack`. Returns the canvas's size beforehand, for pane_account. These and
+ * the below need the panes lock. */
+static size_t pane_touch(struct ui_ctx *, struct pane *, bool unpack);
+
+/* Update ctx->resident after a pane's canvas changed size. */
+static void pane_account(struct ui_ctx *, struct pane *, size_t before);
+
+/* Pack the least recently used panes until back within budget. The shown pane
+ * and `keep` are spared. */
+static void enforce_budget(struct ui_ctx *, const struct pane *keep);
+
+/* Make a pane's canvas, in the state dir if there is one. Returns null and sets
+ * errno on failure. */
+static struct canvas *pane_canvas_new(struct ui_ctx *, const char *name,
+    uint64_t seq, uint16_t width, uint16_t height, uint16_t x, uint16_t y,
+    enum pixel_format);
+
+/* Open the state dir, creating it if need be, and attach to the panes in it.
+ * The root pane is only reused if it still matches the screen. Panes that
+ * can't be used are dropped, along with their files. */
+static void restore_panes(struct ui_ctx *, const char *dir);
+static void restore_pane(struct ui_ctx *, const char *file, uint64_t seq);
+
+/* Bring back the panes in a checkpoint, on top of any already there. */
+static void restore_checkpoint(struct ui_ctx *, const char *path);
+
+static void *checkpoint_panes(void *);
+static void take_checkpoint(struct ui_ctx *);
+static void pane_file(uint64_t seq, char out[static PANE_FILE_LEN]);
+static int is_pane_file(const struct dirent *);
+
 char *ui_failure_strs[] = {
 	[UI_OK] = "no failure",
 	[UI_DUPLICATE] = "duplicate pane",
 	[UI_OOM] = "oom",
 	[UI_NO_SUCH_PANE] = "targeted pane doesn't exist",
 	[UI_TOO_MANY_PANES] = "MAX_PANES would be exceeded",
+	[UI_OFF_SCREEN] = "pane doesn't fit on screen",
+	[UI_STORE_FAILED] = "couldn't store pane in state dir",
+	[UI_OPEN_FAILED] = "couldn't open directory",
+};
+
+// As they appear in ui_lock_report.
+static const char *const site_names[NUM_SITES] = {
+	[SITE_DRAW] = "draw",
+	[SITE_CREATE] = "create",
+	[SITE_REMOVE] = "remove",
+	[SITE_COUNT] = "count",
+	[SITE_MEMORY] = "memory",
+	[SITE_MEMINFO] = "meminfo",
+	[SITE_SAVE] = "save",
+	[SITE_SAVE_ASYNC] = "save_async",
+	[SITE_SAVE_ALL] = "save_all",
+	[SITE_PRESENT] = "present",
+	[SITE_CHECKPOINT] = "checkpoint",
+};
+
+// What's shown around panes smaller than the screen, and the root pane's fill.
+static const struct color background = {
+	.r = 0x3A,
+	.g = 0x22,
+	.b = 0xBD,
 };
 
 char *ui_failure_str(enum ui_failure f)
@@ -70,16 +240,18 @@ char *ui_failure_str(enum ui_failure f)
 	return ui_failure_strs[f];
 }
 
-struct ui_ctx *ui_ctx_new(struct rendering_vtable vt)
+struct ui_ctx *ui_ctx_new(
+    struct rendering_vtable vt, const struct ui_opts *opts)
 {
 	struct ui_ctx *ctx = malloc(sizeof(struct ui_ctx));
 	if (!ctx)
 		FATAL_ERR("ui: failed to allocate ctx");
 
-	ctx->r_ctx = vt.rendering_init();
+	ctx->r_ctx = vt.rendering_init(&opts->rendering);
 	ctx->vt = vt;
 
 	vt.rendering_ctx_log(ctx->r_ctx);
+	vt.rendering_size(ctx->r_ctx, &ctx->screen_width, &ctx->screen_height);
 
 	pthread_mutex_init(&ctx->panes.lock, NULL);
 
@@ -87,19 +259,32 @@ struct ui_ctx *ui_ctx_new(struct rendering_vtable vt)
 		FATAL_ERR("couldn't lock newly created pane mutex");
 
 	ctx->panes.count = 1;
-	ctx->panes.panes[0].canvas = vt.canvas_init(ctx->r_ctx);
-	ctx->panes.panes[0].name = strdup("root");
-
-	if (!ctx->panes.panes[0].name)
-		FATAL_ERR("ui: ctx_new: pane creation OOM");
-
-	struct color bg = {
-		.r = 0x3A,
-		.g = 0x22,
-		.b = 0xBD,
+	memset(ctx->panes.profile, 0, sizeof(ctx->panes.profile));
+	ctx->shown_pane = 0;
+	ctx->resident = 0;
+	ctx->clock = 0;
+	ctx->mem = (struct ui_memory_stats) {
+		.budget = opts->pane_memory_budget,
 	};
-
-	rendering_fill(ctx->panes.panes[0].canvas, bg);
+	ctx->state_dirfd = -1;
+	ctx->next_seq = 1;
+	ctx->saver = NULL;
+	ctx->panes.panes[0] = (struct pane) { 0 };
+
+	if (opts->state_dir) {
+		restore_panes(ctx, opts->state_dir);
+	} else {
+		struct pane *root = &ctx->panes.panes[0];
+		root->canvas = canvas_init(ctx->screen_width,
+		    ctx->screen_height, PIXEL_FORMAT_BGRA8888);
+		root->name = strdup("root");
+
+		if (!root->canvas || !root->name)
+			FATAL_ERR("ui: ctx_new: pane creation OOM");
+
+		rendering_fill(root->canvas, background);
+		ctx->resident += root->canvas->bytes;
+	}
 
 	pthread_mutex_unlock(&ctx->panes.lock);
 
@@ -108,17 +293,84 @@ struct ui_ctx *ui_ctx_new(struct rendering_vtable vt)
 	ctx->cancellation_fd = -1;
 
 	// sync_fd, on the other hand, can be initialized immediately.
-	int sync_fds[2];
-	if (pipe(sync_fds) != 0) {
-		FATAL_ERR("pipe(2) failed for sync fd's: %s", STR_ERR);
+	ctx->sync_fd = eventfd(0, EFD_CLOEXEC);
+	if (ctx->sync_fd < 0)
+		FATAL_ERR("eventfd(2) failed for sync fd: %s", STR_ERR);
+
+	ctx->syncs = 0;
+	ctx->presents = 0;
+	memset(&ctx->show_ns, 0, sizeof(ctx->show_ns));
+	memset(&ctx->recent_show_ns, 0, sizeof(ctx->recent_show_ns));
+	ctx->started = (struct frame_counts) { .at = stats_now() };
+	ctx->vt.rendering_stats(ctx->r_ctx, &ctx->started.backend);
+	ctx->last_summary = ctx->started;
+
+	if (opts->restore_path)
+		restore_checkpoint(ctx, opts->restore_path);
+
+	ctx->checkpoint = NULL;
+	ctx->panes_removed = false;
+	if (opts->checkpoint_path) {
+		ctx->checkpoint = checkpoint_new(opts->checkpoint_path);
+		ctx->checkpoint_interval = opts->checkpoint_interval;
+		ctx->checkpoint_stop = false;
+
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&ctx->checkpoint_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		pthread_mutex_init(&ctx->checkpoint_lock, NULL);
+
+		pthread_create(
+		    &ctx->checkpoint_thread, NULL, checkpoint_panes, ctx);
 	}
 
-	ctx->sync_fd_rx = sync_fds[0];
-	ctx->sync_fd_tx = sync_fds[1];
-
 	return ctx;
 }
 
+void ui_ctx_free(struct ui_ctx *ctx)
+{
+	struct present_stats stats;
+	ctx->vt.rendering_stats(ctx->r_ctx, &stats);
+	fprintf(stderr,
+	    "ui: terminating (frames queued: %" PRIu64 ", dropped: %" PRIu64
+	    ", presented: %" PRIu64 ")\n",
+	    stats.queued, stats.dropped, stats.presented);
+
+	// This takes one last checkpoint, so it has to happen while the panes
+	// are still around.
+	if (ctx->checkpoint) {
+		pthread_mutex_lock(&ctx->checkpoint_lock);
+		ctx->checkpoint_stop = true;
+		pthread_cond_signal(&ctx->checkpoint_cond);
+		pthread_mutex_unlock(&ctx->checkpoint_lock);
+
+		pthread_join(ctx->checkpoint_thread, NULL);
+		checkpoint_free(ctx->checkpoint);
+	}
+
+	// Saves that are still going get to finish.
+	if (ctx->saver)
+		saver_free(ctx->saver);
+
+	if (pthread_mutex_lock(&ctx->panes.lock) != 0)
+		FATAL_ERR("Failed to lock panes.");
+
+	size_t len = ctx->panes.count;
+	for (size_t i = 0; i < len; i++) {
+		canvas_deinit(ctx->panes.panes[i].canvas);
+		free(ctx->panes.panes[i].name);
+	}
+
+	if (ctx->state_dirfd >= 0)
+		close(ctx->state_dirfd);
+	close(ctx->sync_fd);
+
+	ctx->vt.rendering_cleanup(ctx->r_ctx);
+	free(ctx);
+}
+
 void *ui_thread(void *arg)
 {
 	struct ui_ctx *ctx = arg;
@@ -138,28 +390,73 @@ void *ui_thread(void *arg)
 
 	pthread_join(pane_handle, NULL);
 
-	fprintf(stderr, "ui: terminating\n");
-
-	if (pthread_mutex_lock(&ctx->panes.lock) != 0)
-		FATAL_ERR("Failed to lock panes.");
-
-	size_t len = ctx->panes.count;
-	for (size_t i = 0; i < len; i++) {
-		canvas_deinit(ctx->panes.panes[i].canvas);
-		free(ctx->panes.panes[i].name);
-	}
-
-	ctx->vt.rendering_cleanup(ctx->r_ctx);
-	free(ctx);
-
 	return NULL;
 }
 
 void ui_sync(struct ui_ctx *ctx)
 {
-	char data[] = { 0 };
-	if (write(ctx->sync_fd_tx, data, 1) != 1)
-		fprintf(stderr, "failed to write to sync_fd_tx: %s", STR_ERR);
+	uint64_t one = 1;
+	ctx->syncs++;
+	if (write(ctx->sync_fd, &one, sizeof(one)) != sizeof(one))
+		fprintf(stderr, "failed to write to sync_fd: %s", STR_ERR);
+}
+
+int ui_sync_fd(struct ui_ctx *ctx)
+{
+	return ctx->sync_fd;
+}
+
+void ui_present(struct ui_ctx *ctx, bool switching)
+{
+	lock_panes(ctx, SITE_PRESENT);
+
+	ctx->shown_pane += switching;
+	if (ctx->shown_pane >= ctx->panes.count)
+		ctx->shown_pane = 0;
+
+	struct pane *p = &ctx->panes.panes[ctx->shown_pane];
+
+	// It's about to be read in full (and likely again on each sync), so
+	// packed tiles would only slow that down.
+	size_t before = pane_touch(ctx, p, true);
+	pane_account(ctx, p, before);
+
+	const struct placement pl = {
+		.x = p->x,
+		.y = p->y,
+		.background = background,
+	};
+	const uint64_t span = trace_begin();
+	const uint64_t start = stats_now();
+	ctx->vt.rendering_show(ctx->r_ctx, p->canvas, &pl);
+	const uint64_t now = stats_now();
+	trace_end(span, "present");
+	stats_count_present();
+
+	ctx->presents++;
+	hist_record(&ctx->show_ns, now - start);
+	hist_record(&ctx->recent_show_ns, now - start);
+	if (now - ctx->last_summary.at >= PRESENT_SUMMARY_NS)
+		present_summary(ctx, now);
+
+	// Panes only get unpacked here when switching, which is also the only
+	// time that the budget needs rechecking.
+	if (switching && ctx->panes.count > 1) {
+		struct pane *next = &ctx->panes.panes[(ctx->shown_pane + 1) %
+		    ctx->panes.count];
+
+		if (next->canvas->packed_tiles > 0) {
+			before = next->canvas->bytes;
+			canvas_unpack(next->canvas);
+			pane_account(ctx, next, before);
+			next->cold = false;
+			ctx->mem.prefetches++;
+		}
+
+		enforce_budget(ctx, next);
+	}
+
+	unlock_panes(ctx);
 }
 
 static enum sleep_result cancellable_sleep(
@@ -180,6 +477,7 @@ static enum sleep_result cancellable_sleep(
 	fds[0].events = POLLIN;
 	fds[1].events = POLLIN;
 	char buf[1];
+	uint64_t syncs;
 
 	struct timespec a, b;
 	clock_gettime(CLOCK_MONOTONIC_RAW, &a);
@@ -197,8 +495,9 @@ static enum sleep_result cancellable_sleep(
 		*sleep_time = PANE_DELAY;
 		return SHOULD_CANCEL;
 	} else if (fds[1].revents &= POLLIN) {
-		// Sync fd.
-		if (read(fds[1].fd, buf, 1) != 1)
+		// Sync fd. Reading the eventfd consumes every pending sync at
+		// once, so a burst of commands only costs one present.
+		if (read(fds[1].fd, &syncs, sizeof(syncs)) != sizeof(syncs))
 			fprintf(stderr,
 			    "cancellable_sleep: failed to read from sync fd.\n");
 
@@ -226,34 +525,17 @@ static enum sleep_result cancellable_sleep(
 
 static void *rotate_panes(void *arg)
 {
-	int r;
-
 	struct ui_ctx *ctx = arg;
 	int sleep_time = PANE_DELAY;
 	bool switching = true;
 
-	size_t i = 0;
-	for (;;) {
-		r = pthread_mutex_lock(&ctx->panes.lock);
-
-		if (r != 0)
-			FATAL_ERR("ui: couldn't take lock: %s", strerror(r));
-
-		i += switching;
-		if (i >= ctx->panes.count)
-			i = 0;
-
-		struct pane *p = &ctx->panes.panes[i];
-
-		fprintf(stderr, "ui: flipping pane: %s\n", p->name);
-		ctx->vt.rendering_show(ctx->r_ctx, p->canvas);
+	trace_thread_name("ui");
 
-		r = pthread_mutex_unlock(&ctx->panes.lock);
-		if (r != 0)
-			FATAL_ERR("ui: couldn't return lock: %s", strerror(r));
+	for (;;) {
+		ui_present(ctx, switching);
 
 		enum sleep_result r = cancellable_sleep(
-		    ctx->cancellation_fd, ctx->sync_fd_rx, &sleep_time);
+		    ctx->cancellation_fd, ctx->sync_fd, &sleep_time);
 		switch (r) {
 		case SHOULD_SWITCH:
 			switching = true;
@@ -270,6 +552,70 @@ static void *rotate_panes(void *arg)
 	return NULL;
 }
 
+/* Needs the panes lock. */
+static void present_summary(struct ui_ctx *ctx, uint64_t now)
+{
+	struct frame_counts cur = {
+		.at = now,
+		.presents = ctx->presents,
+		.syncs = ctx->syncs,
+	};
+	ctx->vt.rendering_stats(ctx->r_ctx, &cur.backend);
+
+	const struct frame_counts *prev = &ctx->last_summary;
+	const double secs = (cur.at - prev->at) / 1e9;
+	const uint64_t presents = cur.presents - prev->presents;
+	const uint64_t flips = cur.backend.presented - prev->backend.presented;
+	const uint64_t flip_wait =
+	    cur.backend.flip_wait_ns - prev->backend.flip_wait_ns;
+
+	fprintf(stderr,
+	    "ui: %.0fs: %.1f presents/s for %" PRIu64 " syncs, show p50 %.2fms "
+	    "p99 %.2fms, %.1f MB copied, flip wait %.2fms avg, %" PRIu64
+	    " late, %" PRIu64 " dropped\n",
+	    secs, presents / secs, cur.syncs - prev->syncs,
+	    hist_quantile(&ctx->recent_show_ns, 0.5) / 1e6,
+	    hist_quantile(&ctx->recent_show_ns, 0.99) / 1e6,
+	    (cur.backend.copied_bytes - prev->backend.copied_bytes) / 1e6,
+	    flips ? flip_wait / 1e6 / flips : 0.0,
+	    cur.backend.late - prev->backend.late,
+	    cur.backend.dropped - prev->backend.dropped);
+
+	ctx->last_summary = cur;
+	memset(&ctx->recent_show_ns, 0, sizeof(ctx->recent_show_ns));
+}
+
+static void lock_panes(struct ui_ctx *ctx, enum lock_site site)
+{
+	const uint64_t start = stats_now();
+	const uint64_t span = trace_begin();
+
+	int r = pthread_mutex_lock(&ctx->panes.lock);
+	if (r != 0)
+		FATAL_ERR("ui: %s: couldn't take lock: %s", site_names[site],
+		    strerror(r));
+
+	trace_end(span, "lock");
+
+	const uint64_t now = stats_now();
+	ctx->panes.site = site;
+	ctx->panes.locked_at = now;
+	hist_record(&ctx->panes.profile[site].wait, now - start);
+	if (site < SITE_PRESENT)
+		stats_note(STATS_LOCK_WAIT, now - start);
+}
+
+static void unlock_panes(struct ui_ctx *ctx)
+{
+	struct pane_storage *ps = &ctx->panes;
+	hist_record(&ps->profile[ps->site].hold, stats_now() - ps->locked_at);
+
+	int r = pthread_mutex_unlock(&ps->lock);
+	if (r != 0)
+		FATAL_ERR("ui: %s: couldn't return lock: %s",
+		    site_names[ps->site], strerror(r));
+}
+
 static struct pane *lookup_pane_thread_unsafe(
     struct pane_storage *panes, const char *name)
 {
@@ -283,141 +629,726 @@ static struct pane *lookup_pane_thread_unsafe(
 
 /* Create a pane. */
 enum ui_failure ui_pane_create(
-    struct ui_ctx *ctx, char *name, struct color fill)
+    struct ui_ctx *ctx, char *name, const struct pane_opts *opts)
 {
+	const uint16_t width =
+	    opts->width ? opts->width : ctx->screen_width;
+	const uint16_t height =
+	    opts->height ? opts->height : ctx->screen_height;
+	if ((uint32_t)opts->x + width > ctx->screen_width ||
+	    (uint32_t)opts->y + height > ctx->screen_height)
+		return UI_OFF_SCREEN;
+
 	// Really huge assumption that only one thread is calling into this or
 	// the deletion function at once.
-	pthread_mutex_lock(&ctx->panes.lock);
+	lock_panes(ctx, SITE_CREATE);
 
 	size_t idx = ctx->panes.count;
 	if (lookup_pane_thread_unsafe(&ctx->panes, name)) {
-		pthread_mutex_unlock(&ctx->panes.lock);
+		unlock_panes(ctx);
 		return UI_DUPLICATE;
 	}
 
 	if (idx >= MAX_PANES) {
-		pthread_mutex_unlock(&ctx->panes.lock);
+		unlock_panes(ctx);
 		return UI_TOO_MANY_PANES;
 	}
 	struct pane *p = &ctx->panes.panes[idx];
 
 	p->name = strdup(name);
 	if (!p->name) {
-		pthread_mutex_unlock(&ctx->panes.lock);
+		unlock_panes(ctx);
 		return UI_OOM;
 	}
 
-	p->canvas = ctx->vt.canvas_init(ctx->r_ctx);
-	if (!p->canvas) {
+	p->seq = ctx->next_seq++;
+	p->canvas = pane_canvas_new(
+	    ctx, name, p->seq, width, height, opts->x, opts->y, opts->format);
+	if (!p->canvas && ctx->state_dirfd >= 0) {
+		fprintf(stderr, "ui: couldn't store pane '%s': %s\n", name,
+		    STR_ERR);
+		free(p->name);
+		unlock_panes(ctx);
+		return UI_STORE_FAILED;
+	} else if (!p->canvas) {
 		free(p->name);
-		pthread_mutex_unlock(&ctx->panes.lock);
+		unlock_panes(ctx);
 		return UI_OOM;
 	}
 
-	rendering_fill(p->canvas, fill);
+	const uint64_t start = stats_now();
+	const uint64_t span = trace_begin();
+	rendering_fill(p->canvas, opts->fill);
+	trace_end(span, "raster");
+	stats_note(STATS_RASTER, stats_now() - start);
+
+	p->x = opts->x;
+	p->y = opts->y;
+	p->last_used = ++ctx->clock;
+	p->cold = false;
+	ctx->resident += p->canvas->bytes;
 
 	ctx->panes.count++;
-	pthread_mutex_unlock(&ctx->panes.lock);
+	unlock_panes(ctx);
 
 	return UI_OK;
 }
 
 size_t ui_pane_count(struct ui_ctx *ctx)
 {
-	int r = pthread_mutex_lock(&ctx->panes.lock);
-	if (r != 0)
-		FATAL_ERR(
-		    "ui_pane_count: failed to take lock: %s", strerror(r));
+	lock_panes(ctx, SITE_COUNT);
 
 	size_t ret = ctx->panes.count;
-	pthread_mutex_unlock(&ctx->panes.lock);
+	unlock_panes(ctx);
 	return ret;
 }
 
 enum ui_failure ui_pane_remove(struct ui_ctx *ctx, char *name)
 {
-	int r;
-
-	r = pthread_mutex_lock(&ctx->panes.lock);
-	if (r != 0)
-		FATAL_ERR(
-		    "ui_pane_remove: failed to take lock: %s", strerror(r));
+	lock_panes(ctx, SITE_REMOVE);
 
 	for (size_t i = 0; i < ctx->panes.count; i++) {
 		if (strcmp(ctx->panes.panes[i].name, name) != 0)
 			continue;
 
 		struct pane *p = &ctx->panes.panes[i];
+		ctx->resident -= p->canvas->bytes;
 		free(p->name);
 		canvas_deinit(p->canvas);
 
+		if (ctx->state_dirfd >= 0) {
+			char file[PANE_FILE_LEN];
+			pane_file(p->seq, file);
+			if (unlinkat(ctx->state_dirfd, file, 0) < 0)
+				fprintf(stderr, "ui: couldn't remove %s: %s\n",
+				    file, STR_ERR);
+		}
+
 		for (size_t j = i + 1; j < ctx->panes.count; j++) {
 			struct pane *q = &ctx->panes.panes[j];
-			p->name = q->name;
-			p->canvas = q->canvas;
-
+			*p = *q;
 			p = q;
 		}
 
 		ctx->panes.count--;
+		ctx->panes_removed = true;
 
-		pthread_mutex_unlock(&ctx->panes.lock);
+		unlock_panes(ctx);
 		return UI_OK;
 	}
 
-	pthread_mutex_unlock(&ctx->panes.lock);
+	unlock_panes(ctx);
 	return UI_NO_SUCH_PANE;
 }
 
 enum ui_failure ui_pane_draw_shape(
     struct ui_ctx *ctx, char *name, const void *shape, render_fn_t inner)
 {
-	int r;
-
-	r = pthread_mutex_lock(&ctx->panes.lock);
-	if (r != 0)
-		FATAL_ERR(
-		    "ui_pane_draw_shape: failed to lock: %s\n", strerror(r));
+	lock_panes(ctx, SITE_DRAW);
 
 	struct pane *p = lookup_pane_thread_unsafe(&ctx->panes, name);
 	if (!p) {
-		pthread_mutex_unlock(&ctx->panes.lock);
+		unlock_panes(ctx);
 		return UI_NO_SUCH_PANE;
 	}
 
+	// Drawing only unpacks the tiles it touches.
+	size_t before = pane_touch(ctx, p, false);
+	const uint64_t start = stats_now();
+	const uint64_t span = trace_begin();
 	inner(p->canvas, shape);
+	trace_end(span, "raster");
+	stats_note(STATS_RASTER, stats_now() - start);
+	pane_account(ctx, p, before);
+	enforce_budget(ctx, p);
 
-	pthread_mutex_unlock(&ctx->panes.lock);
+	unlock_panes(ctx);
 	return UI_OK;
 }
 
-enum ui_failure ui_pane_save(struct ui_ctx *ctx, char *name, char *path)
+char *ui_lock_report(struct ui_ctx *ctx)
 {
-	// `name` is the pane whose canvas we are saving, not The Target. the
-	// target should always be "root" because this is a privileged action.
+	struct lock_profile *profile = malloc(sizeof(ctx->panes.profile));
+	if (!profile)
+		FATAL_ERR("ui: failed to allocate lock report");
 
-	int r;
+	// Looking isn't one of the sites, so that it doesn't skew them.
+	int r = pthread_mutex_lock(&ctx->panes.lock);
+	if (r != 0)
+		FATAL_ERR("%s: failed to take lock: %s", __func__, strerror(r));
+	memcpy(profile, ctx->panes.profile, sizeof(ctx->panes.profile));
+	pthread_mutex_unlock(&ctx->panes.lock);
+
+	char *report = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&report, &len);
+	if (!out)
+		FATAL_ERR("ui: open_memstream failed: %s", STR_ERR);
+
+	for (size_t i = 0; i < NUM_SITES; i++) {
+		char wait[128], hold[128];
+		hist_format(wait, sizeof(wait), &profile[i].wait);
+		hist_format(hold, sizeof(hold), &profile[i].hold);
+		fprintf(out, "%s%s.wait=%s %s.hold=%s", i ? " " : "",
+		    site_names[i], wait, site_names[i], hold);
+	}
 
-	r = pthread_mutex_lock(&ctx->panes.lock);
+	if (fclose(out) != 0)
+		FATAL_ERR("ui: couldn't write lock report: %s", STR_ERR);
+
+	free(profile);
+	return report;
+}
+
+char *ui_present_report(struct ui_ctx *ctx)
+{
+	// Like ui_lock_report, this isn't a site of its own. Some backends'
+	// stats are only safe to read while nothing's being presented.
+	int r = pthread_mutex_lock(&ctx->panes.lock);
 	if (r != 0)
-		FATAL_ERR("%s: failed to lock: %s\n", __func__, strerror(r));
+		FATAL_ERR("%s: failed to take lock: %s", __func__, strerror(r));
+	const uint64_t presents = ctx->presents;
+	const struct hist show = ctx->show_ns;
+	const struct frame_counts started = ctx->started;
+	struct present_stats b;
+	ctx->vt.rendering_stats(ctx->r_ctx, &b);
+	pthread_mutex_unlock(&ctx->panes.lock);
+
+	const uint64_t syncs = ctx->syncs;
+
+	char show_ns[128];
+	hist_format(show_ns, sizeof(show_ns), &show);
+
+	const double secs = (stats_now() - started.at) / 1e9;
+
+	char *report = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&report, &len);
+	if (!out)
+		FATAL_ERR("ui: open_memstream failed: %s", STR_ERR);
+
+	fprintf(out,
+	    "presents=%" PRIu64 " syncs=%" PRIu64 " syncs_per_present=%.2f "
+	    "presents_per_sec=%.2f show_ns=%s copied_bytes=%" PRIu64
+	    " queued=%" PRIu64 " dropped=%" PRIu64 " presented=%" PRIu64
+	    " flip_wait_ns=%" PRIu64 " late=%" PRIu64 " refresh_hz=%u",
+	    presents, syncs, presents ? (double)syncs / presents : 0.0,
+	    secs > 0 ? presents / secs : 0.0, show_ns, b.copied_bytes,
+	    b.queued, b.dropped, b.presented,
+	    b.presented ? b.flip_wait_ns / b.presented : 0, b.late,
+	    b.refresh_hz);
+
+	if (fclose(out) != 0)
+		FATAL_ERR("ui: couldn't write present report: %s", STR_ERR);
+
+	return report;
+}
+
+void ui_memory_stats(struct ui_ctx *ctx, struct ui_memory_stats *out)
+{
+	lock_panes(ctx, SITE_MEMORY);
+
+	*out = ctx->mem;
+	out->resident = ctx->resident;
+	out->packed_panes = 0;
+	out->packed_bytes = 0;
+	for (size_t i = 0; i < ctx->panes.count; i++) {
+		const struct canvas *c = ctx->panes.panes[i].canvas;
+		out->packed_panes += c->packed_tiles > 0;
+		out->packed_bytes += c->packed_bytes;
+	}
+
+	unlock_panes(ctx);
+}
+
+char *ui_meminfo_report(struct ui_ctx *ctx, struct ui_meminfo *totals)
+{
+	*totals = (struct ui_meminfo) {
+		.backend_bytes = ctx->vt.rendering_memory(ctx->r_ctx),
+	};
+
+	char *report = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&report, &len);
+	if (!out)
+		FATAL_ERR("ui: open_memstream failed: %s", STR_ERR);
+
+	// Checking every tile with mincore(2) takes a while, so the lock is
+	// taken for one pane at a time. A pane removed meanwhile may cause the
+	// one after it to be skipped.
+	for (size_t i = 0;; i++) {
+		lock_panes(ctx, SITE_MEMINFO);
+		if (i >= ctx->panes.count) {
+			unlock_panes(ctx);
+			break;
+		}
+
+		const struct pane *p = &ctx->panes.panes[i];
+		const size_t bytes = p->canvas->bytes;
+		const size_t resident = canvas_resident(p->canvas);
+		fprintf(out, "%spane.%s=%zu/%zu", i ? " " : "", p->name, bytes,
+		    resident);
+		unlock_panes(ctx);
+
+		totals->canvas_bytes += bytes;
+		totals->canvas_resident += resident;
+	}
+
+	if (fclose(out) != 0)
+		FATAL_ERR("ui: couldn't write memory report: %s", STR_ERR);
+
+	return report;
+}
+
+static size_t pane_touch(struct ui_ctx *ctx, struct pane *p, bool unpack)
+{
+	size_t before = p->canvas->bytes;
+
+	if (p->canvas->packed_tiles > 0) {
+		ctx->mem.misses++;
+		if (unpack)
+			canvas_unpack(p->canvas);
+	} else {
+		ctx->mem.hits++;
+	}
+
+	p->last_used = ++ctx->clock;
+	p->cold = false;
+	return before;
+}
+
+static void pane_account(struct ui_ctx *ctx, struct pane *p, size_t before)
+{
+	ctx->resident -= before;
+	ctx->resident += p->canvas->bytes;
+}
+
+static void enforce_budget(struct ui_ctx *ctx, const struct pane *keep)
+{
+	if (ctx->mem.budget == 0)
+		return;
+
+	const struct pane *shown = &ctx->panes.panes[ctx->shown_pane];
+
+	while (ctx->resident > ctx->mem.budget) {
+		struct pane *victim = NULL;
+		for (size_t i = 0; i < ctx->panes.count; i++) {
+			// Stored canvases are left to the page cache, which
+			// writes them back and drops them on its own.
+			struct pane *p = &ctx->panes.panes[i];
+			if (p == shown || p == keep || p->cold ||
+			    p->canvas->pixel_tiles == 0 || p->canvas->stored)
+				continue;
+
+			if (!victim || p->last_used < victim->last_used)
+				victim = p;
+		}
+
+		// Everything left is in use or as small as it gets.
+		if (!victim)
+			return;
+
+		size_t before = victim->canvas->bytes;
+		canvas_pack(victim->canvas);
+		pane_account(ctx, victim, before);
+		victim->cold = true;
+		ctx->mem.evictions++;
+	}
+}
+
+static struct canvas *pane_canvas_new(struct ui_ctx *ctx, const char *name,
+    uint64_t seq, uint16_t width, uint16_t height, uint16_t x, uint16_t y,
+    enum pixel_format format)
+{
+	if (ctx->state_dirfd < 0)
+		return canvas_init(width, height, format);
+
+	char file[PANE_FILE_LEN];
+	pane_file(seq, file);
+	return store_create(
+	    ctx->state_dirfd, file, name, width, height, x, y, format);
+}
+
+static void restore_panes(struct ui_ctx *ctx, const char *dir)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		FATAL_ERR("ui: couldn't create state dir %s: %s", dir, STR_ERR);
+
+	ctx->state_dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ctx->state_dirfd < 0)
+		FATAL_ERR("ui: couldn't open state dir %s: %s", dir, STR_ERR);
+
+	// Sequence numbers are fixed width, so sorting the names puts the
+	// panes back in the order they were made in.
+	struct dirent **files;
+	const int n = scandir(dir, &files, is_pane_file, alphasort);
+	if (n < 0)
+		FATAL_ERR("ui: couldn't list state dir %s: %s", dir, STR_ERR);
+
+	ctx->panes.count = 0;
+	for (int i = 0; i < n; i++) {
+		const uint64_t seq = strtoull(files[i]->d_name, NULL, 16);
+		if (seq >= ctx->next_seq)
+			ctx->next_seq = seq + 1;
+
+		restore_pane(ctx, files[i]->d_name, seq);
+		free(files[i]);
+	}
+	free(files);
+
+	// Start over with a new root pane if there was none to restore.
+	const size_t restored = ctx->panes.count;
+	if (!lookup_pane_thread_unsafe(&ctx->panes, "root")) {
+		struct pane *root = &ctx->panes.panes[0];
+		memmove(root + 1, root, restored * sizeof(struct pane));
+		ctx->panes.count++;
+
+		*root = (struct pane) {
+			.canvas = pane_canvas_new(ctx, "root", 0,
+			    ctx->screen_width, ctx->screen_height, 0, 0,
+			    PIXEL_FORMAT_BGRA8888),
+			.name = strdup("root"),
+		};
+		if (!root->canvas || !root->name)
+			FATAL_ERR("ui: couldn't make root pane in %s: %s", dir,
+			    STR_ERR);
+
+		rendering_fill(root->canvas, background);
+		ctx->resident += root->canvas->bytes;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	const double ms = (end.tv_sec - start.tv_sec) * 1e3 +
+	    (end.tv_nsec - start.tv_nsec) / 1e6;
+
+	fprintf(stderr,
+	    "ui: restored %zu panes from %s in %.2f ms (generation %u)\n",
+	    restored, dir, ms, ctx->panes.panes[0].canvas->stored->generation);
+}
+
+static void restore_pane(struct ui_ctx *ctx, const char *file, uint64_t seq)
+{
+	struct canvas *c = store_attach(ctx->state_dirfd, file);
+	if (!c) {
+		fprintf(stderr, "ui: dropping %s: %s\n", file, STR_ERR);
+		unlinkat(ctx->state_dirfd, file, 0);
+		return;
+	}
+
+	const struct stored_canvas *s = c->stored;
+	const char *why = NULL;
+	if (seq == 0 &&
+	    (c->width != ctx->screen_width || c->height != ctx->screen_height))
+		why = "the screen changed size";
+	else if ((uint32_t)s->x + c->width > ctx->screen_width ||
+	    (uint32_t)s->y + c->height > ctx->screen_height)
+		why = ui_failure_str(UI_OFF_SCREEN);
+	else if (lookup_pane_thread_unsafe(&ctx->panes, s->name))
+		why = ui_failure_str(UI_DUPLICATE);
+	else if (ctx->panes.count >= MAX_PANES)
+		why = ui_failure_str(UI_TOO_MANY_PANES);
+
+	char *name = why ? NULL : strdup(s->name);
+	if (!why && !name)
+		why = ui_failure_str(UI_OOM);
+
+	if (why) {
+		fprintf(stderr, "ui: dropping %s: %s\n", file, why);
+		canvas_deinit(c);
+		unlinkat(ctx->state_dirfd, file, 0);
+		return;
+	}
+
+	struct pane *p = &ctx->panes.panes[ctx->panes.count++];
+	*p = (struct pane) {
+		.name = name,
+		.canvas = c,
+		.x = s->x,
+		.y = s->y,
+		.seq = seq,
+		.last_used = ++ctx->clock,
+	};
+	ctx->resident += c->bytes;
+}
+
+static void pane_file(uint64_t seq, char out[static PANE_FILE_LEN])
+{
+	snprintf(out, PANE_FILE_LEN, "%016" PRIx64 ".pane", seq);
+}
+
+static int is_pane_file(const struct dirent *d)
+{
+	return strlen(d->d_name) == PANE_FILE_LEN - 1 &&
+	    strspn(d->d_name, "0123456789abcdef") == 16 &&
+	    strcmp(d->d_name + 16, ".pane") == 0;
+}
+
+static void restore_checkpoint(struct ui_ctx *ctx, const char *path)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct checkpoint_pane *panes = malloc(MAX_PANES * sizeof(*panes));
+	if (!panes)
+		FATAL_ERR("ui: restore: OOM");
+
+	const ssize_t n = checkpoint_read(path, panes, MAX_PANES);
+	if (n < 0)
+		FATAL_ERR("ui: couldn't restore %s: %s", path, STR_ERR);
+
+	size_t restored = 0;
+	for (ssize_t i = 0; i < n; i++) {
+		const struct canvas_delta *d = panes[i].delta;
+		const struct pane_opts opts = {
+			.format = d->format,
+			.width = d->width,
+			.height = d->height,
+			.x = panes[i].x,
+			.y = panes[i].y,
+		};
+
+		// Panes that already exist (like root) are drawn over, as long
+		// as they're the same shape. Otherwise, they're duplicates.
+		enum ui_failure r = ui_pane_create(ctx, panes[i].name, &opts);
+		if (r == UI_OK || r == UI_DUPLICATE) {
+			pthread_mutex_lock(&ctx->panes.lock);
+			struct pane *p =
+			    lookup_pane_thread_unsafe(&ctx->panes, panes[i].name);
+			const struct canvas *c = p->canvas;
+			if (c->width == d->width && c->height == d->height &&
+			    c->format == d->format) {
+				const size_t before = c->bytes;
+				canvas_apply_delta(p->canvas, d);
+				pane_account(ctx, p, before);
+				restored++;
+				r = UI_OK;
+			}
+			pthread_mutex_unlock(&ctx->panes.lock);
+		}
+
+		if (r != UI_OK)
+			fprintf(stderr, "ui: not restoring pane '%s': %s\n",
+			    panes[i].name, ui_failure_str(r));
+
+		free(panes[i].name);
+		canvas_delta_free(panes[i].delta);
+	}
+	free(panes);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fprintf(stderr, "ui: restored %zu panes from %s in %.2f ms\n",
+	    restored, path,
+	    (end.tv_sec - start.tv_sec) * 1e3 +
+		(end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+static void *checkpoint_panes(void *arg)
+{
+	struct ui_ctx *ctx = arg;
+
+	pthread_mutex_lock(&ctx->checkpoint_lock);
+	for (bool stop = false; !stop;) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += ctx->checkpoint_interval / 1000;
+		deadline.tv_nsec += ctx->checkpoint_interval % 1000 * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		while (!ctx->checkpoint_stop &&
+		    pthread_cond_timedwait(&ctx->checkpoint_cond,
+			&ctx->checkpoint_lock, &deadline) != ETIMEDOUT)
+			;
+
+		// Once stopped, this is the last checkpoint.
+		stop = ctx->checkpoint_stop;
+		pthread_mutex_unlock(&ctx->checkpoint_lock);
+		take_checkpoint(ctx);
+		pthread_mutex_lock(&ctx->checkpoint_lock);
+	}
+	pthread_mutex_unlock(&ctx->checkpoint_lock);
+
+	return NULL;
+}
+
+static void take_checkpoint(struct ui_ctx *ctx)
+{
+	static struct checkpoint_pane panes[MAX_PANES];
+	const bool full = checkpoint_wants_full(ctx->checkpoint);
+
+	// Only copying out the changes happens under the lock. Pixels are
+	// shared copy-on-write, so drawing can go on while they're written.
+	lock_panes(ctx, SITE_CHECKPOINT);
+	const size_t n = ctx->panes.count;
+	bool changed = full || ctx->panes_removed;
+	for (size_t i = 0; i < n; i++) {
+		const struct pane *p = &ctx->panes.panes[i];
+		panes[i] = (struct checkpoint_pane) {
+			.name = strdup(p->name),
+			.x = p->x,
+			.y = p->y,
+			.delta = canvas_take_dirty(p->canvas, full),
+		};
+		if (!panes[i].name)
+			FATAL_ERR("ui: checkpoint: OOM");
+
+		changed |= panes[i].delta->full || panes[i].delta->num_tiles > 0;
+	}
+	ctx->panes_removed = false;
+	unlock_panes(ctx);
+
+	if (changed && !checkpoint_write(ctx->checkpoint, panes, n, full))
+		fprintf(stderr, "ui: checkpoint failed: %s\n", STR_ERR);
+
+	for (size_t i = 0; i < n; i++) {
+		free(panes[i].name);
+		canvas_delta_free(panes[i].delta);
+	}
+}
+
+enum ui_failure ui_pane_save(
+    struct ui_ctx *ctx, char *name, char *path, enum image_format format)
+{
+	// `name` is the pane whose canvas we are saving, not The Target. the
+	// target should always be "root" because this is a privileged action.
+
+	lock_panes(ctx, SITE_SAVE);
 
 	struct pane *p = lookup_pane_thread_unsafe(&ctx->panes, name);
 	if (!p) {
-		pthread_mutex_unlock(&ctx->panes.lock);
+		unlock_panes(ctx);
 		return UI_NO_SUCH_PANE;
 	}
 
+	// Writing the file can take a while. Work from a copy-on-write clone
+	// so that the pane can be drawn to in the meantime.
+	struct canvas *snapshot = canvas_clone(p->canvas);
+	unlock_panes(ctx);
+	if (!snapshot)
+		return UI_OOM;
+
 	const char *dirpath = ".";
+	const uint64_t span = trace_begin();
 
 	DIR *dir = opendir(dirpath);
 	if (!dir)
 		FATAL_ERR("Failed to open directory: %s: %s", dirpath, STR_ERR);
 
-	rendering_dump_bgra_to_rgba(p->canvas, dir, dirpath, path);
-	fprintf(stderr, "ui: saved pane '%s' RGBA pixel data to file: %s/%s\n",
-	    name, dirpath, path);
+	if (format == IMAGE_FORMAT_RAW) {
+		rendering_dump_bgra_to_rgba(snapshot, dir, dirpath, path);
+		fprintf(stderr,
+		    "ui: saved pane '%s' RGBA pixel data to file: %s/%s\n",
+		    name, dirpath, path);
+	} else {
+		rendering_dump_encoded(snapshot, dir, dirpath, path, format);
+		fprintf(stderr, "ui: saved pane '%s' as %s to file: %s/%s\n",
+		    name, image_format_ext(format) + 1, dirpath, path);
+	}
+
+	if (closedir(dir) != 0)
+		FATAL_ERR("couldn't close dir: %s", STR_ERR);
+
+	trace_end(span, "save");
+	canvas_deinit(snapshot);
+	return UI_OK;
+}
+
+/* Start the saver if need be. Needs the panes lock. */
+static struct saver *get_saver(struct ui_ctx *ctx)
+{
+	if (!ctx->saver)
+		ctx->saver = saver_new();
+
+	return ctx->saver;
+}
+
+enum ui_failure ui_pane_save_async(struct ui_ctx *ctx, char *name, char *path,
+    enum image_format format, save_done_fn done, void *arg, uint64_t *id)
+{
+	struct save_item *item = malloc(sizeof(*item));
+	char *path_copy = strdup(path);
+	if (!item || !path_copy) {
+		free(item);
+		free(path_copy);
+		return UI_OOM;
+	}
+
+	lock_panes(ctx, SITE_SAVE_ASYNC);
+
+	struct pane *p = lookup_pane_thread_unsafe(&ctx->panes, name);
+	struct canvas *snapshot = p ? canvas_clone(p->canvas) : NULL;
+	if (!snapshot) {
+		unlock_panes(ctx);
+		free(item);
+		free(path_copy);
+		return p ? UI_OOM : UI_NO_SUCH_PANE;
+	}
+
+	*item = (struct save_item) { snapshot, path_copy, format };
+	*id = saver_submit(get_saver(ctx), AT_FDCWD, item, 1, done, arg);
+	unlock_panes(ctx);
+
+	return UI_OK;
+}
+
+enum ui_failure ui_save_all(struct ui_ctx *ctx, char *dir,
+    enum image_format format, save_done_fn done, void *arg, uint64_t *id,
+    size_t *count)
+{
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return UI_OPEN_FAILED;
+
+	const int dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+		return UI_OPEN_FAILED;
+
+	lock_panes(ctx, SITE_SAVE_ALL);
+
+	// Cloning is copy-on-write, so the lock is only held for as long as it
+	// takes to copy the tile tables.
+	const size_t n = ctx->panes.count;
+	struct save_item *items = calloc(n, sizeof(*items));
+	size_t i = 0;
+	for (; items && i < n; i++) {
+		const struct pane *p = &ctx->panes.panes[i];
+
+		// Pane names can have slashes in them; files can't.
+		const char *ext = image_format_ext(format);
+		char *path = malloc(strlen(p->name) + strlen(ext) + 1);
+		struct canvas *snapshot = path ? canvas_clone(p->canvas) : NULL;
+		if (!snapshot) {
+			free(path);
+			break;
+		}
+
+		strcpy(path, p->name);
+		for (char *c = path; *c; c++)
+			if (*c == '/')
+				*c = '_';
+		strcat(path, ext);
+
+		items[i] = (struct save_item) { snapshot, path, format };
+	}
+
+	if (i < n) {
+		unlock_panes(ctx);
+		while (items && i-- > 0) {
+			canvas_deinit(items[i].snapshot);
+			free(items[i].path);
+		}
+		free(items);
+		close(dirfd);
+		return UI_OOM;
+	}
+
+	*count = n;
+	*id = saver_submit(get_saver(ctx), dirfd, items, n, done, arg);
+	unlock_panes(ctx);
 
-	pthread_mutex_unlock(&ctx->panes.lock);
 	return UI_OK;
 }
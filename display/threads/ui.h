@@ -1,10 +1,74 @@
 #pragma once
 
 #include "../rendering/rendering.h"
+#include "saver.h"
+
+#include <stdbool.h>
+
+/* How long each pane stays on screen, in milliseconds. */
+#define PANE_DELAY 5000
 
 struct ui_ctx;
 
-struct ui_ctx *ui_ctx_new(struct rendering_vtable vt);
+struct ui_opts {
+	// Once canvases take up more than this many bytes altogether, compress
+	// the least recently used panes. Zero means no limit.
+	size_t pane_memory_budget;
+
+	struct rendering_opts rendering;
+
+	// If non-null, keep each pane's canvas in a file in this directory,
+	// and pick up the panes already there on startup.
+	const char *state_dir;
+
+	// If non-null, write whatever changed to this checkpoint file every
+	// `checkpoint_interval` milliseconds, and once more on the way out.
+	const char *checkpoint_path;
+	unsigned checkpoint_interval;
+
+	// If non-null, bring back the panes in this checkpoint file on
+	// startup.
+	const char *restore_path;
+};
+
+/* What a new pane looks like, and where it goes on screen. */
+struct pane_opts {
+	struct color fill;
+	enum pixel_format format;
+
+	// Zero means as wide or tall as the screen. The pane must fit on
+	// screen at (x, y).
+	uint16_t width, height;
+	uint16_t x, y;
+};
+
+struct ui_memory_stats {
+	size_t budget;
+	size_t resident; // bytes held by every canvas
+	size_t packed_panes;
+	size_t packed_bytes; // compressed size of the packed tiles
+
+	// Draws and presents to panes that were or weren't compressed.
+	uint64_t hits;
+	uint64_t misses;
+
+	uint64_t prefetches; // panes unpacked just before being shown
+	uint64_t evictions;  // panes packed to stay within the budget
+};
+
+/* Totals for ui_meminfo_report, in bytes. */
+struct ui_meminfo {
+	size_t canvas_bytes;    // like ui_memory_stats' resident
+	size_t canvas_resident; // how much of that is actually in memory
+	size_t backend_bytes;   // the rendering backend's frame buffers
+};
+
+struct ui_ctx *ui_ctx_new(
+    struct rendering_vtable vt, const struct ui_opts *opts);
+
+/* Free the panes and the rendering backend. Nothing may touch the ctx
+ * afterward, so join every thread using it first. */
+void ui_ctx_free(struct ui_ctx *ctx);
 
 void *ui_thread(void *);
 
@@ -14,6 +78,9 @@ enum ui_failure {
 	UI_OOM,
 	UI_NO_SUCH_PANE,
 	UI_TOO_MANY_PANES,
+	UI_OFF_SCREEN,
+	UI_STORE_FAILED,
+	UI_OPEN_FAILED,
 };
 
 typedef void (*render_fn_t)(struct canvas *, const void *);
@@ -23,15 +90,55 @@ char *ui_failure_str(enum ui_failure);
 /* Flush an update to a pane. */
 void ui_sync(struct ui_ctx *ctx);
 
+/* An eventfd that becomes readable after ui_sync. Reading it clears every
+ * sync so far. For use by event loops that drive ui_present themselves. */
+int ui_sync_fd(struct ui_ctx *ctx);
+
+/* Show the current pane, or the next one if `switching`. Switching also
+ * unpacks the pane after it, so that it's ready in time. */
+void ui_present(struct ui_ctx *ctx, bool switching);
+
 /* Create a pane. */
 enum ui_failure ui_pane_create(
-    struct ui_ctx *ctx, char *name, struct color fill);
+    struct ui_ctx *ctx, char *name, const struct pane_opts *opts);
 
 size_t ui_pane_count(struct ui_ctx *ctx);
 
+void ui_memory_stats(struct ui_ctx *ctx, struct ui_memory_stats *out);
+
+/* Each pane's canvas bytes and how many of them are resident, as
+ * `pane.<name>=<bytes>/<resident>` all on one line, to be freed by the caller.
+ * Also fills in `totals`. */
+char *ui_meminfo_report(struct ui_ctx *ctx, struct ui_meminfo *totals);
+
+/* How long each place that takes the panes lock (drawing, presents, saves and
+ * so on) has waited for it and held it, as `<site>.wait=` and `<site>.hold=`
+ * followed by hist_format's summary in nanoseconds, all on one line. To be
+ * freed by the caller. */
+char *ui_lock_report(struct ui_ctx *ctx);
+
+/* How presents have gone so far, with ui_sync's syncs against the presents
+ * they coalesced into, time spent in rendering_show as hist_format's summary
+ * in nanoseconds, and the backend's present_stats (with flip waits averaged
+ * per flip), as `key=value` pairs on one line. To be freed by the caller. */
+char *ui_present_report(struct ui_ctx *ctx);
+
 enum ui_failure ui_pane_remove(struct ui_ctx *ctx, char *name);
 
 enum ui_failure ui_pane_draw_shape(
     struct ui_ctx *ctx, char *name, const void *shape, render_fn_t inner);
 
-enum ui_failure ui_pane_save(struct ui_ctx *ctx, char *name, char *path);
+enum ui_failure ui_pane_save(
+    struct ui_ctx *ctx, char *name, char *path, enum image_format format);
+
+/* Like ui_pane_save, but the file is written in the background, after which
+ * `done` is called from another thread. Sets `id` to the job's ID. */
+enum ui_failure ui_pane_save_async(struct ui_ctx *ctx, char *name, char *path,
+    enum image_format format, save_done_fn done, void *arg, uint64_t *id);
+
+/* Save every pane to `dir` (created if need be) in the background, one file
+ * per pane named after it plus the format's extension. Sets `count` to the
+ * number of panes. */
+enum ui_failure ui_save_all(struct ui_ctx *ctx, char *dir,
+    enum image_format format, save_done_fn done, void *arg, uint64_t *id,
+    size_t *count);
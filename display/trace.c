@@ -0,0 +1,177 @@
+#define _GNU_SOURCE // gettid
+
+#include "trace.h"
+
+#include "abort.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+// Spans a thread keeps before writing them out.
+#define TRACE_SPANS 4096
+
+struct span {
+	const char *name;
+	uint64_t start, dur;
+};
+
+struct trace_buf {
+	pid_t tid;
+	size_t len;
+	struct span spans[TRACE_SPANS];
+
+	struct trace_buf *next;
+};
+
+// Set before any other thread starts, and after they're all done.
+static bool tracing;
+
+// Protects everything below.
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *file;
+static const char *file_path;
+static bool wrote_any;
+static pid_t pid;
+static uint64_t epoch;
+static struct trace_buf *bufs;
+
+static thread_local struct trace_buf *own_buf;
+
+static struct trace_buf *buf_get(void);
+static void buf_flush(struct trace_buf *);
+static void put_event(const char *fmt, ...);
+static uint64_t now_ns(void);
+
+void trace_open(const char *path)
+{
+	file = fopen(path, "we");
+	if (!file)
+		FATAL_ERR("trace: couldn't open '%s': %s", path, STR_ERR);
+
+	file_path = path;
+	pid = getpid();
+	epoch = now_ns();
+	tracing = true;
+
+	fputs("[\n", file);
+}
+
+void trace_close(void)
+{
+	if (!tracing)
+		return;
+
+	pthread_mutex_lock(&trace_lock);
+	while (bufs) {
+		struct trace_buf *b = bufs;
+		bufs = b->next;
+		buf_flush(b);
+		free(b);
+	}
+
+	fputs("\n]\n", file);
+	if (fclose(file) != 0)
+		fprintf(stderr, "trace: couldn't write '%s': %s\n", file_path,
+		    STR_ERR);
+
+	file = NULL;
+	tracing = false;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+uint64_t trace_begin(void)
+{
+	return tracing ? now_ns() : 0;
+}
+
+void trace_end(uint64_t start, const char *name)
+{
+	if (start == 0)
+		return;
+
+	struct trace_buf *b = buf_get();
+	b->spans[b->len++] = (struct span) {
+		.name = name,
+		.start = start,
+		.dur = now_ns() - start,
+	};
+
+	if (b->len == TRACE_SPANS) {
+		pthread_mutex_lock(&trace_lock);
+		buf_flush(b);
+		pthread_mutex_unlock(&trace_lock);
+	}
+}
+
+void trace_thread_name(const char *name)
+{
+	if (!tracing)
+		return;
+
+	pthread_mutex_lock(&trace_lock);
+	put_event("{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %d, "
+		  "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+	    pid, gettid(), name);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static struct trace_buf *buf_get(void)
+{
+	if (own_buf)
+		return own_buf;
+
+	struct trace_buf *b = malloc(sizeof(struct trace_buf));
+	if (!b)
+		FATAL_ERR("trace: failed to allocate buffer");
+
+	b->tid = gettid();
+	b->len = 0;
+
+	pthread_mutex_lock(&trace_lock);
+	b->next = bufs;
+	bufs = b;
+	pthread_mutex_unlock(&trace_lock);
+
+	own_buf = b;
+	return b;
+}
+
+/* Needs the trace lock. */
+static void buf_flush(struct trace_buf *b)
+{
+	for (size_t i = 0; i < b->len; i++) {
+		const struct span *s = &b->spans[i];
+		put_event("{\"ph\": \"X\", \"name\": \"%s\", \"pid\": %d, "
+			  "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+		    s->name, pid, b->tid, (s->start - epoch) / 1e3,
+		    s->dur / 1e3);
+	}
+
+	b->len = 0;
+}
+
+/* Needs the trace lock. */
+static void put_event(const char *fmt, ...)
+{
+	if (wrote_any)
+		fputs(",\n", file);
+	wrote_any = true;
+
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(file, fmt, args);
+	va_end(args);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Spans of time on a timeline, written out as Chrome trace-event JSON (which
+ * chrome://tracing and ui.perfetto.dev both open). Each thread fills a buffer
+ * of its own without taking any locks, and only takes the file's lock once
+ * that's full. Everything here is a no-op unless tracing was started. */
+
+/* Start tracing to `path`, replacing whatever is there. Call this before any
+ * other thread starts. */
+void trace_open(const char *path);
+
+/* Write out every buffer and finish the file. Every thread that traced must be
+ * done by now. */
+void trace_close(void);
+
+/* The start of a span, to be passed to trace_end, or 0 when not tracing. */
+uint64_t trace_begin(void);
+
+/* End a span begun at `start`. `name` must outlive the trace, e.g., a string
+ * literal. */
+void trace_end(uint64_t start, const char *name);
+
+/* Label the calling thread's row in the timeline. */
+void trace_thread_name(const char *name);